@@ -1,4 +1,5 @@
 #pragma once
+#include "engine/ChunkedLoopBuffer.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
 #include <atomic>
@@ -20,10 +21,12 @@ public:
     struct WaveformSnapshot
     {
         juce::AudioBuffer<float> buffer;
+        LoopSilenceMap silence; // the loop's silence map as of the copy, so the downsampler can skip silent regions
         int length = 0;
         int version = 0;
 
-        void copyFrom (const juce::AudioBuffer<float>& source, int sourceLength, int ver)
+        // Without a map for the source, every region counts as sounding
+        void copyFrom (const juce::AudioBuffer<float>& source, int sourceLength, int ver, const LoopSilenceMap* sourceSilence = nullptr)
         {
             PERFETTO_FUNCTION();
             if (buffer.getNumChannels() != source.getNumChannels() || buffer.getNumSamples() < sourceLength)
@@ -35,6 +38,27 @@ public:
             {
                 buffer.copyFrom (ch, 0, source, ch, 0, sourceLength);
             }
+
+            silence.prepareToPlay (sourceLength);
+            if (sourceSilence != nullptr)
+                silence.copyFrom (*sourceSilence, sourceLength);
+            else
+                silence.markSounding (0, sourceLength);
+            length = sourceLength;
+            version = ver;
+        }
+
+        void copyFrom (const ChunkedLoopBuffer& source, int sourceLength, int ver)
+        {
+            PERFETTO_FUNCTION();
+            if (buffer.getNumChannels() != source.getNumChannels() || buffer.getNumSamples() < sourceLength)
+            {
+                buffer.setSize (source.getNumChannels(), sourceLength, false, true, true);
+            }
+
+            source.copyTo (buffer, 0, sourceLength);
+            silence.prepareToPlay (sourceLength);
+            silence.copyFrom (source.getSilenceMap(), sourceLength);
             length = sourceLength;
             version = ver;
         }
@@ -101,7 +125,7 @@ public:
     }
 
     // Called from AUDIO THREAD - just store the pointer, don't copy
-    void updateFromAudioThread (const juce::AudioBuffer<float>* audioBuffer,
+    void updateFromAudioThread (const ChunkedLoopBuffer* audioBuffer,
                                 int length,
                                 int readPos,
                                 bool recording,
@@ -162,7 +186,7 @@ public:
 
         if (snapshot->version == currentVersion)
         {
-            destination.copyFrom (snapshot->buffer, snapshot->length, snapshot->version);
+            destination.copyFrom (snapshot->buffer, snapshot->length, snapshot->version, &snapshot->silence);
             lastUIVersion = currentVersion;
             return true;
         }
@@ -191,7 +215,7 @@ private:
     int lastUIVersion = -1;
 
     // Background copy thread
-    std::atomic<const juce::AudioBuffer<float>*> pendingBufferPtr { nullptr };
+    std::atomic<const ChunkedLoopBuffer*> pendingBufferPtr { nullptr };
     std::atomic<int> pendingBufferLength { 0 };
     juce::WaitableEvent copySignal;
     std::atomic<bool> shouldStop { false };
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "engine/BackingTrackStream.h"
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * Loads audio files into loop layers off the audio thread.
+ *
+ * Every track has a slot with a staging buffer drawn from the engine arena, like any other layer.
+ * post() hands a file to the slot; a loader thread decodes it, converts it to the engine's sample
+ * rate and channel count and writes it into the staging buffer. At the next block boundary, collect()
+ * passes the finished layer to the track, which swaps it with its live one, and hands the old
+ * layer's blocks back. Nothing is allocated or reallocated on the audio thread.
+ *
+ * Each slot goes Idle -> Requested -> Decoding -> Done -> Idle. The audio thread only posts to an Idle
+ * slot and only collects a Done one; the loader threads claim Requested slots with a compare-and-swap,
+ * so files posted to several tracks decode in parallel. A file posted while its slot is busy waits
+ * in the slot and supersedes the one in flight, whose result is then released instead of installed.
+ *
+ * A file longer than the capacity, posted without a target length, is streamed instead: the slot opens it in one
+ * of its BackingTrackStreams, and the layer it hands over is the stream's paged buffer. One more thread, the
+ * stream reader, keeps the window of every attached stream read from disk.
+ */
+class AudioFileLoader
+{
+public:
+    enum Stage : int
+    {
+        Idle,      // staging buffer empty, owned by the audio thread
+        Requested, // file posted, waiting for a loader thread
+        Decoding,  // staging buffer owned by the loader thread that claimed it
+        Done       // staging buffer holds the loaded layer, back with the audio thread
+    };
+
+    AudioFileLoader() {}
+    ~AudioFileLoader() { releaseResources(); }
+
+    void prepareToPlay (LoopBlockPool& blockPool, const int capacitySamples, const double sampleRate, const int numSlots, const int numThreads)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        pool = &blockPool;
+        capacity = capacitySamples;
+        targetSampleRate = sampleRate;
+        // Staging buffers are sized by the loader thread on first use, so idle tracks cost nothing
+        slots.clear();
+        for (int i = 0; i < numSlots; ++i)
+        {
+            slots.push_back (std::make_unique<Slot>());
+            for (auto& stream : slots.back()->streams)
+            {
+                stream = std::make_unique<BackingTrackStream>();
+                stream->setReaderWake (&streamWake);
+            }
+        }
+
+        shouldStop.store (false);
+        for (int i = 0; i < std::max (numThreads, 1); ++i)
+            loaderThreads.emplace_back ([this]() { runLoaderThread(); });
+        streamReaderThread = std::thread ([this]() { runStreamReaderThread(); });
+    }
+
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        shouldStop.store (true);
+        for (size_t i = 0; i < loaderThreads.size(); ++i)
+            loaderSignal.signal();
+        for (auto& thread : loaderThreads)
+            if (thread.joinable()) thread.join();
+        loaderThreads.clear();
+        streamWake.wake();
+        if (streamReaderThread.joinable()) streamReaderThread.join();
+
+        // Every stream must have been detached from its track by now
+        slots.clear();
+        pool = nullptr;
+        capacity = 0;
+    }
+
+    int getNumSlots() const { return (int) slots.size(); }
+    int getNumLoaderThreads() const { return (int) loaderThreads.size(); }
+
+    bool isIdle (const int slot) const
+    {
+        const auto& s = *slots[(size_t) slot];
+        return s.stage.load (std::memory_order_acquire) == Idle && ! s.hasQueuedFile;
+    }
+    bool isBusy (const int slot) const { return ! isIdle (slot); }
+
+    // Audio thread: loads file into the slot. A targetLength above zero cuts or pads the layer to that many
+    // samples; otherwise it is as long as the file, up to the buffer capacity.
+    void post (const int slot, const juce::File& file, const int targetLength)
+    {
+        PERFETTO_FUNCTION();
+        if (slot < 0 || slot >= getNumSlots()) return;
+        auto& s = *slots[(size_t) slot];
+
+        s.queuedFile = file;
+        s.queuedTargetLength = targetLength;
+        s.hasQueuedFile = true;
+        discardResult (s);
+        postQueuedFile (s);
+    }
+
+    // Audio thread: drops whatever the slot is loading or waiting to load
+    void discard (const int slot)
+    {
+        if (slot < 0 || slot >= getNumSlots()) return;
+        auto& s = *slots[(size_t) slot];
+        s.hasQueuedFile = false;
+        discardResult (s);
+    }
+
+    // Audio thread: once the slot's layer is ready, calls install (std::unique_ptr<ChunkedLoopBuffer>& layer, int length,
+    // BackingTrackStream* stream), which swaps it with the track's live layer or, when stream is set, attaches the stream
+    // instead, and returns true. A discarded or unreadable file is only released.
+    template <typename Install>
+    bool collect (const int slot, Install&& install)
+    {
+        PERFETTO_FUNCTION();
+        if (slot < 0 || slot >= getNumSlots()) return false;
+        auto& s = *slots[(size_t) slot];
+
+        bool installed = false;
+        if (s.stage.load (std::memory_order_acquire) == Done)
+        {
+            installed = ! s.discarded && s.loadedLength > 0;
+            if (installed)
+                install (s.staging, s.loadedLength, s.loadedStream);
+            else if (s.loadedStream != nullptr)
+                s.loadedStream->detach();
+
+            // After the swap this is the track's old layer
+            s.staging->clear();
+            s.loadedStream = nullptr;
+            s.discarded = false;
+            s.stage.store (Idle, std::memory_order_relaxed);
+        }
+
+        postQueuedFile (s);
+        return installed;
+    }
+
+    // Decodes reader into the first samples of layer, converting it to sampleRate and to the layer's channel
+    // count, and returns the length written: targetLength if above zero, otherwise the whole file, both capped
+    // at the layer's capacity. The file is read in AUDIO_FILE_LOADER_CHUNK_SAMPLES pieces, so a long one never
+    // sits in memory whole.
+    static int decodeInto (juce::AudioFormatReader& reader, ChunkedLoopBuffer& layer, const double sampleRate, const int targetLength)
+    {
+        PERFETTO_FUNCTION();
+        const int fileChannels = (int) reader.numChannels;
+        if (fileChannels <= 0 || reader.sampleRate <= 0.0 || sampleRate <= 0.0) return 0;
+
+        const double ratio = reader.sampleRate / sampleRate;
+        const bool resample = std::abs (reader.sampleRate - sampleRate) > 0.01;
+        const auto fileLength = getLengthAtRate (reader, sampleRate);
+        const int length = (int) std::min<juce::int64> (targetLength > 0 ? targetLength : fileLength, layer.getNumSamples());
+        if (length <= 0) return 0;
+
+        // Lagrange needs a few input samples beyond the ones it steps over
+        const int chunkInputSamples = (int) std::ceil (AUDIO_FILE_LOADER_CHUNK_SAMPLES * (resample ? ratio : 1.0)) + 8;
+        juce::AudioBuffer<float> fileChunk (fileChannels, chunkInputSamples);
+        juce::AudioBuffer<float> converted (fileChannels, AUDIO_FILE_LOADER_CHUNK_SAMPLES);
+        std::vector<juce::LagrangeInterpolator> interpolators ((size_t) fileChannels);
+
+        juce::int64 filePosition = 0;
+        for (int done = 0; done < length;)
+        {
+            const int chunk = std::min (AUDIO_FILE_LOADER_CHUNK_SAMPLES, length - done);
+
+            // Reading past the end of the file yields silence, which pads a layer longer than it
+            const juce::AudioBuffer<float>* source = &fileChunk;
+            if (resample)
+            {
+                reader.read (&fileChunk, 0, chunkInputSamples, filePosition, true, true);
+                int used = 0;
+                for (int ch = 0; ch < fileChannels; ++ch)
+                    used = interpolators[(size_t) ch].process (ratio, fileChunk.getReadPointer (ch), converted.getWritePointer (ch), chunk);
+                filePosition += used;
+                source = &converted;
+            }
+            else
+            {
+                reader.read (&fileChunk, 0, chunk, filePosition, true, true);
+                filePosition += chunk;
+            }
+
+            // A mono file feeds every channel; a wider one than the loop keeps its first channels
+            for (int ch = 0; ch < layer.getNumChannels(); ++ch)
+            {
+                const float* samples = source->getReadPointer (ch % fileChannels);
+                layer.forEachWritableRun (ch,
+                                          done,
+                                          chunk,
+                                          [samples] (float* dest, const int offset, const int run)
+                                          { juce::FloatVectorOperations::copy (dest, samples + offset, run); });
+            }
+            done += chunk;
+        }
+
+        // The peaks are measured here so normalising the layer later only reads the table
+        layer.refreshPeaks (0, length);
+        return length;
+    }
+
+    // The file's length once converted to sampleRate; below a hundredth of a hertz apart the file is taken as it is
+    static juce::int64 getLengthAtRate (const juce::AudioFormatReader& reader, const double sampleRate)
+    {
+        if (std::abs (reader.sampleRate - sampleRate) <= 0.01) return reader.lengthInSamples;
+        return (juce::int64) std::ceil ((double) reader.lengthInSamples / (reader.sampleRate / sampleRate));
+    }
+
+private:
+    static constexpr int STREAMS_PER_SLOT = 2; // one playing while the next file opens
+
+    struct Slot
+    {
+        std::unique_ptr<ChunkedLoopBuffer> staging = std::make_unique<ChunkedLoopBuffer>();
+        std::array<std::unique_ptr<BackingTrackStream>, STREAMS_PER_SLOT> streams;
+        std::atomic<int> stage { Idle };
+
+        // Written by the audio thread before the slot is Requested
+        juce::File file;
+        int targetLength = 0;
+
+        // Written by the loader thread before the slot is Done
+        int loadedLength = 0;
+        BackingTrackStream* loadedStream = nullptr; // set when the file was opened as a stream
+
+        // Audio thread only
+        bool discarded = false;
+        juce::File queuedFile;
+        int queuedTargetLength = 0;
+        bool hasQueuedFile = false;
+    };
+
+    std::vector<std::unique_ptr<Slot>> slots;
+    LoopBlockPool* pool = nullptr;
+    int capacity = 0;
+    double targetSampleRate = 0.0;
+
+    juce::WaitableEvent loaderSignal;
+    std::atomic<unsigned int> loaderRequests { 0 };
+    std::atomic<int> sleepingLoaders { 0 };
+    std::atomic<bool> shouldStop { false };
+    std::vector<std::thread> loaderThreads;
+
+    StreamReaderWake streamWake;
+    std::thread streamReaderThread;
+
+    // A file still waiting for a thread is simply withdrawn; one being decoded finishes and is released
+    static void discardResult (Slot& s)
+    {
+        int expected = Requested;
+        if (s.stage.compare_exchange_strong (expected, Idle, std::memory_order_acq_rel)) return;
+        if (expected != Idle) s.discarded = true;
+    }
+
+    void postQueuedFile (Slot& s)
+    {
+        if (! s.hasQueuedFile || s.stage.load (std::memory_order_acquire) != Idle) return;
+
+        s.file = s.queuedFile;
+        s.targetLength = s.queuedTargetLength;
+        s.hasQueuedFile = false;
+        s.discarded = false;
+
+        s.stage.store (Requested, std::memory_order_release);
+        wakeLoader();
+    }
+
+    // Audio thread: only touches the event, and its lock, when a loader is asleep
+    void wakeLoader()
+    {
+        loaderRequests.fetch_add (1);
+        if (sleepingLoaders.load() > 0) loaderSignal.signal();
+    }
+
+    Slot* claimRequestedSlot()
+    {
+        for (auto& slot : slots)
+        {
+            int expected = Requested;
+            if (slot->stage.compare_exchange_strong (expected, Decoding, std::memory_order_acq_rel)) return slot.get();
+        }
+        return nullptr;
+    }
+
+    bool hasRequestedSlot() const
+    {
+        for (const auto& slot : slots)
+            if (slot->stage.load (std::memory_order_relaxed) == Requested) return true;
+        return false;
+    }
+
+    void load (Slot& s, juce::AudioFormatManager& formats)
+    {
+        PERFETTO_FUNCTION();
+        s.loadedLength = 0;
+        s.loadedStream = nullptr;
+
+        std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor (s.file));
+        if (reader != nullptr)
+        {
+            // Only a file that would be cut short streams; one fitted to a target length always decodes
+            const auto fileLength = getLengthAtRate (*reader, targetSampleRate);
+            auto* stream = s.targetLength <= 0 && fileLength > capacity ? claimStream (s) : nullptr;
+            if (stream != nullptr)
+            {
+                const auto streamLength = std::min<juce::int64> (fileLength, std::numeric_limits<int>::max() - LOOP_BLOCK_SIZE_SAMPLES);
+                s.loadedLength = stream->open (std::move (reader), *pool, targetSampleRate, (int) streamLength);
+                if (s.loadedLength > 0) s.loadedStream = stream;
+            }
+            else
+            {
+                if (s.staging->getNumSamples() != capacity) s.staging->prepareToPlay (*pool, capacity);
+                s.loadedLength = decodeInto (*reader, *s.staging, targetSampleRate, s.targetLength);
+            }
+        }
+        s.stage.store (Done, std::memory_order_release);
+    }
+
+    // Null only while both streams are in use, one playing and one opened but not yet collected; the file is then cut
+    static BackingTrackStream* claimStream (Slot& s)
+    {
+        for (auto& stream : s.streams)
+            if (stream->claim()) return stream.get();
+        return nullptr;
+    }
+
+    void runLoaderThread()
+    {
+        juce::Thread::setCurrentThreadName ("Audio File Loader");
+        juce::AudioFormatManager formats;
+        formats.registerBasicFormats();
+
+        unsigned int seen = loaderRequests.load();
+        while (! shouldStop.load())
+        {
+            // wakeLoader() counts its request before it checks for sleepers, so one of the two always notices the other
+            sleepingLoaders.fetch_add (1);
+            if (loaderRequests.load() == seen && ! shouldStop.load()) loaderSignal.wait (AUDIO_FILE_LOADER_IDLE_INTERVAL_MS);
+            sleepingLoaders.fetch_sub (1);
+            seen = loaderRequests.load();
+
+            while (! shouldStop.load())
+            {
+                auto* slot = claimRequestedSlot();
+                if (slot == nullptr) break;
+
+                // One wake-up can stand for several posts; pass the rest on to another thread
+                if (hasRequestedSlot()) loaderSignal.signal();
+                load (*slot, formats);
+            }
+        }
+    }
+
+    // One block at a time for each stream in turn, so a stream falling behind never starves the others
+    void runStreamReaderThread()
+    {
+        juce::Thread::setCurrentThreadName ("Backing Track Streamer");
+        while (! shouldStop.load())
+        {
+            bool worked = false;
+            for (auto& slot : slots)
+                for (auto& stream : slot->streams)
+                    worked = stream->service() || worked;
+
+            if (! worked) streamWake.wait (STREAM_READER_IDLE_INTERVAL_MS);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (AudioFileLoader)
+};
@@ -0,0 +1,534 @@
+#pragma once
+
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * Wakes the thread that reads backing track streams. Streams ask for it from the audio thread, so asking only
+ * touches the event, and its lock, while the reader is asleep.
+ */
+class StreamReaderWake
+{
+public:
+    // Audio thread
+    void notify()
+    {
+        requests.fetch_add (1);
+        if (sleeping.load()) event.signal();
+    }
+
+    // Reader thread: waits up to timeoutMs, unless a request came in since the last wait
+    void wait (const int timeoutMs)
+    {
+        // notify() counts its request before it checks for a sleeper, so one of the two always notices the other
+        sleeping.store (true);
+        if (requests.load() == seen) event.wait (timeoutMs);
+        sleeping.store (false);
+        seen = requests.load();
+    }
+
+    // Message thread, e.g. to stop the reader
+    void wake() { event.signal(); }
+
+private:
+    std::atomic<unsigned int> requests { 0 };
+    std::atomic<bool> sleeping { false };
+    unsigned int seen = 0; // reader thread only
+    juce::WaitableEvent event;
+};
+
+/**
+ * A backing track played from disk rather than from memory, for files longer than a track's loop capacity.
+ *
+ * The stream owns a paged ChunkedLoopBuffer as long as the whole file. Only the blocks around the playhead are
+ * resident; the rest of the table stays empty and reads as silence. A track attaches the stream by swapping the
+ * paged buffer in as its loop, so BufferManager and PlaybackEngine play it like any other layer: speed, direction,
+ * stretching, loop regions and the seam all work unchanged.
+ *
+ * Once per block the track calls update() with where playback is and where it wraps. The audio thread adopts the
+ * blocks the reader has delivered for that window and hands the ones playback has left back to the pool. A
+ * background reader (AudioFileLoader runs one for every stream) calls service() to decode the most urgent missing
+ * block into a fresh pool block. Each table entry goes Empty -> Loading -> delivered (holding the block id) ->
+ * Resident -> Empty. Only the reader moves an entry out of Empty or Loading, only the audio thread makes one
+ * Resident, and either side may take a delivered block back with a compare-and-swap, so exactly one of them
+ * returns it to the pool.
+ *
+ * The stream itself goes Closed -> Opening -> Ready -> Attached -> Detached. The loader opens it and decodes the
+ * first window, so playback starts the moment it is attached; a detached stream is opened again once the reader
+ * has let go of it.
+ */
+class BackingTrackStream
+{
+public:
+    enum State : int
+    {
+        Closed,   // holds no file
+        Opening,  // owned by the loader thread that claimed it
+        Ready,    // first window decoded, waiting for the audio thread to attach it
+        Attached, // playing on a track; the reader keeps its window filled
+        Detached  // given back by the track; reopened once the reader is done with it
+    };
+
+    // Where playback is and where it wraps, as the reader sees it
+    struct Window
+    {
+        double playhead = 0.0;
+        int direction = 1;
+        int wrapStart = 0;
+        int wrapEnd = 0;
+        int guardEnd = 0;    // end of the seam guard past wrapEnd, or wrapEnd when the range has none
+        int seekTarget = -1; // where a seek waiting on the disk will land
+    };
+
+    BackingTrackStream() {}
+    ~BackingTrackStream() { releaseResources(); }
+
+    // Only with the reader stopped; the stream must not be attached
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        jassert (state.load() != Attached);
+        releaseDeliveredBlocks();
+        buffer.reset();
+        paged = nullptr;
+        entries.reset();
+        numEntries = 0;
+        numResident = 0;
+        reader.reset();
+        state.store (Closed);
+    }
+
+    void setReaderWake (StreamReaderWake* wake) { readerWake = wake; }
+
+    State getState() const { return (State) state.load(); }
+    int getLength() const { return length; }
+    int getNumResidentBlocks() const { return numResident; }
+    int getNumUnderruns() const { return underruns; }
+
+    // The paged buffer while the stream is not attached; the track's own buffer while it is
+    std::unique_ptr<ChunkedLoopBuffer>& getBuffer() { return buffer; }
+
+    //==============================================================================
+    // Loader thread
+
+    // Takes the stream for a new file; a detached one only once the reader has finished with it
+    bool claim()
+    {
+        int expected = Closed;
+        if (! state.compare_exchange_strong (expected, Opening))
+        {
+            expected = Detached;
+            if (! state.compare_exchange_strong (expected, Opening)) return false;
+        }
+
+        while (busy.load())
+            std::this_thread::yield();
+        return true;
+    }
+
+    // Opens fileReader as lengthSamples of audio at sampleRate and decodes the blocks playback starts with.
+    // Returns the length, or 0 (and a closed stream) if nothing could be opened.
+    int open (std::unique_ptr<juce::AudioFormatReader> fileReader, LoopBlockPool& blockPool, const double sampleRate, const int lengthSamples)
+    {
+        PERFETTO_FUNCTION();
+        jassert (state.load() == Opening);
+        releaseDeliveredBlocks();
+
+        reader = std::move (fileReader);
+        if (reader == nullptr || reader->numChannels == 0 || reader->sampleRate <= 0.0 || sampleRate <= 0.0 || lengthSamples <= 0)
+        {
+            releaseResources();
+            return 0;
+        }
+
+        pool = &blockPool;
+        length = lengthSamples;
+        fileChannels = (int) reader->numChannels;
+        ratio = reader->sampleRate / sampleRate;
+        resample = std::abs (reader->sampleRate - sampleRate) > 0.01;
+
+        if (buffer == nullptr) buffer = std::make_unique<ChunkedLoopBuffer>();
+        buffer->prepareToPlay (blockPool, length);
+        paged = buffer.get();
+        blockSamples = paged->getBlockSamples();
+        numEntries = paged->getNumTableEntries();
+        entries = std::make_unique<std::atomic<int>[]> ((size_t) numEntries);
+        for (int i = 0; i < numEntries; ++i)
+            entries[(size_t) i].store (EMPTY, std::memory_order_relaxed);
+        numResident = 0;
+        underruns = 0;
+        delivered.reserve (STREAM_MAX_RESIDENT_BLOCKS);
+
+        // One block's span of the file plus the neighbours the interpolator reaches for
+        fileChunk.setSize (fileChannels, (int) std::ceil (blockSamples * (resample ? ratio : 1.0)) + 4, false, false, true);
+        converted.setSize (fileChannels, blockSamples, false, false, true);
+
+        Window window;
+        window.wrapEnd = length;
+        window.guardEnd = length;
+        publishWindow (window);
+
+        std::array<int, STREAM_MAX_RESIDENT_BLOCKS> desired;
+        const int numDesired = collectDesiredBlocks (window, desired);
+        for (int k = 0; k < numDesired; ++k)
+        {
+            const int blockId = pool->acquireBlock();
+            if (blockId == LoopBlockPool::INVALID_BLOCK) break;
+            decodeBlock (desired[(size_t) k], blockId);
+            adopt (desired[(size_t) k], blockId);
+        }
+
+        state.store (Ready);
+        return length;
+    }
+
+    //==============================================================================
+    // Audio thread
+
+    // The track has swapped the paged buffer in
+    void attach()
+    {
+        jassert (state.load() == Ready);
+        state.store (Attached);
+    }
+
+    // The track has swapped its own buffer back, so the paged one is here again. Hands back every block this side
+    // can take; the reader returns any it was still decoding once it sees the stream detached.
+    void detach()
+    {
+        PERFETTO_FUNCTION();
+        jassert (buffer.get() == paged);
+        state.store (Detached);
+
+        for (int r = 0; r < numResident; ++r)
+            entries[(size_t) resident[(size_t) r]].store (EMPTY);
+        numResident = 0;
+        paged->clear();
+
+        for (int i = 0; i < numEntries; ++i)
+        {
+            int blockId = entries[(size_t) i].load();
+            if (blockId >= 0 && entries[(size_t) i].compare_exchange_strong (blockId, EMPTY)) pool->releaseBlock (blockId);
+        }
+    }
+
+    // Before playback reads the block: publishes window, evicts the blocks playback has left and adopts the ones the
+    // reader delivered. Returns false when the span samples from the playhead are not all in yet, so part of the
+    // block plays silent.
+    bool update (const Window& window, const double span)
+    {
+        PERFETTO_FUNCTION();
+        publishWindow (window);
+
+        std::array<int, STREAM_MAX_RESIDENT_BLOCKS> desired;
+        const int numDesired = collectDesiredBlocks (window, desired);
+
+        for (int r = 0; r < numResident;)
+        {
+            const int index = resident[(size_t) r];
+            if (contains (desired, numDesired, index))
+            {
+                ++r;
+                continue;
+            }
+
+            paged->releaseBlockAt (index);
+            paged->getSilenceMap().markSilent (index * blockSamples, getBlockLength (index));
+            entries[(size_t) index].store (EMPTY);
+            resident[(size_t) r] = resident[(size_t) --numResident];
+        }
+
+        bool missing = false;
+        for (int k = 0; k < numDesired; ++k)
+        {
+            const int index = desired[(size_t) k];
+            int blockId = entries[(size_t) index].load();
+            if (blockId >= 0 && numResident < STREAM_MAX_RESIDENT_BLOCKS && entries[(size_t) index].compare_exchange_strong (blockId, RESIDENT))
+                adopt (index, blockId);
+            else if (blockId == EMPTY)
+                missing = true;
+        }
+        if (missing && readerWake != nullptr) readerWake->notify();
+
+        const bool playable = isResident (window.playhead) && isResident (wrap (window, window.playhead + window.direction * span));
+        if (! playable) ++underruns;
+        return playable;
+    }
+
+    bool isResident (const double position) const
+    {
+        const int index = getBlockIndex (position);
+        return index >= 0 && entries[(size_t) index].load() == RESIDENT;
+    }
+
+    //==============================================================================
+    // Reader thread
+
+    // Decodes the most urgent block the attached window is missing. Returns true if it did any work.
+    bool service()
+    {
+        busy.store (true);
+        bool worked = false;
+        const int current = state.load();
+        if (current == Attached)
+            worked = readNextBlock();
+        else if (current == Detached)
+            releaseDeliveredBlocks();
+        busy.store (false);
+        return worked;
+    }
+
+private:
+    static constexpr int EMPTY = -1;
+    static constexpr int LOADING = -2;
+    static constexpr int RESIDENT = -3;
+
+    std::atomic<int> state { Closed };
+    std::atomic<bool> busy { false }; // the reader is inside service()
+
+    std::unique_ptr<ChunkedLoopBuffer> buffer;
+    ChunkedLoopBuffer* paged = nullptr;
+    LoopBlockPool* pool = nullptr;
+    int length = 0;
+    int blockSamples = LOOP_BLOCK_SIZE_SAMPLES;
+
+    // Per table entry: EMPTY, LOADING, RESIDENT or the id of a delivered block
+    std::unique_ptr<std::atomic<int>[]> entries;
+    int numEntries = 0;
+
+    std::atomic<double> windowPlayhead { 0.0 };
+    std::atomic<int> windowDirection { 1 };
+    std::atomic<int> windowStart { 0 };
+    std::atomic<int> windowEnd { 0 };
+    std::atomic<int> windowGuardEnd { 0 };
+    std::atomic<int> windowSeekTarget { -1 };
+    StreamReaderWake* readerWake = nullptr;
+
+    // Audio thread (the loader's before the stream is Ready)
+    std::array<int, STREAM_MAX_RESIDENT_BLOCKS> resident {};
+    int numResident = 0;
+    int underruns = 0;
+
+    // Reader thread (the loader's while the stream is Opening)
+    std::unique_ptr<juce::AudioFormatReader> reader;
+    int fileChannels = 0;
+    double ratio = 1.0;
+    bool resample = false;
+    juce::AudioBuffer<float> fileChunk;
+    juce::AudioBuffer<float> converted;
+    std::vector<int> delivered; // entries this side delivered and has not seen adopted yet
+
+    int getBlockIndex (const double position) const
+    {
+        if (position < 0.0 || position >= (double) length) return -1;
+        return (int) position / blockSamples;
+    }
+
+    int getBlockLength (const int index) const { return std::min (blockSamples, length - index * blockSamples); }
+
+    static bool contains (const std::array<int, STREAM_MAX_RESIDENT_BLOCKS>& blocks, const int num, const int index)
+    {
+        return std::find (blocks.begin(), blocks.begin() + num, index) != blocks.begin() + num;
+    }
+
+    static double wrap (const Window& window, const double position)
+    {
+        const int wrapLength = window.wrapEnd - window.wrapStart;
+        if (wrapLength <= 0) return position;
+        double offset = std::fmod (position - window.wrapStart, (double) wrapLength);
+        if (offset < 0.0) offset += wrapLength;
+        return window.wrapStart + offset;
+    }
+
+    void publishWindow (const Window& window)
+    {
+        windowPlayhead.store (window.playhead, std::memory_order_relaxed);
+        windowDirection.store (window.direction, std::memory_order_relaxed);
+        windowStart.store (window.wrapStart, std::memory_order_relaxed);
+        windowEnd.store (window.wrapEnd, std::memory_order_relaxed);
+        windowGuardEnd.store (window.guardEnd, std::memory_order_relaxed);
+        windowSeekTarget.store (window.seekTarget, std::memory_order_relaxed);
+    }
+
+    // The fields may come from different updates; a window that is briefly off only reads a block early
+    Window loadWindow() const
+    {
+        Window window;
+        window.playhead = windowPlayhead.load (std::memory_order_relaxed);
+        window.direction = windowDirection.load (std::memory_order_relaxed);
+        window.wrapStart = windowStart.load (std::memory_order_relaxed);
+        window.wrapEnd = windowEnd.load (std::memory_order_relaxed);
+        window.guardEnd = windowGuardEnd.load (std::memory_order_relaxed);
+        window.seekTarget = windowSeekTarget.load (std::memory_order_relaxed);
+        return window;
+    }
+
+    // The blocks window needs resident, most urgent first
+    int collectDesiredBlocks (const Window& window, std::array<int, STREAM_MAX_RESIDENT_BLOCKS>& desired) const
+    {
+        int num = 0;
+        auto add = [&] (const double position)
+        {
+            const int index = getBlockIndex (position);
+            if (index >= 0 && num < STREAM_MAX_RESIDENT_BLOCKS && ! contains (desired, num, index)) desired[(size_t) num++] = index;
+        };
+
+        // What plays now, then what plays next in the direction of travel
+        for (int k = 0; k <= STREAM_READ_AHEAD_BLOCKS; ++k)
+            add (wrap (window, window.playhead + (double) window.direction * k * blockSamples));
+
+        // Where a pending seek lands, so it happens as soon as those blocks are in
+        if (window.seekTarget >= 0)
+            for (int k = 0; k < 2; ++k)
+                add ((double) window.seekTarget + (double) window.direction * k * blockSamples);
+
+        // Both ends of the wrap range and its seam guard, so a wrap never waits for the disk
+        add (window.wrapStart);
+        add (window.wrapEnd - 1);
+        if (window.guardEnd > window.wrapEnd)
+        {
+            add (window.wrapEnd);
+            add (window.guardEnd - 1);
+        }
+
+        // The samples just played, which interpolators and reverse reads reach back into
+        add (wrap (window, window.playhead - (double) window.direction * VARISPEED_TAPS));
+        return num;
+    }
+
+    // Makes blockId, already owned by the caller, the resident block of entry index
+    void adopt (const int index, const int blockId)
+    {
+        paged->adoptBlockAt (index, blockId);
+        paged->getSilenceMap().markSounding (index * blockSamples, getBlockLength (index));
+        entries[(size_t) index].store (RESIDENT);
+        resident[(size_t) numResident++] = index;
+    }
+
+    bool readNextBlock()
+    {
+        PERFETTO_FUNCTION();
+        std::array<int, STREAM_MAX_RESIDENT_BLOCKS> desired;
+        const int numDesired = collectDesiredBlocks (loadWindow(), desired);
+
+        // Blocks delivered for a window playback has since left go back before any more are read
+        for (size_t i = 0; i < delivered.size();)
+        {
+            const int index = delivered[i];
+            int blockId = entries[(size_t) index].load();
+            if (blockId >= 0 && ! contains (desired, numDesired, index) && entries[(size_t) index].compare_exchange_strong (blockId, EMPTY))
+            {
+                pool->releaseBlock (blockId);
+                blockId = EMPTY;
+            }
+
+            if (blockId < 0)
+            {
+                delivered[i] = delivered.back();
+                delivered.pop_back();
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        if ((int) delivered.size() >= STREAM_MAX_RESIDENT_BLOCKS) return false;
+
+        for (int k = 0; k < numDesired; ++k)
+        {
+            const int index = desired[(size_t) k];
+            int expected = EMPTY;
+            if (! entries[(size_t) index].compare_exchange_strong (expected, LOADING)) continue;
+
+            const int blockId = pool->acquireBlock();
+            if (blockId == LoopBlockPool::INVALID_BLOCK)
+            {
+                entries[(size_t) index].store (EMPTY);
+                return false;
+            }
+
+            decodeBlock (index, blockId);
+            entries[(size_t) index].store (blockId);
+            delivered.push_back (index);
+
+            // Detached while the block was decoding: the audio thread will not collect it
+            if (state.load() != Attached) releaseDeliveredBlocks();
+            return true;
+        }
+        return false;
+    }
+
+    void releaseDeliveredBlocks()
+    {
+        for (const int index : delivered)
+        {
+            int blockId = entries[(size_t) index].load();
+            if (blockId >= 0 && entries[(size_t) index].compare_exchange_strong (blockId, EMPTY)) pool->releaseBlock (blockId);
+        }
+        delivered.clear();
+    }
+
+    // Lagrange through the four samples from p[0] to p[3], at t past p[1]
+    static float interpolate (const float* p, const float t)
+    {
+        return p[0] * (-t * (t - 1.0f) * (t - 2.0f) / 6.0f) + p[1] * ((t + 1.0f) * (t - 1.0f) * (t - 2.0f) / 2.0f)
+               + p[2] * (-(t + 1.0f) * t * (t - 2.0f) / 2.0f) + p[3] * ((t + 1.0f) * t * (t - 1.0f) / 6.0f);
+    }
+
+    // Decodes table entry index into blockId, converting it to the loop's sample rate and channel count. Every block
+    // reads its own span of the file, so blocks can be decoded in any order.
+    void decodeBlock (const int index, const int blockId)
+    {
+        PERFETTO_FUNCTION();
+        const juce::int64 start = (juce::int64) index * blockSamples;
+        const int num = getBlockLength (index);
+
+        // Reading outside the file yields silence
+        if (resample)
+        {
+            const juce::int64 readStart = (juce::int64) std::floor ((double) start * ratio) - 1;
+            const int readLength = (int) ((juce::int64) std::floor ((double) (start + num - 1) * ratio) + 3 - readStart);
+            reader->read (&fileChunk, 0, readLength, readStart, true, true);
+
+            for (int ch = 0; ch < fileChannels; ++ch)
+            {
+                const float* in = fileChunk.getReadPointer (ch);
+                float* out = converted.getWritePointer (ch);
+                for (int i = 0; i < num; ++i)
+                {
+                    const double x = (double) (start + i) * ratio - (double) readStart;
+                    const int n = (int) x;
+                    out[i] = interpolate (in + n - 1, (float) (x - n));
+                }
+            }
+        }
+        else
+        {
+            reader->read (&fileChunk, 0, num, start, true, true);
+        }
+
+        // A mono file feeds every channel; a wider one than the loop keeps its first channels
+        const auto& source = resample ? converted : fileChunk;
+        const auto format = pool->getSampleFormat();
+        for (int ch = 0; ch < pool->getNumChannels(); ++ch)
+        {
+            const float* samples = source.getReadPointer (ch % fileChannels);
+            if (format == LoopSampleFormat::Float32)
+                juce::FloatVectorOperations::copy (pool->getBlockData (blockId, ch), samples, num);
+            else
+                LoopSampleConversion::fromFloat (format, samples, pool->getBlockStorage (blockId, ch), num);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BackingTrackStream)
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define LOOPER_USE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define LOOPER_USE_NEON 1
+#endif
+
+/**
+ * Named kernels for BufferManager::writeToAudioBuffer and readFromAudioBuffer.
+ *
+ * The BufferManager methods are templated on the kernel, so each call site gets its own copy of the
+ * wrap-split and block-run loops with the kernel inlined into them. Write kernels take
+ * (destination, source, numSamples, shouldOverdub); read kernels take (destination, source, numSamples).
+ * Any callable with those signatures works; these cover the engine's own paths.
+ *
+ * Each kernel also has a reversed() form that reads the source back to front, which is how reverse
+ * playback and reverse overdubs run: a block touches at most two contiguous segments of the loop,
+ * and each is handed to reversed() as is, with the reversal done in registers. Kernels without a
+ * reversed() form still work; BufferManager reverses the source through a small stack buffer first.
+ *
+ * Kernels can also tell BufferManager how they treat silence, so it can keep the loop's silence map and
+ * skip silent regions. A write kernel with replacesDestination (shouldOverdub) writes zeros for zero
+ * input, and when that returns true leaves nothing of the old destination behind; write kernels without
+ * it are taken to make sound wherever they write. A read kernel with addsToDestination leaves the
+ * destination as it was over silence, so silent runs are not read at all.
+ */
+namespace BufferKernels
+{
+namespace detail
+{
+#if LOOPER_USE_SSE2
+    using Vector = __m128;
+    inline Vector load (const float* p) { return _mm_loadu_ps (p); }
+    inline Vector loadReversed (const float* p)
+    {
+        const Vector v = _mm_loadu_ps (p);
+        return _mm_shuffle_ps (v, v, _MM_SHUFFLE (0, 1, 2, 3));
+    }
+    inline void store (float* p, const Vector v) { _mm_storeu_ps (p, v); }
+    inline Vector splat (const float x) { return _mm_set1_ps (x); }
+    inline Vector add (const Vector a, const Vector b) { return _mm_add_ps (a, b); }
+    inline Vector mul (const Vector a, const Vector b) { return _mm_mul_ps (a, b); }
+    inline float sum (const Vector v)
+    {
+        const Vector pairs = _mm_add_ps (v, _mm_movehl_ps (v, v));
+        return _mm_cvtss_f32 (_mm_add_ss (pairs, _mm_shuffle_ps (pairs, pairs, _MM_SHUFFLE (1, 1, 1, 1))));
+    }
+#elif LOOPER_USE_NEON
+    using Vector = float32x4_t;
+    inline Vector load (const float* p) { return vld1q_f32 (p); }
+    inline Vector loadReversed (const float* p)
+    {
+        const Vector v = vrev64q_f32 (vld1q_f32 (p));
+        return vcombine_f32 (vget_high_f32 (v), vget_low_f32 (v));
+    }
+    inline void store (float* p, const Vector v) { vst1q_f32 (p, v); }
+    inline Vector splat (const float x) { return vdupq_n_f32 (x); }
+    inline Vector add (const Vector a, const Vector b) { return vaddq_f32 (a, b); }
+    inline Vector mul (const Vector a, const Vector b) { return vmulq_f32 (a, b); }
+    inline float sum (const Vector v)
+    {
+        const float32x2_t pairs = vadd_f32 (vget_low_f32 (v), vget_high_f32 (v));
+        return vget_lane_f32 (vpadd_f32 (pairs, pairs), 0);
+    }
+#endif
+
+    // destination[i] = op (destination[i], source[numSamples - 1 - i]), four samples at a time where the target allows
+    template <typename VectorOp, typename ScalarOp>
+    inline void forEachReversed (float* destination, const float* source, const int numSamples, VectorOp&& vectorOp, ScalarOp&& scalarOp)
+    {
+        int i = 0;
+#if LOOPER_USE_SSE2 || LOOPER_USE_NEON
+        for (; i + 4 <= numSamples; i += 4)
+            store (destination + i, vectorOp (load (destination + i), loadReversed (source + numSamples - 4 - i)));
+#else
+        juce::ignoreUnused (vectorOp);
+#endif
+        for (; i < numSamples; ++i)
+            destination[i] = scalarOp (destination[i], source[numSamples - 1 - i]);
+    }
+
+    // Sum of a[i] * b[i], four products at a time where the target allows
+    inline float dot (const float* a, const float* b, const int numSamples)
+    {
+        int i = 0;
+        float total = 0.0f;
+#if LOOPER_USE_SSE2 || LOOPER_USE_NEON
+        Vector accumulator = splat (0.0f);
+        for (; i + 4 <= numSamples; i += 4)
+            accumulator = add (accumulator, mul (load (a + i), load (b + i)));
+        total = sum (accumulator);
+#endif
+        for (; i < numSamples; ++i)
+            total += a[i] * b[i];
+        return total;
+    }
+} // namespace detail
+
+inline void reverseCopy (float* destination, const float* source, const int numSamples)
+{
+    detail::forEachReversed (
+        destination, source, numSamples, [] (auto, auto s) { return s; }, [] (float, float s) { return s; });
+}
+
+// destination[i] += source[i] * gain, the gain moving linearly from startGain by (endGain - startGain) / numSamples
+// per sample; a constant gain when the two match. One pass, so a stem is scaled and mixed without a second sweep.
+inline void addWithGainRamp (float* destination, const float* source, const int numSamples, const float startGain, const float endGain)
+{
+    if (startGain == endGain)
+    {
+        juce::FloatVectorOperations::addWithMultiply (destination, source, startGain, numSamples);
+        return;
+    }
+
+    const float increment = (endGain - startGain) / (float) numSamples;
+    int i = 0;
+#if LOOPER_USE_SSE2 || LOOPER_USE_NEON
+    using namespace detail;
+    const float firstGains[4] = { startGain, startGain + increment, startGain + 2.0f * increment, startGain + 3.0f * increment };
+    Vector gain = load (firstGains);
+    const Vector step = splat (4.0f * increment);
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        store (destination + i, add (load (destination + i), mul (load (source + i), gain)));
+        gain = add (gain, step);
+    }
+#endif
+    for (; i < numSamples; ++i)
+        destination[i] += source[i] * (startGain + increment * (float) i);
+}
+
+struct Copy
+{
+    void operator() (float* destination, const float* source, const int numSamples) const
+    {
+        juce::FloatVectorOperations::copy (destination, source, numSamples);
+    }
+    void operator() (float* destination, const float* source, const int numSamples, const bool /*shouldOverdub*/) const
+    {
+        juce::FloatVectorOperations::copy (destination, source, numSamples);
+    }
+
+    void reversed (float* destination, const float* source, const int numSamples) const { reverseCopy (destination, source, numSamples); }
+    void reversed (float* destination, const float* source, const int numSamples, const bool /*shouldOverdub*/) const
+    {
+        reverseCopy (destination, source, numSamples);
+    }
+
+    bool replacesDestination (const bool /*shouldOverdub*/) const { return true; }
+};
+
+struct Add
+{
+    static constexpr bool addsToDestination = true;
+
+    void operator() (float* destination, const float* source, const int numSamples) const
+    {
+        juce::FloatVectorOperations::add (destination, source, numSamples);
+    }
+
+    void reversed (float* destination, const float* source, const int numSamples) const
+    {
+        using namespace detail;
+        forEachReversed (
+            destination, source, numSamples, [] (auto d, auto s) { return add (d, s); }, [] (float d, float s) { return d + s; });
+    }
+};
+
+// destination = destination * oldGain + source * newGain in one pass; a first pass replaces the destination
+struct BalancedOverdub
+{
+    float oldGain;
+    float newGain;
+
+    void operator() (float* destination, const float* source, const int numSamples, const bool shouldOverdub) const
+    {
+        if (! shouldOverdub)
+        {
+            juce::FloatVectorOperations::copyWithMultiply (destination, source, newGain, numSamples);
+            return;
+        }
+
+        for (int i = 0; i < numSamples; ++i)
+            destination[i] = destination[i] * oldGain + source[i] * newGain;
+    }
+
+    void reversed (float* destination, const float* source, const int numSamples, const bool shouldOverdub) const
+    {
+        using namespace detail;
+        const float keep = shouldOverdub ? oldGain : 0.0f;
+#if LOOPER_USE_SSE2 || LOOPER_USE_NEON
+        const Vector keepVector = splat (keep), newVector = splat (newGain);
+        auto vectorOp = [=] (Vector d, Vector s) { return add (mul (d, keepVector), mul (s, newVector)); };
+#else
+        auto vectorOp = [] (auto d, auto) { return d; };
+#endif
+        forEachReversed (destination, source, numSamples, vectorOp, [=, this] (float d, float s) { return d * keep + s * newGain; });
+    }
+
+    bool replacesDestination (const bool shouldOverdub) const { return ! shouldOverdub; }
+};
+
+template <typename Kernel>
+constexpr bool tracksSilence = requires (const Kernel& kernel) { kernel.replacesDestination (true); };
+
+template <typename Kernel>
+constexpr bool skipsSilence = requires { requires Kernel::addsToDestination; };
+} // namespace BufferKernels
@@ -1,6 +1,11 @@
 #pragma once
 
+#include "engine/BufferKernels.h"
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
 #include "engine/LoopFifo.h"
+#include "engine/VarispeedReader.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
 
@@ -8,33 +13,47 @@ class BufferManager
 {
 public:
     BufferManager() {}
+
+    // Standalone use (e.g. short circular buffers): owns a fully preallocated pool and never records in reverse
     void prepareToPlay (const int numChannels, const int bufferSize)
     {
         PERFETTO_FUNCTION();
-        audioBuffer->setSize (numChannels, bufferSize, false, true, true);
-        scratchBuffer->setSize (numChannels, bufferSize, false, true, true);
+        const int blocks = (bufferSize + LOOP_BLOCK_SIZE_SAMPLES - 1) / LOOP_BLOCK_SIZE_SAMPLES;
+        audioBuffer->releaseResources();
+        ownedPool = std::make_unique<LoopBlockPool>();
+        ownedPool->prepareToPlay (numChannels, LOOP_BLOCK_SIZE_SAMPLES, blocks, blocks);
+        prepareToPlay (*ownedPool, bufferSize);
+    }
+
+    // Loop storage drawn from a shared pool
+    void prepareToPlay (LoopBlockPool& blockPool, const int bufferSize)
+    {
+        PERFETTO_FUNCTION();
+        audioBuffer->prepareToPlay (blockPool, bufferSize);
         clear();
     }
 
     void clear()
     {
         PERFETTO_FUNCTION();
-        fifo.clearLoopRegion();
-        fifo.prepareToPlay (audioBuffer->getNumSamples());
         audioBuffer->clear();
-        length = 0;
-        provisionalLength = 0;
-        previousReadPos = -1.0;
+        resetLayout();
+    }
 
-        loopRegionEnabled = false;
-        loopRegionStart = 0;
-        loopRegionEnd = 0;
+    // Trades the loop buffer for other, which may have a different capacity, as is: nothing is cleared. The loop
+    // starts out empty either way, with no length or region, until the next finalizeLayer.
+    void swapAudioBuffer (std::unique_ptr<ChunkedLoopBuffer>& other)
+    {
+        PERFETTO_FUNCTION();
+        std::swap (audioBuffer, other);
+        resetLayout();
     }
 
     void releaseResources()
     {
         PERFETTO_FUNCTION();
-        audioBuffer->setSize (0, 0, false, false, true);
+        audioBuffer->releaseResources();
+        ownedPool.reset();
         length = 0;
         provisionalLength = 0;
         previousReadPos = 0.0;
@@ -44,7 +63,7 @@ public:
         loopRegionEnd = 0;
     }
 
-    std::unique_ptr<juce::AudioBuffer<float>>& getAudioBuffer() { return audioBuffer; }
+    std::unique_ptr<ChunkedLoopBuffer>& getAudioBuffer() { return audioBuffer; }
 
     int getAudioBufferForSave (juce::AudioBuffer<float>* loopBuffer)
     {
@@ -58,11 +77,7 @@ public:
         }
 
         loopBuffer->setSize (audioBuffer->getNumChannels(), loopLength, false, true, true);
-
-        for (int ch = 0; ch < audioBuffer->getNumChannels(); ++ch)
-        {
-            juce::FloatVectorOperations::copy (loopBuffer->getWritePointer (ch), audioBuffer->getReadPointer (ch) + loopStart, loopLength);
-        }
+        audioBuffer->copyTo (*loopBuffer, loopStart, loopLength);
         return loopLength;
     }
 
@@ -78,8 +93,7 @@ public:
     int getLength() const { return length; }
     void setLength (const int newLength) { length = newLength; }
 
-    float* getWritePointer (const int channel) { return audioBuffer->getWritePointer (channel); }
-    const float* getReadPointer (const int channel) const { return audioBuffer->getReadPointer (channel); }
+    float getSample (const int channel, const int index) const { return audioBuffer->getSample (channel, index); }
 
     void finalizeLayer (const bool isOverdub, const int masterLoopLengthSamples)
     {
@@ -97,6 +111,9 @@ public:
         }
         provisionalLength = 0;
         fifo.finishedWrite (0, isOverdub, true);
+
+        // Blocks past the loop end were only touched by the first pass; hand them back
+        audioBuffer->releaseBlocksFrom (length);
     }
 
     bool hasWrappedAround()
@@ -107,8 +124,9 @@ public:
         return wrapped;
     }
 
-    bool writeToAudioBuffer (std::function<void (float* destination, const float* source, const int numSamples, const bool shouldOverdub)>
-                                 writeFunc,
+    // WriteFunc: (float* destination, const float* source, int numSamples, bool shouldOverdub), see BufferKernels
+    template <typename WriteFunc>
+    bool writeToAudioBuffer (WriteFunc&& writeFunc,
                              const juce::AudioBuffer<float>& sourceBuffer,
                              const int numSamples,
                              const bool isOverdub,
@@ -116,46 +134,51 @@ public:
     {
         int writePosBeforeWrap, samplesBeforeWrap, writePosAfterWrap, samplesAfterWrap;
         fifo.prepareToWrite (numSamples, writePosBeforeWrap, samplesBeforeWrap, writePosAfterWrap, samplesAfterWrap);
-        bool isReverse = fifo.getLastPlaybackRate() < 0.0f;
+        const bool isReverse = fifo.getLastPlaybackRate() < 0.0f;
 
-        for (int ch = 0; ch < audioBuffer->getNumChannels(); ++ch)
+        // Each segment is written forward; while playing in reverse its source runs back to front
+        int samplesDropped = 0;
+        auto writeSegment = [&] (const int ch, const int start, const int size, const float* segmentSource)
         {
-            if (samplesBeforeWrap > 0)
-            {
-                float* dest = getWritePointer (ch) + writePosBeforeWrap;
-                const float* src = sourceBuffer.getReadPointer (ch);
+            int samplesWritten = 0;
+            audioBuffer->forEachWritableRunUnmarked (ch,
+                                                     start,
+                                                     size,
+                                                     [&] (float* dest, const int offset, const int run)
+                                                     {
+                                                         if (isReverse)
+                                                             applyReversed (
+                                                                 writeFunc, dest, segmentSource + size - offset - run, run, isOverdub);
+                                                         else
+                                                             writeFunc (dest, segmentSource + offset, run, isOverdub);
+                                                         samplesWritten += run;
+                                                     });
+            samplesDropped += size - samplesWritten;
+        };
+
+        const bool writesAfterWrap = samplesAfterWrap > 0 && isOverdub;
+        if (samplesBeforeWrap > 0) updateSilence (writeFunc, sourceBuffer, 0, writePosBeforeWrap, samplesBeforeWrap, isReverse, isOverdub);
+        if (writesAfterWrap)
+            updateSilence (writeFunc, sourceBuffer, samplesBeforeWrap, writePosAfterWrap, samplesAfterWrap, isReverse, isOverdub);
 
-                if (! isReverse)
-                {
-                    writeFunc (dest, src, samplesBeforeWrap, isOverdub);
-                }
-                else
-                {
-                    juce::FloatVectorOperations::copy (scratchBuffer->getWritePointer (ch), src, samplesBeforeWrap);
-                    scratchBuffer->reverse (0, samplesBeforeWrap);
-                    writeFunc (dest, scratchBuffer->getReadPointer (ch), samplesBeforeWrap, isOverdub);
-                }
-            }
-
-            if (samplesAfterWrap > 0 && isOverdub)
-            {
-                float* dest = getWritePointer (ch) + writePosAfterWrap;
-                const float* src = sourceBuffer.getReadPointer (ch) + samplesBeforeWrap;
+        for (int ch = 0; ch < audioBuffer->getNumChannels(); ++ch)
+        {
+            const float* src = sourceBuffer.getReadPointer (ch);
+            if (samplesBeforeWrap > 0) writeSegment (ch, writePosBeforeWrap, samplesBeforeWrap, src);
+            if (writesAfterWrap) writeSegment (ch, writePosAfterWrap, samplesAfterWrap, src + samplesBeforeWrap);
+        }
 
-                if (! isReverse)
-                {
-                    writeFunc (dest, src, samplesAfterWrap, isOverdub);
-                }
-                else
-                {
-                    juce::FloatVectorOperations::copy (scratchBuffer->getWritePointer (ch), src, samplesAfterWrap);
-                    scratchBuffer->reverse (0, samplesAfterWrap);
-                    writeFunc (dest, scratchBuffer->getReadPointer (ch), samplesAfterWrap, isOverdub);
-                }
-            }
-            scratchBuffer->clear();
+        // A run dropped for want of pool blocks left the old audio in place, whatever the map was told
+        if (samplesDropped > 0)
+        {
+            audioBuffer->getSilenceMap().markSounding (writePosBeforeWrap, samplesBeforeWrap);
+            if (writesAfterWrap) audioBuffer->getSilenceMap().markSounding (writePosAfterWrap, samplesAfterWrap);
         }
 
+        // The peaks are measured from what landed, so they hold whatever the kernel did to the old audio
+        if (samplesBeforeWrap > 0) audioBuffer->refreshPeaks (writePosBeforeWrap, samplesBeforeWrap);
+        if (writesAfterWrap) audioBuffer->refreshPeaks (writePosAfterWrap, samplesAfterWrap);
+
         int actualWritten = samplesBeforeWrap + samplesAfterWrap;
         fifo.finishedWrite (actualWritten, isOverdub, syncWriteWithRead);
         bool fifoPreventedWrap = ! fifo.getWrapAround() && samplesAfterWrap == 0 && numSamples > samplesBeforeWrap;
@@ -165,13 +188,19 @@ public:
         return fifoPreventedWrap;
     }
 
-    bool readFromAudioBuffer (std::function<void (float* destination, const float* source, const int numSamples)> readFunc,
+    // ReadFunc: (float* destination, const float* source, int numSamples), see BufferKernels
+    template <typename ReadFunc>
+    bool readFromAudioBuffer (ReadFunc&& readFunc,
                               juce::AudioBuffer<float>& destBuffer,
                               const int numSamples,
                               const float speedMultiplier,
                               const bool isOverdub)
     {
         bool isReverse = speedMultiplier < 0.0f;
+        lastReadSilent = true;
+
+        int wrapStart, wrapLength;
+        getWrapRange (wrapStart, wrapLength);
 
         if (! isReverse)
         {
@@ -181,29 +210,44 @@ public:
 
             for (int ch = 0; ch < audioBuffer->getNumChannels(); ++ch)
             {
+                float* dest = destBuffer.getWritePointer (ch);
                 if (samplesBeforeWrap > 0)
                 {
-                    const float* src = getReadPointer (ch) + readPosBeforeWrap;
-                    readFunc (destBuffer.getWritePointer (ch), src, samplesBeforeWrap);
+                    readRuns<ReadFunc> (ch,
+                                        readPosBeforeWrap,
+                                        samplesBeforeWrap,
+                                        [&] (const float* src, const int offset, const int run) { readFunc (dest + offset, src, run); });
                 }
                 if (samplesAfterWrap > 0)
                 {
-                    const float* src = getReadPointer (ch) + readPosAfterWrap;
-                    readFunc (destBuffer.getWritePointer (ch) + samplesBeforeWrap, src, samplesAfterWrap);
+                    readRuns<ReadFunc> (ch,
+                                        readPosAfterWrap,
+                                        samplesAfterWrap,
+                                        [&] (const float* src, const int offset, const int run)
+                                        { readFunc (dest + samplesBeforeWrap + offset, src, run); });
                 }
             }
         }
-        else
+        else if (wrapLength > 0)
         {
-            // Reverse: read backward manually
+            // Reverse: destination[i] is the loop at readPos - i, i.e. descending runs that restart at the end of the
+            // loop or its region. A block covers at most two of them unless the range is shorter than the block.
+            const int wrapEnd = wrapStart + wrapLength;
             for (int ch = 0; ch < audioBuffer->getNumChannels(); ++ch)
             {
-                float* destPtr = destBuffer.getWritePointer (ch);
-                const float* srcPtr = audioBuffer->getReadPointer (ch);
+                float* dest = destBuffer.getWritePointer (ch);
+                int position = wrapStart + ((fifo.getReadPos() - wrapStart) % wrapLength + wrapLength) % wrapLength;
 
-                for (int i = 0; i < numSamples; ++i)
+                for (int done = 0; done < numSamples; position = wrapEnd - 1)
                 {
-                    destPtr[i] = srcPtr[fifo.getReverseReadIndex (i)];
+                    const int segment = std::min (numSamples - done, position - wrapStart + 1);
+                    float* segmentDest = dest + done;
+                    readRuns<ReadFunc> (ch,
+                                        position - segment + 1,
+                                        segment,
+                                        [&] (const float* src, const int offset, const int run)
+                                        { applyReversed (readFunc, segmentDest + segment - offset - run, src, run); });
+                    done += segment;
                 }
             }
         }
@@ -211,28 +255,139 @@ public:
         return fifo.finishedRead (numSamples, speedMultiplier, isOverdub);
     }
 
-    bool linearizeAndReadFromAudioBuffer (juce::AudioBuffer<float>& destBuffer,
-                                          int sourceSamples, // How much to linearize
-                                          int outputSamples, // How much to advance fifo
-                                          float speedMultiplier,
-                                          const bool isOverdub)
+    // Adds numSamples of the loop played at speedMultiplier (negative in reverse) to destBuffer, interpolated by reader,
+    // and advances the playhead.
+    bool readVarispeed (VarispeedReader& reader,
+                        juce::AudioBuffer<float>& destBuffer,
+                        const int numSamples,
+                        const float speedMultiplier,
+                        const bool isOverdub)
+    {
+        if (! renderVarispeed (reader, destBuffer, fifo.getExactReadPos(), numSamples, speedMultiplier)) return false;
+        return fifo.finishedRead (numSamples, speedMultiplier, isOverdub);
+    }
+
+    // As readVarispeed, from firstPosition and without touching the playhead. The span of loop a block needs is
+    // filtered in place when it sits in one run of block memory, which is nearly always for Float32 loops; across a
+    // block boundary, the loop end, the seam or a 16-bit block it is first gathered into the reader's window.
+    bool renderVarispeed (VarispeedReader& reader,
+                          juce::AudioBuffer<float>& destBuffer,
+                          const double firstPosition,
+                          const int numSamples,
+                          const float speedMultiplier)
     {
         PERFETTO_FUNCTION();
+        lastReadSilent = false;
+
+        int wrapStart, wrapLength;
+        getWrapRange (wrapStart, wrapLength);
+        if (length == 0 || wrapLength <= 0 || numSamples <= 0) return false;
+
+        const double lastPosition = firstPosition + (double) speedMultiplier * (numSamples - 1);
+        const int spanStart = (int) std::floor (std::min (firstPosition, lastPosition)) - VarispeedReader::TAPS_BEFORE;
+        const int spanLength = (int) std::floor (std::max (firstPosition, lastPosition)) + VarispeedReader::TAPS / 2 - spanStart + 1;
+        if (spanLength > reader.getWindowSize())
+        {
+            jassertfalse; // block larger than announced in prepareToPlay
+            return false;
+        }
+
+        const int wrappedSpanStart = wrapStart + ((spanStart - wrapStart) % wrapLength + wrapLength) % wrapLength;
+        const bool spanIsContiguous = wrappedSpanStart + spanLength <= wrapStart + wrapLength;
+
+        // The reader adds to destBuffer, so a silent span leaves it as it was
+        lastReadSilent = spanIsContiguous && isSilentThroughSeam (getSeam(), wrappedSpanStart, spanLength);
+        if (lastReadSilent) return true;
+
+        const double positionInSpan = firstPosition - spanStart;
+        float* window = reader.getWindow();
+
+        for (int ch = 0; ch < audioBuffer->getNumChannels() && ch < destBuffer.getNumChannels(); ++ch)
+        {
+            float* dest = destBuffer.getWritePointer (ch);
+            bool rendered = false;
 
-        if (length == 0) return false;
+            for (int done = 0, position = wrappedSpanStart; done < spanLength; position = wrapStart)
+            {
+                const int segment = std::min (spanLength - done, wrapStart + wrapLength - position);
+                readRuns<BufferKernels::Copy> (ch,
+                                               position,
+                                               segment,
+                                               [&] (const float* src, const int offset, const int run)
+                                               {
+                                                   if (spanIsContiguous && run == spanLength)
+                                                   {
+                                                       reader.render (src, positionInSpan, speedMultiplier, dest, numSamples);
+                                                       rendered = true;
+                                                   }
+                                                   else
+                                                   {
+                                                       juce::FloatVectorOperations::copy (window + done + offset, src, run);
+                                                   }
+                                               });
+                done += segment;
+            }
 
-        bool wrapped = readFromAudioBuffer ([=] (float* destination, const float* source, const int numSamples)
-                                            { juce::FloatVectorOperations::copy (destination, source, numSamples); },
-                                            destBuffer,
-                                            sourceSamples,
-                                            speedMultiplier,
-                                            isOverdub);
+            if (! rendered) reader.render (window, positionInSpan, speedMultiplier, dest, numSamples);
+        }
 
-        // Advance the fifo accounting for the difference between sourceSamples and outputSamples
-        bool wrappedDelta = fifo.finishedRead (outputSamples - sourceSamples, speedMultiplier, isOverdub);
-        return wrapped || wrappedDelta;
+        return true;
     }
 
+    // Applies readFunc to numSamples of the loop starting at position and stepping in direction (1 or -1), wrapping
+    // the way playback does, without touching the playhead. Returns the position that follows the last sample read.
+    template <typename ReadFunc>
+    int readAt (ReadFunc&& readFunc, juce::AudioBuffer<float>& destBuffer, int position, const int numSamples, const int direction)
+    {
+        PERFETTO_FUNCTION();
+
+        int wrapStart, wrapLength;
+        getWrapRange (wrapStart, wrapLength);
+        if (length == 0 || wrapLength <= 0) return position;
+
+        const int wrapEnd = wrapStart + wrapLength;
+        position = wrapStart + ((position - wrapStart) % wrapLength + wrapLength) % wrapLength;
+
+        for (int done = 0; done < numSamples;)
+        {
+            const int segment = std::min (numSamples - done, direction > 0 ? wrapEnd - position : position - wrapStart + 1);
+            const int segmentStart = direction > 0 ? position : position - segment + 1;
+
+            for (int ch = 0; ch < audioBuffer->getNumChannels() && ch < destBuffer.getNumChannels(); ++ch)
+            {
+                float* segmentDest = destBuffer.getWritePointer (ch) + done;
+                readRuns<ReadFunc> (ch,
+                                    segmentStart,
+                                    segment,
+                                    [&] (const float* src, const int offset, const int run)
+                                    {
+                                        if (direction > 0)
+                                            readFunc (segmentDest + offset, src, run);
+                                        else
+                                            applyReversed (readFunc, segmentDest + segment - offset - run, src, run);
+                                    });
+            }
+
+            done += segment;
+            position = direction > 0 ? position + segment : position - segment;
+            if (position >= wrapEnd) position = wrapStart;
+            if (position < wrapStart) position = wrapEnd - 1;
+        }
+
+        return position;
+    }
+
+    // Moves the playhead as if numSamples had been played at speedMultiplier; true when it wrapped
+    bool advancePlayhead (const int numSamples, const float speedMultiplier, const bool isOverdub)
+    {
+        return fifo.finishedRead (numSamples, speedMultiplier, isOverdub);
+    }
+
+    double getExactReadPosition() const { return fifo.getExactReadPos(); }
+
+    // True when the last readFromAudioBuffer or renderVarispeed found only silence and left the destination untouched
+    bool wasLastReadSilent() const { return lastReadSilent; }
+
     void setWritePosition (int pos) { fifo.setWritePosition (pos); }
     int getWritePosition() const { return fifo.getWritePos(); }
 
@@ -265,18 +420,263 @@ public:
     int getLoopRegionStart() const { return loopRegionStart; }
     int getLoopRegionEnd() const { return loopRegionEnd; }
 
+    // Samples over which playback blends the end of the loop, or of the loop region, into its start
+    void setSeamFadeLength (const int numSamples) { seamFadeLength = std::max (0, numSamples); }
+    int getSeamFadeLength() const { return seamFadeLength; }
+
 private:
+    static constexpr int REVERSE_CHUNK_SAMPLES = 256;
+    static constexpr int SEAM_CHUNK_SAMPLES = 256;
+
+    // An empty loop over the whole buffer: no length, no region, the playhead at the start
+    void resetLayout()
+    {
+        fifo.clearLoopRegion();
+        fifo.prepareToPlay (audioBuffer->getNumSamples());
+        length = 0;
+        provisionalLength = 0;
+        previousReadPos = -1.0;
+
+        loopRegionEnabled = false;
+        loopRegionStart = 0;
+        loopRegionEnd = 0;
+    }
+
+    // Where the wrap range joins its end to its start. Every read sees the first fade samples after start blended
+    // with the guard, the fade samples that follow end in the loop, so the head picks up where the tail left off.
+    // A range that runs to the loop end has no guard; its tail fades out and its head fades in instead.
+    struct Seam
+    {
+        int start = 0;
+        int end = 0;
+        int fade = 0;
+        bool hasGuard = false;
+
+        bool inHead (const int position) const { return position >= start && position < start + fade; }
+        bool inTail (const int position) const { return ! hasGuard && position >= end - fade && position < end; }
+    };
+
+    Seam getSeam() const
+    {
+        int wrapStart, wrapLength;
+        getWrapRange (wrapStart, wrapLength);
+
+        Seam seam;
+        seam.start = wrapStart;
+        seam.end = wrapStart + wrapLength;
+        seam.fade = length > 0 ? std::min (seamFadeLength, wrapLength / 4) : 0;
+        seam.hasGuard = seam.end + seam.fade <= length;
+        return seam;
+    }
+
+    // True when [start, start + num) reads any sample the seam changes
+    static bool touchesSeam (const Seam& seam, const int start, const int num)
+    {
+        if (seam.fade == 0 || num <= 0) return false;
+        const int end = start + num;
+        const bool touchesHead = start < seam.start + seam.fade && end > seam.start;
+        const bool touchesTail = ! seam.hasGuard && start < seam.end && end > seam.end - seam.fade;
+        return touchesHead || touchesTail;
+    }
+
+    // True when [start, start + num) plays silent, seam included: the loop is silent there and so is any guard it blends in
+    bool isSilentThroughSeam (const Seam& seam, const int start, const int num) const
+    {
+        const auto& silence = audioBuffer->getSilenceMap();
+        if (! silence.isSilent (start, num)) return false;
+        return ! seam.hasGuard || ! touchesSeam (seam, start, num) || silence.isSilent (seam.end, seam.fade);
+    }
+
+    // Playback wraps inside the loop region when one is set, otherwise inside the loop
+    void getWrapRange (int& wrapStart, int& wrapLength) const
+    {
+        wrapStart = loopRegionEnabled ? loopRegionStart : 0;
+        wrapLength = loopRegionEnabled ? loopRegionEnd - loopRegionStart : fifo.getMusicalLength();
+    }
+
+    // Visits the loop for a read kernel as playback hears it, seam included: every run, or only the sounding ones
+    // when the kernel adds to the destination
+    template <typename ReadFunc, typename Func>
+    void readRuns (const int channel, const int start, const int num, Func&& func)
+    {
+        const Seam seam = getSeam();
+        if (! touchesSeam (seam, start, num))
+        {
+            readLoopRuns<ReadFunc> (channel, start, num, func);
+            return;
+        }
+
+        // Split where the seam starts or stops, so each piece is either blended throughout or read as stored
+        for (int done = 0; done < num;)
+        {
+            const int position = start + done;
+            const bool blended = seam.inHead (position) || seam.inTail (position);
+
+            int pieceEnd = start + num;
+            for (const int boundary : { seam.start, seam.start + seam.fade, seam.end - seam.fade, seam.end })
+                if (boundary > position) pieceEnd = std::min (pieceEnd, boundary);
+
+            const int piece = pieceEnd - position;
+            if constexpr (BufferKernels::skipsSilence<std::decay_t<ReadFunc>>)
+            {
+                if (blended && isSilentThroughSeam (seam, position, piece))
+                {
+                    done += piece;
+                    continue;
+                }
+            }
+
+            auto shifted = [&, done] (const float* src, const int offset, const int run) { func (src, done + offset, run); };
+            if (blended)
+                readSeamRuns (seam, channel, position, piece, shifted);
+            else
+                readLoopRuns<ReadFunc> (channel, position, piece, shifted);
+            done += piece;
+        }
+    }
+
+    // As readRuns for a span that lies wholly inside the head or the tail of the seam, a chunk on the stack at a time
+    template <typename Func>
+    void readSeamRuns (const Seam& seam, const int channel, const int start, const int num, Func&& func)
+    {
+        float blended[SEAM_CHUNK_SAMPLES];
+        float guard[SEAM_CHUNK_SAMPLES];
+        lastReadSilent = false;
+
+        for (int done = 0; done < num;)
+        {
+            const int position = start + done;
+            const int chunk = std::min (SEAM_CHUNK_SAMPLES, num - done);
+            copyRuns (channel, position, chunk, blended);
+
+            if (seam.inHead (position))
+            {
+                const int index = position - seam.start;
+                if (seam.hasGuard) copyRuns (channel, seam.end + index, chunk, guard);
+                for (int i = 0; i < chunk; ++i)
+                {
+                    const float in = (float) (index + i) / (float) seam.fade;
+                    blended[i] = blended[i] * in + (seam.hasGuard ? guard[i] * (1.0f - in) : 0.0f);
+                }
+            }
+            else
+            {
+                const int index = position - (seam.end - seam.fade);
+                for (int i = 0; i < chunk; ++i)
+                    blended[i] *= 1.0f - (float) (index + i) / (float) seam.fade;
+            }
+
+            func (blended, done, chunk);
+            done += chunk;
+        }
+    }
+
+    void copyRuns (const int channel, const int start, const int num, float* dest) const
+    {
+        audioBuffer->forEachReadableRun (channel,
+                                         start,
+                                         num,
+                                         [&] (const float* src, const int offset, const int run)
+                                         { juce::FloatVectorOperations::copy (dest + offset, src, run); });
+    }
+
+    // The loop as stored, for readRuns
+    template <typename ReadFunc, typename Func>
+    void readLoopRuns (const int channel, const int start, const int num, Func&& func)
+    {
+        if constexpr (BufferKernels::skipsSilence<std::decay_t<ReadFunc>>)
+        {
+            audioBuffer->forEachSoundingRun (channel,
+                                             start,
+                                             num,
+                                             [&] (const float* src, const int offset, const int run)
+                                             {
+                                                 lastReadSilent = false;
+                                                 func (src, offset, run);
+                                             });
+        }
+        else
+        {
+            lastReadSilent = false;
+            audioBuffer->forEachReadableRun (channel, start, num, func);
+        }
+    }
+
+    // Brings the silence map up to date for a write of size samples at start, about to be taken from sourceBuffer at
+    // sourceOffset (back to front when isReverse). Regions are checked one at a time against the input: silent
+    // input keeps a silent region silent, and silences a sounding one only if the kernel replaces all of it.
+    template <typename WriteFunc>
+    void updateSilence (const WriteFunc& writeFunc,
+                        const juce::AudioBuffer<float>& sourceBuffer,
+                        const int sourceOffset,
+                        const int start,
+                        const int size,
+                        const bool isReverse,
+                        const bool isOverdub)
+    {
+        PERFETTO_FUNCTION();
+        auto& silence = audioBuffer->getSilenceMap();
+        if constexpr (! BufferKernels::tracksSilence<std::decay_t<WriteFunc>>)
+        {
+            juce::ignoreUnused (writeFunc, sourceBuffer, sourceOffset, isReverse, isOverdub);
+            silence.markSounding (start, size);
+        }
+        else
+        {
+            const bool replaces = writeFunc.replacesDestination (isOverdub);
+            for (int done = 0; done < size;)
+            {
+                const int region = LoopSilenceMap::regionOf (start + done);
+                const int piece = std::min (size - done, LoopSilenceMap::regionStart (region + 1) - (start + done));
+                const int pieceSource = sourceOffset + (isReverse ? size - done - piece : done);
+
+                bool inputIsSilent = true;
+                for (int ch = 0; ch < audioBuffer->getNumChannels() && inputIsSilent; ++ch)
+                {
+                    const auto range = juce::FloatVectorOperations::findMinAndMax (sourceBuffer.getReadPointer (ch, pieceSource), piece);
+                    inputIsSilent = range.getStart() == 0.0f && range.getEnd() == 0.0f;
+                }
+
+                const bool coversRegion = piece == LoopSilenceMap::REGION_SAMPLES;
+                silence.setRegionSilent (region, inputIsSilent && (silence.isRegionSilent (region) || (replaces && coversRegion)));
+                done += piece;
+            }
+        }
+    }
+
+    // Applies a read or write kernel with its source read back to front
+    template <typename Kernel, typename... Flags>
+    static void applyReversed (Kernel& kernel, float* destination, const float* source, const int numSamples, const Flags... flags)
+    {
+        if constexpr (requires { kernel.reversed (destination, source, numSamples, flags...); })
+        {
+            kernel.reversed (destination, source, numSamples, flags...);
+        }
+        else
+        {
+            float reversedSource[REVERSE_CHUNK_SAMPLES];
+            for (int done = 0; done < numSamples; done += REVERSE_CHUNK_SAMPLES)
+            {
+                const int chunk = std::min (REVERSE_CHUNK_SAMPLES, numSamples - done);
+                BufferKernels::reverseCopy (reversedSource, source + numSamples - done - chunk, chunk);
+                kernel (destination + done, reversedSource, chunk, flags...);
+            }
+        }
+    }
+
     bool loopRegionEnabled = false;
     int loopRegionStart = 0;
     int loopRegionEnd = 0;
 
-    std::unique_ptr<juce::AudioBuffer<float>> audioBuffer = std::make_unique<juce::AudioBuffer<float>>();
-    std::unique_ptr<juce::AudioBuffer<float>> scratchBuffer = std::make_unique<juce::AudioBuffer<float>>();
+    std::unique_ptr<LoopBlockPool> ownedPool;
+    std::unique_ptr<ChunkedLoopBuffer> audioBuffer = std::make_unique<ChunkedLoopBuffer>();
     int length;
     int provisionalLength;
+    int seamFadeLength = 0;
 
     LoopFifo fifo;
     double previousReadPos = 0.0;
+    bool lastReadSilent = false;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BufferManager)
 };
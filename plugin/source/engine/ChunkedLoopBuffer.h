@@ -0,0 +1,487 @@
+#pragma once
+
+#include "engine/LoopBlockPool.h"
+#include "engine/LoopPeakTable.h"
+#include "engine/LoopSilenceMap.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Loop audio stored as a table of fixed-size blocks drawn from a LoopBlockPool.
+ *
+ * The table covers the full loop capacity, but a block is only claimed the first time a write
+ * touches it, so resident memory grows with the recording rather than with the capacity. Reads from
+ * blocks that were never written return silence. Buffers drawing from the same pool can share
+ * blocks (see shareFrom); a shared block is duplicated the first time either side writes to it.
+ * The gain and magnitude helpers mirror the juce::AudioBuffer calls they replace, so
+ * post-processing code works on either type.
+ *
+ * The buffer also carries a LoopSilenceMap, so the map follows it through undo and redo. Writable runs
+ * mark their range as sounding; BufferManager, which knows what it writes, uses the unmarked form and
+ * keeps the map itself. Magnitude, gain and copyTo skip the regions the map knows to be silent.
+ *
+ * A LoopPeakTable travels with it the same way, and a playback gain: the level the layer is heard at,
+ * which normalising sets instead of rewriting every sample. Run visitors see the samples as stored;
+ * getSample, getMagnitude, getPeak and copyTo report the loop as heard, with the gain applied.
+ *
+ * Run visitors always see floats. When the pool stores a 16-bit format, each run is converted in
+ * CONVERSION_SAMPLES pieces through a buffer on the stack: decoded before the visitor sees it and,
+ * for writable runs, encoded again afterwards.
+ */
+class ChunkedLoopBuffer
+{
+public:
+    static constexpr int CONVERSION_SAMPLES = 256;
+
+    ChunkedLoopBuffer() {}
+    ~ChunkedLoopBuffer() { releaseResources(); }
+
+    void prepareToPlay (LoopBlockPool& blockPool, const int capacitySamples)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        pool = &blockPool;
+        numChannels = blockPool.getNumChannels();
+        blockSamples = blockPool.getBlockSamples();
+        sampleFormat = blockPool.getSampleFormat();
+        bytesPerSample = blockPool.getBytesPerSample();
+        blockShift = 0;
+        while ((1 << blockShift) < blockSamples)
+            ++blockShift;
+        jassert ((1 << blockShift) == blockSamples); // block size must be a power of two
+        blockMask = blockSamples - 1;
+
+        capacity = capacitySamples;
+        blockTable.assign ((size_t) ((capacity + blockSamples - 1) / blockSamples), LoopBlockPool::INVALID_BLOCK);
+        silence.prepareToPlay (capacity);
+        peaks.prepareToPlay (capacity);
+        playbackGain = 1.0f;
+    }
+
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        clear();
+        blockTable.clear();
+        silence.releaseResources();
+        peaks.releaseResources();
+        capacity = 0;
+        numChannels = 0;
+        pool = nullptr;
+    }
+
+    // Returns every block to the pool; the table keeps its capacity
+    void clear()
+    {
+        PERFETTO_FUNCTION();
+        releaseBlocksFrom (0);
+        playbackGain = 1.0f;
+    }
+
+    // Returns the blocks lying entirely past endSample, e.g. once a layer's length is fixed
+    void releaseBlocksFrom (const int endSample)
+    {
+        PERFETTO_FUNCTION();
+        if (pool == nullptr) return;
+
+        const size_t firstUnused = (size_t) ((std::max (endSample, 0) + blockSamples - 1) >> blockShift);
+        for (size_t b = firstUnused; b < blockTable.size(); ++b)
+        {
+            if (blockTable[b] == LoopBlockPool::INVALID_BLOCK) continue;
+            pool->releaseBlock (blockTable[b]);
+            blockTable[b] = LoopBlockPool::INVALID_BLOCK;
+        }
+
+        const int firstReleased = (int) (firstUnused << blockShift);
+        silence.markSilent (firstReleased, capacity - firstReleased);
+        peaks.markSilent (firstReleased, capacity - firstReleased);
+    }
+
+    int getNumChannels() const { return numChannels; }
+    int getNumSamples() const { return capacity; }
+    int getBlockSamples() const { return blockSamples; }
+    LoopSampleFormat getSampleFormat() const { return sampleFormat; }
+
+    LoopSilenceMap& getSilenceMap() { return silence; }
+    const LoopSilenceMap& getSilenceMap() const { return silence; }
+    const LoopPeakTable& getPeakTable() const { return peaks; }
+
+    float getPlaybackGain() const { return playbackGain; }
+    void setPlaybackGain (const float newGain) { playbackGain = newGain; }
+
+    int getNumAllocatedBlocks() const
+    {
+        return (int) std::count_if (blockTable.begin(), blockTable.end(), [] (int id) { return id != LoopBlockPool::INVALID_BLOCK; });
+    }
+
+    // Direct block table access for background codecs; the caller coordinates ownership
+    int getNumTableEntries() const { return (int) blockTable.size(); }
+    int getBlockId (const int tableIndex) const { return blockTable[(size_t) tableIndex]; }
+
+    void releaseBlockAt (const int tableIndex)
+    {
+        auto& entry = blockTable[(size_t) tableIndex];
+        if (entry == LoopBlockPool::INVALID_BLOCK) return;
+        pool->releaseBlock (entry);
+        entry = LoopBlockPool::INVALID_BLOCK;
+    }
+
+    // Takes over a block the caller already owns
+    void adoptBlockAt (const int tableIndex, const int blockId)
+    {
+        releaseBlockAt (tableIndex);
+        blockTable[(size_t) tableIndex] = blockId;
+    }
+
+    float getSample (const int channel, const int index) const
+    {
+        const int blockId = blockTable[(size_t) (index >> blockShift)];
+        if (blockId == LoopBlockPool::INVALID_BLOCK) return 0.0f;
+
+        float value;
+        LoopSampleConversion::toFloat (sampleFormat, getStorage (blockId, channel, index & blockMask), &value, 1);
+        return value * playbackGain;
+    }
+
+    // Visits [start, start + num) as contiguous runs, claiming blocks as needed, marks the range sounding
+    // and leaves its peaks stale. func (float* dest, int offsetInRange, int runLength)
+    template <typename Func>
+    void forEachWritableRun (const int channel, const int start, const int num, Func&& func)
+    {
+        silence.markSounding (start, num);
+        peaks.markStale (start, num);
+        forEachWritableRunUnmarked (channel, start, num, func);
+    }
+
+    // As forEachWritableRun, for writers that keep the silence map and peaks up to date themselves
+    template <typename Func>
+    void forEachWritableRunUnmarked (const int channel, const int start, const int num, Func&& func)
+    {
+        visitRuns (start,
+                   num,
+                   [&] (const size_t block, const int offsetInBlock, const int offsetInRange, const int runLength)
+                   {
+                       // Pool exhausted: this run is dropped rather than blocking the audio thread
+                       if (! makeWritable (block)) return;
+
+                       visitWritable (blockTable[block], channel, offsetInBlock, offsetInRange, runLength, func);
+                   });
+    }
+
+    // Visits [start, start + num) as contiguous runs; unwritten blocks read as silence.
+    // func (const float* source, int offsetInRange, int runLength)
+    template <typename Func>
+    void forEachReadableRun (const int channel, const int start, const int num, Func&& func) const
+    {
+        visitRuns (start,
+                   num,
+                   [&] (const size_t block, const int offsetInBlock, const int offsetInRange, const int runLength)
+                   {
+                       const int blockId = blockTable[block];
+                       if (blockId == LoopBlockPool::INVALID_BLOCK)
+                       {
+                           func (pool->getSilentData(), offsetInRange, runLength);
+                           return;
+                       }
+
+                       if (sampleFormat == LoopSampleFormat::Float32)
+                       {
+                           func (pool->getBlockData (blockId, channel) + offsetInBlock, offsetInRange, runLength);
+                           return;
+                       }
+
+                       float decoded[CONVERSION_SAMPLES];
+                       for (int done = 0; done < runLength; done += CONVERSION_SAMPLES)
+                       {
+                           const int count = std::min (CONVERSION_SAMPLES, runLength - done);
+                           LoopSampleConversion::toFloat (sampleFormat, getStorage (blockId, channel, offsetInBlock + done), decoded, count);
+                           func ((const float*) decoded, offsetInRange + done, count);
+                       }
+                   });
+    }
+
+    // Visits only the runs that are backed by a block, without claiming new ones. Shared blocks are
+    // duplicated first, so func may modify the data in place; the caller keeps the peaks up to date.
+    // func (float* data, int offsetInRange, int runLength)
+    template <typename Func>
+    void forEachAllocatedRun (const int channel, const int start, const int num, Func&& func)
+    {
+        visitRuns (start,
+                   num,
+                   [&] (const size_t block, const int offsetInBlock, const int offsetInRange, const int runLength)
+                   {
+                       if (blockTable[block] == LoopBlockPool::INVALID_BLOCK || ! makeWritable (block)) return;
+                       visitWritable (blockTable[block], channel, offsetInBlock, offsetInRange, runLength, func);
+                   });
+    }
+
+    // As forEachReadableRun, leaving out the regions the silence map knows to be silent
+    template <typename Func>
+    void forEachSoundingRun (const int channel, const int start, const int num, Func&& func) const
+    {
+        silence.forEachRun (start,
+                            num,
+                            [&] (const int runStart, const int runLength, const bool isSilent)
+                            {
+                                if (isSilent) return;
+                                forEachReadableRun (channel,
+                                                    runStart,
+                                                    runLength,
+                                                    [&] (const float* source, const int offset, const int run)
+                                                    { func (source, runStart - start + offset, run); });
+                            });
+    }
+
+    float getMagnitude (const int channel, const int start, const int num) const
+    {
+        PERFETTO_FUNCTION();
+        float magnitude = 0.0f;
+        forEachSoundingRun (channel,
+                            start,
+                            num,
+                            [&] (const float* source, int, const int runLength)
+                            {
+                                auto range = juce::FloatVectorOperations::findMinAndMax (source, runLength);
+                                magnitude = std::max ({ magnitude, -range.getStart(), range.getEnd() });
+                            });
+        return magnitude * std::abs (playbackGain);
+    }
+
+    // Largest magnitude over [start, start + num) on any channel. Regions the range covers whole are read
+    // from the peak table; only partly covered and stale ones are measured.
+    float getPeak (const int start, const int num) const
+    {
+        PERFETTO_FUNCTION();
+        float peak = 0.0f;
+        for (int region = LoopPeakTable::regionOf (start); num > 0 && region <= LoopPeakTable::regionOf (start + num - 1); ++region)
+        {
+            if (silence.isRegionSilent (region)) continue;
+
+            const int from = std::max (start, LoopPeakTable::regionStart (region));
+            const int to = std::min ({ start + num, LoopPeakTable::regionStart (region + 1), capacity });
+            const bool known = to - from == LoopPeakTable::REGION_SAMPLES && ! peaks.isRegionStale (region);
+            peak = std::max (peak, known ? peaks.getRegionPeak (region) : measurePeak (from, to - from));
+        }
+        return peak * std::abs (playbackGain);
+    }
+
+    // Measures the regions [start, start + num) touches again, for writers that used the unmarked form
+    void refreshPeaks (const int start, const int num)
+    {
+        PERFETTO_FUNCTION();
+        for (int region = LoopPeakTable::regionOf (start); num > 0 && region <= LoopPeakTable::regionOf (start + num - 1); ++region)
+        {
+            const int from = LoopPeakTable::regionStart (region);
+            const int length = std::min (capacity - from, LoopPeakTable::REGION_SAMPLES);
+            peaks.setRegionPeak (region, silence.isRegionSilent (region) ? 0.0f : measurePeak (from, length));
+        }
+    }
+
+    void applyGain (const int start, const int num, const float gain)
+    {
+        PERFETTO_FUNCTION();
+        if (gain == 1.0f) return; // would only unshare blocks
+
+        for (int ch = 0; ch < numChannels; ++ch)
+            forEachSoundingAllocatedRun (ch,
+                                         start,
+                                         num,
+                                         [gain] (float* data, int, const int runLength)
+                                         { juce::FloatVectorOperations::multiply (data, gain, runLength); });
+        peaks.scale (start, num, gain);
+    }
+
+    void applyGainRamp (const int start, const int num, const float startGain, const float endGain)
+    {
+        PERFETTO_FUNCTION();
+        if (num <= 0) return;
+
+        const float increment = (endGain - startGain) / (float) num;
+        for (int ch = 0; ch < numChannels; ++ch)
+            forEachSoundingAllocatedRun (ch,
+                                         start,
+                                         num,
+                                         [=] (float* data, const int offsetInRange, const int runLength)
+                                         {
+                                             float gain = startGain + increment * (float) offsetInRange;
+                                             for (int i = 0; i < runLength; ++i)
+                                             {
+                                                 data[i] *= gain;
+                                                 gain += increment;
+                                             }
+                                         });
+        refreshPeaks (start, num);
+    }
+
+    // Linear copy out of the block table at the playback gain, e.g. for saving or UI snapshots
+    void copyTo (juce::AudioBuffer<float>& destination, const int sourceStart, const int num) const
+    {
+        PERFETTO_FUNCTION();
+        const int channelsToCopy = std::min (numChannels, destination.getNumChannels());
+        for (int ch = 0; ch < channelsToCopy; ++ch)
+        {
+            float* dest = destination.getWritePointer (ch);
+            silence.forEachRun (sourceStart,
+                                num,
+                                [&] (const int runStart, const int runLength, const bool isSilent)
+                                {
+                                    float* runDest = dest + runStart - sourceStart;
+                                    if (isSilent)
+                                    {
+                                        juce::FloatVectorOperations::clear (runDest, runLength);
+                                        return;
+                                    }
+                                    forEachReadableRun (ch,
+                                                        runStart,
+                                                        runLength,
+                                                        [this, runDest] (const float* source, const int offset, const int run)
+                                                        {
+                                                            juce::FloatVectorOperations::copyWithMultiply (runDest + offset,
+                                                                                                           source,
+                                                                                                           playbackGain,
+                                                                                                           run);
+                                                        });
+                                });
+        }
+    }
+
+    // Makes the first num samples of this buffer refer to the same blocks as source, without
+    // copying audio. Both buffers must draw from the same pool.
+    void shareFrom (const ChunkedLoopBuffer& source, const int num)
+    {
+        PERFETTO_FUNCTION();
+        jassert (source.pool == pool);
+
+        const size_t blocksToShare = std::min ((size_t) ((num + blockSamples - 1) >> blockShift), blockTable.size());
+        for (size_t b = 0; b < blocksToShare; ++b)
+        {
+            const int sourceId = source.blockTable[b];
+            if (blockTable[b] == sourceId) continue;
+
+            if (sourceId != LoopBlockPool::INVALID_BLOCK) pool->retainBlock (sourceId);
+            if (blockTable[b] != LoopBlockPool::INVALID_BLOCK) pool->releaseBlock (blockTable[b]);
+            blockTable[b] = sourceId;
+        }
+
+        // Shared blocks carry whatever source holds past num, so the map is taken for whole blocks
+        silence.copyFrom (source.silence, (int) (blocksToShare << blockShift));
+        peaks.copyFrom (source.peaks, (int) (blocksToShare << blockShift));
+        playbackGain = source.playbackGain;
+        releaseBlocksFrom (num);
+    }
+
+private:
+    LoopBlockPool* pool = nullptr;
+    std::vector<int> blockTable;
+    LoopSilenceMap silence;
+    LoopPeakTable peaks;
+    float playbackGain = 1.0f; // level the stored samples are heard at
+
+    int numChannels = 0;
+    int capacity = 0;
+    int blockSamples = 0;
+    int blockShift = 0;
+    int blockMask = 0;
+
+    LoopSampleFormat sampleFormat = LoopSampleFormat::Float32;
+    int bytesPerSample = (int) sizeof (float);
+
+    // Largest magnitude over [start, start + num) on any channel, as stored
+    float measurePeak (const int start, const int num) const
+    {
+        float peak = 0.0f;
+        for (int ch = 0; ch < numChannels; ++ch)
+            forEachReadableRun (ch,
+                                start,
+                                num,
+                                [&] (const float* source, int, const int runLength)
+                                {
+                                    auto range = juce::FloatVectorOperations::findMinAndMax (source, runLength);
+                                    peak = std::max ({ peak, -range.getStart(), range.getEnd() });
+                                });
+        return peak;
+    }
+
+    uint8_t* getStorage (const int blockId, const int channel, const int offsetInBlock) const
+    {
+        return pool->getBlockStorage (blockId, channel) + (size_t) offsetInBlock * (size_t) bytesPerSample;
+    }
+
+    template <typename Func>
+    void visitWritable (const int blockId, const int channel, const int offsetInBlock, const int offsetInRange, const int runLength, Func& func)
+    {
+        if (sampleFormat == LoopSampleFormat::Float32)
+        {
+            func (pool->getBlockData (blockId, channel) + offsetInBlock, offsetInRange, runLength);
+            return;
+        }
+
+        float staging[CONVERSION_SAMPLES];
+        for (int done = 0; done < runLength; done += CONVERSION_SAMPLES)
+        {
+            const int count = std::min (CONVERSION_SAMPLES, runLength - done);
+            uint8_t* storage = getStorage (blockId, channel, offsetInBlock + done);
+
+            LoopSampleConversion::toFloat (sampleFormat, storage, staging, count);
+            func (staging, offsetInRange + done, count);
+            LoopSampleConversion::fromFloat (sampleFormat, staging, storage, count);
+        }
+    }
+
+    // forEachAllocatedRun over the regions that may hold sound; silent ones are left alone, and left shared
+    template <typename Func>
+    void forEachSoundingAllocatedRun (const int channel, const int start, const int num, Func&& func)
+    {
+        silence.forEachRun (start,
+                            num,
+                            [&] (const int runStart, const int runLength, const bool isSilent)
+                            {
+                                if (isSilent) return;
+                                forEachAllocatedRun (channel,
+                                                     runStart,
+                                                     runLength,
+                                                     [&] (float* data, const int offset, const int run)
+                                                     { func (data, runStart - start + offset, run); });
+                            });
+    }
+
+    // Gives this buffer sole ownership of a block, claiming or duplicating it as needed
+    bool makeWritable (const size_t block)
+    {
+        const int blockId = blockTable[block];
+        if (blockId != LoopBlockPool::INVALID_BLOCK && ! pool->isBlockShared (blockId)) return true;
+
+        const int newId = pool->acquireBlock();
+        if (newId == LoopBlockPool::INVALID_BLOCK) return false;
+
+        if (blockId != LoopBlockPool::INVALID_BLOCK)
+        {
+            pool->copyBlock (blockId, newId);
+            pool->releaseBlock (blockId);
+        }
+
+        blockTable[block] = newId;
+        return true;
+    }
+
+    template <typename Visitor>
+    void visitRuns (const int start, const int num, Visitor&& visitor) const
+    {
+        int position = start;
+        int done = 0;
+        while (done < num)
+        {
+            const int offsetInBlock = position & blockMask;
+            const int runLength = std::min (num - done, blockSamples - offsetInBlock);
+            visitor ((size_t) (position >> blockShift), offsetInBlock, done, runLength);
+            position += runLength;
+            done += runLength;
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ChunkedLoopBuffer)
+};
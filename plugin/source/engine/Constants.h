@@ -4,14 +4,17 @@
 //**************************************************************
 #include <JuceHeader.h>
 
-constexpr int NUM_TRACKS = 4;
+constexpr int NUM_TRACKS = 4;  // Default track count
+constexpr int MAX_TRACKS = 32; // Upper bound for the track count chosen at prepareToPlay
+constexpr int SPARE_TRACKS = 4; // Prepared tracks kept ready, so one block's commands can arm that many new slots
+constexpr int DEFERRED_COMMANDS_CAPACITY = 64; // Commands held back while their slot waits for a prepared track
 constexpr int LEFT_CHANNEL = 0;
 constexpr int RIGHT_CHANNEL = 1;
 constexpr int MAX_NUM_CHANNELS = 4;
 
 constexpr int SAVE_TRACK_BITS_PER_SAMPLE = 16;
 constexpr int LOOP_MAX_SECONDS_HARD_LIMIT = 5 * 60;
-constexpr int MAX_UNDO_LAYERS = 2;
+constexpr int MAX_UNDO_LAYERS = 64; // Layers share unchanged blocks and deep ones are spilled to disk, so depth is nearly free
 
 constexpr int DEFAULT_ACTIVE_TRACK_INDEX = -1;
 constexpr float MIN_PLAYBACK_SPEED = 0.5f;
@@ -48,6 +51,61 @@ constexpr char COMPANY_NAME[] = "fp";
 constexpr char PLUGIN_NAME[] = "AwesomeLooper";
 constexpr char MIDI_MAPPING_FILE_NAME[] = "MidiMapping.json";
 
+//**************************************************************
+// Loop Storage Constants
+//**************************************************************
+constexpr int LOOP_BLOCK_SIZE_SAMPLES = 1 << 15;            // Power of two; ~0.7s at 48kHz
+constexpr int LOOP_BLOCK_POOL_RESERVE_BLOCKS = 8;           // Cleared blocks kept ready for the audio thread
+constexpr int LOOP_BLOCK_POOL_MAINTENANCE_INTERVAL_MS = 50; // Worker wake-up period when not signalled
+constexpr int LOOP_BLOCK_POOL_RESERVE_HEADROOM = 2;         // Maintenance intervals of claims, at the observed rate, kept in reserve
+constexpr size_t LOOP_ARENA_BUDGET_BYTES = (size_t) 1 << 30; // Shared by every track's live, undo and redo audio
+constexpr bool LOOP_ARENA_LOCK_PAGES = false;                // mlock arena blocks; needs a raised RLIMIT_MEMLOCK
+constexpr float LOOP_INT16_HEADROOM = 2.0f;                 // Int16 loop storage full scale: +6 dB above unity for overdubs
+constexpr int LOOP_SILENCE_REGION_SAMPLES = 256;            // Granularity of a loop's silence map; divides the block size
+static_assert (LOOP_BLOCK_SIZE_SAMPLES % LOOP_SILENCE_REGION_SAMPLES == 0);
+
+constexpr int SCRATCH_POOL_BUFFERS = 12; // Block-sized working buffers shared by the tracks of an engine
+
+constexpr int RENDER_POOL_MAX_WORKERS = 3;             // Track render threads besides the audio thread
+constexpr int RENDER_POOL_WORKER_PRIORITY = 8;         // Real-time priority of the render threads, 0 to 10
+constexpr int RENDER_POOL_SPIN_ITERATIONS = 4096;      // Polls of an idle render thread before it sleeps
+constexpr int RENDER_POOL_STOP_TIMEOUT_MS = 1000;      // Grace period for a render thread to finish at shutdown
+constexpr int PARALLEL_RENDER_MIN_BLOCK_SAMPLES = 128; // Smaller blocks render serially; waking workers would cost more
+// Each track rendering at once may borrow three scratch buffers: a path handover, the stretcher's source and a block being cached
+static_assert (SCRATCH_POOL_BUFFERS >= 3 * (RENDER_POOL_MAX_WORKERS + 1));
+
+constexpr int STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS = 2; // Blocks an offloaded stretcher renders ahead of the audio thread
+constexpr int STRETCH_OFFLOAD_JOBS = 4;             // Queued source blocks per offloaded track
+constexpr bool DEFAULT_STRETCH_OFFLOAD = false;     // Tracks stretch on the audio thread unless offload is turned on
+constexpr int STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES = 128; // Fade around a block an offloaded stretcher came up short on, about 3 ms
+constexpr bool DEFAULT_RENDERED_LOOP_CACHE = true;  // Stretched tracks replay a cached pass once their settings hold for a loop
+constexpr int RENDERED_LOOP_SEAM_SAMPLES = 256;    // Captured past a full pass and crossfaded into its start, so the cached wrap has no splice
+static_assert (STRETCH_OFFLOAD_JOBS > STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS);
+
+constexpr int VARISPEED_TAPS = 16;              // Windowed-sinc length of the varispeed reader; a multiple of four
+constexpr int VARISPEED_PHASES = 256;           // Sub-sample phases tabulated per filter, interpolated between
+constexpr int VARISPEED_CUTOFF_BANDS = 5;       // Anti-alias cutoffs spread between unity and MAX_PLAYBACK_SPEED
+constexpr double VARISPEED_KAISER_BETA = 7.0;   // Window shape: stopband depth against transition width
+constexpr bool DEFAULT_NATIVE_VARISPEED = true; // Tracks without pitch lock use the varispeed reader rather than SoundTouch
+
+constexpr int UNDO_RESIDENT_LAYERS = 1;                     // Most recent undo layers kept uncompressed
+constexpr int UNDO_PACKING_LAYERS = 1;                      // Layers a track's own pool covers while they are being compressed
+constexpr int REDO_RESIDENT_LAYERS = 8;                     // Undone layers a track's own pool holds for redo; deeper undos wait for blocks
+constexpr int UNDO_COMPRESSOR_IDLE_INTERVAL_MS = 200;        // Compressor wake-up period when not signalled
+constexpr size_t UNDO_SPILL_GROW_BYTES = (size_t) 16 << 20; // Growth step of the on-disk undo scratch file
+
+constexpr int LAYER_FINALIZER_IDLE_INTERVAL_MS = 200;        // Finaliser wake-up period when not signalled
+constexpr bool DEFAULT_BACKGROUND_FINALIZATION = false;     // Standalone tracks normalise and fade a finished layer inline
+
+constexpr int AUDIO_FILE_LOADER_MAX_THREADS = 4;           // Files dropped on different tracks decode in parallel, up to this many
+constexpr int AUDIO_FILE_LOADER_IDLE_INTERVAL_MS = 200;    // Loader wake-up period when not signalled
+constexpr int AUDIO_FILE_LOADER_CHUNK_SAMPLES = 1 << 16;   // Samples decoded and resampled at a time
+
+constexpr int STREAM_READ_AHEAD_BLOCKS = 6;          // Loop blocks a streamed backing track keeps decoded ahead of its playhead, ~4s at 48kHz
+constexpr int STREAM_MAX_RESIDENT_BLOCKS = 32;       // Most blocks one stream holds at a time: read-ahead, wrap ends and seam guard
+constexpr int STREAM_READER_IDLE_INTERVAL_MS = 10;   // Stream reader wake-up period when not signalled
+static_assert (STREAM_READ_AHEAD_BLOCKS + 8 <= STREAM_MAX_RESIDENT_BLOCKS);
+
 //**************************************************************
 // Message Bus Constants
 //**************************************************************
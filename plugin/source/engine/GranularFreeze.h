@@ -419,12 +419,7 @@ public:
     {
         if (cloudController.isIdle() || cloudController.isTailing())
         {
-            for (int ch = 0; ch < circularBuffer.getNumChannels(); ++ch)
-            {
-                juce::FloatVectorOperations::copy (frozenBuffer.getWritePointer (ch),
-                                                   circularBuffer.getReadPointer (ch),
-                                                   circularBuffer.getNumSamples());
-            }
+            circularBuffer.getAudioBuffer()->copyTo (frozenBuffer, 0, circularBuffer.getNumSamples());
             cloudController.triggerFreeze();
         }
         else if (cloudController.isFreezing())
@@ -451,12 +446,7 @@ public:
     {
         const auto numSamples = buffer.getNumSamples();
 
-        circularBuffer.writeToAudioBuffer ([] (float* dest, const float* src, int numCurrentSamples, bool)
-                                           { juce::FloatVectorOperations::copy (dest, src, numCurrentSamples); },
-                                           buffer,
-                                           numSamples,
-                                           true,
-                                           false);
+        circularBuffer.writeToAudioBuffer (BufferKernels::Copy {}, buffer, numSamples, true, false);
 
         if (! cloudController.isIdle())
         {
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "engine/VolumeProcessor.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+/**
+ * Background worker that normalises a finished layer, so closing a long loop costs the audio thread a
+ * block-table copy rather than measuring every region the recording left stale.
+ *
+ * post() shares the layer's blocks into a staging buffer, which is the committed snapshot the worker
+ * processes; copy-on-write duplicates each block the first time the worker changes it, so the audio
+ * thread keeps playing the raw layer untouched. Once the worker is done, collect() swaps the staging
+ * buffer with the live one at the next block boundary and hands the raw layer's blocks back.
+ *
+ * The job has three stages. The audio thread only posts from Idle and only collects from Done; the
+ * worker only touches the staging buffer while the job is Requested. A layer that changes before its
+ * result lands is marked discarded, and the result is released instead of installed.
+ */
+class LayerFinalizer
+{
+public:
+    enum Stage : int
+    {
+        Idle,      // staging buffer empty, owned by the audio thread
+        Requested, // staging buffer holds the snapshot, owned by the worker
+        Done       // staging buffer holds the finished layer, back with the audio thread
+    };
+
+    LayerFinalizer() {}
+    ~LayerFinalizer() { releaseResources(); }
+
+    void prepareToPlay (LoopBlockPool& blockPool, const int capacitySamples)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        staging->prepareToPlay (blockPool, capacitySamples);
+        stage.store (Idle);
+        discardResult = false;
+        startWorkerThread();
+    }
+
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        stopWorkerThread();
+        staging->releaseResources();
+        stage.store (Idle);
+        discardResult = false;
+    }
+
+    bool isIdle() const { return stage.load (std::memory_order_acquire) == Idle; }
+    bool isBusy() const { return ! isIdle(); }
+
+    // Audio thread: takes a snapshot of the first length samples of layer and hands it to the worker
+    void post (const ChunkedLoopBuffer& layer, const int length)
+    {
+        PERFETTO_FUNCTION();
+        jassert (isIdle());
+        staging->shareFrom (layer, length);
+        jobLength = length;
+        discardResult = false;
+
+        stage.store (Requested, std::memory_order_release);
+        workerSignal.signal();
+    }
+
+    // Audio thread: the layer behind the current job has changed, so its result must not be installed
+    void discard()
+    {
+        if (isBusy()) discardResult = true;
+    }
+
+    // Audio thread: swaps a finished layer into layer and returns true; a discarded one is only released
+    bool collect (std::unique_ptr<ChunkedLoopBuffer>& layer)
+    {
+        PERFETTO_FUNCTION();
+        if (stage.load (std::memory_order_acquire) != Done) return false;
+
+        const bool install = ! discardResult;
+        if (install) std::swap (layer, staging);
+
+        staging->clear();
+        discardResult = false;
+        stage.store (Idle, std::memory_order_relaxed);
+        return install;
+    }
+
+private:
+    std::unique_ptr<ChunkedLoopBuffer> staging = std::make_unique<ChunkedLoopBuffer>();
+    std::atomic<int> stage { Idle };
+    bool discardResult = false; // audio thread only
+
+    // Written by the audio thread before the job is posted
+    int jobLength = 0;
+
+    juce::WaitableEvent workerSignal;
+    std::atomic<bool> shouldStop { false };
+    std::thread workerThread;
+
+    void finalize()
+    {
+        PERFETTO_FUNCTION();
+        VolumeProcessor::normalizeOutput (*staging, jobLength);
+        stage.store (Done, std::memory_order_release);
+    }
+
+    void startWorkerThread()
+    {
+        shouldStop.store (false);
+        workerThread = std::thread (
+            [this]()
+            {
+                juce::Thread::setCurrentThreadName ("Layer Finalizer");
+
+                while (! shouldStop.load())
+                {
+                    workerSignal.wait (LAYER_FINALIZER_IDLE_INTERVAL_MS);
+                    if (! shouldStop.load() && stage.load (std::memory_order_acquire) == Requested) finalize();
+                }
+            });
+    }
+
+    void stopWorkerThread()
+    {
+        shouldStop.store (true);
+        workerSignal.signal();
+        if (workerThread.joinable()) workerThread.join();
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (LayerFinalizer)
+};
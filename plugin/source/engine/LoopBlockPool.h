@@ -0,0 +1,482 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "engine/LoopSampleFormat.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#if JUCE_LINUX || JUCE_BSD || JUCE_MAC
+    #include <sys/mman.h>
+#endif
+
+/**
+ * Pool of fixed-size sample blocks backing ChunkedLoopBuffer block tables.
+ *
+ * Every slot holds one block of numChannels * blockSamples samples in the pool's LoopSampleFormat.
+ * Cleared blocks sit on a lock-free index stack, so the audio thread claims one with a single pop and
+ * returns it with a refcount decrement, never touching the allocator, clearing memory or scanning the
+ * slots: if the reserve runs dry it gets INVALID_BLOCK and the miss is counted. The worker is woken
+ * through a sleeping flag, and only when a block becomes dirty or the reserve falls below its target. Threads
+ * marked with ScopedRealtimeThread are held to that; other writers (loaders, finalisers, tests) may
+ * clear or allocate a block themselves. In-use blocks are refcounted so undo layers can share unchanged audio. A
+ * background thread keeps a reserve of cleared, resident blocks ahead of the writers, sized from the
+ * rate they are claimed at, clears blocks that were handed back, and frees memory beyond the reserve
+ * so that the resident footprint follows what was actually recorded.
+ *
+ * Fully preallocated pools run no worker; blocks handed back stay dirty until cleanReleasedBlocks(),
+ * the next prepareToPlay, or a writer that may clear them on its own thread.
+ *
+ * Block memory is zero-filled when allocated, so its pages are faulted in off the audio thread,
+ * and can optionally be locked into RAM so a long session never pages loop audio out.
+ */
+class LoopBlockPool
+{
+public:
+    static constexpr int INVALID_BLOCK = -1;
+
+    // Marks the current thread as real-time for its lifetime: acquireBlock then never clears or allocates
+    class ScopedRealtimeThread
+    {
+    public:
+        ScopedRealtimeThread() : previous (realtimeThread) { realtimeThread = true; }
+        ~ScopedRealtimeThread() { realtimeThread = previous; }
+
+    private:
+        const bool previous;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedRealtimeThread)
+    };
+
+    static bool isRealtimeThread() { return realtimeThread; }
+
+    LoopBlockPool() {}
+    ~LoopBlockPool() { releaseResources(); }
+
+    void prepareToPlay (const int numChannelsToUse,
+                        const int blockSamplesToUse,
+                        const int maxBlocksToUse,
+                        const int reserveBlocksToUse,
+                        const bool shouldLockPages = false,
+                        const LoopSampleFormat sampleFormatToUse = LoopSampleFormat::Float32)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        lockPages = shouldLockPages;
+        sampleFormat = sampleFormatToUse;
+        numChannels = numChannelsToUse;
+        blockSamples = blockSamplesToUse;
+        maxBlocks = std::max (maxBlocksToUse, 1);
+        reserveBlocks = juce::jlimit (0, maxBlocks, reserveBlocksToUse);
+        targetReserve = reserveBlocks;
+
+        storage.assign ((size_t) maxBlocks, nullptr);
+        slotStates = std::make_unique<std::atomic<int>[]> ((size_t) maxBlocks);
+        nextFree = std::make_unique<std::atomic<int>[]> ((size_t) maxBlocks);
+        for (int i = 0; i < maxBlocks; ++i)
+            slotStates[(size_t) i].store (UNALLOCATED, std::memory_order_relaxed);
+        freeHead.store (packFreeHead (INVALID_BLOCK, 0));
+        freeCount.store (0);
+
+        silentBlock.assign ((size_t) (numChannels * blockSamples), 0.0f);
+
+        // Pushed last to first, so blocks are handed out in slot order
+        for (int i = reserveBlocks - 1; i >= 0; --i)
+            allocateSlot (i);
+
+        // Fully preallocated pools (short circular buffers) never need the worker
+        if (reserveBlocks < maxBlocks) startWorkerThread();
+    }
+
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        stopWorkerThread();
+
+        for (size_t i = 0; i < storage.size(); ++i)
+        {
+            freeBlockMemory (storage[i]);
+            storage[i] = nullptr;
+        }
+
+        storage.clear();
+        slotStates.reset();
+        nextFree.reset();
+        freeHead.store (packFreeHead (INVALID_BLOCK, 0));
+        freeCount.store (0);
+        silentBlock.clear();
+        residentBlocks.store (0, std::memory_order_relaxed);
+        inlineAllocations.store (0, std::memory_order_relaxed);
+        reserveMisses.store (0, std::memory_order_relaxed);
+        claimsSinceRateCheck.store (0, std::memory_order_relaxed);
+        lockFailures.store (0, std::memory_order_relaxed);
+        maxBlocks = 0;
+    }
+
+    // Claims a cleared block. On a real-time thread an empty reserve is a counted miss; elsewhere the
+    // caller clears a released block or allocates one itself, so a load or finalise is never truncated.
+    int acquireBlock()
+    {
+        PERFETTO_FUNCTION();
+        if (maxBlocks == 0) return INVALID_BLOCK;
+
+        int blockId = popFree();
+        if (blockId != INVALID_BLOCK)
+        {
+            slotStates[(size_t) blockId].store (1, std::memory_order_release);
+        }
+        else if (! realtimeThread)
+        {
+            const int start = searchHint.load (std::memory_order_relaxed);
+            blockId = claimSlotInState (DIRTY, start, BUSY);
+            if (blockId != INVALID_BLOCK)
+                std::memset (storage[(size_t) blockId], 0, getBlockBytes());
+            else if ((blockId = claimSlotInState (UNALLOCATED, start, BUSY)) != INVALID_BLOCK)
+            {
+                inlineAllocations.fetch_add (1, std::memory_order_relaxed);
+                storage[(size_t) blockId] = allocateBlockMemory();
+                residentBlocks.fetch_add (1, std::memory_order_relaxed);
+            }
+            if (blockId != INVALID_BLOCK) slotStates[(size_t) blockId].store (1, std::memory_order_release);
+        }
+
+        if (blockId != INVALID_BLOCK)
+        {
+            searchHint.store ((blockId + 1) % maxBlocks, std::memory_order_relaxed);
+            claimsSinceRateCheck.fetch_add (1, std::memory_order_relaxed);
+        }
+        else
+        {
+            reserveMisses.fetch_add (1, std::memory_order_relaxed);
+        }
+
+        if (freeCount.load (std::memory_order_relaxed) < targetReserve.load (std::memory_order_relaxed)) requestMaintenance();
+        return blockId;
+    }
+
+    // Hands a block back. It is left dirty for the worker, or for the next maintenance pass in a
+    // pool without one, rather than cleared on the caller's thread.
+    void releaseBlock (const int blockId)
+    {
+        PERFETTO_FUNCTION();
+        if (! isValidBlock (blockId)) return;
+
+        auto& state = slotStates[(size_t) blockId];
+        int expected = state.load (std::memory_order_acquire);
+        while (expected > 0)
+        {
+            const int next = expected == 1 ? DIRTY : expected - 1;
+            if (! state.compare_exchange_weak (expected, next, std::memory_order_acq_rel)) continue;
+
+            // Only the last owner leaves a block for the worker to clear
+            if (next == DIRTY) requestMaintenance();
+            break;
+        }
+    }
+
+    // Maintenance pass for pools without a worker: clears every block handed back. Not for the audio thread.
+    void cleanReleasedBlocks()
+    {
+        PERFETTO_FUNCTION();
+        jassert (! realtimeThread);
+        for (int i = 0; i < maxBlocks; ++i)
+            cleanSlot (i);
+    }
+
+    // Adds an owner to a block that is already in use (copy-on-write sharing between layers)
+    void retainBlock (const int blockId)
+    {
+        if (! isValidBlock (blockId)) return;
+
+        auto& state = slotStates[(size_t) blockId];
+        int expected = state.load (std::memory_order_acquire);
+        while (expected > 0 && ! state.compare_exchange_weak (expected, expected + 1, std::memory_order_acq_rel))
+        {
+        }
+        jassert (expected > 0); // retaining a block nobody owns
+    }
+
+    bool isBlockShared (const int blockId) const { return slotStates[(size_t) blockId].load (std::memory_order_acquire) > 1; }
+
+    // Raw block storage in the pool's sample format
+    uint8_t* getBlockStorage (const int blockId, const int channel) const
+    {
+        return storage[(size_t) blockId] + (size_t) channel * (size_t) blockSamples * (size_t) getBytesPerSample();
+    }
+
+    float* getBlockData (const int blockId, const int channel) const
+    {
+        jassert (sampleFormat == LoopSampleFormat::Float32); // reduced-precision blocks must go through LoopSampleConversion
+        return reinterpret_cast<float*> (getBlockStorage (blockId, channel));
+    }
+
+    // Copies a whole block, all channels, in its stored format
+    void copyBlock (const int sourceId, const int destinationId) const
+    {
+        std::memcpy (storage[(size_t) destinationId], storage[(size_t) sourceId], getBlockBytes());
+    }
+
+    const float* getSilentData() const { return silentBlock.data(); }
+
+    bool isValidBlock (const int blockId) const { return blockId >= 0 && blockId < maxBlocks; }
+
+    int getNumChannels() const { return numChannels; }
+    int getBlockSamples() const { return blockSamples; }
+    int getMaxBlocks() const { return maxBlocks; }
+    int getNumResidentBlocks() const { return residentBlocks.load (std::memory_order_relaxed); }
+    int getNumBlocksInUse() const
+    {
+        int inUse = 0;
+        for (int i = 0; i < maxBlocks; ++i)
+            if (slotStates[(size_t) i].load (std::memory_order_relaxed) > 0) ++inUse;
+        return inUse;
+    }
+
+    int getNumInlineAllocations() const { return inlineAllocations.load (std::memory_order_relaxed); }
+    int getNumReserveMisses() const { return reserveMisses.load (std::memory_order_relaxed); }
+    int getTargetReserve() const { return targetReserve.load (std::memory_order_relaxed); }
+    int getNumLockFailures() const { return lockFailures.load (std::memory_order_relaxed); }
+    bool isLockingPages() const { return lockPages; }
+    LoopSampleFormat getSampleFormat() const { return sampleFormat; }
+    int getBytesPerSample() const { return LoopSampleConversion::getBytesPerSample (sampleFormat); }
+    size_t getBlockBytes() const { return (size_t) (numChannels * blockSamples) * (size_t) getBytesPerSample(); }
+    size_t getResidentBytes() const { return (size_t) getNumResidentBlocks() * getBlockBytes(); }
+    size_t getBudgetBytes() const { return (size_t) maxBlocks * getBlockBytes(); }
+
+private:
+    // Slot states; values above zero are "in use"
+    static constexpr int UNALLOCATED = -3;
+    static constexpr int BUSY = -2;
+    static constexpr int DIRTY = -1;
+    static constexpr int FREE = 0;
+
+    int numChannels = 0;
+    int blockSamples = 0;
+    int maxBlocks = 0;
+    int reserveBlocks = 0;
+    std::atomic<int> targetReserve { 0 }; // reserveBlocks, raised by the worker while blocks are claimed quickly
+    bool lockPages = false;
+    LoopSampleFormat sampleFormat = LoopSampleFormat::Float32;
+
+    std::vector<uint8_t*> storage;
+    std::unique_ptr<std::atomic<int>[]> slotStates;
+    std::vector<float> silentBlock;
+
+    // Stack of FREE slots: every FREE slot is on it, so claiming one never scans. The head packs the top
+    // slot with a tag that changes on every update, so a pop racing a pop and push of the same slot fails.
+    std::unique_ptr<std::atomic<int>[]> nextFree;
+    std::atomic<uint64_t> freeHead { 0 };
+    std::atomic<int> freeCount { 0 };
+
+    std::atomic<int> searchHint { 0 };
+    std::atomic<int> residentBlocks { 0 };
+    std::atomic<int> inlineAllocations { 0 };
+    std::atomic<int> reserveMisses { 0 };
+    std::atomic<int> claimsSinceRateCheck { 0 };
+    int missesAtRateCheck = 0;
+    juce::uint32 lastRateCheckMs = 0;
+    std::atomic<int> lockFailures { 0 };
+
+    // Background maintenance thread
+    juce::WaitableEvent workerSignal;
+    std::atomic<unsigned int> maintenanceRequests { 0 };
+    std::atomic<bool> workerSleeping { false };
+    std::atomic<bool> shouldStop { false };
+    std::atomic<bool> workerRunning { false };
+    std::thread workerThread;
+
+    static inline thread_local bool realtimeThread = false;
+
+    static uint64_t packFreeHead (const int slot, const uint32_t tag) { return ((uint64_t) tag << 32) | (uint32_t) (slot + 1); }
+    static int getFreeHeadSlot (const uint64_t head) { return (int) (uint32_t) head - 1; }
+    static uint32_t getFreeHeadTag (const uint64_t head) { return (uint32_t) (head >> 32); }
+
+    // Any thread; the slot must already be FREE
+    void pushFree (const int slot)
+    {
+        auto head = freeHead.load (std::memory_order_relaxed);
+        do
+        {
+            nextFree[(size_t) slot].store (getFreeHeadSlot (head), std::memory_order_relaxed);
+        } while (! freeHead.compare_exchange_weak (head,
+                                                   packFreeHead (slot, getFreeHeadTag (head) + 1),
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed));
+        freeCount.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    // Any thread; the caller owns the slot it returns, still marked FREE
+    int popFree()
+    {
+        auto head = freeHead.load (std::memory_order_acquire);
+        for (int slot = getFreeHeadSlot (head); slot != INVALID_BLOCK; slot = getFreeHeadSlot (head))
+        {
+            const int next = nextFree[(size_t) slot].load (std::memory_order_relaxed);
+            if (freeHead.compare_exchange_weak (head, packFreeHead (next, getFreeHeadTag (head) + 1), std::memory_order_acquire))
+            {
+                freeCount.fetch_sub (1, std::memory_order_relaxed);
+                return slot;
+            }
+        }
+        return INVALID_BLOCK;
+    }
+
+    // Wakes the worker only if it is asleep, and only once per sleep, so bursts of requests cost an increment each
+    void requestMaintenance()
+    {
+        if (! workerRunning.load (std::memory_order_relaxed)) return;
+        maintenanceRequests.fetch_add (1);
+        if (workerSleeping.exchange (false)) workerSignal.signal();
+    }
+
+    // Off the audio thread only: used when the free stack is empty
+    int claimSlotInState (const int fromState, const int startIndex, const int toState)
+    {
+        for (int n = 0; n < maxBlocks; ++n)
+        {
+            const int i = (startIndex + n) % maxBlocks;
+            // A plain load first, so slots in other states cost a shared read rather than a locked write
+            if (slotStates[(size_t) i].load (std::memory_order_relaxed) != fromState) continue;
+            int expected = fromState;
+            if (slotStates[(size_t) i].compare_exchange_strong (expected, toState, std::memory_order_acq_rel)) return i;
+        }
+        return INVALID_BLOCK;
+    }
+
+    uint8_t* allocateBlockMemory()
+    {
+        auto* data = new uint8_t[getBlockBytes()](); // zero-filling faults every page in now; all-zero bits are silence in every format
+        if (lockPages && ! setMemoryLocked (data, true)) lockFailures.fetch_add (1, std::memory_order_relaxed);
+        return data;
+    }
+
+    void freeBlockMemory (uint8_t* data)
+    {
+        if (data == nullptr) return;
+        if (lockPages) setMemoryLocked (data, false);
+        delete[] data;
+    }
+
+    bool setMemoryLocked (uint8_t* data, const bool shouldLock) const
+    {
+#if JUCE_LINUX || JUCE_BSD || JUCE_MAC
+        const size_t bytes = getBlockBytes();
+        return (shouldLock ? mlock (data, bytes) : munlock (data, bytes)) == 0;
+#else
+        // VirtualLock only covers the process minimum working set, which would have to be raised first
+        juce::ignoreUnused (data, shouldLock);
+        return false;
+#endif
+    }
+
+    void allocateSlot (const int slot)
+    {
+        int expected = UNALLOCATED;
+        if (! slotStates[(size_t) slot].compare_exchange_strong (expected, BUSY, std::memory_order_acq_rel)) return;
+
+        storage[(size_t) slot] = allocateBlockMemory();
+        residentBlocks.fetch_add (1, std::memory_order_relaxed);
+        slotStates[(size_t) slot].store (FREE, std::memory_order_release);
+        pushFree (slot);
+    }
+
+    // Gives back the memory of a slot just popped from the free stack
+    void freeSlot (const int slot)
+    {
+        slotStates[(size_t) slot].store (BUSY, std::memory_order_relaxed);
+        freeBlockMemory (storage[(size_t) slot]);
+        storage[(size_t) slot] = nullptr;
+        residentBlocks.fetch_sub (1, std::memory_order_relaxed);
+        slotStates[(size_t) slot].store (UNALLOCATED, std::memory_order_release);
+    }
+
+    void cleanSlot (const int slot)
+    {
+        int expected = DIRTY;
+        if (! slotStates[(size_t) slot].compare_exchange_strong (expected, BUSY, std::memory_order_acq_rel)) return;
+
+        std::memset (storage[(size_t) slot], 0, getBlockBytes());
+        slotStates[(size_t) slot].store (FREE, std::memory_order_release);
+        pushFree (slot);
+    }
+
+    // Sizes the reserve to cover LOOP_BLOCK_POOL_RESERVE_HEADROOM maintenance intervals at the claim rate
+    // seen over the last one, plus whatever was missed; it falls back towards reserveBlocks when recording slows
+    void updateTargetReserve()
+    {
+        const auto now = juce::Time::getMillisecondCounter();
+        const auto elapsedMs = now - lastRateCheckMs;
+        if (elapsedMs < (juce::uint32) LOOP_BLOCK_POOL_MAINTENANCE_INTERVAL_MS) return;
+
+        const int claims = claimsSinceRateCheck.exchange (0, std::memory_order_relaxed);
+        const int misses = reserveMisses.load (std::memory_order_relaxed);
+        const int newMisses = misses - missesAtRateCheck;
+        missesAtRateCheck = misses;
+        lastRateCheckMs = now;
+
+        const int claimsPerInterval = (int) ((juce::int64) claims * LOOP_BLOCK_POOL_MAINTENANCE_INTERVAL_MS / (juce::int64) elapsedMs);
+        const int wanted = claimsPerInterval * LOOP_BLOCK_POOL_RESERVE_HEADROOM + newMisses;
+        const int current = targetReserve.load (std::memory_order_relaxed);
+        targetReserve.store (juce::jlimit (reserveBlocks, maxBlocks, std::max (wanted, (current + reserveBlocks) / 2)),
+                             std::memory_order_relaxed);
+    }
+
+    void maintainReserve()
+    {
+        PERFETTO_FUNCTION();
+        updateTargetReserve();
+        const int reserve = targetReserve.load (std::memory_order_relaxed);
+
+        for (int i = 0; i < maxBlocks; ++i)
+            cleanSlot (i);
+
+        // Top up the reserve so the audio thread always finds a cleared block
+        for (int i = 0; i < maxBlocks && freeCount.load (std::memory_order_relaxed) < reserve; ++i)
+            if (slotStates[(size_t) i].load (std::memory_order_relaxed) == UNALLOCATED) allocateSlot (i);
+
+        // Give memory back once blocks are no longer needed, keeping the reserve resident
+        while (freeCount.load (std::memory_order_relaxed) > reserve * 2)
+        {
+            const int slot = popFree();
+            if (slot == INVALID_BLOCK) break;
+            freeSlot (slot);
+        }
+    }
+
+    void startWorkerThread()
+    {
+        shouldStop.store (false);
+        lastRateCheckMs = juce::Time::getMillisecondCounter();
+        missesAtRateCheck = 0;
+        workerRunning.store (true);
+        workerThread = std::thread (
+            [this]()
+            {
+                juce::Thread::setCurrentThreadName ("Loop Block Pool");
+
+                unsigned int seen = maintenanceRequests.load();
+                while (! shouldStop.load())
+                {
+                    // requestMaintenance() counts its request before it checks for a sleeper, so one of the two always notices the other
+                    workerSleeping.store (true);
+                    if (maintenanceRequests.load() == seen) workerSignal.wait (LOOP_BLOCK_POOL_MAINTENANCE_INTERVAL_MS);
+                    workerSleeping.store (false);
+                    seen = maintenanceRequests.load();
+                    if (! shouldStop.load()) maintainReserve();
+                }
+            });
+    }
+
+    void stopWorkerThread()
+    {
+        shouldStop.store (true);
+        workerSignal.signal();
+        if (workerThread.joinable()) workerThread.join();
+        workerRunning.store (false);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (LoopBlockPool)
+};
@@ -87,10 +87,12 @@ public:
         jassert (numToRead > 0);
         start1 = (int) readPos;
 
-        int remaining = musicalLength - start1;
+        // A playhead inside the loop region wraps at its end, back to its start
+        const bool inRegion = regionEnabled && start1 >= regionStart && start1 < regionEnd;
+        int remaining = (inRegion ? regionEnd : musicalLength) - start1;
 
         size1 = std::min (numToRead, remaining);
-        start2 = 0;
+        start2 = inRegion ? regionStart : 0;
         size2 = std::max (0, numToRead - remaining);
     }
 
@@ -1,19 +1,33 @@
 #pragma once
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
+#include <vector>
 
 class LoopLifo
 {
 public:
+    // Where the audio of the layer in a slot currently lives
+    enum class Residency : uint8_t
+    {
+        Resident,   // blocks in the pool, ready to swap in
+        Compressed, // packed in RAM
+        OnDisk      // packed in the spill file
+    };
+
     LoopLifo() : capacity (0), slotToPush (0), activeLayers (0) {}
 
     void prepareToPlay (int totalSize)
     {
         capacity = totalSize;
+        residency.assign ((size_t) std::max (totalSize, 0), Residency::Resident);
         clear();
     }
 
-    void clear() { slotToPush = activeLayers = 0; }
+    void clear()
+    {
+        slotToPush = activeLayers = 0;
+        std::fill (residency.begin(), residency.end(), Residency::Resident);
+    }
 
     // Prepare to push 1 layer
     void prepareToWrite (int /*numToWrite*/, int& start1, int& size1, int& start2, int& size2)
@@ -74,10 +88,38 @@ public:
         return (slotToPush - 1 + capacity) % capacity;
     }
 
+    // Slot holding the layer pushed depth pushes ago (1 = most recent), or -1
+    int getLayerIndexAtDepth (int depth) const
+    {
+        if (depth < 1 || depth > activeLayers) return -1;
+        return (slotToPush - depth + capacity) % capacity;
+    }
+
+    void setResidency (int slot, Residency newResidency)
+    {
+        if (slot >= 0 && slot < (int) residency.size()) residency[(size_t) slot] = newResidency;
+    }
+
+    Residency getResidency (int slot) const
+    {
+        return slot >= 0 && slot < (int) residency.size() ? residency[(size_t) slot] : Residency::Resident;
+    }
+
+    bool isResident (int slot) const { return getResidency (slot) == Residency::Resident; }
+
+    int getNumLayersWithResidency (Residency wanted) const
+    {
+        int count = 0;
+        for (int depth = 1; depth <= activeLayers; ++depth)
+            if (getResidency (getLayerIndexAtDepth (depth)) == wanted) ++count;
+        return count;
+    }
+
 private:
     int capacity;
     int slotToPush;
     int activeLayers;
+    std::vector<Residency> residency;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (LoopLifo)
 };
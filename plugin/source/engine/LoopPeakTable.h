@@ -0,0 +1,91 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * The largest magnitude each LOOP_SILENCE_REGION_SAMPLES region of a loop buffer holds, across all of its
+ * channels, so the peak of a whole layer is a scan of one float per region rather than of every sample.
+ *
+ * Writers that know what they wrote set their regions' peaks straight away. Any other change leaves the
+ * regions it touched stale, and the buffer measures those again when it is asked for a peak.
+ *
+ * The table is sized at prepareToPlay; nothing here allocates afterwards.
+ */
+class LoopPeakTable
+{
+public:
+    static constexpr int REGION_SAMPLES = LOOP_SILENCE_REGION_SAMPLES;
+
+    void prepareToPlay (const int capacitySamples)
+    {
+        numRegions = (capacitySamples + REGION_SAMPLES - 1) / REGION_SAMPLES;
+        peaks.assign ((size_t) numRegions, 0.0f);
+    }
+
+    void releaseResources()
+    {
+        peaks.clear();
+        numRegions = 0;
+    }
+
+    // Every region empty again, e.g. once the buffer has given all its blocks back
+    void clear() { std::fill (peaks.begin(), peaks.end(), 0.0f); }
+
+    static int regionOf (const int sample) { return sample / REGION_SAMPLES; }
+    static int regionStart (const int region) { return region * REGION_SAMPLES; }
+
+    int getNumRegions() const { return numRegions; }
+
+    bool isRegionStale (const int region) const { return region >= 0 && region < numRegions && peaks[(size_t) region] < 0.0f; }
+    float getRegionPeak (const int region) const { return region >= 0 && region < numRegions ? peaks[(size_t) region] : 0.0f; }
+
+    void setRegionPeak (const int region, const float peak)
+    {
+        if (region >= 0 && region < numRegions) peaks[(size_t) region] = peak;
+    }
+
+    // Regions [start, start + num) touches must be measured again before their peak is used
+    void markStale (const int start, const int num)
+    {
+        if (num <= 0) return;
+        for (int region = regionOf (start); region <= regionOf (start + num - 1); ++region)
+            setRegionPeak (region, STALE);
+    }
+
+    // Only regions lying entirely inside [start, start + num) are emptied; the rest may still hold sound
+    void markSilent (const int start, const int num)
+    {
+        for (int region = regionOf (start + REGION_SAMPLES - 1); regionStart (region + 1) <= start + num; ++region)
+            setRegionPeak (region, 0.0f);
+    }
+
+    // Follows a constant gain over [start, start + num); regions it only partly covers go stale
+    void scale (const int start, const int num, const float gain)
+    {
+        if (num <= 0) return;
+        for (int region = regionOf (start); region <= regionOf (start + num - 1); ++region)
+        {
+            if (isRegionStale (region)) continue;
+            const bool covered = regionStart (region) >= start && regionStart (region + 1) <= start + num;
+            setRegionPeak (region, covered ? getRegionPeak (region) * std::abs (gain) : STALE);
+        }
+    }
+
+    // Takes over the peaks of the regions covering [0, num) of other; later regions become empty
+    void copyFrom (const LoopPeakTable& other, const int num)
+    {
+        const int regions = std::min ({ numRegions, other.numRegions, regionOf (num + REGION_SAMPLES - 1) });
+        clear();
+        std::copy_n (other.peaks.begin(), regions, peaks.begin());
+    }
+
+private:
+    static constexpr float STALE = -1.0f;
+
+    std::vector<float> peaks;
+    int numRegions = 0;
+};
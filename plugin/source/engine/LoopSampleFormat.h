@@ -0,0 +1,168 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+    #include <immintrin.h>
+    #define LOOPER_USE_F16C 1
+#else
+    #define LOOPER_USE_F16C 0
+#endif
+
+// How loop audio is held in LoopBlockPool blocks
+enum class LoopSampleFormat
+{
+    Float32,
+    Int16,  // half the memory; full scale is LOOP_INT16_HEADROOM, so overdubs can build up past unity
+    Float16 // half the memory; relative precision of ~11 bits, no clipping below 65504
+};
+
+/**
+ * Conversion kernels between float processing buffers and loop block storage.
+ *
+ * The loops are written without cross-iteration dependencies so the compiler can vectorise them;
+ * half floats use the F16C instructions when the target has them.
+ *
+ * Int16 headroom and rounding: samples are stored with LOOP_INT16_HEADROOM of headroom above unity
+ * and saturate beyond it, so a stack of overdubs survives until the layer is normalised. Samples are
+ * rounded to the nearest step without dither. Dither that actually decorrelates the error needs
+ * +/-1 LSB of triangular noise, which would also move samples already on the grid, so every overdub
+ * pass that only reads and writes audio back would add a fresh layer of it. Plain rounding leaves
+ * that audio exactly as stored. The cost is rounding error that follows the signal instead of
+ * sounding as noise, audible only on material within a few steps (about 84 dB below unity) of
+ * silence. Float16 rounds to nearest even and its error scales with the signal.
+ */
+class LoopSampleConversion
+{
+public:
+    static int getBytesPerSample (const LoopSampleFormat format)
+    {
+        return format == LoopSampleFormat::Float32 ? (int) sizeof (float) : (int) sizeof (uint16_t);
+    }
+
+    static void toFloat (const LoopSampleFormat format, const uint8_t* source, float* destination, const int numSamples)
+    {
+        switch (format)
+        {
+            case LoopSampleFormat::Float32:
+                std::memcpy (destination, source, (size_t) numSamples * sizeof (float));
+                break;
+            case LoopSampleFormat::Int16:
+                int16ToFloat (reinterpret_cast<const int16_t*> (source), destination, numSamples);
+                break;
+            case LoopSampleFormat::Float16:
+                halfToFloat (reinterpret_cast<const uint16_t*> (source), destination, numSamples);
+                break;
+        }
+    }
+
+    static void fromFloat (const LoopSampleFormat format, const float* source, uint8_t* destination, const int numSamples)
+    {
+        switch (format)
+        {
+            case LoopSampleFormat::Float32:
+                std::memcpy (destination, source, (size_t) numSamples * sizeof (float));
+                break;
+            case LoopSampleFormat::Int16:
+                floatToInt16 (source, reinterpret_cast<int16_t*> (destination), numSamples);
+                break;
+            case LoopSampleFormat::Float16:
+                floatToHalf (source, reinterpret_cast<uint16_t*> (destination), numSamples);
+                break;
+        }
+    }
+
+    static void int16ToFloat (const int16_t* source, float* destination, const int numSamples)
+    {
+        constexpr float scale = LOOP_INT16_HEADROOM / 32767.0f;
+        for (int i = 0; i < numSamples; ++i)
+            destination[i] = (float) source[i] * scale;
+    }
+
+    static void floatToInt16 (const float* source, int16_t* destination, const int numSamples)
+    {
+        constexpr float scale = 32767.0f / LOOP_INT16_HEADROOM;
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const float value = std::clamp (source[i] * scale, -32768.0f, 32767.0f);
+            destination[i] = (int16_t) (value + (value < 0.0f ? -0.5f : 0.5f));
+        }
+    }
+
+    static void halfToFloat (const uint16_t* source, float* destination, int numSamples)
+    {
+#if LOOPER_USE_F16C
+        for (; numSamples >= 4; numSamples -= 4, source += 4, destination += 4)
+            _mm_storeu_ps (destination, _mm_cvtph_ps (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (source))));
+#endif
+        for (int i = 0; i < numSamples; ++i)
+            destination[i] = halfToFloat (source[i]);
+    }
+
+    static void floatToHalf (const float* source, uint16_t* destination, int numSamples)
+    {
+#if LOOPER_USE_F16C
+        for (; numSamples >= 4; numSamples -= 4, source += 4, destination += 4)
+            _mm_storel_epi64 (reinterpret_cast<__m128i*> (destination), _mm_cvtps_ph (_mm_loadu_ps (source), _MM_FROUND_TO_NEAREST_INT));
+#endif
+        for (int i = 0; i < numSamples; ++i)
+            destination[i] = floatToHalf (source[i]);
+    }
+
+    // Branch-free: rebiasing the exponent with one multiply also covers subnormals
+    static float halfToFloat (const uint16_t half)
+    {
+        const uint32_t magnitudeBits = (uint32_t) (half & 0x7fffu) << 13;
+        float magnitude;
+        std::memcpy (&magnitude, &magnitudeBits, sizeof (magnitude));
+        magnitude *= 5.192296858534828e33f; // 2^112
+
+        uint32_t bits;
+        std::memcpy (&bits, &magnitude, sizeof (bits));
+        if (magnitude >= 65536.0f) bits |= 0x7f800000u; // infinity and NaN keep an all-ones exponent
+        bits |= (uint32_t) (half & 0x8000u) << 16;
+
+        float value;
+        std::memcpy (&value, &bits, sizeof (value));
+        return value;
+    }
+
+    // Round to nearest even, like the hardware conversion
+    static uint16_t floatToHalf (const float value)
+    {
+        uint32_t bits;
+        std::memcpy (&bits, &value, sizeof (bits));
+        const uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000u);
+        bits &= 0x7fffffffu;
+
+        if (bits >= 0x7f800000u) return (uint16_t) (sign | (bits > 0x7f800000u ? 0x7e00u : 0x7c00u)); // NaN, infinity
+        if (bits >= 0x477ff000u) return (uint16_t) (sign | 0x7c00u);                                   // rounds past 65504
+        if (bits < 0x33000000u) return sign;                                                           // rounds to zero
+
+        uint32_t half;
+        uint32_t remainder;
+        uint32_t halfway;
+        if (bits < 0x38800000u)
+        {
+            // Subnormal half
+            const int shift = 126 - (int) (bits >> 23);
+            const uint32_t mantissa = (bits & 0x7fffffu) | 0x800000u;
+            half = mantissa >> shift;
+            remainder = mantissa & ((1u << shift) - 1u);
+            halfway = 1u << (shift - 1);
+        }
+        else
+        {
+            half = (bits - 0x38000000u) >> 13;
+            remainder = bits & 0x1fffu;
+            halfway = 0x1000u;
+        }
+
+        if (remainder > halfway || (remainder == halfway && (half & 1u) != 0)) ++half; // may carry into the exponent
+        return (uint16_t) (sign | half);
+    }
+};
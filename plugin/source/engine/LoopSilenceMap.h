@@ -0,0 +1,109 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include <JuceHeader.h>
+#include <cstdint>
+#include <vector>
+
+/**
+ * One bit per LOOP_SILENCE_REGION_SAMPLES of a loop buffer, set where the region may hold anything
+ * other than zeros. A clear bit is a promise that every sample of the region, on every channel, is
+ * exactly zero, so readers may skip it without changing a single output sample. Bits only need to be
+ * conservative: a set bit over silence costs time, never correctness.
+ *
+ * The words are sized at prepareToPlay; nothing here allocates afterwards.
+ */
+class LoopSilenceMap
+{
+public:
+    static constexpr int REGION_SAMPLES = LOOP_SILENCE_REGION_SAMPLES;
+
+    void prepareToPlay (const int capacitySamples)
+    {
+        numRegions = (capacitySamples + REGION_SAMPLES - 1) / REGION_SAMPLES;
+        sounding.assign ((size_t) ((numRegions + 63) / 64), 0);
+    }
+
+    void releaseResources()
+    {
+        sounding.clear();
+        numRegions = 0;
+    }
+
+    // Every region silent again, e.g. once the buffer has given all its blocks back
+    void clear() { std::fill (sounding.begin(), sounding.end(), (uint64_t) 0); }
+
+    static int regionOf (const int sample) { return sample / REGION_SAMPLES; }
+    static int regionStart (const int region) { return region * REGION_SAMPLES; }
+
+    bool isRegionSilent (const int region) const
+    {
+        if (region < 0 || region >= numRegions) return true;
+        return (sounding[(size_t) (region >> 6)] & bitOf (region)) == 0;
+    }
+
+    void setRegionSilent (const int region, const bool isSilent)
+    {
+        if (region < 0 || region >= numRegions) return;
+        if (isSilent)
+            sounding[(size_t) (region >> 6)] &= ~bitOf (region);
+        else
+            sounding[(size_t) (region >> 6)] |= bitOf (region);
+    }
+
+    // True when every region [start, start + num) touches is silent
+    bool isSilent (const int start, const int num) const
+    {
+        if (num <= 0) return true;
+        for (int region = regionOf (start); region <= regionOf (start + num - 1); ++region)
+            if (! isRegionSilent (region)) return false;
+        return true;
+    }
+
+    void markSounding (const int start, const int num)
+    {
+        if (num <= 0) return;
+        for (int region = regionOf (start); region <= regionOf (start + num - 1); ++region)
+            setRegionSilent (region, false);
+    }
+
+    // Only regions lying entirely inside [start, start + num) are cleared; the rest may still hold sound
+    void markSilent (const int start, const int num)
+    {
+        for (int region = regionOf (start + REGION_SAMPLES - 1); regionStart (region + 1) <= start + num; ++region)
+            setRegionSilent (region, true);
+    }
+
+    // Takes over the state of the regions covering [0, num) of other; later regions become silent
+    void copyFrom (const LoopSilenceMap& other, const int num)
+    {
+        const int regions = std::min ({ numRegions, other.numRegions, regionOf (num + REGION_SAMPLES - 1) });
+        clear();
+        std::copy_n (other.sounding.begin(), regions / 64, sounding.begin());
+        for (int region = regions & ~63; region < regions; ++region)
+            setRegionSilent (region, other.isRegionSilent (region));
+    }
+
+    // func (int runStart, int runLength, bool isSilent) over [start, start + num), split where silence starts or stops
+    template <typename Func>
+    void forEachRun (const int start, const int num, Func&& func) const
+    {
+        int runStart = start;
+        while (runStart < start + num)
+        {
+            const bool silent = isRegionSilent (regionOf (runStart));
+            int runEnd = std::min (regionStart (regionOf (runStart) + 1), start + num);
+            while (runEnd < start + num && isRegionSilent (regionOf (runEnd)) == silent)
+                runEnd = std::min (regionStart (regionOf (runEnd) + 1), start + num);
+
+            func (runStart, runEnd - runStart, silent);
+            runStart = runEnd;
+        }
+    }
+
+private:
+    std::vector<uint64_t> sounding;
+    int numRegions = 0;
+
+    static uint64_t bitOf (const int region) { return (uint64_t) 1 << (region & 63); }
+};
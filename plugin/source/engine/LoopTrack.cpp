@@ -4,6 +4,7 @@
 #include "profiler/PerfettoProfiler.h"
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 
 //==============================================================================
 // Setup
@@ -16,18 +17,78 @@ void LoopTrack::prepareToPlay (const double currentSampleRate,
                                const int maxUndoLayers)
 {
     PERFETTO_FUNCTION();
-    if (currentSampleRate <= 0.0 || maxBlockSize <= 0 || numChannels <= 0 || maxSeconds <= 0) return;
+    if (! setFormat (currentSampleRate, maxBlockSize, numChannels, maxSeconds)) return;
+
+    // Hand every block back before the pool is rebuilt underneath the buffers
+    detachStream();
+    layerFinalizer.releaseResources();
+    undoManager.releaseResources();
+    bufferManager.releaseResources();
+
+    // Blocks are claimed as audio is recorded, so the pool only bounds the worst case of what is resident at once:
+    // live, staging, the uncompressed undo layers, one being packed and the redo layers all full, plus a cached pass
+    // at the slowest speed. Deeper undo layers live compressed in RAM or in the spill file, so depth costs no blocks.
+    const int blocksPerLayer = (int) ((alignedBufferSize + LOOP_BLOCK_SIZE_SAMPLES - 1) / LOOP_BLOCK_SIZE_SAMPLES);
+    const int blocksPerCachedPass = (int) std::ceil (blocksPerLayer / MIN_PLAYBACK_SPEED) + 1;
+    const int residentLayers = 2 + std::min (maxUndoLayers, UNDO_RESIDENT_LAYERS + UNDO_PACKING_LAYERS) + std::min (maxUndoLayers, REDO_RESIDENT_LAYERS);
+    if (ownedPool == nullptr) ownedPool = std::make_unique<LoopBlockPool>();
+    ownedPool->prepareToPlay (channels, LOOP_BLOCK_SIZE_SAMPLES, blocksPerLayer * residentLayers + blocksPerCachedPass, LOOP_BLOCK_POOL_RESERVE_BLOCKS);
+
+    // Stretched playback holds one buffer and one more while it caches, and a block that switches playback path another
+    if (ownedScratch == nullptr) ownedScratch = std::make_unique<ScratchBufferPool>();
+    ownedScratch->prepareToPlay (channels, blockSize, 3);
+
+    prepareStorage (*ownedPool, *ownedScratch, maxUndoLayers);
+}
+
+void LoopTrack::prepareToPlay (LoopBlockPool& sharedPool,
+                               ScratchBufferPool& sharedScratch,
+                               const double currentSampleRate,
+                               const int maxBlockSize,
+                               const int numChannels,
+                               const int maxSeconds,
+                               const int maxUndoLayers)
+{
+    PERFETTO_FUNCTION();
+    if (! setFormat (currentSampleRate, maxBlockSize, numChannels, maxSeconds)) return;
+    jassert (sharedPool.getNumChannels() == channels);
+
+    detachStream();
+    layerFinalizer.releaseResources();
+    undoManager.releaseResources();
+    bufferManager.releaseResources();
+    ownedPool.reset();
+    ownedScratch.reset();
+
+    prepareStorage (sharedPool, sharedScratch, maxUndoLayers);
+}
+
+bool LoopTrack::setFormat (const double currentSampleRate, const int maxBlockSize, const int numChannels, const int maxSeconds)
+{
+    if (currentSampleRate <= 0.0 || maxBlockSize <= 0 || numChannels <= 0 || maxSeconds <= 0) return false;
 
     sampleRate = currentSampleRate;
     blockSize = std::max (blockSize, maxBlockSize);
     channels = (int) numChannels;
     auto requestedSamples = std::max ((int) currentSampleRate * maxSeconds, 1); // at least 1 block will be allocated
     alignedBufferSize = (size_t) ((requestedSamples + blockSize - 1) / blockSize) * (size_t) blockSize;
+    return true;
+}
 
-    bufferManager.prepareToPlay ((int) numChannels, (int) alignedBufferSize);
-    undoManager.prepareToPlay ((int) maxUndoLayers, (int) numChannels, (int) alignedBufferSize);
+void LoopTrack::prepareStorage (LoopBlockPool& pool, ScratchBufferPool& scratch, const int maxUndoLayers)
+{
+    blockPool = &pool;
+    scratchPool = &scratch;
+
+    bufferManager.prepareToPlay (pool, (int) alignedBufferSize);
+    bufferManager.setSeamFadeLength ((int) (CROSSFADE_DEFAULT_LENGTH_SECONDS * sampleRate));
+    undoManager.prepareToPlay (pool, (int) maxUndoLayers, (int) alignedBufferSize);
     volumeProcessor.prepareToPlay (sampleRate, blockSize);
-    playbackEngine.prepareToPlay (currentSampleRate, (int) alignedBufferSize, (int) numChannels, (int) blockSize);
+    playbackEngine.prepareToPlay (sampleRate, channels, (int) blockSize, scratch);
+    playbackEngine.prepareRenderedLoopCache (pool, (int) alignedBufferSize);
+    layerFinalizer.prepareToPlay (pool, (int) alignedBufferSize);
+    stem.setSize (channels, blockSize);
+    stem.clear();
 
     clear();
 }
@@ -40,9 +101,13 @@ void LoopTrack::releaseResources()
     sampleRate = 0.0;
 
     volumeProcessor.releaseResources();
+    layerFinalizer.releaseResources();
     bufferManager.releaseResources();
     playbackEngine.releaseResources();
     undoManager.releaseResources();
+    stem.setSize (0, 0);
+    if (ownedPool) ownedPool->releaseResources();
+    if (ownedScratch) ownedScratch->releaseResources();
 }
 
 //==============================================================================
@@ -55,41 +120,87 @@ void LoopTrack::processRecord (const juce::AudioBuffer<float>& input,
                                const LooperState& currentLooperState)
 {
     PERFETTO_FUNCTION();
+    // A stream is played from disk; there is nothing in memory to record into
+    if (isStreaming()) return;
+    if (isFinalizingLayer()) discardLayerFinalization();
 
-    bufferManager.writeToAudioBuffer ([&] (float* dest, const float* source, const int samples, const bool shouldOverdub)
-                                      { volumeProcessor.saveBalancedLayers (dest, source, samples, shouldOverdub); },
-                                      input,
-                                      numSamples,
-                                      isOverdub,
-                                      true);
+    const float loopGain = bufferManager.getAudioBuffer()->getPlaybackGain();
+    bufferManager.writeToAudioBuffer (volumeProcessor.getBalancedOverdubKernel (loopGain), input, numSamples, isOverdub, true);
+    recordedThisBlock = true;
     updateUIBridge (numSamples, true, currentLooperState);
 }
 
 void LoopTrack::initializeForNewOverdubSession()
 {
     PERFETTO_FUNCTION();
+    if (isStreaming()) return;
+    discardLayerFinalization();
     undoManager.finalizeCopyAndPush (bufferManager.getLength());
 }
 
 void LoopTrack::finalizeLayer (const bool isOverdub, const int masterLoopLengthSamples)
 {
     PERFETTO_FUNCTION();
+    if (isStreaming()) return;
 
     bufferManager.finalizeLayer (isOverdub, masterLoopLengthSamples);
+    finishLayer();
+}
 
+void LoopTrack::applyPostProcessing (ChunkedLoopBuffer& audioBuffer, int length)
+{
+    // The seam is crossfaded as the loop plays, so only the playback gain changes here
+    volumeProcessor.normalizeOutput (audioBuffer, length);
+}
+
+// The live layer has just been fixed: recorded, undone or redone
+void LoopTrack::finishLayer()
+{
+    PERFETTO_FUNCTION();
     auto& audioBuffer = *bufferManager.getAudioBuffer();
     auto length = bufferManager.getLength();
 
-    applyPostProcessing (audioBuffer, length);
+    if (finalizeInBackground)
+    {
+        // Playback carries on from the raw layer until processLayerFinalization swaps in the finished one
+        discardLayerFinalization();
+        finalizationPending = true;
+        processLayerFinalization();
+    }
+    else
+    {
+        applyPostProcessing (audioBuffer, length);
+    }
 
+    playbackEngine.invalidateRenderedLoop();
     undoManager.stageCurrentBuffer (audioBuffer, length);
     uiBridge->signalWaveformChanged();
 }
 
-void LoopTrack::applyPostProcessing (juce::AudioBuffer<float>& audioBuffer, int length)
+void LoopTrack::processLayerFinalization()
 {
-    volumeProcessor.normalizeOutput (audioBuffer, length);
-    volumeProcessor.applyCrossfade (audioBuffer, length);
+    PERFETTO_FUNCTION();
+    if (layerFinalizer.collect (bufferManager.getAudioBuffer()))
+    {
+        auto& audioBuffer = *bufferManager.getAudioBuffer();
+        playbackEngine.invalidateRenderedLoop();
+        undoManager.stageCurrentBuffer (audioBuffer, bufferManager.getLength());
+        uiBridge->signalWaveformChanged();
+    }
+
+    // A finaliser still busy with a discarded layer takes the pending one once it is free
+    if (finalizationPending && layerFinalizer.isIdle())
+    {
+        layerFinalizer.post (*bufferManager.getAudioBuffer(), bufferManager.getLength());
+        finalizationPending = false;
+    }
+}
+
+// The live layer is about to change, so whatever the finaliser makes of it would be stale
+void LoopTrack::discardLayerFinalization()
+{
+    finalizationPending = false;
+    layerFinalizer.discard();
 }
 
 bool LoopTrack::processPlayback (juce::AudioBuffer<float>& output,
@@ -98,15 +209,55 @@ bool LoopTrack::processPlayback (juce::AudioBuffer<float>& output,
                                  const LooperState& currentLooperState)
 {
     PERFETTO_FUNCTION();
-    bool loopFinished = playbackEngine.processPlayback (output, bufferManager, numSamples, isOverdub);
-    volumeProcessor.applyVolume (output, numSamples);
+    const bool loopFinished = renderStem (numSamples, isOverdub, currentLooperState);
+    mixStemInto (output, numSamples);
+    return loopFinished;
+}
+
+bool LoopTrack::renderStem (const int numSamples, const bool isOverdub, const LooperState& currentLooperState)
+{
+    PERFETTO_FUNCTION();
+    playbackEngine.setLoopRecordedThisBlock (recordedThisBlock);
+    recordedThisBlock = false;
+    if (isStreaming()) serviceStream (numSamples);
+
+    bool loopFinished = false;
+    if (numSamples > stem.getNumSamples())
+    {
+        jassertfalse; // block larger than announced in prepareToPlay
+        stem.clear();
+        stemIsSilent = true;
+    }
+    else if (volumeProcessor.isInaudible())
+    {
+        // A track nobody can hear only keeps its place; the block that fades it out is still rendered
+        loopFinished = playbackEngine.advanceInaudibly (bufferManager, numSamples, isOverdub);
+        stem.clear (0, numSamples); // getStem() readers see silence, not the last audible block
+        stemIsSilent = true;
+    }
+    else
+    {
+        stem.clear (0, numSamples);
+        loopFinished = playbackEngine.processPlayback (stem, bufferManager, numSamples, isOverdub);
+        stemIsSilent = playbackEngine.wasLastBlockSilent();
+    }
+
     updateUIBridge (numSamples, false, currentLooperState);
     return loopFinished;
 }
 
+void LoopTrack::mixStemInto (juce::AudioBuffer<float>& output, const int numSamples)
+{
+    PERFETTO_FUNCTION();
+    const float loopGain = bufferManager.getAudioBuffer()->getPlaybackGain();
+    volumeProcessor.addWithVolume (output, stem, std::min (numSamples, stem.getNumSamples()), stemIsSilent, loopGain);
+}
+
 void LoopTrack::clear()
 {
     PERFETTO_FUNCTION();
+    detachStream();
+    discardLayerFinalization();
     volumeProcessor.clear();
     bufferManager.clear();
     undoManager.clear();
@@ -127,38 +278,45 @@ void LoopTrack::resetPlaybackPosition (LooperState currentState)
 bool LoopTrack::undo()
 {
     PERFETTO_FUNCTION();
-    if (bufferManager.getLength() == 0) return false;
+    if (bufferManager.getLength() == 0 || isStreaming()) return false;
+
+    // Never wait for the disk on the audio thread: queue the undo until its layer is paged back in
+    if (! undoManager.isUndoReady())
+    {
+        undoManager.deferUndo();
+        return false;
+    }
 
     if (undoManager.undo (bufferManager.getAudioBuffer()))
     {
         bufferManager.finalizeLayer (true, 0);
-
-        auto& audioBuffer = *bufferManager.getAudioBuffer();
-        auto length = bufferManager.getLength();
-        applyPostProcessing (audioBuffer, length);
-        undoManager.stageCurrentBuffer (audioBuffer, length);
-
-        uiBridge->signalWaveformChanged();
+        finishLayer();
         return true;
     }
     return false;
 }
 
+void LoopTrack::processUndoCompression (const bool canServeUndo)
+{
+    PERFETTO_FUNCTION();
+    undoManager.processBackgroundCompression();
+    if (undoManager.getPendingUndos() == 0) return;
+
+    if (! canServeUndo)
+        undoManager.cancelPendingUndos();
+    else if (undoManager.isUndoReady() && ! undo())
+        undoManager.cancelPendingUndos();
+}
+
 bool LoopTrack::redo()
 {
     PERFETTO_FUNCTION();
-    if (bufferManager.getLength() == 0) return false;
+    if (bufferManager.getLength() == 0 || isStreaming()) return false;
 
     if (undoManager.redo (bufferManager.getAudioBuffer()))
     {
         bufferManager.finalizeLayer (true, 0);
-
-        auto& audioBuffer = *bufferManager.getAudioBuffer();
-        auto length = bufferManager.getLength();
-        applyPostProcessing (audioBuffer, length);
-        undoManager.stageCurrentBuffer (audioBuffer, length);
-
-        uiBridge->signalWaveformChanged();
+        finishLayer();
         return true;
     }
     return false;
@@ -171,11 +329,8 @@ void LoopTrack::loadBackingTrack (const juce::AudioBuffer<float>& backingTrack,
     PERFETTO_FUNCTION();
     if (backingTrack.getNumChannels() != bufferManager.getNumChannels() || backingTrack.getNumSamples() == 0) return;
 
-    auto prevSampleRate = sampleRate;
-    auto prevBlockSize = blockSize;
-    auto prevChannels = channels;
-    releaseResources();
-    prepareToPlay (prevSampleRate, (int) prevBlockSize, (int) prevChannels);
+    // The storage is already laid out for this format, so only its content goes
+    clear();
 
     // need to resample if backing track sample rate differs
     juce::AudioBuffer<float>& trackToUse = const_cast<juce::AudioBuffer<float>&> (backingTrack);
@@ -202,20 +357,107 @@ void LoopTrack::loadBackingTrack (const juce::AudioBuffer<float>& backingTrack,
         copySamples = masterLoopLengthSamples;
     }
 
-    bufferManager.writeToAudioBuffer ([&] (float* dest, const float* source, const int samples, const bool /*shouldOverdub*/)
-                                      { juce::FloatVectorOperations::copy (dest, source, samples); },
-                                      trackToUse,
-                                      copySamples,
-                                      false,
-                                      false);
+    bufferManager.writeToAudioBuffer (BufferKernels::Copy {}, trackToUse, copySamples, false, false);
 
     finalizeLayer (false, copySamples);
     updateUIBridge (copySamples, false, LooperState::Stopped);
 }
 
+void LoopTrack::loadLayer (std::unique_ptr<ChunkedLoopBuffer>& layer, const int length)
+{
+    PERFETTO_FUNCTION();
+    jassert (layer->getNumSamples() == bufferManager.getNumSamples() && layer->getNumChannels() == channels);
+    if (length <= 0) return;
+
+    clear();
+    std::swap (bufferManager.getAudioBuffer(), layer);
+
+    finalizeLayer (false, std::min (length, bufferManager.getNumSamples()));
+    updateUIBridge (bufferManager.getLength(), false, LooperState::Stopped);
+}
+
+void LoopTrack::loadStream (BackingTrackStream& streamToPlay)
+{
+    PERFETTO_FUNCTION();
+    jassert (streamToPlay.getState() == BackingTrackStream::Ready && streamToPlay.getBuffer()->getNumChannels() == channels);
+
+    clear();
+    bufferManager.swapAudioBuffer (streamToPlay.getBuffer());
+    streamToPlay.attach();
+    stream = &streamToPlay;
+
+    // Played as it is on disk: no normalising, no undo history and no cached pass until the stream is in place
+    bufferManager.finalizeLayer (false, streamToPlay.getLength());
+    playbackEngine.invalidateRenderedLoop();
+    updateUIBridge (bufferManager.getLength(), false, LooperState::Stopped);
+}
+
+// Gives the stream its paged buffer back and takes the track's own buffer, cleared, in return
+void LoopTrack::detachStream()
+{
+    if (stream == nullptr) return;
+    bufferManager.swapAudioBuffer (stream->getBuffer());
+    stream->detach();
+    stream = nullptr;
+    pendingSeek = {};
+}
+
+void LoopTrack::setLoopRegion (int startSample, int endSample)
+{
+    if (! isStreaming())
+    {
+        bufferManager.setLoopRegion (startSample, endSample);
+        return;
+    }
+
+    const int start = juce::jlimit (0, getTrackLengthSamples(), startSample);
+    pendingSeek = { start, true, start, endSample };
+}
+
+void LoopTrack::clearLoopRegion()
+{
+    if (pendingSeek.setsRegion) pendingSeek = {};
+    bufferManager.clearLoopRegion();
+}
+
+void LoopTrack::setReadPosition (int pos)
+{
+    // Keeps a region still waiting to be set, so it lands together with the position
+    if (isStreaming())
+        pendingSeek.position = juce::jlimit (0, getTrackLengthSamples() - 1, pos);
+    else
+        bufferManager.setReadPosition (pos);
+}
+
+// Before the block is read: moves to a pending seek once its blocks are in, then lets the stream follow the playhead
+void LoopTrack::serviceStream (const int numSamples)
+{
+    PERFETTO_FUNCTION();
+    if (pendingSeek.position >= 0 && stream->isResident (pendingSeek.position))
+    {
+        if (pendingSeek.setsRegion) bufferManager.setLoopRegion (pendingSeek.regionStart, pendingSeek.regionEnd);
+        bufferManager.setReadPosition (pendingSeek.position);
+        pendingSeek = {};
+    }
+
+    const int length = bufferManager.getLength();
+    BackingTrackStream::Window window;
+    window.playhead = bufferManager.getExactReadPosition();
+    window.direction = playbackEngine.isPlaybackDirectionForward() ? 1 : -1;
+    window.wrapStart = bufferManager.hasLoopRegion() ? bufferManager.getLoopRegionStart() : 0;
+    window.wrapEnd = bufferManager.hasLoopRegion() ? bufferManager.getLoopRegionEnd() : length;
+    window.guardEnd = std::min (window.wrapEnd + bufferManager.getSeamFadeLength(), length);
+    window.seekTarget = pendingSeek.position;
+
+    // Whatever plays while the disk catches up is silence, which a cached pass must not keep
+    if (! stream->update (window, numSamples * playbackEngine.getPlaybackSpeed())) playbackEngine.invalidateRenderedLoop();
+}
+
 void LoopTrack::saveTrackToWavFile (const juce::File& audioFile)
 {
     PERFETTO_FUNCTION();
+    // A streamed track is already a file, and far too long to copy into memory
+    if (isStreaming()) return;
     juce::AudioFormatManager formatManager;
     formatManager.registerBasicFormats();
     std::unique_ptr<juce::AudioFormatWriter> writer;
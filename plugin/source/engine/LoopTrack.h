@@ -2,9 +2,13 @@
 
 #include "UndoManager.h"
 #include "audio/AudioToUIBridge.h"
+#include "engine/BackingTrackStream.h"
 #include "engine/BufferManager.h"
+#include "engine/LayerFinalizer.h"
+#include "engine/LoopBlockPool.h"
 #include "engine/LooperStateConfig.h"
 #include "engine/PlaybackEngine.h"
+#include "engine/ScratchBufferPool.h"
 #include "engine/VolumeProcessor.h"
 #include "juce_audio_basics/juce_audio_basics.h"
 #include <JuceHeader.h>
@@ -12,14 +16,26 @@
 class LoopTrack
 {
 public:
-    LoopTrack() {}
+    LoopTrack() : ownedUIBridge (std::make_unique<AudioToUIBridge>()), uiBridge (ownedUIBridge.get()) {}
+    explicit LoopTrack (AudioToUIBridge& bridge) : uiBridge (&bridge) {}
     ~LoopTrack() { releaseResources(); }
 
+    // Standalone use: the track owns a block pool sized for its own worst case and its own scratch buffers
     void prepareToPlay (const double currentSampleRate,
                         const int maxBlockSize,
                         const int numChannels,
                         const int maxSeconds = LOOP_MAX_SECONDS_HARD_LIMIT,
                         const int maxUndoLayers = MAX_UNDO_LAYERS);
+
+    // Loop, undo and redo audio drawn from an arena shared with the other tracks of the engine,
+    // block-sized working buffers borrowed from the engine's scratch pool
+    void prepareToPlay (LoopBlockPool& sharedPool,
+                        ScratchBufferPool& sharedScratch,
+                        const double currentSampleRate,
+                        const int maxBlockSize,
+                        const int numChannels,
+                        const int maxSeconds = LOOP_MAX_SECONDS_HARD_LIMIT,
+                        const int maxUndoLayers = MAX_UNDO_LAYERS);
     void releaseResources();
 
     void initializeForNewOverdubSession();
@@ -30,26 +46,62 @@ public:
 
     void finalizeLayer (const bool isOverdub, const int masterLoopLengthSamples);
 
+    // Renders the block and adds it to output at the track volume, leaving what output already held as it was
     bool processPlayback (juce::AudioBuffer<float>& output,
                           const int numSamples,
                           const bool isOverdub,
                           const LooperState& currentLooperState);
 
+    // Renders the block into the track's own stem buffer, so tracks can render on different threads;
+    // mixStemInto then scales the stem by the track volume and the loop's playback gain and adds it to the shared
+    // output in one pass
+    bool renderStem (const int numSamples, const bool isOverdub, const LooperState& currentLooperState);
+    void mixStemInto (juce::AudioBuffer<float>& output, const int numSamples);
+    const juce::AudioBuffer<float>& getStem() const { return stem; }
+
     void clear();
     bool undo();
     bool redo();
 
+    // Also serves undos that were deferred while their layer was paged back in
+    void processUndoCompression (const bool canServeUndo);
+    // Once per block: installs a layer the finaliser has finished and hands it the next one
+    void processLayerFinalization();
+    bool isBackgroundFinalizationEnabled() const { return finalizeInBackground; }
+    void setBackgroundFinalizationEnabled (const bool shouldFinalizeInBackground) { finalizeInBackground = shouldFinalizeInBackground; }
+    bool isFinalizingLayer() const { return finalizationPending || layerFinalizer.isBusy(); }
+
+    size_t getUndoCompressedBytes() const { return undoManager.getCompressedBytes(); }
+    size_t getUndoUncompressedBytes() const { return undoManager.getUncompressedBytes(); }
+    size_t getUndoSpilledBytes() const { return undoManager.getSpilledBytes(); }
+    int getPendingUndos() const { return undoManager.getPendingUndos(); }
+    int getNumUndoLayersOnDisk() const { return undoManager.getNumLayersOnDisk(); }
+
     int getCurrentReadPosition() const { return bufferManager.getReadPosition(); }
     int getCurrentWritePosition() const { return bufferManager.getWritePosition(); }
 
     int getLoopDurationSeconds() const { return (int) (bufferManager.getLength() / sampleRate); }
 
-    void setCrossFadeLength (const int newCrossFadeLength) { volumeProcessor.setCrossFadeLength (newCrossFadeLength); }
+    // Length of the crossfade playback applies where the loop, or its region, wraps; the loop audio is left as recorded
+    void setCrossFadeLength (const int newCrossFadeLength)
+    {
+        bufferManager.setSeamFadeLength (newCrossFadeLength);
+        playbackEngine.invalidateRenderedLoop();
+    }
 
     void loadBackingTrack (const juce::AudioBuffer<float>& backingTrack,
                            const int masterLoopLengthSamples,
                            const double backingTrackSampleRate);
-    juce::AudioBuffer<float>* getAudioBuffer() { return bufferManager.getAudioBuffer().get(); }
+    // Swaps in a layer built off the audio thread, e.g. by AudioFileLoader, in place of whatever the track held.
+    // layer must draw from the track's pool and match its capacity; it comes back holding the old layer, cleared.
+    void loadLayer (std::unique_ptr<ChunkedLoopBuffer>& layer, const int length);
+    // Plays a stream AudioFileLoader has opened in place of whatever the track held, with the stream's paged buffer as
+    // the loop. A streaming track plays, seeks and loops regions but records nothing; clear() gives the stream back.
+    void loadStream (BackingTrackStream& streamToPlay);
+    bool isStreaming() const { return stream != nullptr; }
+    int getStreamUnderruns() const { return stream != nullptr ? stream->getNumUnderruns() : 0; }
+    ChunkedLoopBuffer* getAudioBuffer() { return bufferManager.getAudioBuffer().get(); }
+    const LoopBlockPool* getBlockPool() const { return blockPool; }
 
     const int getAvailableTrackSizeSamples() const { return (int) alignedBufferSize; }
 
@@ -66,6 +118,26 @@ public:
     bool shouldKeepPitchWhenChangingSpeed() const { return playbackEngine.shouldKeepPitchWhenChangingSpeed(); }
     void setKeepPitchWhenChangingSpeed (const bool shouldKeepPitch) { playbackEngine.setKeepPitchWhenChangingSpeed (shouldKeepPitch); }
 
+    bool isNativeVarispeedEnabled() const { return playbackEngine.isNativeVarispeedEnabled(); }
+    void setNativeVarispeedEnabled (const bool shouldUseNativeVarispeed) { playbackEngine.setNativeVarispeedEnabled (shouldUseNativeVarispeed); }
+
+    TimeStretchBackend getTimeStretchBackend() const { return playbackEngine.getTimeStretchBackend(); }
+    void setTimeStretchBackend (const TimeStretchBackend backend) { playbackEngine.setTimeStretchBackend (backend); }
+
+    StretchQuality getStretchQuality() const { return playbackEngine.getStretchQuality(); }
+    void setStretchQuality (const StretchQuality quality) { playbackEngine.setStretchQuality (quality); }
+
+    void setStretchOffloadWorker (StretchOffloadWorker* worker) { playbackEngine.setStretchOffloadWorker (worker); }
+    bool isStretchOffloadEnabled() const { return playbackEngine.isStretchOffloadEnabled(); }
+    void setStretchOffloadEnabled (const bool shouldOffload) { playbackEngine.setStretchOffloadEnabled (shouldOffload); }
+    bool isStretchOffloaded() const { return playbackEngine.isStretchOffloaded(); }
+
+    bool isRenderedLoopCacheEnabled() const { return playbackEngine.isRenderedLoopCacheEnabled(); }
+    void setRenderedLoopCacheEnabled (const bool shouldCache) { playbackEngine.setRenderedLoopCacheEnabled (shouldCache); }
+    bool isPlayingRenderedLoop() const { return playbackEngine.isPlayingRenderedLoop(); }
+    bool isStemSilent() const { return stemIsSilent; }
+    bool isStretchRunning() const { return playbackEngine.isStretchRunning(); }
+
     bool hasWrappedAround() { return bufferManager.hasWrappedAround(); }
 
     float getTrackVolume() const { return volumeProcessor.getTrackVolume(); }
@@ -86,13 +158,21 @@ public:
 
     void cancelCurrentRecording();
 
-    void setLoopRegion (int startSample, int endSample) { bufferManager.setLoopRegion (startSample, endSample); }
-    void clearLoopRegion() { bufferManager.clearLoopRegion(); }
+    // A streaming track starts playing a new region from its start, as soon as the blocks there are read from disk
+    void setLoopRegion (int startSample, int endSample);
+    void clearLoopRegion();
     bool hasLoopRegion() const { return bufferManager.hasLoopRegion(); }
     int getLoopRegionStart() const { return bufferManager.getLoopRegionStart(); }
     int getLoopRegionEnd() const { return bufferManager.getLoopRegionEnd(); }
 
-    AudioToUIBridge* getUIBridge() const { return uiBridge.get(); }
+    AudioToUIBridge* getUIBridge() const { return uiBridge; }
+
+    // Report to a bridge owned elsewhere, e.g. by the engine slot the UI bound to before the track existed
+    void attachUIBridge (AudioToUIBridge& bridge)
+    {
+        uiBridge = &bridge;
+        bridgeInitialized = false;
+    }
 
     bool isSynced() const { return isSyncedToMaster; }
     void setSynced (bool synced) { isSyncedToMaster = synced; }
@@ -101,27 +181,58 @@ public:
 
     void setWritePosition (int pos) { bufferManager.setWritePosition (pos); }
 
-    void setReadPosition (int pos) { bufferManager.setReadPosition (pos); }
+    void setReadPosition (int pos);
 
     void saveTrackToWavFile (const juce::File& fileToSave);
 
 private:
+    // Declared first so it outlives every buffer holding blocks from it
+    std::unique_ptr<LoopBlockPool> ownedPool;
+    LoopBlockPool* blockPool = nullptr;
+    std::unique_ptr<ScratchBufferPool> ownedScratch;
+    ScratchBufferPool* scratchPool = nullptr;
+
     VolumeProcessor volumeProcessor;
     BufferManager bufferManager;
     UndoStackManager undoManager;
     PlaybackEngine playbackEngine;
+    LayerFinalizer layerFinalizer;
+    bool finalizeInBackground = DEFAULT_BACKGROUND_FINALIZATION;
+    bool finalizationPending = false; // the live layer still waits to be normalised
+    juce::AudioBuffer<float> stem; // this track's playback for the current block, before its volume and gain
+    bool stemIsSilent = true;      // the block read only silent regions of the loop, so the stem is all zeros
 
     double sampleRate = 0.0;
     int blockSize = 0;
     int channels = 0;
     size_t alignedBufferSize = 0;
     bool isSyncedToMaster = DEFAULT_TRACK_SYNCED;
+    bool recordedThisBlock = false; // keeps the stretcher inline and the cache empty while the block's input lands in the loop
+
+    // A move a streaming track makes once the blocks it lands on are in
+    struct PendingSeek
+    {
+        int position = -1; // nothing pending when negative
+        bool setsRegion = false;
+        int regionStart = 0;
+        int regionEnd = 0;
+    };
 
-    std::unique_ptr<AudioToUIBridge> uiBridge = std::make_unique<AudioToUIBridge>();
+    BackingTrackStream* stream = nullptr; // owned by the engine's AudioFileLoader
+    PendingSeek pendingSeek;
+
+    std::unique_ptr<AudioToUIBridge> ownedUIBridge;
+    AudioToUIBridge* uiBridge = nullptr;
     bool bridgeInitialized = uiBridge != nullptr;
 
+    bool setFormat (const double currentSampleRate, const int maxBlockSize, const int numChannels, const int maxSeconds);
+    void prepareStorage (LoopBlockPool& pool, ScratchBufferPool& scratch, const int maxUndoLayers);
     void processRecordChannel (const juce::AudioBuffer<float>& input, const int numSamples, const int ch);
-    void applyPostProcessing (juce::AudioBuffer<float>& audioBuffer, int length);
+    void applyPostProcessing (ChunkedLoopBuffer& audioBuffer, int length);
+    void finishLayer();
+    void discardLayerFinalization();
+    void serviceStream (const int numSamples);
+    void detachStream();
 
     void updateUIBridge (int numSamples, bool wasRecording, LooperState currentState)
     {
@@ -129,6 +240,9 @@ private:
 
         bool nowRecording = StateConfig::isRecording (currentState);
 
+        // The UI copies the loop to draw it, which for a stream would be the whole file
+        if (isStreaming()) bridgeInitialized = true;
+
         // Initialize bridge if needed
         if (! bridgeInitialized && getTrackLengthSamples() > 0)
         {
@@ -137,14 +251,14 @@ private:
         }
 
         // Handle recording finalization
-        if (wasRecording && ! nowRecording)
+        if (wasRecording && ! nowRecording && ! isStreaming())
         {
             uiBridge->signalWaveformChanged();
             uiBridge->resetRecordingCounter();
         }
 
         // Periodic updates during recording
-        if (nowRecording && uiBridge->shouldUpdateWhileRecording (numSamples, sampleRate))
+        if (nowRecording && ! isStreaming() && uiBridge->shouldUpdateWhileRecording (numSamples, sampleRate))
         {
             uiBridge->signalWaveformChanged();
         }
@@ -10,7 +10,7 @@ LooperEngine::LooperEngine() {}
 
 LooperEngine::~LooperEngine() { releaseResources(); }
 
-void LooperEngine::prepareToPlay (double newSampleRate, int newMaxBlockSize, int newNumChannels)
+void LooperEngine::prepareToPlay (double newSampleRate, int newMaxBlockSize, int newNumChannels, int numTracksToUse)
 {
     PERFETTO_FUNCTION();
     if (newSampleRate <= 0.0 || newMaxBlockSize <= 0 || newNumChannels <= 0) return;
@@ -19,8 +19,42 @@ void LooperEngine::prepareToPlay (double newSampleRate, int newMaxBlockSize, int
     maxBlockSize = newMaxBlockSize;
     numChannels = newNumChannels;
 
-    for (int i = 0; i < NUM_TRACKS; ++i)
-        addTrack (i);
+    // Tracks hand their blocks back before the arena is rebuilt underneath them
+    releaseTracks();
+
+    // A 16-bit format fits twice the audio in the same budget
+    const size_t blockBytes =
+        (size_t) numChannels * (size_t) LOOP_BLOCK_SIZE_SAMPLES * (size_t) LoopSampleConversion::getBytesPerSample (loopSampleFormat);
+    loopArena.prepareToPlay (numChannels,
+                             LOOP_BLOCK_SIZE_SAMPLES,
+                             (int) (LOOP_ARENA_BUDGET_BYTES / blockBytes),
+                             LOOP_BLOCK_POOL_RESERVE_BLOCKS,
+                             LOOP_ARENA_LOCK_PAGES,
+                             loopSampleFormat);
+    scratchPool.prepareToPlay (numChannels, maxBlockSize, SCRATCH_POOL_BUFFERS);
+    renderPool.prepareToPlay (juce::jlimit (0, RENDER_POOL_MAX_WORKERS, juce::SystemStats::getNumCpus() - 1), sampleRate, maxBlockSize);
+    stretchOffloadWorker.start (sampleRate, maxBlockSize);
+
+    numTracks = juce::jlimit (1, MAX_TRACKS, numTracksToUse);
+    for (int i = 0; i < numTracks; ++i)
+    {
+        if (trackBridges[(size_t) i] == nullptr) trackBridges[(size_t) i] = std::make_unique<AudioToUIBridge>();
+        trackBridges[(size_t) i]->clear();
+    }
+
+    // Track 0 is armed straight away, and the spares are ready before the audio thread can ask for the next ones
+    spareTracks[0].store (createPreparedTrack().release());
+    activeTrackIndex = 0;
+    armTrack (0);
+    fillSpareTracks();
+    startTrackPreparer();
+
+    // Every track has the same capacity, so a layer loaded into any slot fits any track
+    audioFileLoader.prepareToPlay (loopArena,
+                                   loopTracks[0]->getAvailableTrackSizeSamples(),
+                                   sampleRate,
+                                   numTracks,
+                                   juce::jlimit (1, AUDIO_FILE_LOADER_MAX_THREADS, juce::SystemStats::getNumCpus() - 1));
 
     metronome->prepareToPlay (sampleRate, maxBlockSize);
     granularFreeze->prepareToPlay (sampleRate, numChannels);
@@ -37,8 +71,11 @@ void LooperEngine::prepareToPlay (double newSampleRate, int newMaxBlockSize, int
 void LooperEngine::releaseResources()
 {
     PERFETTO_FUNCTION();
-    for (auto& track : loopTracks)
-        if (track) track->releaseResources();
+    renderPool.releaseResources();
+    releaseTracks();
+    stretchOffloadWorker.stop();
+    loopArena.releaseResources();
+    scratchPool.releaseResources();
 
     sampleRate = 0.0;
     maxBlockSize = 0;
@@ -52,15 +89,115 @@ void LooperEngine::releaseResources()
     granularFreeze->releaseResources();
 }
 
-void LooperEngine::addTrack (int index)
+void LooperEngine::releaseTracks()
+{
+    stopTrackPreparer();
+    for (auto& spare : spareTracks)
+        delete spare.exchange (nullptr);
+    numDeferredCommands = 0;
+
+    for (auto& track : loopTracks)
+    {
+        if (track) track->releaseResources();
+        track.reset();
+    }
+
+    // After the tracks, which hand back the streams they play
+    audioFileLoader.releaseResources();
+    numArmedTracks = 0;
+    numTracksToPlay = 0;
+}
+
+std::unique_ptr<LoopTrack> LooperEngine::createPreparedTrack()
+{
+    PERFETTO_FUNCTION();
+    auto track = std::make_unique<LoopTrack> (*spareTrackBridge);
+    track->prepareToPlay (loopArena, scratchPool, sampleRate, maxBlockSize, numChannels);
+    track->setStretchOffloadWorker (&stretchOffloadWorker);
+    track->setBackgroundFinalizationEnabled (true);
+    return track;
+}
+
+LoopTrack* LooperEngine::armTrack (int trackIndex)
+{
+    PERFETTO_FUNCTION();
+    if (trackIndex < 0 || trackIndex >= numTracks) return nullptr;
+    auto& slot = loopTracks[(size_t) trackIndex];
+    if (slot) return slot.get();
+
+    // Building a track allocates and starts threads, so the audio thread only ever takes a prepared one
+    auto* spare = takeSpareTrack();
+    if (spare == nullptr)
+    {
+        deferredTrackArms.fetch_add (1, std::memory_order_relaxed);
+        preparerSignal.signal();
+        return nullptr;
+    }
+    slot.reset (spare);
+    slot->attachUIBridge (*trackBridges[(size_t) trackIndex]);
+
+    // A new track joins muted while another one is soloed, as if it had been there when the solo started
+    for (int n = 0; n < numArmedTracks; ++n)
+        if (loopTracks[(size_t) armedTracks[(size_t) n]]->isSoloed()) slot->setMuted (true);
+
+    int n = numArmedTracks++;
+    for (; n > 0 && armedTracks[(size_t) n - 1] > trackIndex; --n)
+        armedTracks[(size_t) n] = armedTracks[(size_t) n - 1];
+    armedTracks[(size_t) n] = trackIndex;
+
+    spareTracksWanted.store (std::min (SPARE_TRACKS, numTracks - numArmedTracks));
+    preparerSignal.signal();
+    return slot.get();
+}
+
+LoopTrack* LooperEngine::takeSpareTrack()
+{
+    for (auto& spare : spareTracks)
+        if (auto* track = spare.exchange (nullptr)) return track;
+    return nullptr;
+}
+
+void LooperEngine::fillSpareTracks()
 {
     PERFETTO_FUNCTION();
+    const int wanted = spareTracksWanted.load();
+    int ready = 0;
+    for (auto& spare : spareTracks)
+        if (spare.load() != nullptr) ++ready;
 
-    if (loopTracks[(size_t) index] == nullptr) loopTracks[(size_t) index] = std::make_unique<LoopTrack>();
-    loopTracks[(size_t) index]->prepareToPlay (sampleRate, maxBlockSize, numChannels);
+    for (auto& spare : spareTracks)
+    {
+        if (ready >= wanted) break;
+        if (spare.load() != nullptr) continue;
+        spare.store (createPreparedTrack().release());
+        ++ready;
+    }
+}
+
+void LooperEngine::startTrackPreparer()
+{
+    shouldStopPreparer.store (false);
+    preparerThread = std::thread (
+        [this]()
+        {
+            juce::Thread::setCurrentThreadName ("Track Preparer");
+
+            while (! shouldStopPreparer.load())
+            {
+                preparerSignal.wait();
+                if (shouldStopPreparer.load()) break;
+
+                // Only this thread fills the spares while it runs; the audio thread only takes them
+                fillSpareTracks();
+            }
+        });
+}
 
-    numTracks = static_cast<int> (loopTracks.size());
-    activeTrackIndex = numTracks - 1;
+void LooperEngine::stopTrackPreparer()
+{
+    shouldStopPreparer.store (true);
+    preparerSignal.signal();
+    if (preparerThread.joinable()) preparerThread.join();
 }
 
 LoopTrack* LooperEngine::getActiveTrack() const
@@ -77,6 +214,12 @@ LoopTrack* LooperEngine::getTrackByIndex (int trackIndex) const
     return nullptr;
 }
 
+AudioToUIBridge* LooperEngine::getTrackUIBridge (int trackIndex) const
+{
+    if (trackIndex >= 0 && trackIndex < numTracks) return trackBridges[(size_t) trackIndex].get();
+    return nullptr;
+}
+
 bool LooperEngine::trackHasContent (int index) const
 {
     PERFETTO_FUNCTION();
@@ -87,6 +230,7 @@ bool LooperEngine::trackHasContent (int index) const
 void LooperEngine::switchToTrackImmediately (int trackIndex)
 {
     PERFETTO_FUNCTION();
+    if (armTrack (trackIndex) == nullptr) return;
     activeTrackIndex = trackIndex;
     nextTrackIndex = DEFAULT_ACTIVE_TRACK_INDEX;
 
@@ -105,9 +249,11 @@ void LooperEngine::scheduleTrackSwitch (int trackIndex)
 StateContext LooperEngine::createStateContext (const juce::AudioBuffer<float>& buffer)
 {
     PERFETTO_FUNCTION();
-    for (int i = 0; i < NUM_TRACKS; ++i)
+    numTracksToPlay = 0;
+    for (int n = 0; n < numArmedTracks; ++n)
     {
-        tracksToPlay[(size_t) i] = shouldTrackPlay (i);
+        const int i = armedTracks[(size_t) n];
+        if (shouldTrackPlay (i)) tracksToPlay[(size_t) numTracksToPlay++] = i;
         hasWrappedAround[(size_t) i] = false;
     }
 
@@ -123,7 +269,9 @@ StateContext LooperEngine::createStateContext (const juce::AudioBuffer<float>& b
                           .hasWrappedAround = hasWrappedAround,
                           .syncMasterTrackIndex = syncMasterTrackIndex,
                           .allTracks = &loopTracks,
-                          .tracksToPlay = &tracksToPlay };
+                          .tracksToPlay = &tracksToPlay,
+                          .numTracksToPlay = numTracksToPlay,
+                          .renderPool = &renderPool };
 }
 
 bool LooperEngine::transitionTo (LooperState newState)
@@ -137,8 +285,9 @@ void LooperEngine::record()
 {
     PERFETTO_FUNCTION();
 
+    // A streamed backing track plays from disk and takes no recording
     auto* activeTrack = getActiveTrack();
-    if (! activeTrack) return;
+    if (! activeTrack || activeTrack->isStreaming()) return;
 
     LooperState targetState = trackHasContent (activeTrackIndex) ? LooperState::Overdubbing : LooperState::Recording;
     transitionTo (targetState);
@@ -190,14 +339,11 @@ void LooperEngine::stop()
     else if (StateConfig::isStopped (currentState))
     {
         // Reset all playheads to start
-        for (auto& track : loopTracks)
-            track->resetPlaybackPosition (currentState);
+        for (int n = 0; n < numArmedTracks; ++n)
+            loopTracks[(size_t) armedTracks[(size_t) n]]->resetPlaybackPosition (currentState);
 
         transitionTo (LooperState::Idle);
-        for (int i = 0; i < NUM_TRACKS; ++i)
-        {
-            loopCounts[(size_t) i] = 0;
-        }
+        loopCounts.fill (0);
     }
 }
 
@@ -216,7 +362,7 @@ void LooperEngine::togglePlay() { StateConfig::isPlaying (currentState) ? stop()
 
 void LooperEngine::toggleSync (int trackIndex)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setSynced (! track->isSynced());
@@ -233,12 +379,12 @@ void LooperEngine::toggleReverse (int trackIndex)
 }
 void LooperEngine::toggleSolo (int trackIndex)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track) setTrackSoloed (trackIndex, ! track->isSoloed());
 }
 void LooperEngine::toggleMute (int trackIndex)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track) setTrackMuted (trackIndex, ! track->isMuted());
 }
 // void LooperEngine::toggleVolumeNormalize (int trackIndex)
@@ -263,6 +409,7 @@ void LooperEngine::selectTrack (int trackIndex)
     PERFETTO_FUNCTION();
     if (trackIndex < 0 || trackIndex >= numTracks) return;
     if (trackIndex == activeTrackIndex) return;
+    if (armTrack (trackIndex) == nullptr) return;
 
     if (StateConfig::isRecording (currentState))
     {
@@ -288,15 +435,44 @@ void LooperEngine::undo (int trackIndex)
     if (! StateConfig::allowsUndo (currentState)) return;
 
     auto* track = getTrackByIndex (trackIndex);
-
-    track->undo();
+    if (track) track->undo();
 }
 void LooperEngine::setTrackPitch (int trackIndex, float pitch)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track) track->setPlaybackPitch (pitch);
 }
 
+void LooperEngine::setTrackNativeVarispeed (int trackIndex, bool shouldUseNativeVarispeed)
+{
+    auto* track = armTrack (trackIndex);
+    if (track) track->setNativeVarispeedEnabled (shouldUseNativeVarispeed);
+}
+
+void LooperEngine::setTrackTimeStretchBackend (int trackIndex, TimeStretchBackend backend)
+{
+    auto* track = armTrack (trackIndex);
+    if (track) track->setTimeStretchBackend (backend);
+}
+
+void LooperEngine::setTrackStretchQuality (int trackIndex, StretchQuality quality)
+{
+    auto* track = armTrack (trackIndex);
+    if (track) track->setStretchQuality (quality);
+}
+
+void LooperEngine::setTrackStretchOffload (int trackIndex, bool shouldOffload)
+{
+    auto* track = armTrack (trackIndex);
+    if (track) track->setStretchOffloadEnabled (shouldOffload);
+}
+
+void LooperEngine::setTrackRenderedLoopCache (int trackIndex, bool shouldCache)
+{
+    auto* track = armTrack (trackIndex);
+    if (track) track->setRenderedLoopCacheEnabled (shouldCache);
+}
+
 void LooperEngine::redo (int trackIndex)
 {
     PERFETTO_FUNCTION();
@@ -305,8 +481,7 @@ void LooperEngine::redo (int trackIndex)
     if (! StateConfig::allowsUndo (currentState)) return;
 
     auto* track = getTrackByIndex (trackIndex);
-
-    track->redo();
+    if (track) track->redo();
 }
 
 void LooperEngine::clear (int trackIndex)
@@ -315,7 +490,9 @@ void LooperEngine::clear (int trackIndex)
     if (trackIndex < 0 || trackIndex >= numTracks) trackIndex = activeTrackIndex;
 
     auto* track = getTrackByIndex (trackIndex);
+    if (! track) return;
 
+    audioFileLoader.discard (trackIndex);
     track->clear();
 
     if (trackIndex == syncMasterTrackIndex)
@@ -326,7 +503,7 @@ void LooperEngine::clear (int trackIndex)
         for (int i = 0; i < numTracks; ++i)
         {
             auto* t = getTrackByIndex (i);
-            if (t && t->isSynced() && t->getTrackLengthSamples() > syncMasterLength)
+            if (t && t->isSynced() && ! t->isStreaming() && t->getTrackLengthSamples() > syncMasterLength)
             {
                 syncMasterLength = t->getTrackLengthSamples();
                 syncMasterTrackIndex = i;
@@ -340,6 +517,7 @@ void LooperEngine::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuf
 {
     performanceMonitor.startBlock();
     PERFETTO_FUNCTION();
+    const LoopBlockPool::ScopedRealtimeThread realtimeThread;
 
     handleMidiCommand (midiMessages, activeTrackIndex);
 
@@ -351,13 +529,15 @@ void LooperEngine::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuf
     auto* activeTrack = getActiveTrack();
     if (! activeTrack) return;
 
+    processLoadedFiles();
     processPendingActions();
 
     auto ctx = createStateContext (buffer);
     stateMachine.processAudio (currentState, ctx);
     automationEngine->processBlock (buffer.getNumSamples());
-    for (int i = 0; i < NUM_TRACKS; ++i)
+    for (int n = 0; n < numArmedTracks; ++n)
     {
+        const int i = armedTracks[(size_t) n];
         if (ctx.hasWrappedAround.at ((size_t) i))
         {
             automationEngine->applyAtLoopIndex (i, loopCounts[(size_t) i]);
@@ -367,6 +547,19 @@ void LooperEngine::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuf
         }
     }
 
+    size_t undoCompressedBytes = 0, undoUncompressedBytes = 0, undoSpilledBytes = 0;
+    for (int n = 0; n < numArmedTracks; ++n)
+    {
+        auto& track = loopTracks[(size_t) armedTracks[(size_t) n]];
+        track->processLayerFinalization();
+        track->processUndoCompression (StateConfig::allowsUndo (currentState));
+        undoCompressedBytes += track->getUndoCompressedBytes();
+        undoUncompressedBytes += track->getUndoUncompressedBytes();
+        undoSpilledBytes += track->getUndoSpilledBytes();
+    }
+    performanceMonitor.updateUndoCompression (undoUncompressedBytes, undoCompressedBytes, undoSpilledBytes);
+    performanceMonitor.updateLoopArena (loopArena.getResidentBytes(), loopArena.getBudgetBytes());
+
     granularFreeze->processBlock (buffer);
     if (metronome->isEnabled()) metronome->processBlock (buffer);
 
@@ -390,17 +583,52 @@ void LooperEngine::processCommandsFromMessageBus()
 {
     PERFETTO_FUNCTION();
 
+    // Commands held back last block go first, and stay in order behind any that still have to wait
+    int heldBack = 0;
+    for (int n = 0; n < numDeferredCommands; ++n)
+    {
+        auto& cmd = deferredCommands[(size_t) n];
+        if (! mustWaitForTrack (cmd.trackIndex, heldBack))
+            dispatchCommand (cmd);
+        else if (heldBack++ != n)
+            deferredCommands[(size_t) heldBack - 1] = std::move (cmd);
+    }
+    numDeferredCommands = heldBack;
+
+    // Once the held-back queue is full, the rest stay on the bus for a later block rather than overtake it
     EngineMessageBus::Command cmd;
-    while (messageBus->popCommand (cmd))
+    while (numDeferredCommands < DEFERRED_COMMANDS_CAPACITY && messageBus->popCommand (cmd))
     {
-        auto it = commandHandlers.find (cmd.type);
-        if (it != commandHandlers.end())
-        {
-            it->second (cmd);
-        }
+        if (mustWaitForTrack (cmd.trackIndex, numDeferredCommands))
+            deferredCommands[(size_t) numDeferredCommands++] = std::move (cmd);
+        else
+            dispatchCommand (cmd);
     }
 }
 
+void LooperEngine::dispatchCommand (const EngineMessageBus::Command& cmd)
+{
+    auto it = commandHandlers.find (cmd.type);
+    if (it != commandHandlers.end())
+    {
+        it->second (cmd);
+    }
+}
+
+// A command for an empty slot waits while no prepared track is ready, and so does any later one for the same slot
+bool LooperEngine::mustWaitForTrack (const int trackIndex, const int numCommandsHeldBack) const
+{
+    if (trackIndex < 0 || trackIndex >= numTracks) return false;
+
+    for (int n = 0; n < numCommandsHeldBack; ++n)
+        if (deferredCommands[(size_t) n].trackIndex == trackIndex) return true;
+
+    if (loopTracks[(size_t) trackIndex] != nullptr) return false;
+    for (auto& spare : spareTracks)
+        if (spare.load (std::memory_order_relaxed) != nullptr) return false;
+    return true;
+}
+
 void LooperEngine::setPendingAction (PendingAction::Type type, int trackIndex, bool waitForWrap, LooperState currentLooperState)
 {
     pendingAction.type = type;
@@ -458,7 +686,7 @@ void LooperEngine::setExistingGainForTrack (int trackIndex, double oldGain)
 {
     PERFETTO_FUNCTION();
     if (trackIndex < 0 || trackIndex >= numTracks) trackIndex = activeTrackIndex;
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setOverdubGainOld (oldGain);
@@ -471,7 +699,7 @@ void LooperEngine::setNewOverdubGainForTrack (int trackIndex, double newGain)
 {
     PERFETTO_FUNCTION();
     if (trackIndex < 0 || trackIndex >= numTracks) trackIndex = activeTrackIndex;
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setOverdubGainNew (newGain);
@@ -481,53 +709,58 @@ void LooperEngine::setNewOverdubGainForTrack (int trackIndex, double newGain)
     }
 }
 
-void LooperEngine::loadBackingTrackToTrack (const juce::AudioBuffer<float>& backingTrack, int trackIndex, double backingTrackSampleRate)
+void LooperEngine::loadWaveFileToTrack (const juce::File& audioFile, int trackIndex)
 {
     PERFETTO_FUNCTION();
     if (trackIndex < 0 || trackIndex >= numTracks) trackIndex = activeTrackIndex;
-    selectTrack (trackIndex);
-    auto* track = getTrackByIndex (trackIndex);
-    if (track)
-    {
-        track->loadBackingTrack (backingTrack, backingTrack.getNumSamples(), backingTrackSampleRate);
+    auto* track = armTrack (trackIndex);
+    if (! track) return;
 
-        play();
-    }
+    // Only apply sync logic in multitrack mode: a synced track follows the master loop once there is one
+    const bool followsMaster = ! singlePlayMode.load() && track->isSynced() && syncMasterLength > 0;
+    audioFileLoader.post (trackIndex, audioFile, followsMaster ? syncMasterLength : 0);
 }
 
-void LooperEngine::loadWaveFileToTrack (const juce::File& audioFile, int trackIndex)
+void LooperEngine::processLoadedFiles()
 {
     PERFETTO_FUNCTION();
-    juce::AudioFormatManager formatManager;
-    formatManager.registerBasicFormats();
-    std::unique_ptr<juce::AudioFormatReader> reader (formatManager.createReaderFor (audioFile));
-    if (reader)
+    // Selecting a loaded track would cancel a take in progress, so finished layers wait for it to end
+    if (StateConfig::isRecording (currentState)) return;
+
+    for (int n = 0; n < numArmedTracks; ++n)
     {
-        juce::AudioBuffer<float> backingTrack ((int) reader->numChannels, (int) reader->lengthInSamples);
-        auto track = getTrackByIndex (trackIndex);
+        const int i = armedTracks[(size_t) n];
+        auto* track = loopTracks[(size_t) i].get();
+
+        int loadedLength = 0;
+        if (! audioFileLoader.collect (i,
+                                       [track, &loadedLength] (std::unique_ptr<ChunkedLoopBuffer>& layer,
+                                                               const int length,
+                                                               BackingTrackStream* stream)
+                                       {
+                                           if (stream != nullptr)
+                                               track->loadStream (*stream);
+                                           else
+                                               track->loadLayer (layer, length);
+                                           loadedLength = track->getTrackLengthSamples();
+                                       }))
+            continue;
 
-        // Only apply sync logic in multitrack mode
-        if (! singlePlayMode.load() && track && track->isSynced())
+        // A streamed file is far longer than any loop, so it never sets the length the others sync to
+        if (! singlePlayMode.load() && track->isSynced() && ! track->isStreaming() && syncMasterLength == 0)
         {
-            if (syncMasterLength > 0)
-            {
-                backingTrack.setSize ((int) reader->numChannels, syncMasterLength, true, true, true);
-            }
-            else
-            {
-                syncMasterLength = reader->lengthInSamples;
-                syncMasterTrackIndex = trackIndex;
-            }
+            syncMasterLength = loadedLength;
+            syncMasterTrackIndex = i;
         }
 
-        reader->read (&backingTrack, 0, backingTrack.getNumSamples(), 0, true, true);
-        loadBackingTrackToTrack (backingTrack, trackIndex, reader->sampleRate);
+        selectTrack (i);
+        play();
     }
 }
 
 void LooperEngine::setTrackPlaybackSpeed (int trackIndex, float speed)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setPlaybackSpeed (speed);
@@ -537,7 +770,7 @@ void LooperEngine::setTrackPlaybackSpeed (int trackIndex, float speed)
 
 void LooperEngine::setTrackPlaybackDirectionForward (int trackIndex)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setPlaybackDirectionForward();
@@ -547,7 +780,7 @@ void LooperEngine::setTrackPlaybackDirectionForward (int trackIndex)
 
 void LooperEngine::setTrackPlaybackDirectionBackward (int trackIndex)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setPlaybackDirectionBackward();
@@ -569,7 +802,7 @@ bool LooperEngine::isTrackPlaybackForward (int trackIndex) const
 
 void LooperEngine::setTrackVolume (int trackIndex, float volume)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setTrackVolume (volume);
@@ -579,7 +812,7 @@ void LooperEngine::setTrackVolume (int trackIndex, float volume)
 
 void LooperEngine::setTrackMuted (int trackIndex, bool muted)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setMuted (muted);
@@ -591,27 +824,31 @@ void LooperEngine::setTrackSoloed (int trackIndex, bool soloed)
 {
     PERFETTO_FUNCTION();
 
+    armTrack (trackIndex);
+
+    // Empty slots are reported too; armTrack mutes them on arrival while a solo is active
     for (size_t i = 0; i < (size_t) numTracks; ++i)
     {
-        if ((int) i == trackIndex)
+        auto* track = loopTracks[i].get();
+        if (track && (int) i == trackIndex)
         {
-            loopTracks[i]->setSoloed (soloed);
+            track->setSoloed (soloed);
         }
-        else if (soloed)
+        else if (track && soloed)
         {
-            loopTracks[i]->setMuted (true);
+            track->setMuted (true);
         }
-        else
+        else if (track)
         {
-            loopTracks[i]->setSoloed (false);
-            loopTracks[i]->setMuted (false);
+            track->setSoloed (false);
+            track->setMuted (false);
         }
         messageBus->broadcastEvent (EngineMessageBus::Event (EngineMessageBus::EventType::TrackSoloChanged,
                                                              (int) i,
-                                                             loopTracks[i]->isSoloed()));
+                                                             track ? track->isSoloed() : false));
         messageBus->broadcastEvent (EngineMessageBus::Event (EngineMessageBus::EventType::TrackMuteChanged,
                                                              (int) i,
-                                                             loopTracks[i]->isMuted()));
+                                                             track ? track->isMuted() : soloed));
     }
 }
 
@@ -629,7 +866,7 @@ bool LooperEngine::isTrackMuted (int trackIndex) const
 
 void LooperEngine::setKeepPitchWhenChangingSpeed (int trackIndex, bool shouldKeepPitch)
 {
-    auto* track = getTrackByIndex (trackIndex);
+    auto* track = armTrack (trackIndex);
     if (track)
     {
         track->setKeepPitchWhenChangingSpeed (shouldKeepPitch);
@@ -836,7 +1073,7 @@ void LooperEngine::setPlayheadPosition (int trackIndex, int positionSamples)
     PERFETTO_FUNCTION();
 
     auto* sourceTrack = getTrackByIndex (trackIndex);
-    if (sourceTrack->getTrackLengthSamples() == 0) return;
+    if (! sourceTrack || sourceTrack->getTrackLengthSamples() == 0) return;
 
     sourceTrack->setReadPosition (positionSamples);
 
@@ -849,7 +1086,7 @@ void LooperEngine::setPlayheadPosition (int trackIndex, int positionSamples)
         if (i == trackIndex) continue;
 
         auto* targetTrack = getTrackByIndex (i);
-        if (! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
+        if (! targetTrack || ! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
 
         int newPos = positionSamples % targetTrack->getTrackLengthSamples();
         targetTrack->setReadPosition (newPos);
@@ -861,7 +1098,7 @@ void LooperEngine::setLoopRegion (int trackIndex, int startSample, int endSample
     PERFETTO_FUNCTION();
 
     auto* sourceTrack = getTrackByIndex (trackIndex);
-    if (sourceTrack->getTrackLengthSamples() == 0) return;
+    if (! sourceTrack || sourceTrack->getTrackLengthSamples() == 0) return;
 
     sourceTrack->setLoopRegion (startSample, endSample);
 
@@ -874,7 +1111,7 @@ void LooperEngine::setLoopRegion (int trackIndex, int startSample, int endSample
         if (i == trackIndex) continue;
 
         auto* targetTrack = getTrackByIndex (i);
-        if (! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
+        if (! targetTrack || ! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
 
         targetTrack->setLoopRegion (startSample, endSample);
     }
@@ -885,7 +1122,7 @@ void LooperEngine::clearLoopRegion (int trackIndex)
     PERFETTO_FUNCTION();
 
     auto* sourceTrack = getTrackByIndex (trackIndex);
-    if (sourceTrack->getTrackLengthSamples() == 0) return;
+    if (! sourceTrack || sourceTrack->getTrackLengthSamples() == 0) return;
 
     sourceTrack->clearLoopRegion();
 
@@ -898,7 +1135,7 @@ void LooperEngine::clearLoopRegion (int trackIndex)
         if (i == trackIndex) continue;
 
         auto* targetTrack = getTrackByIndex (i);
-        if (! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
+        if (! targetTrack || ! targetTrack->isSynced() || targetTrack->getTrackLengthSamples() == 0) continue;
 
         targetTrack->clearLoopRegion();
     }
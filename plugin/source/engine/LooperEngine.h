@@ -2,6 +2,7 @@
 
 #include "audio/EngineCommandBus.h"
 #include "audio/EngineStateToUIBridge.h"
+#include "engine/AudioFileLoader.h"
 #include "engine/AutomationEngine.h"
 #include "engine/Constants.h"
 #include "engine/GranularFreeze.h"
@@ -12,7 +13,11 @@
 #include "engine/Metronome.h"
 #include "engine/MidiCommandConfig.h"
 #include "engine/PerformanceMonitor.h"
+#include "engine/StretchPipeline.h"
+#include "engine/TrackRenderPool.h"
 #include <JuceHeader.h>
+#include <atomic>
+#include <thread>
 
 struct PendingAction
 {
@@ -45,7 +50,8 @@ public:
     LooperEngine();
     ~LooperEngine();
 
-    void prepareToPlay (double sampleRate, int maxBlockSize, int numChannels);
+    // numTracksToUse is clamped to 1..MAX_TRACKS; only track 0 is built up front, the rest when first armed
+    void prepareToPlay (double sampleRate, int maxBlockSize, int numChannels, int numTracksToUse = NUM_TRACKS);
     void releaseResources();
 
     void selectTrack (int trackIndex);
@@ -55,7 +61,13 @@ public:
 
     int getNumTracks() const { return numTracks; }
 
+    // Null until the track is armed by selecting, recording or configuring it
     LoopTrack* getTrackByIndex (int trackIndex) const;
+    // Stays valid for the engine's lifetime, so the UI can bind to a track that has not been armed yet
+    AudioToUIBridge* getTrackUIBridge (int trackIndex) const;
+    int getNumArmedTracks() const { return numArmedTracks; }
+    // Times a slot could not be armed because no prepared track was ready; its commands waited a block
+    int getNumDeferredTrackArms() const { return deferredTrackArms.load (std::memory_order_relaxed); }
 
     void processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages);
 
@@ -76,6 +88,13 @@ public:
 
     void setTrackVolume (int trackIndex, float volume);
     void setTrackPitch (int trackIndex, float pitch);
+    // Tape-style speed changes for tracks without pitch lock; off sends them through SoundTouch instead
+    void setTrackNativeVarispeed (int trackIndex, bool shouldUseNativeVarispeed);
+    // Which stretcher a track uses for pitch lock and pitch shifts, and how hard the in-house one works
+    void setTrackTimeStretchBackend (int trackIndex, TimeStretchBackend backend);
+    void setTrackStretchQuality (int trackIndex, StretchQuality quality);
+    void setTrackStretchOffload (int trackIndex, bool shouldOffload);
+    void setTrackRenderedLoopCache (int trackIndex, bool shouldCache);
     void setMetronomeVolume (float volume);
 
     EngineStateToUIBridge* getEngineStateBridge() const { return engineStateBridge.get(); }
@@ -97,6 +116,13 @@ public:
     int getActiveTrackIndex() const { return activeTrackIndex; }
 
     PerformanceMonitor* getPerformanceMonitor() { return &performanceMonitor; }
+    const LoopBlockPool& getLoopArena() const { return loopArena; }
+
+    // Storage format of every track's loop audio. Takes effect at the next prepareToPlay, which
+    // rebuilds the arena and so discards what was recorded in the previous format.
+    void setLoopSampleFormat (LoopSampleFormat format) { loopSampleFormat = format; }
+    LoopSampleFormat getLoopSampleFormat() const { return loopSampleFormat; }
+    const ScratchBufferPool& getScratchPool() const { return scratchPool; }
     AutomationEngine* getAutomationEngine() const { return automationEngine.get(); }
 
 private:
@@ -109,7 +135,7 @@ private:
     std::unique_ptr<EngineMessageBus> messageBus = std::make_unique<EngineMessageBus>();
     std::unique_ptr<Metronome> metronome = std::make_unique<Metronome>();
     std::unique_ptr<GranularFreeze> granularFreeze = std::make_unique<GranularFreeze>();
-    std::array<int, NUM_TRACKS> loopCounts = { 0 };
+    std::array<int, MAX_TRACKS> loopCounts = { 0 };
 
     std::unique_ptr<LevelMeter> inputMeter = std::make_unique<LevelMeter>();
     std::unique_ptr<LevelMeter> outputMeter = std::make_unique<LevelMeter>();
@@ -133,9 +159,44 @@ private:
     int syncMasterLength = 0;
     int syncMasterTrackIndex = DEFAULT_ACTIVE_TRACK_INDEX;
 
-    std::array<std::unique_ptr<LoopTrack>, NUM_TRACKS> loopTracks;
-    std::array<bool, NUM_TRACKS> tracksToPlay;
-    std::array<bool, NUM_TRACKS> hasWrappedAround;
+    // Loop audio and working buffers of every track are drawn from here; declared before the tracks so they outlive them
+    LoopBlockPool loopArena;
+    LoopSampleFormat loopSampleFormat = LoopSampleFormat::Float32;
+    ScratchBufferPool scratchPool;
+
+    // Renders the playing tracks of a block in parallel; stopped before the tracks are released
+    TrackRenderPool renderPool;
+
+    // Runs offloaded stretchers ahead of the audio thread; declared before the tracks, whose pipelines register with it
+    StretchOffloadWorker stretchOffloadWorker;
+
+    // Decodes dropped files into layers for the tracks, one slot per track; its staging buffers draw from the arena
+    AudioFileLoader audioFileLoader;
+
+    // One bridge per slot, created at prepareToPlay; spares report to their own until they are armed
+    std::array<std::unique_ptr<AudioToUIBridge>, MAX_TRACKS> trackBridges;
+    std::unique_ptr<AudioToUIBridge> spareTrackBridge = std::make_unique<AudioToUIBridge>();
+
+    // Slots stay empty until armed; the per-block loops only visit armedTracks, kept in ascending order
+    std::array<std::unique_ptr<LoopTrack>, MAX_TRACKS> loopTracks;
+    std::array<int, MAX_TRACKS> armedTracks = { 0 };
+    int numArmedTracks = 0;
+    std::array<int, MAX_TRACKS> tracksToPlay = { 0 };
+    int numTracksToPlay = 0;
+    std::array<bool, MAX_TRACKS> hasWrappedAround = { false };
+
+    // Prepared tracks waiting to be armed, so the audio thread never builds one itself. The preparer
+    // thread keeps spareTracksWanted of them ready and builds a replacement whenever one is taken.
+    std::array<std::atomic<LoopTrack*>, SPARE_TRACKS> spareTracks {};
+    std::atomic<int> spareTracksWanted { 0 };
+    std::atomic<int> deferredTrackArms { 0 };
+    juce::WaitableEvent preparerSignal;
+    std::atomic<bool> shouldStopPreparer { false };
+    std::thread preparerThread;
+
+    // Commands for a slot that had no prepared track yet, retried in order at the start of the next block
+    std::array<EngineMessageBus::Command, DEFERRED_COMMANDS_CAPACITY> deferredCommands;
+    int numDeferredCommands = 0;
 
     // Helper methods
     LooperState determineStateAfterRecording() const;
@@ -150,8 +211,16 @@ private:
     void processPendingActions();
     void setupMidiCommands();
     void processCommandsFromMessageBus();
-
-    void addTrack (int index);
+    void dispatchCommand (const EngineMessageBus::Command& cmd);
+    bool mustWaitForTrack (int trackIndex, int numCommandsHeldBack) const;
+
+    LoopTrack* armTrack (int trackIndex);
+    std::unique_ptr<LoopTrack> createPreparedTrack();
+    LoopTrack* takeSpareTrack();
+    void fillSpareTracks();
+    void startTrackPreparer();
+    void stopTrackPreparer();
+    void releaseTracks();
     LoopTrack* getActiveTrack() const;
     void record();
     void play();
@@ -163,8 +232,8 @@ private:
     void setNewOverdubGainForTrack (int trackIndex, double newGain);
     void setExistingGainForTrack (int trackIndex, double oldGain);
 
-    void loadBackingTrackToTrack (const juce::AudioBuffer<float>& backingTrack, int trackIndex, double backingTrackSampleRate);
     void loadWaveFileToTrack (const juce::File& audioFile, int trackIndex);
+    void processLoadedFiles();
     void setTrackPlaybackDirectionForward (int trackIndex);
     void setTrackPlaybackDirectionBackward (int trackIndex);
     float getTrackPlaybackSpeed (int trackIndex) const;
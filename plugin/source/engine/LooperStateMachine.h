@@ -2,6 +2,7 @@
 #include "LooperStateConfig.h"
 #include "engine/Constants.h"
 #include "engine/LoopTrack.h"
+#include "engine/TrackRenderPool.h"
 #include <JuceHeader.h>
 #include <array>
 
@@ -19,9 +20,11 @@ struct StateContext
     bool isSinglePlayMode;
     int syncMasterLength;
     int syncMasterTrackIndex;
-    std::array<std::unique_ptr<LoopTrack>, NUM_TRACKS>* allTracks;
-    std::array<bool, NUM_TRACKS>* tracksToPlay;
-    std::array<bool, NUM_TRACKS> hasWrappedAround;
+    std::array<std::unique_ptr<LoopTrack>, MAX_TRACKS>* allTracks;
+    const std::array<int, MAX_TRACKS>* tracksToPlay; // indices of the tracks that play this block
+    int numTracksToPlay;
+    std::array<bool, MAX_TRACKS> hasWrappedAround;
+    TrackRenderPool* renderPool = nullptr; // renders the playing tracks in parallel; null renders them in turn
 };
 
 // Function pointer types for state actions
@@ -51,17 +54,36 @@ inline void stoppedOnEnter (StateContext&) {}
 inline void stoppedOnExit (StateContext&) {}
 
 // Playing state
+struct TrackRenderBatch
+{
+    StateContext& ctx;
+    const LooperState& currentState;
+};
+
+// Render pool task: each task touches only its own track, stem and wrap flag
+inline void renderTrackStem (void* context, const int n)
+{
+    // Render workers stand in for the audio thread, so they are held to its rules on the block pool
+    const LoopBlockPool::ScopedRealtimeThread realtimeThread;
+    auto& batch = *static_cast<TrackRenderBatch*> (context);
+    const auto i = (size_t) batch.ctx.tracksToPlay->at ((size_t) n);
+    batch.ctx.hasWrappedAround.at (i) = batch.ctx.allTracks->at (i)->renderStem (batch.ctx.numSamples, false, batch.currentState);
+}
+
 inline void playingProcessAudio (StateContext& ctx, const LooperState& currentState)
 {
     if (ctx.outputBuffer)
     {
-        for (int i = 0; i < NUM_TRACKS; ++i)
-        {
-            if (! ctx.tracksToPlay->at ((size_t) i)) continue;
-            bool hasWrappedAround = ctx.allTracks->at ((size_t) i)
-                                        ->processPlayback (*ctx.outputBuffer, ctx.numSamples, false, currentState);
-            ctx.hasWrappedAround.at ((size_t) i) = hasWrappedAround;
-        }
+        TrackRenderBatch batch { ctx, currentState };
+        if (ctx.renderPool != nullptr && ctx.numSamples >= PARALLEL_RENDER_MIN_BLOCK_SAMPLES)
+            ctx.renderPool->run (renderTrackStem, &batch, ctx.numTracksToPlay);
+        else
+            for (int n = 0; n < ctx.numTracksToPlay; ++n)
+                renderTrackStem (&batch, n);
+
+        // Stems are summed in track order whichever thread rendered them, so the mix is the same either way
+        for (int n = 0; n < ctx.numTracksToPlay; ++n)
+            ctx.allTracks->at ((size_t) ctx.tracksToPlay->at ((size_t) n))->mixStemInto (*ctx.outputBuffer, ctx.numSamples);
     }
 }
 inline void playingOnEnter (StateContext&) {}
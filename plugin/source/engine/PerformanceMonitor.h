@@ -72,6 +72,39 @@ public:
     int getBlockSize() const { return blockSize; }
     double getSampleRate() const { return sampleRate; }
 
+    // Undo history held compressed across all tracks; spilledBytes of the compressed bytes live on disk
+    void updateUndoCompression (size_t uncompressedBytes, size_t compressedBytes, size_t spilledBytes)
+    {
+        undoUncompressedBytes.store (uncompressedBytes, std::memory_order_relaxed);
+        undoCompressedBytes.store (compressedBytes, std::memory_order_relaxed);
+        undoSpilledBytes.store (spilledBytes, std::memory_order_relaxed);
+    }
+
+    float getUndoCompressionRatio() const
+    {
+        size_t compressed = undoCompressedBytes.load (std::memory_order_relaxed);
+        return compressed > 0 ? (float) undoUncompressedBytes.load (std::memory_order_relaxed) / (float) compressed : 1.0f;
+    }
+
+    float getUndoMemorySavedMB() const
+    {
+        size_t uncompressed = undoUncompressedBytes.load (std::memory_order_relaxed);
+        size_t inMemory = undoCompressedBytes.load (std::memory_order_relaxed) - undoSpilledBytes.load (std::memory_order_relaxed);
+        return uncompressed > inMemory ? (float) (uncompressed - inMemory) / (1024.0f * 1024.0f) : 0.0f;
+    }
+
+    // Loop audio of all tracks against the engine-wide arena budget
+    void updateLoopArena (size_t residentBytes, size_t budgetBytes)
+    {
+        arenaResidentBytes.store (residentBytes, std::memory_order_relaxed);
+        arenaBudgetBytes.store (budgetBytes, std::memory_order_relaxed);
+    }
+
+    float getLoopArenaResidentMB() const { return (float) arenaResidentBytes.load (std::memory_order_relaxed) / (1024.0f * 1024.0f); }
+    float getLoopArenaBudgetMB() const { return (float) arenaBudgetBytes.load (std::memory_order_relaxed) / (1024.0f * 1024.0f); }
+
+    float getUndoOnDiskMB() const { return (float) undoSpilledBytes.load (std::memory_order_relaxed) / (1024.0f * 1024.0f); }
+
     void resetPeaks()
     {
         peakCpuLoad.store (0.0f, std::memory_order_relaxed);
@@ -109,6 +142,11 @@ private:
     std::atomic<float> peakBlockTimeMs { 0.0f };
     std::atomic<int> xrunCount { 0 };
     std::atomic<int> totalBlocksProcessed { 0 };
+    std::atomic<size_t> undoUncompressedBytes { 0 };
+    std::atomic<size_t> undoCompressedBytes { 0 };
+    std::atomic<size_t> undoSpilledBytes { 0 };
+    std::atomic<size_t> arenaResidentBytes { 0 };
+    std::atomic<size_t> arenaBudgetBytes { 0 };
 
     juce::int64 blockStartTime = 0;
     double expectedBlockTimeMs = 0.0;
@@ -1,81 +1,112 @@
 #pragma once
 
-#include "SoundTouch.h"
 #include "engine/BufferManager.h"
 #include "engine/Constants.h"
+#include "engine/RenderedLoopCache.h"
+#include "engine/ScratchBufferPool.h"
+#include "engine/SoundTouchStretchEngine.h"
+#include "engine/StretchPipeline.h"
+#include "engine/TimeStretchEngine.h"
+#include "engine/VarispeedReader.h"
+#include "engine/WsolaStretchEngine.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
 
+/**
+ * Plays a track's loop at its speed, pitch and direction, through one of three paths: a direct read
+ * at unity, the varispeed reader for tape-style speed changes, or a time-stretcher for pitch-locked
+ * stretching and pitch shifts. The stretcher is SoundTouch or the in-house WSOLA, chosen per track.
+ *
+ * The stretcher only runs while its path is in use. Entering the path primes it with its latency plus
+ * one nominal sequence of source, read ahead of the playhead, so the first stretched sample lines up
+ * with the playhead and the output never runs dry; after that each block feeds exactly the source the
+ * playhead advances by. Leaving the path drops whatever the stretcher still holds. A block that
+ * switches path, or swaps the running stretcher for another backend or quality, crossfades from the
+ * outgoing path to the incoming one.
+ *
+ * With offload on, a running stretcher is handed to a StretchPipeline once it has rendered
+ * STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS blocks ahead, and from then on the audio thread only queues source
+ * and collects output. The source is still read from the same position ahead of the playhead, so the
+ * output lines up with the playhead exactly as inline and nothing is added to the latency. Blocks
+ * that record into the track stretch inline. Each backend is kept twice: taking a stretcher back from
+ * a worker that is mid-job would mean waiting for it, so the engine goes on with the other one of
+ * the pair while the worker finishes and lets go.
+ *
+ * Stretched blocks are also kept in a RenderedLoopCache. Once a whole pass has been stretched under the
+ * same settings, later passes are read from the cache instead, at the cost of a direct read; the switch
+ * to and from the cache crossfades like any other path change.
+ */
 class PlaybackEngine
 {
 public:
     PlaybackEngine() {}
 
-    void prepareToPlay (const double currentSampleRate, const int bufferSize, const int numChannels, const int blockSize)
+    // Time-stretched playback borrows its working buffer from scratch for each block. Every stretcher
+    // is prepared up front so switching backend never allocates on the audio thread.
+    void prepareToPlay (const double currentSampleRate, const int numChannels, const int blockSize, ScratchBufferPool& scratch)
     {
-        interpolationBuffer->setSize ((int) numChannels, (int) bufferSize, false, true, true);
-        soundTouchProcessors.clear();
-        for (int ch = 0; ch < numChannels; ++ch)
-        {
-            soundTouchProcessors.push_back (std::make_unique<soundtouch::SoundTouch>());
-        }
-
-        for (auto& soundTouchProcessor : soundTouchProcessors)
-        {
-            soundTouchProcessor->setSampleRate ((uint) currentSampleRate);
-            soundTouchProcessor->setChannels (1);
-            soundTouchProcessor->setPitchSemiTones (0);
-            soundTouchProcessor->setSetting (SETTING_USE_QUICKSEEK, 0);
-            soundTouchProcessor->setSetting (SETTING_USE_AA_FILTER, 1);
-            soundTouchProcessor->setSetting (SETTING_SEQUENCE_MS, 82);
-            soundTouchProcessor->setSetting (SETTING_SEEKWINDOW_MS, 28);
-            soundTouchProcessor->setSetting (SETTING_OVERLAP_MS, 12);
-        }
-
-        zeroBuffer.resize ((size_t) blockSize);
-        std::fill (zeroBuffer.begin(), zeroBuffer.end(), 0.0f);
+        jassert (numChannels > 0 && numChannels <= MAX_NUM_CHANNELS);
+        scratchPool = &scratch;
+        stretchChannels = juce::jlimit (1, MAX_NUM_CHANNELS, numChannels);
+
+        // The pipeline first, so no worker is still running one of the stretchers
+        stretchPipeline.prepareToPlay (stretchChannels, blockSize);
+        for (auto& stretcher : soundTouchStretchers)
+            stretcher.prepareToPlay (currentSampleRate, stretchChannels, blockSize);
+        for (auto& stretcher : wsolaStretchers)
+            stretcher.prepareToPlay (currentSampleRate, stretchChannels, blockSize);
+        stretchRunning = false;
+        runningStretcher = nullptr;
+        stretchPrepared = true;
+
+        varispeedReader.prepareToPlay (blockSize);
     }
 
+    // Without this the engine stretches every pass; loopCapacity bounds the loops the cache must hold
+    void prepareRenderedLoopCache (LoopBlockPool& blockPool, const int loopCapacity) { renderedLoop.prepareToPlay (blockPool, loopCapacity); }
+
     void releaseResources()
     {
         clear();
-        interpolationBuffer->setSize (0, 0, false, false, true);
-        soundTouchProcessors.clear();
-        zeroBuffer.clear();
+        renderedLoop.releaseResources();
+        scratchPool = nullptr;
+        stretchPipeline.releaseResources();
+        for (auto& stretcher : soundTouchStretchers)
+            stretcher.releaseResources();
+        for (auto& stretcher : wsolaStretchers)
+            stretcher.releaseResources();
+        stretchPrepared = false;
+        varispeedReader.releaseResources();
     }
 
     void clear()
     {
-        interpolationBuffer->clear();
         playbackSpeed = DEFAULT_PLAYBACK_SPEED;
         playheadDirection = DEFAULT_REVERSE_STATE ? -1 : 1;
 
-        for (auto& st : soundTouchProcessors)
-        {
-            st->clear();
-        }
+        stopStretch();
+        renderedLoop.invalidate();
+        renderedLoopStale = false;
+        lastPath = PlaybackPath::None;
     }
 
     float getPlaybackSpeed() const { return playbackSpeed; }
     void setPlaybackSpeed (const float newSpeed)
     {
+        // Scratch buffers hold one block of source at MAX_PLAYBACK_SPEED
         if (newSpeed > 0.0f)
         {
-            playbackSpeed = newSpeed;
+            playbackSpeed = std::min (newSpeed, MAX_PLAYBACK_SPEED);
         }
     }
 
+    // Picked up by the stretcher at the next block
     bool shouldKeepPitchWhenChangingSpeed() const { return keepPitchWhenChangingSpeed; }
-    void setKeepPitchWhenChangingSpeed (const bool shouldKeepPitch)
-    {
-        for (auto& st : soundTouchProcessors)
-        {
-            st->flush();
-            st->clear();
-        }
+    void setKeepPitchWhenChangingSpeed (const bool shouldKeepPitch) { keepPitchWhenChangingSpeed = shouldKeepPitch; }
 
-        keepPitchWhenChangingSpeed = shouldKeepPitch;
-    }
+    // Without pitch lock, speed changes go through the varispeed reader unless this is turned off
+    bool isNativeVarispeedEnabled() const { return nativeVarispeedEnabled; }
+    void setNativeVarispeedEnabled (const bool shouldUseNativeVarispeed) { nativeVarispeedEnabled = shouldUseNativeVarispeed; }
 
     bool isPlaybackDirectionForward() const { return playheadDirection > 0; }
     void setPlaybackDirectionForward()
@@ -92,137 +123,431 @@ public:
     }
     double getPlaybackPitchSemitones() const { return playbackPitchSemitones; }
 
+    // Picked up the next time the stretcher starts; a running one is handed over to the new choice
+    TimeStretchBackend getTimeStretchBackend() const { return stretchBackend; }
+    void setTimeStretchBackend (const TimeStretchBackend newBackend)
+    {
+        stretchConfigChanged = stretchConfigChanged || newBackend != stretchBackend;
+        stretchBackend = newBackend;
+    }
+
+    StretchQuality getStretchQuality() const { return stretchQuality; }
+    void setStretchQuality (const StretchQuality newQuality)
+    {
+        stretchConfigChanged = stretchConfigChanged || newQuality != stretchQuality;
+        stretchQuality = newQuality;
+    }
+
+    // Offload needs a worker; without one the stretcher always runs inline
+    void setStretchOffloadWorker (StretchOffloadWorker* worker) { stretchPipeline.setWorker (worker); }
+    bool isStretchOffloadEnabled() const { return stretchOffloadEnabled; }
+    void setStretchOffloadEnabled (const bool shouldOffload) { stretchOffloadEnabled = shouldOffload; }
+    bool isStretchOffloaded() const { return stretchPipeline.isActive(); }
+    int getStretchOffloadUnderruns() const { return stretchPipeline.getUnderruns(); }
+
+    bool isRenderedLoopCacheEnabled() const { return renderedLoopCacheEnabled; }
+    void setRenderedLoopCacheEnabled (const bool shouldCache)
+    {
+        renderedLoopCacheEnabled = shouldCache;
+        if (! shouldCache) invalidateRenderedLoop();
+    }
+    bool isPlayingRenderedLoop() const { return lastPath == PlaybackPath::Cached; }
+
+    // The last processPlayback added nothing to its output: the loop was silent where the playhead read it
+    bool wasLastBlockSilent() const { return lastBlockSilent; }
+
+    // The loop audio was replaced (undo, redo, a new layer). The cache is dropped after the next block,
+    // which may still fade out of it.
+    void invalidateRenderedLoop() { renderedLoopStale = true; }
+
+    // Set for each block that records into the track: its stretcher runs inline, so it sees the new
+    // audio without lookahead, and nothing is cached from the loop while it changes
+    void setLoopRecordedThisBlock (const bool wasRecorded)
+    {
+        stretchOffloadSuspended = wasRecorded;
+        if (wasRecorded) invalidateRenderedLoop();
+    }
+
+    bool isStretchRunning() const { return stretchRunning; }
+    // Source fed to the stretcher since it was last primed, not counting the priming itself
+    juce::int64 getStretchSourceSamplesFed() const { return stretchSourceSamplesFed; }
+
     bool processPlayback (juce::AudioBuffer<float>& output, BufferManager& audioBufferManager, const int numSamples, const bool isOverdub)
     {
         PERFETTO_FUNCTION();
+        lastBlockSilent = true;
         if (shouldNotPlayback (audioBufferManager.getLength(), numSamples)) return false;
 
-        bool useFastPath = (std::abs (playbackSpeed - 1.0f) < 0.01f && isPlaybackDirectionForward()
-                            && std::abs (playbackPitchSemitones - 0.0) < 0.01);
+        const auto path = choosePath (audioBufferManager);
+        const bool switchingStretcher = path == PlaybackPath::Stretch && stretchRunning && stretchConfigChanged;
+        const bool switchingPath = (lastPath != PlaybackPath::None && lastPath != path) || switchingStretcher;
+        const bool loopFinished = switchingPath ? handOver (path, output, audioBufferManager, numSamples, isOverdub)
+                                                : renderPath (path, output, audioBufferManager, numSamples, isOverdub);
+        lastPath = path;
 
-        bool loopFinished = false;
-        if (useFastPath)
-        {
-            if (! wasUsingFastPath)
-            {
-                for (auto& st : soundTouchProcessors)
-                {
-                    st->setRate (1.0);
-                    st->setTempo (1.0);
-                    st->setPitch (1.0);
-                }
-            }
-
-            int channelsToFeed = std::min ((int) soundTouchProcessors.size(), output.getNumChannels());
-            for (int ch = 0; ch < channelsToFeed; ++ch)
-            {
-                soundTouchProcessors[(size_t) ch]->putSamples (zeroBuffer.data(), (uint) numSamples);
-
-                while (soundTouchProcessors[(size_t) ch]->numSamples() > (uint) (numSamples * 2))
-                {
-                    soundTouchProcessors[(size_t) ch]->receiveSamples (zeroBuffer.data(), (uint) numSamples);
-                }
-            }
-
-            loopFinished = processPlaybackNormalSpeedForward (output, audioBufferManager, numSamples, isOverdub);
-        }
-        else
-        {
-            loopFinished = processPlaybackInterpolatedSpeed (output, audioBufferManager, numSamples, isOverdub);
-        }
+        // Only the paths that read the loop directly know it was silent; the others always count as sound
+        lastBlockSilent = ! switchingPath && (path == PlaybackPath::Direct || path == PlaybackPath::Varispeed)
+                          && audioBufferManager.wasLastReadSilent();
 
-        wasUsingFastPath = useFastPath;
+        dropStaleRenderedLoop();
         return loopFinished;
     }
 
+    // For a block nobody will hear: moves the playhead exactly as processPlayback would, wraps included, without
+    // reading the loop. The stretcher is let go, so the first block heard again primes it afresh from the playhead
+    // and fades in from there; a cached pass that still matches is picked up again as it is.
+    bool advanceInaudibly (BufferManager& audioBufferManager, const int numSamples, const bool isOverdub)
+    {
+        PERFETTO_FUNCTION();
+        lastBlockSilent = true;
+        if (shouldNotPlayback (audioBufferManager.getLength(), numSamples)) return false;
+
+        stopStretch();
+        lastPath = PlaybackPath::None;
+        dropStaleRenderedLoop();
+        return audioBufferManager.advancePlayhead (numSamples, playbackSpeed * (float) playheadDirection, isOverdub);
+    }
+
 private:
-    std::unique_ptr<juce::AudioBuffer<float>> interpolationBuffer = std::make_unique<juce::AudioBuffer<float>>();
-    std::vector<std::unique_ptr<soundtouch::SoundTouch>> soundTouchProcessors;
-    std::vector<float> zeroBuffer;
+    enum class PlaybackPath
+    {
+        None,      // nothing played since the engine was cleared
+        Direct,    // unity speed and pitch, either direction
+        Varispeed, // speed without pitch lock, no pitch shift
+        Stretch,   // everything else, through the chosen time-stretcher
+        Cached     // as Stretch, read back from a pass the stretcher already played
+    };
+
+    ScratchBufferPool* scratchPool = nullptr;
+    std::array<SoundTouchStretchEngine, 2> soundTouchStretchers;
+    std::array<WsolaStretchEngine, 2> wsolaStretchers;
+    size_t stretcherPair = 0; // the other pair may still be with a retiring pipeline
+    TimeStretchEngine* runningStretcher = nullptr;
+    TimeStretchBackend stretchBackend = DEFAULT_TIME_STRETCH_BACKEND;
+    StretchQuality stretchQuality = DEFAULT_STRETCH_QUALITY;
+    bool stretchPrepared = false;
+    bool stretchConfigChanged = false;
+    int stretchChannels = 0;
+    StretchPipeline stretchPipeline; // declared after the stretchers, so it lets go of them first
+    bool stretchOffloadEnabled = DEFAULT_STRETCH_OFFLOAD;
+    bool stretchOffloadSuspended = false;
+    RenderedLoopCache renderedLoop;
+    bool renderedLoopCacheEnabled = DEFAULT_RENDERED_LOOP_CACHE;
+    bool renderedLoopStale = false;
+    VarispeedReader varispeedReader;
 
     bool keepPitchWhenChangingSpeed = DEFAULT_PITCH_LOCK_STATE;
 
-    float previousSpeedMultiplier = 1.0f;
     float playbackSpeed = DEFAULT_PLAYBACK_SPEED;
     double playbackPitchSemitones = DEFAULT_PLAYBACK_PITCH_SEMITONES;
-
-    bool previousKeepPitch = false;
-    bool wasUsingFastPath = true;
+    bool nativeVarispeedEnabled = DEFAULT_NATIVE_VARISPEED;
+    PlaybackPath lastPath = PlaybackPath::None;
+    bool lastBlockSilent = true;
 
     int playheadDirection = DEFAULT_REVERSE_STATE ? -1 : 1;
 
+    // Stretcher lifecycle
+    bool stretchRunning = false;
+    int stretchDirection = 1;
+    int stretchInputPosition = 0;   // next loop sample to feed, ahead of the playhead by the priming
+    double stretchPlayhead = 0.0;   // where the playhead was left; anything else means it was moved
+    double stretchSourceDebt = 0.0; // fraction of a source sample owed to the stretcher
+    juce::int64 stretchSourceSamplesFed = 0;
+    float stretchSpeed = 0.0f;
+    double stretchPitch = 0.0;
+    double stretchTempo = 1.0;
+    double stretchRate = 1.0;
+    bool stretchKeepsPitch = false;
+
     bool shouldNotPlayback (const int trackLength, const int numSamples) const { return trackLength <= 0 || numSamples <= 0; }
 
-    bool processPlaybackInterpolatedSpeed (juce::AudioBuffer<float>& output,
-                                           BufferManager& audioBufferManager,
-                                           const int numSamples,
-                                           const bool isOverdub)
+    void dropStaleRenderedLoop()
+    {
+        if (! renderedLoopStale) return;
+        renderedLoop.invalidate();
+        renderedLoopStale = false;
+    }
+
+    PlaybackPath choosePath (const BufferManager& audioBufferManager) const
+    {
+        const bool noPitchShift = std::abs (playbackPitchSemitones - 0.0) < 0.01;
+
+        // Reverse at unity speed reads the loop back to front directly, so it costs the same as forward
+        if (std::abs (playbackSpeed - 1.0f) < 0.01f && noPitchShift) return PlaybackPath::Direct;
+        if (nativeVarispeedEnabled && ! keepPitchWhenChangingSpeed && noPitchShift) return PlaybackPath::Varispeed;
+        if (renderedLoopCacheEnabled && ! renderedLoopStale && renderedLoop.isReadyFor (getStretchSettings (audioBufferManager)))
+            return PlaybackPath::Cached;
+        return PlaybackPath::Stretch;
+    }
+
+    RenderedLoopCache::Settings getStretchSettings (const BufferManager& audioBufferManager) const
+    {
+        const bool inRegion = audioBufferManager.hasLoopRegion();
+        return { .speed = playbackSpeed,
+                 .pitchSemitones = playbackPitchSemitones,
+                 .keepPitch = keepPitchWhenChangingSpeed,
+                 .direction = playheadDirection,
+                 .backend = stretchBackend,
+                 .quality = stretchQuality,
+                 .wrapStart = inRegion ? audioBufferManager.getLoopRegionStart() : 0,
+                 .wrapLength = inRegion ? audioBufferManager.getLoopRegionEnd() - audioBufferManager.getLoopRegionStart()
+                                        : audioBufferManager.getLength() };
+    }
+
+    bool renderPath (const PlaybackPath path,
+                     juce::AudioBuffer<float>& output,
+                     BufferManager& audioBufferManager,
+                     const int numSamples,
+                     const bool isOverdub)
+    {
+        switch (path)
+        {
+            case PlaybackPath::None:
+                break;
+            case PlaybackPath::Direct:
+                return processPlaybackNormalSpeed (output, audioBufferManager, numSamples, isOverdub);
+            case PlaybackPath::Varispeed:
+                return audioBufferManager.readVarispeed (varispeedReader,
+                                                         output,
+                                                         numSamples,
+                                                         playbackSpeed * (float) playheadDirection,
+                                                         isOverdub);
+            case PlaybackPath::Stretch:
+                return processPlaybackStretched (output, audioBufferManager, numSamples, isOverdub);
+            case PlaybackPath::Cached:
+                renderedLoop.addTo (output, audioBufferManager.getExactReadPosition(), numSamples);
+                return audioBufferManager.advancePlayhead (numSamples, playbackSpeed * (float) playheadDirection, isOverdub);
+        }
+        return false;
+    }
+
+    // Fades the outgoing path out over the block while the incoming one fades in. The outgoing path
+    // renders from the same playhead without moving it; the stretcher gives up its backlog and goes idle.
+    bool handOver (const PlaybackPath path,
+                   juce::AudioBuffer<float>& output,
+                   BufferManager& audioBufferManager,
+                   const int numSamples,
+                   const bool isOverdub)
     {
         PERFETTO_FUNCTION();
 
-        float speedMultiplier = playbackSpeed * (float) playheadDirection;
-        int maxSourceSamples = (int) ((float) numSamples * std::abs (speedMultiplier));
-        int outputOffset = maxSourceSamples + 100;
-        bool speedChanged = std::abs (speedMultiplier - previousSpeedMultiplier) > 0.001f;
-        bool modeChanged = (shouldKeepPitchWhenChangingSpeed() != previousKeepPitch);
-        previousSpeedMultiplier = speedMultiplier;
-        previousKeepPitch = shouldKeepPitchWhenChangingSpeed();
-
-        bool loopFinished = audioBufferManager.linearizeAndReadFromAudioBuffer (*interpolationBuffer,
-                                                                                maxSourceSamples,
-                                                                                numSamples,
-                                                                                speedMultiplier,
-                                                                                isOverdub);
-
-        int channelsToProcess = (int) std::min ({ output.getNumChannels(),
-                                                  audioBufferManager.getNumChannels(),
-                                                  interpolationBuffer->getNumChannels(),
-                                                  (int) soundTouchProcessors.size() });
-
-        for (int ch = 0; ch < channelsToProcess; ++ch)
+        auto handover = scratchPool != nullptr ? scratchPool->borrow() : ScratchBufferPool::ScopedBuffer();
+        if (! handover || handover->getNumSamples() < numSamples)
         {
-            auto& st = soundTouchProcessors[(size_t) ch];
-
-            st->setPitchSemiTones (playbackPitchSemitones);
-            if (speedChanged || modeChanged)
-            {
-                if (shouldKeepPitchWhenChangingSpeed())
-                {
-                    st->setRate (1.0);            // Reset rate to neutral
-                    st->setTempo (playbackSpeed); // Control speed via tempo
-                }
-                else
-                {
-                    st->setTempo (1.0);          // Reset tempo to neutral
-                    st->setRate (playbackSpeed); // Control speed via rate
-                }
-            }
-
-            st->putSamples (interpolationBuffer->getReadPointer (ch), (uint) maxSourceSamples);
-            while (st->numSamples() < (uint) numSamples)
-            {
-                st->putSamples (interpolationBuffer->getReadPointer (ch), (uint) maxSourceSamples);
-            }
-
-            uint received = st->receiveSamples (interpolationBuffer->getWritePointer (ch) + outputOffset, (uint) numSamples);
-
-            if (received < (uint) numSamples)
-                juce::FloatVectorOperations::clear (interpolationBuffer->getWritePointer (ch) + outputOffset + received,
-                                                    (int) ((uint) numSamples - received));
-
-            output.addFrom (ch, 0, *interpolationBuffer, ch, outputOffset, (int) numSamples);
+            jassertfalse; // block larger than announced in prepareToPlay, or every scratch buffer is out
+            stopStretch();
+            return renderPath (path, output, audioBufferManager, numSamples, isOverdub);
         }
+
+        const int channels = std::min (output.getNumChannels(), handover->getNumChannels());
+
+        handover->clear (0, numSamples);
+        switch (lastPath)
+        {
+            case PlaybackPath::None:
+                break;
+            case PlaybackPath::Direct:
+                audioBufferManager.readAt (BufferKernels::Add {},
+                                           *handover,
+                                           audioBufferManager.getReadPosition(),
+                                           numSamples,
+                                           playheadDirection);
+                break;
+            case PlaybackPath::Varispeed:
+                audioBufferManager.renderVarispeed (varispeedReader,
+                                                    *handover,
+                                                    audioBufferManager.getExactReadPosition(),
+                                                    numSamples,
+                                                    playbackSpeed * (float) playheadDirection);
+                break;
+            case PlaybackPath::Stretch:
+                if (stretchPipeline.isActive())
+                    stretchPipeline.popOutput (*handover, numSamples);
+                else if (stretchRunning)
+                    runningStretcher->addReceived (*handover, numSamples);
+                stopStretch();
+                break;
+            case PlaybackPath::Cached:
+                if (renderedLoop.isReady()) renderedLoop.addTo (*handover, audioBufferManager.getExactReadPosition(), numSamples);
+                break;
+        }
+        for (int ch = 0; ch < channels; ++ch)
+            output.addFromWithRamp (ch, 0, handover->getReadPointer (ch), numSamples, 1.0f, 0.0f);
+
+        handover->clear (0, numSamples);
+        const bool loopFinished = renderPath (path, *handover, audioBufferManager, numSamples, isOverdub);
+        for (int ch = 0; ch < channels; ++ch)
+            output.addFromWithRamp (ch, 0, handover->getReadPointer (ch), numSamples, 0.0f, 1.0f);
+
         return loopFinished;
     }
 
-    bool processPlaybackNormalSpeedForward (juce::AudioBuffer<float>& output,
-                                            BufferManager& audioBufferManager,
-                                            const int numSamples,
-                                            const bool isOverdub)
+    bool processPlaybackStretched (juce::AudioBuffer<float>& output,
+                                   BufferManager& audioBufferManager,
+                                   const int numSamples,
+                                   const bool isOverdub)
+    {
+        PERFETTO_FUNCTION();
+
+        auto sourceBuffer = scratchPool != nullptr ? scratchPool->borrow() : ScratchBufferPool::ScopedBuffer();
+        if (! stretchPrepared || ! sourceBuffer || sourceBuffer->getNumChannels() < stretchChannels)
+        {
+            jassertfalse; // not prepared, or every scratch buffer is out
+            return false;
+        }
+
+        // Recording into the track takes the stretcher back inline, from a fresh lookahead
+        const bool offloadAllowed = stretchOffloadEnabled && ! stretchOffloadSuspended && stretchPipeline.hasWorker();
+        if (stretchPipeline.isActive() && ! offloadAllowed) stopStretch();
+
+        // A playhead moved from outside (sync, seek, loop region) or a new direction needs a fresh lookahead
+        const bool playheadMoved = std::abs (audioBufferManager.getExactReadPosition() - stretchPlayhead) > 0.5;
+        if (! stretchRunning || playheadMoved || playheadDirection != stretchDirection)
+            startStretch (*sourceBuffer, audioBufferManager);
+        else if (std::abs (playbackSpeed - stretchSpeed) > 0.001f || std::abs (playbackPitchSemitones - stretchPitch) > 0.001
+                 || keepPitchWhenChangingSpeed != stretchKeepsPitch)
+            applyStretchSettings();
+
+        // Until a pass is cached, the block is rendered on its own so it can be kept as well as played
+        const auto settings = getStretchSettings (audioBufferManager);
+        const bool capturing = renderedLoopCacheEnabled && ! renderedLoopStale && renderedLoop.isPrepared() && ! renderedLoop.isReadyFor (settings);
+        auto captureBuffer = capturing ? scratchPool->borrow() : ScratchBufferPool::ScopedBuffer();
+        auto& stretched = captureBuffer ? *captureBuffer : output;
+        if (captureBuffer) captureBuffer->clear (0, numSamples);
+        const double playheadBefore = audioBufferManager.getExactReadPosition();
+
+        const float speedMultiplier = playbackSpeed * (float) playheadDirection;
+        stretchSourceDebt += (double) playbackSpeed * numSamples;
+        const int sourceSamples = (int) stretchSourceDebt;
+        stretchSourceDebt -= sourceSamples;
+
+        // An offloaded block the queue has no room for restarts the stretcher inline
+        if (stretchPipeline.isActive() && ! renderOffloaded (stretched, audioBufferManager, sourceSamples, numSamples))
+        {
+            stopStretch();
+            startStretch (*sourceBuffer, audioBufferManager);
+        }
+        if (! stretchPipeline.isActive())
+        {
+            feedStretch (*sourceBuffer, audioBufferManager, sourceSamples);
+            runningStretcher->addReceived (stretched, numSamples);
+            if (offloadAllowed && ! stretchPipeline.isRetiring()) startOffload (*sourceBuffer, audioBufferManager, numSamples);
+        }
+        stretchSourceSamplesFed += sourceSamples;
+
+        if (captureBuffer)
+        {
+            renderedLoop.capture (settings, playheadBefore, *captureBuffer, numSamples);
+            for (int ch = 0; ch < std::min (output.getNumChannels(), captureBuffer->getNumChannels()); ++ch)
+                output.addFrom (ch, 0, *captureBuffer, ch, 0, numSamples);
+        }
+
+        const bool loopFinished = audioBufferManager.advancePlayhead (numSamples, speedMultiplier, isOverdub);
+        stretchPlayhead = audioBufferManager.getExactReadPosition();
+        return loopFinished;
+    }
+
+    void startStretch (juce::AudioBuffer<float>& sourceBuffer, BufferManager& audioBufferManager)
+    {
+        PERFETTO_FUNCTION();
+        takeBackStretcher();
+        wsolaStretchers[stretcherPair].setQuality (stretchQuality);
+        runningStretcher = stretchBackend == TimeStretchBackend::Wsola ? static_cast<TimeStretchEngine*> (&wsolaStretchers[stretcherPair])
+                                                                       : static_cast<TimeStretchEngine*> (&soundTouchStretchers[stretcherPair]);
+        runningStretcher->reset();
+        stretchConfigChanged = false;
+        applyStretchSettings();
+
+        stretchDirection = playheadDirection;
+        stretchInputPosition = audioBufferManager.getReadPosition();
+        stretchSourceDebt = 0.0;
+        stretchSourceSamplesFed = 0;
+        renderedLoop.restartPass();
+
+        feedStretch (sourceBuffer, audioBufferManager, runningStretcher->getPrimingSamples());
+        stretchRunning = true;
+    }
+
+    void stopStretch()
+    {
+        if (takeBackStretcher() && stretchRunning) runningStretcher->reset();
+        stretchRunning = false;
+    }
+
+    // False when the pipeline is still retiring with the running stretcher; the engine then moves to the other
+    // pair, which the worker let go of before it could be handed the running one
+    bool takeBackStretcher()
+    {
+        if (! stretchPipeline.isActive()) return true;
+        stretchPipeline.deactivate();
+        if (! stretchPipeline.isRetiring()) return true;
+        stretcherPair = 1 - stretcherPair;
+        return false;
+    }
+
+    void applyStretchSettings()
+    {
+        // Pitch lock controls speed via tempo; without it, via rate. Offloaded, they travel with the next job.
+        stretchTempo = keepPitchWhenChangingSpeed ? (double) playbackSpeed : 1.0;
+        stretchRate = keepPitchWhenChangingSpeed ? 1.0 : (double) playbackSpeed;
+        if (! stretchPipeline.isActive()) runningStretcher->setParameters (stretchTempo, stretchRate, playbackPitchSemitones);
+
+        stretchSpeed = playbackSpeed;
+        stretchPitch = playbackPitchSemitones;
+        stretchKeepsPitch = keepPitchWhenChangingSpeed;
+    }
+
+    // Reads numSamples of the loop from stretchInputPosition on, a scratch buffer at a time, into the stretcher
+    void feedStretch (juce::AudioBuffer<float>& sourceBuffer, BufferManager& audioBufferManager, const int numSamples)
+    {
+        for (int done = 0; done < numSamples;)
+        {
+            const int chunk = std::min (numSamples - done, sourceBuffer.getNumSamples());
+            stretchInputPosition = audioBufferManager.readAt (BufferKernels::Copy {}, sourceBuffer, stretchInputPosition, chunk, stretchDirection);
+            runningStretcher->putSamples (sourceBuffer, chunk);
+            done += chunk;
+        }
+    }
+
+    // Renders STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS blocks ahead into the pipeline, then hands it the stretcher
+    void startOffload (juce::AudioBuffer<float>& sourceBuffer, BufferManager& audioBufferManager, const int numSamples)
+    {
+        PERFETTO_FUNCTION();
+        for (int block = 0; block < STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS; ++block)
+        {
+            stretchSourceDebt += (double) playbackSpeed * numSamples;
+            const int sourceSamples = (int) stretchSourceDebt;
+            stretchSourceDebt -= sourceSamples;
+
+            feedStretch (sourceBuffer, audioBufferManager, sourceSamples);
+            stretchPipeline.renderAhead (*runningStretcher, numSamples);
+        }
+        stretchPipeline.activate (*runningStretcher, stretchTempo, stretchRate, stretchPitch);
+    }
+
+    // Queues the source for a block STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS ahead and adds this block's output
+    bool renderOffloaded (juce::AudioBuffer<float>& output, BufferManager& audioBufferManager, const int sourceSamples, const int numSamples)
+    {
+        PERFETTO_FUNCTION();
+        if (! stretchPipeline.canQueue (sourceSamples, numSamples)) return false;
+
+        stretchInputPosition = audioBufferManager.readAt (BufferKernels::Copy {},
+                                                          stretchPipeline.getNextJobSource(),
+                                                          stretchInputPosition,
+                                                          sourceSamples,
+                                                          stretchDirection);
+        stretchPipeline.commitJob (sourceSamples, numSamples, stretchTempo, stretchRate, stretchPitch);
+        stretchPipeline.popOutput (output, numSamples);
+        return true;
+    }
+
+    bool processPlaybackNormalSpeed (juce::AudioBuffer<float>& output,
+                                     BufferManager& audioBufferManager,
+                                     const int numSamples,
+                                     const bool isOverdub)
     {
         PERFETTO_FUNCTION();
-        return audioBufferManager.readFromAudioBuffer ([&] (float* dest, const float* source, const int samples)
-                                                       { juce::FloatVectorOperations::add (dest, source, samples); },
+        return audioBufferManager.readFromAudioBuffer (BufferKernels::Add {},
                                                        output,
                                                        numSamples,
                                                        playbackSpeed * (float) playheadDirection,
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "engine/TimeStretchEngine.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <cmath>
+
+/**
+ * One pass of a track's loop as the time-stretcher plays it, kept so that later passes can be read back
+ * instead of stretched again.
+ *
+ * The cache fills itself from playback: every stretched block is written at the place in the pass its
+ * playhead maps to, and once the settings have held for a whole pass the cache is ready. Positions map
+ * through the playhead rather than a running count, so a cache that is ready follows seeks and sync
+ * the same way the loop does. The pass starts wherever a freshly primed stretcher happened to start, and the
+ * stretcher's splices are not periodic in the loop length, so the capture runs RENDERED_LOOP_SEAM_SAMPLES
+ * past a full pass and equal-power crossfades that second-pass output into the start of the first: the
+ * wrap then joins two samples of one continuous stream. A change of settings starts a new pass; recording into the loop or
+ * replacing its layer invalidates the cache outright. Storage comes from the loop's block pool, claimed
+ * as the pass is written; if the pool runs dry the pass is abandoned and playback keeps stretching.
+ */
+class RenderedLoopCache
+{
+public:
+    // Everything that shapes the stretched output; any difference means the cached pass does not apply
+    struct Settings
+    {
+        float speed = DEFAULT_PLAYBACK_SPEED;
+        double pitchSemitones = DEFAULT_PLAYBACK_PITCH_SEMITONES;
+        bool keepPitch = DEFAULT_PITCH_LOCK_STATE;
+        int direction = 1;
+        TimeStretchBackend backend = DEFAULT_TIME_STRETCH_BACKEND;
+        StretchQuality quality = DEFAULT_STRETCH_QUALITY;
+        int wrapStart = 0;
+        int wrapLength = 0;
+
+        bool operator== (const Settings&) const = default;
+    };
+
+    RenderedLoopCache() {}
+
+    // Room for one pass of the longest loop at the slowest speed
+    void prepareToPlay (LoopBlockPool& blockPool, const int loopCapacitySamples)
+    {
+        PERFETTO_FUNCTION();
+        audio.prepareToPlay (blockPool, (int) std::ceil (loopCapacitySamples / MIN_PLAYBACK_SPEED));
+        hasAudio = false;
+        state = State::Idle;
+    }
+
+    void releaseResources()
+    {
+        audio.releaseResources();
+        hasAudio = false;
+        state = State::Idle;
+    }
+
+    bool isPrepared() const { return audio.getNumSamples() > 0; }
+    bool isReady() const { return state == State::Ready; }
+    bool isReadyFor (const Settings& current) const { return state == State::Ready && settings == current; }
+    int getLength() const { return length; }
+
+    // The loop changed under the cache; a new pass starts with the next stretched block
+    void invalidate()
+    {
+        if (hasAudio) audio.clear();
+        hasAudio = false;
+        state = State::Idle;
+    }
+
+    // The stretched stream being captured was restarted, so the blocks before it may not join up with the ones after
+    void restartPass()
+    {
+        if (state == State::Capturing) captured = 0;
+    }
+
+    // Stores a stretched block that started at playhead, played with current
+    void capture (const Settings& current, const double playhead, const juce::AudioBuffer<float>& block, const int numSamples)
+    {
+        PERFETTO_FUNCTION();
+        if (! isPrepared() || current.wrapLength <= 0) return;
+        if (state == State::Idle || ! (settings == current)) startPass (current);
+        if (state != State::Capturing) return;
+
+        // Samples up to a full pass are stored as they are; the seam overlap after them is faded into the pass start
+        const int start = indexFor (playhead);
+        const int seam = getSeamLength();
+        const int copyEnd = juce::jlimit (0, numSamples, length - captured);
+        const int fadeEnd = juce::jlimit (0, numSamples, length + seam - captured);
+        for (int ch = 0; ch < std::min (audio.getNumChannels(), block.getNumChannels()); ++ch)
+        {
+            const float* source = block.getReadPointer (ch);
+            writeRange (ch,
+                        start,
+                        0,
+                        copyEnd,
+                        [&] (float* dest, const int blockOffset, const int run)
+                        { juce::FloatVectorOperations::copy (dest, source + blockOffset, run); });
+            writeRange (ch,
+                        (start + copyEnd) % length,
+                        copyEnd,
+                        fadeEnd - copyEnd,
+                        [&] (float* dest, const int blockOffset, const int run)
+                        {
+                            for (int i = 0; i < run; ++i)
+                            {
+                                const float angle = juce::MathConstants<float>::halfPi * (float) (captured + blockOffset + i - length) / (float) seam;
+                                dest[i] = dest[i] * std::sin (angle) + source[blockOffset + i] * std::cos (angle);
+                            }
+                        });
+        }
+        hasAudio = true;
+
+        captured += numSamples;
+        if (captured < length + seam) return;
+        if (passIsComplete())
+        {
+            state = State::Ready;
+            return;
+        }
+        invalidate(); // a pass with holes is no use; give its blocks back to recording
+        state = State::Failed;
+    }
+
+    // Adds numSamples of the cached pass to output, from where playhead maps to
+    void addTo (juce::AudioBuffer<float>& output, const double playhead, const int numSamples) const
+    {
+        PERFETTO_FUNCTION();
+        jassert (isReady());
+        const int start = indexFor (playhead);
+        for (int ch = 0; ch < std::min (audio.getNumChannels(), output.getNumChannels()); ++ch)
+        {
+            float* dest = output.getWritePointer (ch);
+            forEachSegment (start,
+                            numSamples,
+                            [&] (const int position, const int offset, const int segment)
+                            {
+                                audio.forEachReadableRun (ch,
+                                                          position,
+                                                          segment,
+                                                          [&] (const float* source, const int runOffset, const int run)
+                                                          { juce::FloatVectorOperations::add (dest + offset + runOffset, source, run); });
+                            });
+        }
+    }
+
+private:
+    enum class State
+    {
+        Idle,      // nothing captured since the last invalidation
+        Capturing, // a pass under the current settings is being written
+        Ready,     // a full pass is stored and matches settings
+        Failed     // the pool ran dry or the pass does not fit; waits for new settings or an invalidation
+    };
+
+    ChunkedLoopBuffer audio;
+    bool hasAudio = false;
+    State state = State::Idle;
+    Settings settings;
+    int length = 0;   // samples in one pass: the wrap length at speed, rounded down so the seam overlaps rather than gaps
+    int captured = 0; // samples written since the pass started; the pass is ready at length + the seam overlap
+
+    void startPass (const Settings& current)
+    {
+        invalidate();
+        settings = current;
+        length = std::max (1, (int) std::floor (current.wrapLength / (double) current.speed));
+        captured = 0;
+        state = length <= audio.getNumSamples() ? State::Capturing : State::Failed;
+    }
+
+    // Output time into the pass, counted from where the playhead enters the wrap range
+    int indexFor (const double playhead) const
+    {
+        const double offset = settings.direction > 0 ? playhead - settings.wrapStart : settings.wrapStart + settings.wrapLength - playhead;
+        const int index = (int) (std::llround (offset / settings.speed) % length);
+        return index < 0 ? index + length : index;
+    }
+
+    int getSeamLength() const { return std::max (1, std::min (RENDERED_LOOP_SEAM_SAMPLES, length / 2)); }
+
+    // func (float* dest, int offsetInBlock, int run) over the pass storage for block samples [from, from + num), placed at position
+    template <typename Func>
+    void writeRange (const int channel, const int position, const int from, const int numSamples, Func&& func)
+    {
+        if (numSamples <= 0) return;
+        forEachSegment (position,
+                        numSamples,
+                        [&] (const int segmentPosition, const int offset, const int segment)
+                        {
+                            audio.forEachWritableRun (channel,
+                                                      segmentPosition,
+                                                      segment,
+                                                      [&] (float* dest, const int runOffset, const int run)
+                                                      { func (dest, from + offset + runOffset, run); });
+                        });
+    }
+
+    // func (int positionInPass, int offsetInBlock, int segmentLength), for each piece of [start, start + num) modulo the pass
+    template <typename Func>
+    void forEachSegment (int position, const int numSamples, Func&& func) const
+    {
+        for (int done = 0; done < numSamples; position = 0)
+        {
+            const int segment = std::min (numSamples - done, length - position);
+            func (position, done, segment);
+            done += segment;
+        }
+    }
+
+    bool passIsComplete() const
+    {
+        const int blocks = (length + audio.getBlockSamples() - 1) / audio.getBlockSamples();
+        for (int b = 0; b < blocks; ++b)
+            if (audio.getBlockId (b) == LoopBlockPool::INVALID_BLOCK) return false;
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RenderedLoopCache)
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Block-sized working buffers shared by the tracks of an engine.
+ *
+ * Time-stretched playback only ever needs one block of source material at a time, up to
+ * MAX_PLAYBACK_SPEED blocks long. Rather than every track keeping loop-length working buffers,
+ * callers borrow a buffer for the duration of a call and hand it back when the ScopedBuffer goes
+ * out of scope. Buffers are claimed with a compare-and-swap, so borrowers on different threads
+ * never wait on each other.
+ */
+class ScratchBufferPool
+{
+public:
+    class ScopedBuffer
+    {
+    public:
+        ScopedBuffer() {}
+        ScopedBuffer (ScratchBufferPool* owner, const int index) : pool (owner), slot (index) {}
+        ScopedBuffer (ScopedBuffer&& other) noexcept : pool (std::exchange (other.pool, nullptr)), slot (other.slot) {}
+        ~ScopedBuffer()
+        {
+            if (pool != nullptr) pool->giveBack (slot);
+        }
+
+        ScopedBuffer& operator= (ScopedBuffer&&) = delete;
+
+        explicit operator bool() const { return pool != nullptr; }
+        juce::AudioBuffer<float>& operator*() const { return *pool->buffers[(size_t) slot]; }
+        juce::AudioBuffer<float>* operator->() const { return pool->buffers[(size_t) slot].get(); }
+
+    private:
+        ScratchBufferPool* pool = nullptr;
+        int slot = 0;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedBuffer)
+    };
+
+    ScratchBufferPool() {}
+    ~ScratchBufferPool() { releaseResources(); }
+
+    void prepareToPlay (const int numChannels, const int maxBlockSize, const int numBuffers)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        const int samples = getSamplesNeeded (maxBlockSize);
+        inUse = std::make_unique<std::atomic<bool>[]> ((size_t) numBuffers);
+        for (int i = 0; i < numBuffers; ++i)
+        {
+            auto buffer = std::make_unique<juce::AudioBuffer<float>> (numChannels, samples);
+            buffer->clear();
+            buffers.push_back (std::move (buffer));
+            inUse[(size_t) i].store (false, std::memory_order_relaxed);
+        }
+    }
+
+    void releaseResources()
+    {
+        buffers.clear();
+        inUse.reset();
+        failedBorrows.store (0, std::memory_order_relaxed);
+    }
+
+    // Returns an empty ScopedBuffer if every buffer is out
+    ScopedBuffer borrow()
+    {
+        for (int i = 0; i < (int) buffers.size(); ++i)
+        {
+            bool expected = false;
+            if (inUse[(size_t) i].compare_exchange_strong (expected, true, std::memory_order_acquire)) return ScopedBuffer (this, i);
+        }
+
+        failedBorrows.fetch_add (1, std::memory_order_relaxed);
+        return {};
+    }
+
+    // One block of source at top speed; the stretched output goes straight to the track's output
+    static int getSamplesNeeded (const int blockSize) { return (int) std::ceil ((float) blockSize * MAX_PLAYBACK_SPEED); }
+
+    int getNumBuffers() const { return (int) buffers.size(); }
+    int getNumSamples() const { return buffers.empty() ? 0 : buffers[0]->getNumSamples(); }
+    int getNumFailedBorrows() const { return failedBorrows.load (std::memory_order_relaxed); }
+
+private:
+    std::vector<std::unique_ptr<juce::AudioBuffer<float>>> buffers;
+    std::unique_ptr<std::atomic<bool>[]> inUse;
+    std::atomic<int> failedBorrows { 0 };
+
+    void giveBack (const int slot) { inUse[(size_t) slot].store (false, std::memory_order_release); }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ScratchBufferPool)
+};
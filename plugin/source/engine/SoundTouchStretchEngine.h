@@ -0,0 +1,103 @@
+#pragma once
+
+#include "SoundTouch.h"
+#include "engine/Constants.h"
+#include "engine/TimeStretchEngine.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+
+/**
+ * TimeStretchEngine on SoundTouch.
+ *
+ * All channels go through one SoundTouch instance, so the overlap search runs once per splice, on the
+ * correlation summed over the channels, and every channel is cut at the same point. SoundTouch takes
+ * interleaved frames; they are staged in small chunks on the stack.
+ */
+class SoundTouchStretchEngine : public TimeStretchEngine
+{
+public:
+    SoundTouchStretchEngine() {}
+
+    void prepareToPlay (const double sampleRate, const int numChannels, const int maxBlockSize) override
+    {
+        PERFETTO_FUNCTION();
+        juce::ignoreUnused (maxBlockSize);
+        jassert (numChannels > 0 && numChannels <= MAX_NUM_CHANNELS);
+        channels = juce::jlimit (1, MAX_NUM_CHANNELS, numChannels);
+
+        soundTouch = std::make_unique<soundtouch::SoundTouch>();
+        soundTouch->setSampleRate ((uint) sampleRate);
+        soundTouch->setChannels ((uint) channels);
+        soundTouch->setPitchSemiTones (0);
+        soundTouch->setSetting (SETTING_USE_QUICKSEEK, 0);
+        soundTouch->setSetting (SETTING_USE_AA_FILTER, 1);
+        soundTouch->setSetting (SETTING_SEQUENCE_MS, 82);
+        soundTouch->setSetting (SETTING_SEEKWINDOW_MS, 28);
+        soundTouch->setSetting (SETTING_OVERLAP_MS, 12);
+    }
+
+    void releaseResources() override { soundTouch.reset(); }
+
+    void reset() override
+    {
+        if (soundTouch != nullptr) soundTouch->clear();
+    }
+
+    void setParameters (const double tempo, const double rate, const double pitchSemitones) override
+    {
+        soundTouch->setPitchSemiTones (pitchSemitones);
+        soundTouch->setRate (rate);
+        soundTouch->setTempo (tempo);
+    }
+
+    // The latency covers SoundTouch's lookahead; the extra sequence keeps a block of output in hand
+    int getPrimingSamples() const override
+    {
+        return soundTouch->getSetting (SETTING_INITIAL_LATENCY) + soundTouch->getSetting (SETTING_NOMINAL_INPUT_SEQUENCE);
+    }
+
+    void putSamples (const juce::AudioBuffer<float>& source, const int numFrames) override
+    {
+        float interleaved[CHUNK_FRAMES * MAX_NUM_CHANNELS];
+        for (int done = 0; done < numFrames; done += CHUNK_FRAMES)
+        {
+            const int frames = std::min (CHUNK_FRAMES, numFrames - done);
+            for (int ch = 0; ch < channels; ++ch)
+            {
+                const float* src = source.getReadPointer (ch, done);
+                for (int i = 0; i < frames; ++i)
+                    interleaved[i * channels + ch] = src[i];
+            }
+            soundTouch->putSamples (interleaved, (uint) frames);
+        }
+    }
+
+    int addReceived (juce::AudioBuffer<float>& destination, const int numFrames) override
+    {
+        float interleaved[CHUNK_FRAMES * MAX_NUM_CHANNELS];
+        const int channelsToAdd = std::min (channels, destination.getNumChannels());
+        int done = 0;
+        while (done < numFrames)
+        {
+            const int frames = (int) soundTouch->receiveSamples (interleaved, (uint) std::min (CHUNK_FRAMES, numFrames - done));
+            if (frames == 0) break;
+
+            for (int ch = 0; ch < channelsToAdd; ++ch)
+            {
+                float* dest = destination.getWritePointer (ch, done);
+                for (int i = 0; i < frames; ++i)
+                    dest[i] += interleaved[i * channels + ch];
+            }
+            done += frames;
+        }
+        return done;
+    }
+
+private:
+    static constexpr int CHUNK_FRAMES = 256;
+
+    std::unique_ptr<soundtouch::SoundTouch> soundTouch;
+    int channels = 1;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SoundTouchStretchEngine)
+};
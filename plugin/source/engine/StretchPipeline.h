@@ -0,0 +1,484 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "engine/TimeStretchEngine.h"
+#include "engine/TrackRenderPool.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+
+class StretchPipeline;
+
+/**
+ * Real-time thread that runs the stretchers of every offloaded track ahead of the audio thread.
+ *
+ * Pipelines register once, when their track is prepared, and stay registered whether or not they have
+ * work. Each pass the worker services every registered pipeline that has jobs queued; between passes it
+ * polls for RENDER_POOL_SPIN_ITERATIONS, then sleeps until notify() is called for a new job.
+ *
+ * On a single core the worker could only run by taking time from the audio thread, so it is never
+ * started there and pipelines refuse it.
+ */
+class StretchOffloadWorker : public juce::Thread
+{
+public:
+    StretchOffloadWorker() : juce::Thread ("Stretch Offload") {}
+    ~StretchOffloadWorker() override { stop(); }
+
+    static bool isSupported()
+    {
+        static const bool supported = juce::SystemStats::getNumCpus() >= 2;
+        return supported;
+    }
+
+    void start (const double sampleRate, const int maxBlockSize)
+    {
+        PERFETTO_FUNCTION();
+        stop();
+        if (! isSupported()) return;
+
+        const auto options = juce::Thread::RealtimeOptions {}
+                                 .withPriority (RENDER_POOL_WORKER_PRIORITY)
+                                 .withApproximateAudioProcessingTime (maxBlockSize, sampleRate);
+        if (! startRealtimeThread (options)) startThread (juce::Thread::Priority::highest);
+    }
+
+    void stop()
+    {
+        signalThreadShouldExit();
+        wakeUp.signal();
+        stopThread (RENDER_POOL_STOP_TIMEOUT_MS);
+    }
+
+    // Called from whichever thread prepares a track; false when every slot is taken
+    bool registerPipeline (StretchPipeline& pipeline)
+    {
+        for (auto& slot : slots)
+        {
+            StretchPipeline* expected = nullptr;
+            if (slot.pipeline.compare_exchange_strong (expected, &pipeline)) return true;
+        }
+        return false;
+    }
+
+    // Returns once the worker can no longer be touching the pipeline
+    void unregisterPipeline (StretchPipeline& pipeline)
+    {
+        for (auto& slot : slots)
+        {
+            StretchPipeline* expected = &pipeline;
+            if (! slot.pipeline.compare_exchange_strong (expected, nullptr)) continue;
+            while (slot.busy.load())
+                TrackRenderPool::pause();
+        }
+    }
+
+    // Wakes the worker for a newly queued job; cheap when it is already polling
+    void notify()
+    {
+        requests.fetch_add (1);
+        if (sleeping.load()) wakeUp.signal();
+    }
+
+    void run() override
+    {
+        unsigned int seen = requests.load();
+        int idleSpins = 0;
+        while (! threadShouldExit())
+        {
+            if (servicePipelines())
+            {
+                idleSpins = 0;
+                continue;
+            }
+
+            const unsigned int current = requests.load();
+            if (current != seen)
+            {
+                seen = current;
+                idleSpins = 0;
+                continue;
+            }
+
+            if (++idleSpins < RENDER_POOL_SPIN_ITERATIONS)
+            {
+                TrackRenderPool::pause();
+                continue;
+            }
+
+            // notify() checks for a sleeper after counting its request, so one of the two always notices the other
+            sleeping.store (true);
+            if (requests.load() == seen && ! threadShouldExit()) wakeUp.wait();
+            sleeping.store (false);
+            idleSpins = 0;
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<StretchPipeline*> pipeline { nullptr };
+        std::atomic<bool> busy { false };
+    };
+
+    // One per track. Armed tracks and prepared spares never outnumber the engine's track slots, since it only
+    // keeps as many spares as there are slots left to arm.
+    std::array<Slot, MAX_TRACKS> slots;
+    std::atomic<unsigned int> requests { 0 };
+    std::atomic<bool> sleeping { false };
+    juce::WaitableEvent wakeUp;
+
+    inline bool servicePipelines();
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (StretchOffloadWorker)
+};
+
+/**
+ * Hands one track's stretcher to the offload worker.
+ *
+ * While active, the stretcher belongs to the pipeline: each block the audio thread reads the source the
+ * playhead will need STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS blocks from now into a job, and takes this block's
+ * output from a ring the jobs render into. Jobs carry their own stretch parameters, so settings changes
+ * stay in step with the source they apply to. Only the thread holding the service flag runs jobs, and the
+ * worker gives the flag back after each one. If the worker falls behind, the audio thread runs the late jobs
+ * itself when the flag is free; if the worker is in the middle of one, the audio thread does not wait for it
+ * but plays what is ready, fading it out, and counts an underrun. The samples it missed are skipped when they
+ * arrive, so the output stays in step with the playhead, and what follows fades back in.
+ *
+ * Deactivating never waits either. If the worker holds the flag, the pipeline is left retiring and the worker
+ * drops the queues and lets go of the stretcher once its job is done; until then the stretcher is still its.
+ *
+ * Both rings are single-producer, single-consumer: the audio thread queues jobs and reads output, and the
+ * holder of the service flag consumes jobs and writes output.
+ */
+class StretchPipeline
+{
+public:
+    StretchPipeline() {}
+    ~StretchPipeline() { setWorker (nullptr); }
+
+    // Message thread, while the track is not playing
+    void setWorker (StretchOffloadWorker* newWorker)
+    {
+        if (newWorker == worker) return;
+        deactivate();
+        if (worker != nullptr) worker->unregisterPipeline (*this);
+        finishRetiring();
+        worker = newWorker != nullptr && StretchOffloadWorker::isSupported() && newWorker->registerPipeline (*this) ? newWorker : nullptr;
+    }
+    bool hasWorker() const { return worker != nullptr; }
+
+    void prepareToPlay (const int numChannels, const int maxBlockSize)
+    {
+        deactivate();
+        acquireService();
+        for (auto& job : jobs)
+            job.source.setSize (numChannels, (int) std::ceil (MAX_PLAYBACK_SPEED * maxBlockSize) + 1);
+        output.setSize (numChannels, (STRETCH_OFFLOAD_LOOKAHEAD_BLOCKS + 1) * maxBlockSize);
+        rendered.setSize (numChannels, maxBlockSize);
+        retire();
+        releaseService();
+    }
+
+    void releaseResources()
+    {
+        deactivate();
+        acquireService();
+        for (auto& job : jobs)
+            job.source.setSize (0, 0);
+        output.setSize (0, 0);
+        rendered.setSize (0, 0);
+        retire();
+        releaseService();
+    }
+
+    bool isActive() const { return active.load (std::memory_order_relaxed); }
+
+    // Deactivated while the worker was mid-job, and not yet let go of by it: the stretcher is still the worker's
+    bool isRetiring() const { return retiring.load (std::memory_order_acquire); }
+
+    // Blocks that came up short because the worker was busy with the job they needed; audio thread only
+    int getUnderruns() const { return underruns; }
+
+    // The stretcher must not be touched by the caller until deactivate() returns with the pipeline not retiring
+    void activate (TimeStretchEngine& stretcherToRun, const double tempo, const double rate, const double semitones)
+    {
+        jassert (! isActive() && ! isRetiring());
+        stretcher = &stretcherToRun;
+        appliedTempo = tempo;
+        appliedRate = rate;
+        appliedSemitones = semitones;
+        active.store (true);
+    }
+
+    // Drops queued jobs and output and hands the stretcher back, or, if the worker is running a job, leaves that
+    // to the worker and returns with the pipeline retiring. The worker starts no job once active is cleared.
+    void deactivate()
+    {
+        if (! isActive()) return;
+        active.store (false);
+        if (tryAcquireService())
+        {
+            retire();
+            releaseService();
+            return;
+        }
+
+        retiring.store (true, std::memory_order_release);
+        if (worker != nullptr) worker->notify();
+    }
+
+    // Audio thread, before activate(): renders numSamples of the stretcher straight into the output ring
+    void renderAhead (TimeStretchEngine& stretcherToRun, const int numSamples)
+    {
+        jassert (! isActive() && ! isRetiring() && numSamples <= rendered.getNumSamples() && canCommit (numSamples));
+        rendered.clear (0, numSamples);
+        stretcherToRun.addReceived (rendered, numSamples);
+        writeOutput (rendered, numSamples);
+        committedOutput += numSamples;
+    }
+
+    bool canQueue (const int numSource, const int numOutput) const
+    {
+        return jobsQueued - jobsDone.load (std::memory_order_acquire) < STRETCH_OFFLOAD_JOBS && canCommit (numOutput)
+               && numSource <= jobs[0].source.getNumSamples() && numOutput <= rendered.getNumSamples();
+    }
+
+    // The buffer to read the next job's source into; call commitJob() once it is filled
+    juce::AudioBuffer<float>& getNextJobSource() { return jobs[(size_t) (jobsQueued % STRETCH_OFFLOAD_JOBS)].source; }
+
+    void commitJob (const int numSource, const int numOutput, const double tempo, const double rate, const double semitones)
+    {
+        jassert (canQueue (numSource, numOutput));
+        auto& job = jobs[(size_t) (jobsQueued % STRETCH_OFFLOAD_JOBS)];
+        job.numSource = numSource;
+        job.numOutput = numOutput;
+        job.tempo = tempo;
+        job.rate = rate;
+        job.semitones = semitones;
+        committedOutput += numOutput;
+
+        jobsQueued++;
+        jobsPublished.store (jobsQueued, std::memory_order_release);
+        if (worker != nullptr) worker->notify();
+    }
+
+    // Adds up to numSamples of output into dest, running late jobs here if the worker is not busy with one; returns
+    // the samples added
+    int popOutput (juce::AudioBuffer<float>& dest, const int numSamples)
+    {
+        PERFETTO_FUNCTION();
+        if (outputAvailable() < samplesOwed + numSamples && tryAcquireService())
+        {
+            while (outputAvailable() < samplesOwed + numSamples && runNextJob())
+            {
+            }
+            releaseService();
+        }
+
+        // Output a short block went without is dropped as it arrives, so later blocks keep their place
+        const int skipped = std::min (samplesOwed, outputAvailable());
+        outputRead += skipped;
+        committedOutput -= skipped;
+        samplesOwed -= skipped;
+
+        const int samples = std::min (numSamples, outputAvailable());
+        const bool cameUpShort = samples < numSamples;
+
+        // A short block fades its tail out rather than stopping dead, and output resuming after it fades back in
+        const int fadeIn = juce::jlimit (0, samples, STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES - fadeInPosition);
+        const int fadeOut = cameUpShort ? std::min (samples, STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES) : 0;
+        const auto gainAt = [&] (const int i)
+        {
+            const float in = std::min (1.0f, (float) (fadeInPosition + i) / (float) STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES);
+            const float out = fadeOut > 0 ? std::min (1.0f, (float) (samples - i) / (float) fadeOut) : 1.0f;
+            return in * out;
+        };
+
+        std::array<int, 4> edges { 0, fadeIn, samples - fadeOut, samples };
+        std::sort (edges.begin(), edges.end());
+        for (size_t e = 1; e < edges.size(); ++e)
+            if (edges[e] > edges[e - 1]) addOutput (dest, edges[e - 1], edges[e] - edges[e - 1], gainAt (edges[e - 1]), gainAt (edges[e]));
+
+        fadeInPosition = std::min (fadeInPosition + samples, STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES);
+        if (cameUpShort)
+        {
+            samplesOwed += numSamples - samples;
+            fadeInPosition = 0;
+            ++underruns;
+        }
+        return samples;
+    }
+
+    // Offload worker: runs the queued jobs, taking the service flag for one job at a time so the audio thread
+    // never finds it held for longer than that. A retiring pipeline is finished with here instead.
+    bool service()
+    {
+        if (isRetiring())
+        {
+            if (! tryAcquireService()) return false;
+            if (isRetiring()) retire();
+            releaseService();
+            return false;
+        }
+
+        bool ranJob = false;
+        while (isActive() && jobsPublished.load (std::memory_order_acquire) != jobsDone.load (std::memory_order_relaxed))
+        {
+            if (! tryAcquireService()) break;
+            const bool ran = isActive() && runNextJob();
+            releaseService();
+            if (! ran) break;
+            ranJob = true;
+        }
+        return ranJob;
+    }
+
+private:
+    struct Job
+    {
+        juce::AudioBuffer<float> source;
+        int numSource = 0;
+        int numOutput = 0;
+        double tempo = 1.0;
+        double rate = 1.0;
+        double semitones = 0.0;
+    };
+
+    StretchOffloadWorker* worker = nullptr;
+    TimeStretchEngine* stretcher = nullptr;
+    std::atomic<bool> active { false };
+    std::atomic<bool> retiring { false };
+    std::atomic<bool> serviceFlag { false };
+
+    std::array<Job, STRETCH_OFFLOAD_JOBS> jobs;
+    juce::int64 jobsQueued = 0; // audio thread's copy of jobsPublished
+    std::atomic<juce::int64> jobsPublished { 0 };
+    std::atomic<juce::int64> jobsDone { 0 };
+
+    juce::AudioBuffer<float> output;
+    juce::AudioBuffer<float> rendered;
+    juce::int64 outputRead = 0;      // audio thread only
+    juce::int64 committedOutput = 0; // queued or rendered but not yet read; bounded by the ring size
+    int samplesOwed = 0;             // output an underrun went without, skipped once it is written
+    int fadeInPosition = STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES; // into the fade back in after an underrun
+    int underruns = 0;
+    std::atomic<juce::int64> outputWritten { 0 };
+
+    // Only touched by the holder of the service flag
+    double appliedTempo = 1.0;
+    double appliedRate = 1.0;
+    double appliedSemitones = 0.0;
+
+    bool canCommit (const int numOutput) const { return committedOutput + numOutput <= output.getNumSamples(); }
+    int outputAvailable() const { return (int) (outputWritten.load (std::memory_order_acquire) - outputRead); }
+
+    bool tryAcquireService() { return ! serviceFlag.exchange (true, std::memory_order_acquire); }
+
+    // Message thread only; the holder only ever keeps the flag for one job
+    void acquireService()
+    {
+        while (! tryAcquireService())
+            TrackRenderPool::pause();
+    }
+
+    // Message thread, once no worker can finish a retiring pipeline any more
+    void finishRetiring()
+    {
+        if (! isRetiring()) return;
+        acquireService();
+        if (isRetiring()) retire();
+        releaseService();
+    }
+    void releaseService() { serviceFlag.store (false, std::memory_order_release); }
+
+    // Holder of the service flag, with the pipeline inactive: the audio thread leaves a retiring pipeline alone
+    void retire()
+    {
+        jobsQueued = 0;
+        jobsPublished.store (0);
+        jobsDone.store (0);
+        outputRead = 0;
+        committedOutput = 0;
+        samplesOwed = 0;
+        fadeInPosition = STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES;
+        outputWritten.store (0);
+        stretcher = nullptr;
+        retiring.store (false, std::memory_order_release);
+    }
+
+    // Adds numSamples from the output ring, ramping the gain from startGain to endGain
+    void addOutput (juce::AudioBuffer<float>& dest, const int destStart, const int numSamples, const float startGain, const float endGain)
+    {
+        const int capacity = output.getNumSamples();
+        const int start = (int) (outputRead % capacity);
+        const int first = std::min (numSamples, capacity - start);
+        const float splitGain = startGain + (endGain - startGain) * (float) first / (float) numSamples;
+        for (int ch = 0; ch < std::min (dest.getNumChannels(), output.getNumChannels()); ++ch)
+        {
+            dest.addFromWithRamp (ch, destStart, output.getReadPointer (ch, start), first, startGain, splitGain);
+            if (numSamples > first) dest.addFromWithRamp (ch, destStart + first, output.getReadPointer (ch), numSamples - first, splitGain, endGain);
+        }
+        outputRead += numSamples;
+        committedOutput -= numSamples;
+    }
+
+    // Holder of the service flag only
+    bool runNextJob()
+    {
+        const auto done = jobsDone.load (std::memory_order_relaxed);
+        if (stretcher == nullptr || done == jobsPublished.load (std::memory_order_acquire)) return false;
+
+        PERFETTO_FUNCTION();
+        auto& job = jobs[(size_t) (done % STRETCH_OFFLOAD_JOBS)];
+        if (job.tempo != appliedTempo || job.rate != appliedRate || job.semitones != appliedSemitones)
+        {
+            stretcher->setParameters (job.tempo, job.rate, job.semitones);
+            appliedTempo = job.tempo;
+            appliedRate = job.rate;
+            appliedSemitones = job.semitones;
+        }
+
+        stretcher->putSamples (job.source, job.numSource);
+        rendered.clear (0, job.numOutput);
+        stretcher->addReceived (rendered, job.numOutput);
+        writeOutput (rendered, job.numOutput);
+
+        jobsDone.store (done + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The producer side of the output ring: the service flag holder, or the audio thread while inactive
+    void writeOutput (const juce::AudioBuffer<float>& source, const int numSamples)
+    {
+        const auto written = outputWritten.load (std::memory_order_relaxed);
+        const int capacity = output.getNumSamples();
+        const int start = (int) (written % capacity);
+        const int first = std::min (numSamples, capacity - start);
+        for (int ch = 0; ch < output.getNumChannels(); ++ch)
+        {
+            output.copyFrom (ch, start, source, ch, 0, first);
+            if (numSamples > first) output.copyFrom (ch, 0, source, ch, first, numSamples - first);
+        }
+        outputWritten.store (written + numSamples, std::memory_order_release);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (StretchPipeline)
+};
+
+inline bool StretchOffloadWorker::servicePipelines()
+{
+    PERFETTO_FUNCTION();
+    bool ranJob = false;
+    for (auto& slot : slots)
+    {
+        // unregisterPipeline() clears the slot before waiting on busy, so one of the two always notices the other
+        slot.busy.store (true);
+        if (auto* pipeline = slot.pipeline.load()) ranJob = pipeline->service() || ranJob;
+        slot.busy.store (false);
+    }
+    return ranJob;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Which time-stretcher a track uses when it needs one
+enum class TimeStretchBackend
+{
+    SoundTouch, // library WSOLA with an anti-aliased rate transposer
+    Wsola       // in-house WSOLA: lighter, stereo-linked, with quality tiers
+};
+
+// Trade-off between CPU and smoothness for stretchers that offer one
+enum class StretchQuality
+{
+    Fast,
+    Balanced,
+    High
+};
+
+constexpr TimeStretchBackend DEFAULT_TIME_STRETCH_BACKEND = TimeStretchBackend::SoundTouch;
+constexpr StretchQuality DEFAULT_STRETCH_QUALITY = StretchQuality::Balanced;
+
+/**
+ * A streaming time-stretcher and pitch shifter, as PlaybackEngine drives it.
+ *
+ * Audio goes in and comes out as planar blocks. After reset(), feeding getPrimingSamples() of source
+ * makes the first output sample line up with the first sample fed and leaves at least a block of
+ * output in hand; from then on, feeding tempo * rate source samples per output sample keeps it
+ * there. Everything is allocated in prepareToPlay, so the other calls are safe on the audio thread.
+ */
+class TimeStretchEngine
+{
+public:
+    virtual ~TimeStretchEngine() = default;
+
+    virtual void prepareToPlay (double sampleRate, int numChannels, int maxBlockSize) = 0;
+    virtual void releaseResources() = 0;
+
+    // Drops everything buffered, ready to be primed again
+    virtual void reset() = 0;
+
+    // tempo changes speed at constant pitch, rate changes both like a tape, pitchSemitones shifts pitch on top
+    virtual void setParameters (double tempo, double rate, double pitchSemitones) = 0;
+
+    virtual int getPrimingSamples() const = 0;
+
+    virtual void putSamples (const juce::AudioBuffer<float>& source, int numFrames) = 0;
+
+    // Adds up to numFrames of output to destination and returns how many there were
+    virtual int addReceived (juce::AudioBuffer<float>& destination, int numFrames) = 0;
+};
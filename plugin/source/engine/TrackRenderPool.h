@@ -0,0 +1,192 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+#endif
+
+/**
+ * Fork-join pool that renders the tracks of a block in parallel.
+ *
+ * Worker threads are started once, in prepareToPlay, at real-time priority. run() publishes a batch
+ * of tasks by bumping a generation counter; the workers and the calling thread then claim task
+ * indices with a fetch-and-add until none are left, and run() returns once every task has finished.
+ * Nothing is allocated or locked per batch. Between batches a worker polls the generation for
+ * RENDER_POOL_SPIN_ITERATIONS, then sleeps until run() signals it.
+ *
+ * The calling thread always takes part, so a batch completes even if no worker wakes in time. Tasks
+ * must only touch the state of their own index; the caller combines the results after run() returns,
+ * in index order, so they do not depend on which thread ran what.
+ */
+class TrackRenderPool
+{
+public:
+    using Task = void (*) (void* context, int index);
+
+    TrackRenderPool() {}
+    ~TrackRenderPool() { releaseResources(); }
+
+    void prepareToPlay (const int numWorkers, const double sampleRate, const int maxBlockSize)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        stopping.store (false);
+        const auto options = juce::Thread::RealtimeOptions {}
+                                 .withPriority (RENDER_POOL_WORKER_PRIORITY)
+                                 .withApproximateAudioProcessingTime (maxBlockSize, sampleRate);
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            auto worker = std::make_unique<Worker> (*this);
+            // Without real-time rights the worker still helps, at the highest ordinary priority
+            if (! worker->startRealtimeThread (options)) worker->startThread (juce::Thread::Priority::highest);
+            workers.push_back (std::move (worker));
+        }
+    }
+
+    void releaseResources()
+    {
+        stopping.store (true);
+        generation.fetch_add (2);
+        for (auto& worker : workers)
+            worker->wakeUp.signal();
+        for (auto& worker : workers)
+            worker->stopThread (RENDER_POOL_STOP_TIMEOUT_MS);
+        workers.clear();
+    }
+
+    int getNumWorkers() const { return (int) workers.size(); }
+
+    // Busy-wait hint for the real-time threads that poll each other
+    static void pause()
+    {
+#if defined(__SSE2__) || defined(_M_X64)
+        _mm_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__ ("yield");
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    // Runs task (context, i) for every i in [0, numTasks) and returns when all of them have finished
+    void run (const Task task, void* const context, const int numTasks)
+    {
+        PERFETTO_FUNCTION();
+        if (workers.empty() || numTasks < 2)
+        {
+            for (int i = 0; i < numTasks; ++i)
+                task (context, i);
+            return;
+        }
+
+        batchTask = task;
+        batchContext = context;
+        batchSize = numTasks;
+        nextTask.store (0, std::memory_order_relaxed);
+        tasksDone.store (0, std::memory_order_relaxed);
+
+        // Odd generations are open batches
+        generation.fetch_add (1);
+        if (sleepingWorkers.load() > 0)
+            for (auto& worker : workers)
+                worker->wakeUp.signal();
+
+        runTasks();
+        while (tasksDone.load (std::memory_order_acquire) < numTasks)
+            pause();
+
+        // Close the batch, then wait for workers that joined it to notice there is nothing left
+        generation.fetch_add (1);
+        while (activeWorkers.load (std::memory_order_acquire) > 0)
+            pause();
+    }
+
+private:
+    class Worker : public juce::Thread
+    {
+    public:
+        explicit Worker (TrackRenderPool& owner) : juce::Thread ("Track Renderer"), pool (owner) {}
+        ~Worker() override { stopThread (RENDER_POOL_STOP_TIMEOUT_MS); }
+
+        void run() override { pool.workerLoop (*this); }
+
+        juce::WaitableEvent wakeUp;
+
+    private:
+        TrackRenderPool& pool;
+
+        JUCE_DECLARE_NON_COPYABLE (Worker)
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Written by run() before the generation is bumped, read by workers after they see it
+    Task batchTask = nullptr;
+    void* batchContext = nullptr;
+    int batchSize = 0;
+
+    std::atomic<unsigned int> generation { 0 };
+    std::atomic<int> nextTask { 0 };
+    std::atomic<int> tasksDone { 0 };
+    std::atomic<int> activeWorkers { 0 };
+    std::atomic<int> sleepingWorkers { 0 };
+    std::atomic<bool> stopping { false };
+
+    void workerLoop (Worker& worker)
+    {
+        unsigned int seen = generation.load();
+        while (! stopping.load())
+        {
+            seen = waitForNextGeneration (worker, seen);
+            if ((seen & 1u) == 0 || stopping.load()) continue;
+
+            // A batch that closed while this worker was waking up must not be joined
+            activeWorkers.fetch_add (1);
+            if (generation.load() == seen) runTasks();
+            activeWorkers.fetch_sub (1, std::memory_order_release);
+        }
+    }
+
+    unsigned int waitForNextGeneration (Worker& worker, const unsigned int seen)
+    {
+        for (int spins = 0;; ++spins)
+        {
+            const unsigned int current = generation.load();
+            if (current != seen || stopping.load()) return current;
+
+            if (spins < RENDER_POOL_SPIN_ITERATIONS)
+            {
+                pause();
+                continue;
+            }
+
+            // run() checks for sleepers after bumping the generation, so one of the two always notices the other
+            sleepingWorkers.fetch_add (1);
+            if (generation.load() == seen && ! stopping.load()) worker.wakeUp.wait();
+            sleepingWorkers.fetch_sub (1);
+            spins = 0;
+        }
+    }
+
+    void runTasks()
+    {
+        for (;;)
+        {
+            const int index = nextTask.fetch_add (1, std::memory_order_relaxed);
+            if (index >= batchSize) return;
+
+            batchTask (batchContext, index);
+            tasksDone.fetch_add (1, std::memory_order_release);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TrackRenderPool)
+};
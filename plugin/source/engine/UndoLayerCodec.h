@@ -0,0 +1,304 @@
+#pragma once
+
+#include "engine/LoopSampleFormat.h"
+#include <JuceHeader.h>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+/**
+ * Lossless codec for undo layer audio.
+ *
+ * Each float is mapped to an unsigned integer that sorts in the same order as the float value, so
+ * neighbouring samples of a smooth signal map to neighbouring integers. The sample-to-sample
+ * differences are zigzag encoded and Rice coded in short partitions, each with its own parameter,
+ * in the spirit of FLAC's residual coding. Silence and quiet tails shrink to about one bit per
+ * sample; dense material still gains from the shared exponent bits. Blocks held in a 16-bit
+ * LoopSampleFormat are coded from their stored values, which map to order the same way.
+ */
+class UndoLayerCodec
+{
+public:
+    static constexpr int PARTITION_SAMPLES = 256;
+
+    // Appends the encoded channel to out and returns the number of words written
+    static size_t encode (const float* samples, const int numSamples, std::vector<uint32_t>& out)
+    {
+        return encodeOrdered (numSamples, out, SILENCE, [samples] (const int i) { return toOrdered (samples[i]); });
+    }
+
+    // Returns false if the stream ends before numSamples were decoded
+    static bool decode (const uint32_t* words, const size_t numWords, float* destination, const int numSamples)
+    {
+        return decodeOrdered (words,
+                              numWords,
+                              numSamples,
+                              SILENCE,
+                              [destination] (const int i, const uint32_t ordered) { destination[i] = fromOrdered (ordered); });
+    }
+
+    // Same, for one channel of block storage in the given format
+    static size_t encode (const LoopSampleFormat format, const uint8_t* storage, const int numSamples, std::vector<uint32_t>& out)
+    {
+        if (format == LoopSampleFormat::Float32) return encode (reinterpret_cast<const float*> (storage), numSamples, out);
+
+        const auto* values = reinterpret_cast<const uint16_t*> (storage);
+        return encodeOrdered (numSamples, out, SILENCE_16, [values, format] (const int i) { return toOrdered16 (format, values[i]); });
+    }
+
+    static bool decode (const uint32_t* words, const size_t numWords, const LoopSampleFormat format, uint8_t* storage, const int numSamples)
+    {
+        if (format == LoopSampleFormat::Float32) return decode (words, numWords, reinterpret_cast<float*> (storage), numSamples);
+
+        auto* values = reinterpret_cast<uint16_t*> (storage);
+        return decodeOrdered (words,
+                              numWords,
+                              numSamples,
+                              SILENCE_16,
+                              [values, format] (const int i, const uint32_t ordered) { values[i] = fromOrdered16 (format, ordered); });
+    }
+
+private:
+    static constexpr int ESCAPE_QUOTIENT = 32;
+    static constexpr int ESCAPE_BITS = ESCAPE_QUOTIENT + 32;
+    static constexpr uint32_t SILENCE = 0x80000000u; // toOrdered (0.0f): a layer starts from silence
+    static constexpr uint32_t SILENCE_16 = 0x8000u;    // toOrdered16 of a stored zero, in either 16-bit format
+
+    template <typename ToOrdered>
+    static size_t encodeOrdered (const int numSamples, std::vector<uint32_t>& out, const uint32_t silence, ToOrdered&& orderedAt)
+    {
+        const size_t startSize = out.size();
+        BitWriter writer (out);
+
+        uint32_t previous = silence;
+        uint32_t residuals[PARTITION_SAMPLES];
+
+        for (int start = 0; start < numSamples; start += PARTITION_SAMPLES)
+        {
+            const int count = std::min (PARTITION_SAMPLES, numSamples - start);
+
+            for (int i = 0; i < count; ++i)
+            {
+                const uint32_t ordered = orderedAt (start + i);
+                const uint32_t delta = ordered - previous;
+                previous = ordered;
+
+                residuals[i] = (delta << 1) ^ (uint32_t) ((int32_t) delta >> 31);
+            }
+
+            const int k = riceParameterFor (residuals, count);
+            writer.write ((uint32_t) k, 5);
+
+            for (int i = 0; i < count; ++i)
+            {
+                const uint32_t quotient = residuals[i] >> k;
+                if (quotient >= ESCAPE_QUOTIENT)
+                {
+                    writer.writeOnes (ESCAPE_QUOTIENT);
+                    writer.write (residuals[i], 32);
+                    continue;
+                }
+
+                writer.writeOnes ((int) quotient);
+                writer.write (0, 1);
+                if (k > 0) writer.write (residuals[i] & ((1u << k) - 1u), k);
+            }
+        }
+
+        writer.flush();
+        return out.size() - startSize;
+    }
+
+    template <typename FromOrdered>
+    static bool decodeOrdered (const uint32_t* words, const size_t numWords, const int numSamples, const uint32_t silence, FromOrdered&& store)
+    {
+        BitReader reader (words, numWords);
+        uint32_t previous = silence;
+
+        for (int start = 0; start < numSamples; start += PARTITION_SAMPLES)
+        {
+            const int count = std::min (PARTITION_SAMPLES, numSamples - start);
+            const int k = (int) reader.read (5);
+
+            for (int i = 0; i < count; ++i)
+            {
+                const int quotient = reader.countOnes (ESCAPE_QUOTIENT);
+                uint32_t residual;
+                if (quotient >= ESCAPE_QUOTIENT)
+                {
+                    residual = reader.read (32);
+                }
+                else
+                {
+                    reader.read (1);
+                    residual = ((uint32_t) quotient << k) | (k > 0 ? reader.read (k) : 0u);
+                }
+
+                if (reader.overrun()) return false;
+
+                const uint32_t delta = (residual >> 1) ^ (0u - (residual & 1u));
+                previous += delta;
+                store (start + i, previous);
+            }
+        }
+
+        return true;
+    }
+
+    static uint32_t toOrdered (const float value)
+    {
+        uint32_t bits;
+        std::memcpy (&bits, &value, sizeof (bits));
+        return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    }
+
+    static float fromOrdered (const uint32_t ordered)
+    {
+        const uint32_t bits = (ordered & 0x80000000u) ? (ordered & 0x7fffffffu) : ~ordered;
+        float value;
+        std::memcpy (&value, &bits, sizeof (value));
+        return value;
+    }
+
+    // Int16 becomes offset binary; Float16 uses the same sign-folding as toOrdered
+    static uint32_t toOrdered16 (const LoopSampleFormat format, const uint16_t value)
+    {
+        if (format == LoopSampleFormat::Int16) return (uint32_t) (value ^ 0x8000u);
+        return (value & 0x8000u) ? (uint32_t) (~value & 0xffffu) : (uint32_t) (value | 0x8000u);
+    }
+
+    static uint16_t fromOrdered16 (const LoopSampleFormat format, const uint32_t ordered)
+    {
+        if (format == LoopSampleFormat::Int16) return (uint16_t) (ordered ^ 0x8000u);
+        return (uint16_t) ((ordered & 0x8000u) ? (ordered & 0x7fffu) : (~ordered & 0xffffu));
+    }
+
+    // Rice parameter with the smallest coded size for the partition. Residuals are bucketed by bit
+    // length, so the cost of every k comes from 33 buckets rather than another pass over the
+    // samples; isolated jumps (an attack, a punch-in) get escaped instead of inflating k.
+    static int riceParameterFor (const uint32_t* residuals, const int count)
+    {
+        uint64_t countByLength[33] = {};
+        uint64_t sumByLength[33] = {};
+        for (int i = 0; i < count; ++i)
+        {
+            const int length = (int) std::bit_width (residuals[i]);
+            ++countByLength[length];
+            sumByLength[length] += residuals[i];
+        }
+
+        int bestK = 0;
+        uint64_t bestBits = std::numeric_limits<uint64_t>::max();
+        for (int k = 0; k < 32; ++k)
+        {
+            uint64_t bits = 0;
+            for (int length = 0; length <= 32; ++length)
+            {
+                if (length > k + 5)
+                    bits += countByLength[length] * ESCAPE_BITS;
+                else if (length > k)
+                    bits += (sumByLength[length] >> k) + countByLength[length] * (uint64_t) (1 + k);
+                else
+                    bits += countByLength[length] * (uint64_t) (1 + k);
+            }
+
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                bestK = k;
+            }
+        }
+        return bestK;
+    }
+
+    // Bits go out most significant first. They collect in a 64-bit accumulator and leave a word at a time.
+    class BitWriter
+    {
+    public:
+        explicit BitWriter (std::vector<uint32_t>& destination) : out (destination) {}
+
+        // numBits up to 32
+        void write (const uint32_t value, const int numBits)
+        {
+            accumulator = (accumulator << numBits) | (value & (uint32_t) ((1ull << numBits) - 1u));
+            used += numBits;
+            if (used < 32) return;
+
+            used -= 32;
+            out.push_back ((uint32_t) (accumulator >> used));
+        }
+
+        void writeOnes (int count)
+        {
+            for (; count >= 32; count -= 32)
+                write (0xffffffffu, 32);
+            write (0xffffffffu, count);
+        }
+
+        void flush()
+        {
+            if (used == 0) return;
+            out.push_back ((uint32_t) (accumulator << (32 - used)));
+            used = 0;
+        }
+
+    private:
+        std::vector<uint32_t>& out;
+        uint64_t accumulator = 0; // the low used bits are pending; anything above them is stale
+        int used = 0;
+    };
+
+    // Reads from a 64-bit buffer, left aligned, that is topped up a word at a time and holds more than 32 bits
+    // while the stream lasts, so every read and every unary prefix is served without touching the words.
+    // Past the end it reads zeros and flags the overrun.
+    class BitReader
+    {
+    public:
+        BitReader (const uint32_t* data, const size_t size) : words (data), numWords (size) { refill(); }
+
+        // numBits up to 32
+        uint32_t read (const int numBits)
+        {
+            if (numBits == 0) return 0u;
+            const auto value = (uint32_t) (buffer >> (64 - numBits));
+            consume (numBits);
+            return value;
+        }
+
+        // Up to limit, at most 32, ones before the next zero; the buffer holds zeros past its bits, so they stop there
+        int countOnes (const int limit)
+        {
+            jassert (limit <= 32);
+            const int ones = std::min (limit, std::countl_one (buffer));
+            if (ones < limit && ones >= bufferedBits) pastEnd = true;
+            consume (ones);
+            return ones;
+        }
+
+        bool overrun() const { return pastEnd; }
+
+    private:
+        const uint32_t* words;
+        size_t numWords;
+        size_t nextWord = 0;
+        uint64_t buffer = 0; // bits past bufferedBits are zero
+        int bufferedBits = 0;
+        bool pastEnd = false;
+
+        void consume (const int numBits)
+        {
+            if (numBits > bufferedBits) pastEnd = true;
+            buffer <<= numBits;
+            bufferedBits = std::max (0, bufferedBits - numBits);
+            refill();
+        }
+
+        void refill()
+        {
+            for (; bufferedBits <= 32 && nextWord < numWords; bufferedBits += 32)
+                buffer |= (uint64_t) words[nextWord++] << (32 - bufferedBits);
+        }
+    };
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "engine/UndoLayerCodec.h"
+#include "engine/UndoSpillFile.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * Background worker that compresses and restores the blocks of older undo layers.
+ *
+ * Compressed layers are written to a memory-mapped scratch file and dropped from RAM, so undo
+ * depth is bounded by disk rather than memory. If the file cannot be created or grown the
+ * compressed words simply stay in the job.
+ *
+ * Work is exchanged through one Job per undo slot. The audio thread fills a job and moves it to a
+ * *Requested stage; the worker picks it up, runs the codec and moves it to the matching *Done
+ * stage. Only the audio thread touches block tables: it retains the blocks to encode before
+ * posting, and installs (or discards) the worker's result when it next services the jobs. The
+ * compressed words and their spill range belong to the worker, which frees them once a job is
+ * back to Idle. The audio thread never waits on the worker.
+ */
+class UndoLayerCompressor
+{
+public:
+    enum Stage : int
+    {
+        Idle,                // layer fully resident, nothing pending
+        CompressRequested,   // blockIds retained by the audio thread, waiting for the worker
+        CompressDone,        // words/offsets filled, worker dropped its references
+        Compressed,          // tableIndices hold compressed audio only
+        DecompressRequested, // waiting for the worker to rebuild the blocks
+        DecompressDone,      // blockIds hold freshly decoded blocks owned by the job
+        DecompressFailed     // pool had no room; still compressed
+    };
+
+    struct Job
+    {
+        std::atomic<int> stage { Idle };
+        bool discard = false; // audio thread only: result belongs to a layer that no longer exists
+
+        std::vector<int> tableIndices;
+        std::vector<int> blockIds;
+
+        std::vector<uint32_t> words;
+        std::vector<size_t> offsets; // (block, channel) start offsets into words, plus end
+
+        size_t uncompressedBytes = 0;
+        size_t compressedBytes = 0;
+        bool spilled = false; // words live in the spill file rather than in RAM
+
+        // Worker only: where the spilled words are in the file
+        int64_t spillOffset = UndoSpillFile::INVALID_OFFSET;
+        size_t spillWords = 0;
+    };
+
+    UndoLayerCompressor() {}
+    ~UndoLayerCompressor() { releaseResources(); }
+
+    void prepareToPlay (LoopBlockPool& blockPool, const int numJobs, const int blocksPerLayer)
+    {
+        PERFETTO_FUNCTION();
+        releaseResources();
+
+        pool = &blockPool;
+        jobs.clear();
+        for (int i = 0; i < numJobs; ++i)
+        {
+            auto job = std::make_unique<Job>();
+            job->tableIndices.reserve ((size_t) blocksPerLayer);
+            job->blockIds.reserve ((size_t) blocksPerLayer);
+            jobs.push_back (std::move (job));
+        }
+
+        spillFile.open();
+        startWorkerThread();
+    }
+
+    void releaseResources()
+    {
+        PERFETTO_FUNCTION();
+        stopWorkerThread();
+
+        // Drop whatever the worker left behind so no block keeps a stale reference
+        for (auto& job : jobs)
+        {
+            const int stage = job->stage.load();
+            if (stage == CompressRequested || stage == DecompressDone)
+                for (int id : job->blockIds)
+                    pool->releaseBlock (id);
+        }
+
+        jobs.clear();
+        spillFile.close();
+        pool = nullptr;
+    }
+
+    bool isSpillingToDisk() const { return spillFile.isOpen(); }
+
+    int getNumJobs() const { return (int) jobs.size(); }
+    Job& getJob (const int index) { return *jobs[(size_t) index]; }
+    const Job& getJob (const int index) const { return *jobs[(size_t) index]; }
+
+    // Audio thread: hand a filled job to the worker
+    void post (Job& job, const Stage requestedStage)
+    {
+        job.stage.store (requestedStage, std::memory_order_release);
+        workerSignal.signal();
+    }
+
+private:
+    LoopBlockPool* pool = nullptr;
+    std::vector<std::unique_ptr<Job>> jobs;
+    UndoSpillFile spillFile;
+
+    juce::WaitableEvent workerSignal;
+    std::atomic<bool> shouldStop { false };
+    std::thread workerThread;
+
+    void compress (Job& job)
+    {
+        PERFETTO_FUNCTION();
+        const int numChannels = pool->getNumChannels();
+        const int blockSamples = pool->getBlockSamples();
+
+        releaseSpill (job);
+        job.words.clear();
+        job.offsets.clear();
+
+        for (int id : job.blockIds)
+        {
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                job.offsets.push_back (job.words.size());
+                UndoLayerCodec::encode (pool->getSampleFormat(), pool->getBlockStorage (id, ch), blockSamples, job.words);
+            }
+            pool->releaseBlock (id);
+            std::this_thread::yield();
+        }
+        job.offsets.push_back (job.words.size());
+
+        job.uncompressedBytes = job.blockIds.size() * pool->getBlockBytes();
+        job.compressedBytes = job.words.size() * sizeof (uint32_t);
+        job.blockIds.clear();
+
+        job.spillOffset = spillFile.write (job.words.data(), job.words.size());
+        job.spilled = job.spillOffset != UndoSpillFile::INVALID_OFFSET;
+        if (job.spilled)
+        {
+            job.spillWords = job.words.size();
+            std::vector<uint32_t>().swap (job.words);
+        }
+
+        job.stage.store (CompressDone, std::memory_order_release);
+    }
+
+    void decompress (Job& job)
+    {
+        PERFETTO_FUNCTION();
+        const int numChannels = pool->getNumChannels();
+        const int blockSamples = pool->getBlockSamples();
+        const uint32_t* words = job.spilled ? spillFile.read (job.spillOffset) : job.words.data();
+
+        job.blockIds.clear();
+        for (size_t b = 0; b < job.tableIndices.size(); ++b)
+        {
+            const int id = pool->acquireBlock();
+            if (id == LoopBlockPool::INVALID_BLOCK)
+            {
+                for (int acquired : job.blockIds)
+                    pool->releaseBlock (acquired);
+                job.blockIds.clear();
+                job.stage.store (DecompressFailed, std::memory_order_release);
+                return;
+            }
+
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                const size_t entry = b * (size_t) numChannels + (size_t) ch;
+                const bool ok = UndoLayerCodec::decode (words + job.offsets[entry],
+                                                        job.offsets[entry + 1] - job.offsets[entry],
+                                                        pool->getSampleFormat(),
+                                                        pool->getBlockStorage (id, ch),
+                                                        blockSamples);
+                jassert (ok);
+                juce::ignoreUnused (ok);
+            }
+            job.blockIds.push_back (id);
+            std::this_thread::yield();
+        }
+
+        // The layer is resident again; a later compression encodes it afresh
+        releaseSpill (job);
+        std::vector<uint32_t>().swap (job.words);
+        job.stage.store (DecompressDone, std::memory_order_release);
+    }
+
+    void releaseSpill (Job& job)
+    {
+        spillFile.release (job.spillOffset, job.spillWords);
+        job.spillOffset = UndoSpillFile::INVALID_OFFSET;
+        job.spillWords = 0;
+    }
+
+    // The audio thread sets a replaced layer's job back to Idle without touching its words, which only this
+    // thread owns; the file range and the RAM copy are given back here, on the next pass
+    void releaseRetired (Job& job)
+    {
+        if (job.spillOffset == UndoSpillFile::INVALID_OFFSET && job.words.capacity() == 0) return;
+        releaseSpill (job);
+        std::vector<uint32_t>().swap (job.words);
+    }
+
+    void startWorkerThread()
+    {
+        shouldStop.store (false);
+        workerThread = std::thread (
+            [this]()
+            {
+                juce::Thread::setCurrentThreadName ("Undo Compressor");
+
+                while (! shouldStop.load())
+                {
+                    workerSignal.wait (UNDO_COMPRESSOR_IDLE_INTERVAL_MS);
+
+                    for (auto& job : jobs)
+                    {
+                        if (shouldStop.load()) break;
+
+                        const int stage = job->stage.load (std::memory_order_acquire);
+                        if (stage == CompressRequested)
+                            compress (*job);
+                        else if (stage == DecompressRequested)
+                            decompress (*job);
+                        else if (stage == Idle)
+                            releaseRetired (*job);
+                    }
+                }
+            });
+    }
+
+    void stopWorkerThread()
+    {
+        shouldStop.store (true);
+        workerSignal.signal();
+        if (workerThread.joinable()) workerThread.join();
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (UndoLayerCompressor)
+};
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "LoopLifo.h"
+#include "engine/ChunkedLoopBuffer.h"
+#include "engine/Constants.h"
+#include "engine/LoopBlockPool.h"
+#include "engine/UndoLayerCompressor.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
 #include <vector>
@@ -11,7 +15,10 @@ public:
     UndoStackManager() {}
     ~UndoStackManager() { releaseResources(); }
 
-    void prepareToPlay (int numLayers, int numChannels, int bufferSamples)
+    // Layers only hold blocks for the audio they contain and share unchanged blocks with each other.
+    // Only live, staging, the resident undo layers, one being packed and redo need blocks at once;
+    // deeper layers are compressed and spilled, and an undo past the blocks available waits for them.
+    void prepareToPlay (LoopBlockPool& blockPool, int numLayers, int bufferSamples)
     {
         PERFETTO_FUNCTION();
         undoLifo.prepareToPlay (numLayers);
@@ -22,24 +29,26 @@ public:
 
         for (auto& b : undoBuffers)
         {
-            auto buf = std::make_unique<juce::AudioBuffer<float>>();
-            b = std::move (buf);
-            b->setSize (numChannels, bufferSamples, false, true, true);
+            b = std::make_unique<ChunkedLoopBuffer>();
+            b->prepareToPlay (blockPool, bufferSamples);
         }
 
         for (auto& b : redoBuffers)
         {
-            auto buf = std::make_unique<juce::AudioBuffer<float>>();
-            b = std::move (buf);
-            b->setSize (numChannels, bufferSamples, false, true, true);
+            b = std::make_unique<ChunkedLoopBuffer>();
+            b->prepareToPlay (blockPool, bufferSamples);
         }
 
-        undoStaging->setSize (numChannels, bufferSamples, false, true, true);
+        undoStaging->prepareToPlay (blockPool, bufferSamples);
+
+        pool = &blockPool;
+        compressor.prepareToPlay (blockPool, numLayers, undoStaging->getNumTableEntries());
+        compressionDirty = false;
 
         length = 0;
     }
 
-    bool undo (std::unique_ptr<juce::AudioBuffer<float>>& destination)
+    bool undo (std::unique_ptr<ChunkedLoopBuffer>& destination)
     {
         PERFETTO_FUNCTION();
         // juce::Logger::
@@ -50,14 +59,25 @@ public:
 
         if (uSize1 > 0)
         {
+            // The layer is packed: refuse rather than wait, the next scheduling pass brings it back
+            if (! isLayerResident (uStart1))
+            {
+                compressionDirty = true;
+                return false;
+            }
+
             int rStart1, rSize1, rStart2, rSize2;
             redoLifo.prepareToWrite (1, rStart1, rSize1, rStart2, rSize2);
 
+            retireSlot (uStart1); // drops a compression still in flight for this layer
+
             std::swap (redoBuffers[(size_t) rStart1], destination);
             std::swap (destination, undoBuffers[(size_t) uStart1]);
 
             redoLifo.finishedWrite (rSize1, false);
             undoLifo.finishedRead (uSize1, false);
+            pendingUndos = std::max (pendingUndos - 1, 0);
+            compressionDirty = true;
 
             // juce::Logger::outputDebugString (
             //     "########################################################################\nUndoStackManager::undo completed");
@@ -67,7 +87,7 @@ public:
         return false;
     }
 
-    bool redo (std::unique_ptr<juce::AudioBuffer<float>>& destination)
+    bool redo (std::unique_ptr<ChunkedLoopBuffer>& destination)
     {
         PERFETTO_FUNCTION();
         // juce::Logger::outputDebugString ("UndoStackManager::redo called");
@@ -81,11 +101,14 @@ public:
             int uStart1, uSize1, uStart2, uSize2;
             undoLifo.prepareToWrite (1, uStart1, uSize1, uStart2, uSize2);
 
+            retireSlot (uStart1);
             std::swap (undoBuffers[(size_t) uStart1], destination);
             std::swap (destination, redoBuffers[(size_t) rStart1]);
 
             undoLifo.finishedWrite (uSize1, false);
             redoLifo.finishedRead (rSize1, false);
+            pendingUndos = 0;
+            compressionDirty = true;
 
             // juce::Logger::outputDebugString ("UndoStackManager::redo completed");
             // printDebugInfo();
@@ -98,11 +121,15 @@ public:
     const int getNumChannels() const { return undoBuffers.empty() ? 0 : undoBuffers[0]->getNumChannels(); }
     const int getNumLayers() const { return (int) undoBuffers.size(); }
 
-    const std::vector<std::unique_ptr<juce::AudioBuffer<float>>>& getBuffers() const { return undoBuffers; }
+    const std::vector<std::unique_ptr<ChunkedLoopBuffer>>& getBuffers() const { return undoBuffers; }
 
     void clear()
     {
         PERFETTO_FUNCTION();
+        for (int slot = 0; slot < compressor.getNumJobs(); ++slot)
+            retireSlot (slot);
+        updateCompressionStats();
+
         undoLifo.clear();
         redoLifo.clear();
         for (auto& buf : undoBuffers)
@@ -110,19 +137,26 @@ public:
         for (auto& buf : redoBuffers)
             buf->clear();
         undoStaging->clear();
+        pendingUndos = 0;
         length = 0;
     }
 
     void releaseResources()
     {
         PERFETTO_FUNCTION();
+        compressor.releaseResources();
+        compressedBytes.store (0, std::memory_order_relaxed);
+        uncompressedBytes.store (0, std::memory_order_relaxed);
+        spilledBytes.store (0, std::memory_order_relaxed);
+        pendingUndos = 0;
+
         undoLifo.clear();
         redoLifo.clear();
         for (auto& buf : undoBuffers)
-            buf->setSize (0, 0, false, false, true);
+            buf->releaseResources();
         for (auto& buf : redoBuffers)
-            buf->setSize (0, 0, false, false, true);
-        undoStaging->setSize (0, 0, false, false, true);
+            buf->releaseResources();
+        undoStaging->releaseResources();
         undoBuffers.clear();
         redoBuffers.clear();
     }
@@ -137,40 +171,243 @@ public:
         undoLifo.prepareToWrite (1, start1, size1, start2, size2);
 
         length = loopLength;
+        retireSlot (start1);
         std::swap (undoBuffers[(size_t) start1], undoStaging);
 
+        // Whatever was swapped out (oldest layer) and the redo history are dead now: return their blocks
+        undoStaging->clear();
+        for (auto& buf : redoBuffers)
+            buf->clear();
+
         undoLifo.finishedWrite (size1, false);
         redoLifo.clear();
+        pendingUndos = 0;
+        compressionDirty = true;
         // juce::Logger::outputDebugString (
         //     "###########################################################################\nUndoStackManager::finalizeCopyAndPush completed");
         // printDebugInfo();
     }
 
-    void stageCurrentBuffer (const juce::AudioBuffer<float>& sourceBuffer, int numSamples)
+    void stageCurrentBuffer (const ChunkedLoopBuffer& sourceBuffer, int numSamples)
     {
         // juce::Logger::outputDebugString (
         //     "###########################################################################\nUndoStackManager::stageCurrentBuffer called");
         // printDebugInfo();
         PERFETTO_FUNCTION();
-        undoStaging->setSize (sourceBuffer.getNumChannels(), numSamples, false, true, true);
-        for (int ch = 0; ch < sourceBuffer.getNumChannels(); ++ch)
-        {
-            juce::FloatVectorOperations::copy (undoStaging->getWritePointer (ch), sourceBuffer.getReadPointer (ch), numSamples);
-        }
+        // Only block references are taken; blocks are duplicated when the live buffer next writes to them
+        undoStaging->shareFrom (sourceBuffer, numSamples);
         // juce::Logger::outputDebugString (
         //     "###########################################################################\nUndoStackManager::stageCurrentBuffer completed");
         // printDebugInfo();
     }
 
+    // The next undo layer is cold: remember the request so the caller can serve it once the layer
+    // is back, and prefetch it ahead of everything else. Returns false if there is nothing to undo.
+    bool deferUndo()
+    {
+        if (pendingUndos >= undoLifo.getActiveLayers()) return false;
+
+        ++pendingUndos;
+        compressionDirty = true;
+        return true;
+    }
+
+    void cancelPendingUndos()
+    {
+        pendingUndos = 0;
+        compressionDirty = true;
+    }
+
+    int getPendingUndos() const { return pendingUndos; }
+
+    bool isUndoReady() const
+    {
+        const int slot = undoLifo.getNextLayerIndex();
+        return slot >= 0 && isLayerResident (slot);
+    }
+
+    // Audio thread, once per block: installs finished codec work and queues new work when the
+    // stack has changed. Layers deeper than UNDO_RESIDENT_LAYERS (or the pending undos) are
+    // compressed and spilled, shallower ones are restored ahead of the undo that will need them.
+    void processBackgroundCompression()
+    {
+        PERFETTO_FUNCTION();
+        bool changed = false;
+
+        for (int slot = 0; slot < compressor.getNumJobs(); ++slot)
+        {
+            auto& job = compressor.getJob (slot);
+            const int stage = job.stage.load (std::memory_order_acquire);
+
+            if (stage == UndoLayerCompressor::CompressDone)
+            {
+                if (! job.discard)
+                {
+                    for (int index : job.tableIndices)
+                        undoBuffers[(size_t) slot]->releaseBlockAt (index);
+                    undoLifo.setResidency (slot, job.spilled ? LoopLifo::Residency::OnDisk : LoopLifo::Residency::Compressed);
+                }
+
+                job.stage.store (job.discard ? UndoLayerCompressor::Idle : UndoLayerCompressor::Compressed, std::memory_order_relaxed);
+                job.discard = false;
+                changed = true;
+            }
+            else if (stage == UndoLayerCompressor::DecompressDone)
+            {
+                for (size_t i = 0; i < job.blockIds.size(); ++i)
+                {
+                    if (job.discard)
+                        pool->releaseBlock (job.blockIds[i]);
+                    else
+                        undoBuffers[(size_t) slot]->adoptBlockAt (job.tableIndices[i], job.blockIds[i]);
+                }
+
+                if (! job.discard) undoLifo.setResidency (slot, LoopLifo::Residency::Resident);
+
+                job.blockIds.clear();
+                job.stage.store (UndoLayerCompressor::Idle, std::memory_order_relaxed);
+                job.discard = false;
+                changed = true;
+            }
+            else if (stage == UndoLayerCompressor::DecompressFailed)
+            {
+                job.stage.store (job.discard ? UndoLayerCompressor::Idle : UndoLayerCompressor::Compressed, std::memory_order_relaxed);
+                job.discard = false;
+                changed = true;
+            }
+        }
+
+        if (changed || compressionDirty)
+        {
+            scheduleCompressionWork();
+            updateCompressionStats();
+        }
+    }
+
+    size_t getCompressedBytes() const { return compressedBytes.load (std::memory_order_relaxed); }
+    size_t getUncompressedBytes() const { return uncompressedBytes.load (std::memory_order_relaxed); }
+    size_t getSpilledBytes() const { return spilledBytes.load (std::memory_order_relaxed); }
+
+    float getCompressionRatio() const
+    {
+        const size_t compressed = getCompressedBytes();
+        return compressed > 0 ? (float) getUncompressedBytes() / (float) compressed : 1.0f;
+    }
+
+    bool isLayerResident (const int slot) const { return undoLifo.isResident (slot); }
+
+    LoopLifo::Residency getLayerResidency (const int slot) const { return undoLifo.getResidency (slot); }
+    int getNumLayersOnDisk() const { return undoLifo.getNumLayersWithResidency (LoopLifo::Residency::OnDisk); }
+
 private:
     LoopLifo undoLifo;
-    std::vector<std::unique_ptr<juce::AudioBuffer<float>>> undoBuffers {};
+    std::vector<std::unique_ptr<ChunkedLoopBuffer>> undoBuffers {};
 
     LoopLifo redoLifo;
-    std::vector<std::unique_ptr<juce::AudioBuffer<float>>> redoBuffers {};
+    std::vector<std::unique_ptr<ChunkedLoopBuffer>> redoBuffers {};
 
     int length { 0 };
-    std::unique_ptr<juce::AudioBuffer<float>> undoStaging = std::make_unique<juce::AudioBuffer<float>>();
+    std::unique_ptr<ChunkedLoopBuffer> undoStaging = std::make_unique<ChunkedLoopBuffer>();
+
+    LoopBlockPool* pool = nullptr;
+    UndoLayerCompressor compressor;
+    bool compressionDirty = false;
+    int pendingUndos = 0;
+    std::atomic<size_t> compressedBytes { 0 };
+    std::atomic<size_t> uncompressedBytes { 0 };
+    std::atomic<size_t> spilledBytes { 0 };
+
+    // The layer in this slot is being replaced: forget its compressed copy and any pending work
+    void retireSlot (const int slot)
+    {
+        if (slot < 0 || slot >= compressor.getNumJobs()) return;
+
+        undoLifo.setResidency (slot, LoopLifo::Residency::Resident);
+
+        auto& job = compressor.getJob (slot);
+        switch (job.stage.load (std::memory_order_acquire))
+        {
+            case UndoLayerCompressor::CompressRequested:
+            case UndoLayerCompressor::DecompressRequested:
+                job.discard = true; // the worker still owns the job; processBackgroundCompression cleans up
+                break;
+            case UndoLayerCompressor::DecompressDone:
+                for (int id : job.blockIds)
+                    pool->releaseBlock (id);
+                job.blockIds.clear();
+                job.stage.store (UndoLayerCompressor::Idle, std::memory_order_relaxed);
+                break;
+            default:
+                // A compressed copy's words and spill range are the worker's; its next pass frees them for an Idle job
+                job.stage.store (UndoLayerCompressor::Idle, std::memory_order_release);
+                break;
+        }
+    }
+
+    void scheduleCompressionWork()
+    {
+        PERFETTO_FUNCTION();
+        compressionDirty = false;
+        const int hotDepth = std::max (UNDO_RESIDENT_LAYERS, pendingUndos);
+
+        for (int depth = 1; depth <= undoLifo.getActiveLayers(); ++depth)
+        {
+            const int slot = undoLifo.getLayerIndexAtDepth (depth);
+            auto& job = compressor.getJob (slot);
+            if (job.discard) continue;
+
+            const int stage = job.stage.load (std::memory_order_acquire);
+            if (depth <= hotDepth)
+            {
+                if (stage == UndoLayerCompressor::Compressed) compressor.post (job, UndoLayerCompressor::DecompressRequested);
+            }
+            else if (stage == UndoLayerCompressor::Idle)
+            {
+                postCompression (slot, job);
+            }
+        }
+    }
+
+    void postCompression (const int slot, UndoLayerCompressor::Job& job)
+    {
+        auto& layer = *undoBuffers[(size_t) slot];
+        job.tableIndices.clear();
+        job.blockIds.clear();
+
+        // Blocks still shared with a newer layer stay resident; only this layer's own audio is packed
+        for (int index = 0; index < layer.getNumTableEntries(); ++index)
+        {
+            const int id = layer.getBlockId (index);
+            if (id == LoopBlockPool::INVALID_BLOCK || pool->isBlockShared (id)) continue;
+
+            pool->retainBlock (id);
+            job.tableIndices.push_back (index);
+            job.blockIds.push_back (id);
+        }
+
+        if (! job.tableIndices.empty()) compressor.post (job, UndoLayerCompressor::CompressRequested);
+    }
+
+    void updateCompressionStats()
+    {
+        size_t compressed = 0, uncompressed = 0, spilled = 0;
+        for (int slot = 0; slot < compressor.getNumJobs(); ++slot)
+        {
+            auto& job = compressor.getJob (slot);
+            const int stage = job.stage.load (std::memory_order_acquire);
+            if (job.discard
+                || (stage != UndoLayerCompressor::Compressed && stage != UndoLayerCompressor::DecompressRequested
+                    && stage != UndoLayerCompressor::DecompressFailed))
+                continue;
+
+            compressed += job.compressedBytes;
+            uncompressed += job.uncompressedBytes;
+            if (job.spilled) spilled += job.compressedBytes;
+        }
+        compressedBytes.store (compressed, std::memory_order_relaxed);
+        uncompressedBytes.store (uncompressed, std::memory_order_relaxed);
+        spilledBytes.store (spilled, std::memory_order_relaxed);
+    }
 
     // void printDebugInfo()
     // {
@@ -181,7 +418,7 @@ private:
     //     juce::String sampleStr;
     //     for (int i = 0; i < std::min (10, undoStaging->getNumSamples()); ++i)
     //     {
-    //         sampleStr += juce::String (undoStaging->getReadPointer (0)[i]) + " ";
+    //         sampleStr += juce::String (undoStaging->getSample (0, i)) + " ";
     //     }
     //     juce::Logger::outputDebugString ("    " + sampleStr);
     //
@@ -197,7 +434,7 @@ private:
     //         juce::String sampleStr;
     //         for (int i = 0; i < std::min (10, undoBuffers[(size_t) layer]->getNumSamples()); ++i)
     //         {
-    //             sampleStr += juce::String (undoBuffers[(size_t) layer]->getReadPointer (0)[i]) + " ";
+    //             sampleStr += juce::String (undoBuffers[(size_t) layer]->getSample (0, i)) + " ";
     //         }
     //         juce::Logger::outputDebugString ("    " + sampleStr);
     //     }
@@ -213,7 +450,7 @@ private:
     //         juce::String sampleStr;
     //         for (int i = 0; i < std::min (10, redoBuffers[(size_t) layer]->getNumSamples()); ++i)
     //         {
-    //             sampleStr += juce::String (redoBuffers[(size_t) layer]->getReadPointer (0)[i]) + " ";
+    //             sampleStr += juce::String (redoBuffers[(size_t) layer]->getSample (0, i)) + " ";
     //         }
     //         juce::Logger::outputDebugString ("    " + sampleStr);
     //     }
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "engine/Constants.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/**
+ * Memory-mapped scratch file holding compressed undo layers that were moved out of RAM.
+ *
+ * Storage is handed out in word ranges with a first-fit free list; the file grows in
+ * UNDO_SPILL_GROW_BYTES steps and is remapped when it does. The mapping is only ever touched by
+ * the undo compressor's worker thread, so remapping never races with a reader. The file is
+ * deleted when closed.
+ */
+class UndoSpillFile
+{
+public:
+    static constexpr int64_t INVALID_OFFSET = -1;
+
+    UndoSpillFile() {}
+    ~UndoSpillFile() { close(); }
+
+    bool open()
+    {
+        PERFETTO_FUNCTION();
+        close();
+
+        file = juce::File::createTempFile (".undo");
+        if (! file.create()) return false;
+
+        return grow (UNDO_SPILL_GROW_BYTES / sizeof (uint32_t));
+    }
+
+    void close()
+    {
+        mapping.reset();
+        if (file.existsAsFile()) file.deleteFile();
+
+        file = juce::File();
+        freeRanges.clear();
+        capacityWords = 0;
+        usedWords = 0;
+    }
+
+    bool isOpen() const { return mapping != nullptr; }
+
+    // Copies numWords into the file and returns their word offset, or INVALID_OFFSET if the file could not grow
+    int64_t write (const uint32_t* words, const size_t numWords)
+    {
+        PERFETTO_FUNCTION();
+        if (! isOpen() || numWords == 0) return INVALID_OFFSET;
+
+        int64_t offset = allocate (numWords);
+        if (offset == INVALID_OFFSET)
+        {
+            const size_t growWords = UNDO_SPILL_GROW_BYTES / sizeof (uint32_t);
+            if (! grow (capacityWords + std::max (numWords, growWords))) return INVALID_OFFSET;
+            offset = allocate (numWords);
+        }
+
+        std::memcpy (getData() + offset, words, numWords * sizeof (uint32_t));
+        usedWords += numWords;
+        return offset;
+    }
+
+    const uint32_t* read (const int64_t offset) const { return isOpen() && offset >= 0 ? getData() + offset : nullptr; }
+
+    void release (const int64_t offset, const size_t numWords)
+    {
+        if (offset < 0 || numWords == 0) return;
+
+        addFreeRange ((size_t) offset, numWords);
+        usedWords -= numWords;
+    }
+
+    size_t getUsedBytes() const { return usedWords * sizeof (uint32_t); }
+    size_t getFileBytes() const { return capacityWords * sizeof (uint32_t); }
+
+private:
+    struct Range
+    {
+        size_t start;
+        size_t size;
+        bool operator<(const Range& other) const { return start < other.start; }
+    };
+
+    juce::File file;
+    std::unique_ptr<juce::MemoryMappedFile> mapping;
+    std::vector<Range> freeRanges; // sorted by start, never adjacent
+    size_t capacityWords = 0;
+    size_t usedWords = 0;
+
+    uint32_t* getData() const { return static_cast<uint32_t*> (mapping->getData()); }
+
+    int64_t allocate (const size_t numWords)
+    {
+        for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+        {
+            if (it->size < numWords) continue;
+
+            const size_t start = it->start;
+            it->start += numWords;
+            it->size -= numWords;
+            if (it->size == 0) freeRanges.erase (it);
+            return (int64_t) start;
+        }
+        return INVALID_OFFSET;
+    }
+
+    void addFreeRange (const size_t start, const size_t size)
+    {
+        auto it = freeRanges.insert (std::lower_bound (freeRanges.begin(), freeRanges.end(), Range { start, 0 }), Range { start, size });
+
+        // Merge with the following and then the preceding neighbour
+        if (std::next (it) != freeRanges.end() && it->start + it->size == std::next (it)->start)
+        {
+            it->size += std::next (it)->size;
+            freeRanges.erase (std::next (it));
+        }
+        if (it != freeRanges.begin() && std::prev (it)->start + std::prev (it)->size == it->start)
+        {
+            std::prev (it)->size += it->size;
+            freeRanges.erase (it);
+        }
+    }
+
+    bool grow (const size_t newCapacityWords)
+    {
+        PERFETTO_FUNCTION();
+        mapping.reset();
+
+        if (! extendFile (newCapacityWords) || ! map (newCapacityWords))
+        {
+            map (capacityWords); // keep what was already spilled readable
+            return false;
+        }
+
+        addFreeRange (capacityWords, newCapacityWords - capacityWords);
+        capacityWords = newCapacityWords;
+        return true;
+    }
+
+    bool extendFile (const size_t numWords)
+    {
+        juce::FileOutputStream stream (file);
+        if (! stream.openedOk() || ! stream.setPosition ((juce::int64) (numWords * sizeof (uint32_t)) - 1) || ! stream.writeByte (0))
+            return false;
+
+        stream.flush();
+        return true;
+    }
+
+    bool map (const size_t numWords)
+    {
+        if (numWords == 0) return false;
+
+        mapping = std::make_unique<juce::MemoryMappedFile> (file, juce::MemoryMappedFile::readWrite);
+        if (mapping->getData() == nullptr || mapping->getSize() < numWords * sizeof (uint32_t))
+        {
+            mapping.reset();
+            return false;
+        }
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (UndoSpillFile)
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "engine/BufferKernels.h"
+#include "engine/Constants.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <array>
+#include <cmath>
+
+/**
+ * Varispeed resampler for playback without pitch lock: speed and pitch move together, like a tape.
+ *
+ * Each output sample is a VARISPEED_TAPS-point windowed-sinc interpolation of the loop at a
+ * fractional position. The filter is tabulated at VARISPEED_PHASES sub-sample phases, each row
+ * stored with its difference to the next so the coefficients for any phase are one multiply-add
+ * away; the taps are then summed four at a time. Above unity speed the cutoff drops to the new
+ * Nyquist frequency to keep the loop from aliasing, using the closest of VARISPEED_CUTOFF_BANDS
+ * precomputed tables that is at least as steep as needed. At unity speed and whole-sample
+ * positions the output is the loop itself.
+ *
+ * The reader keeps no history: BufferManager::readVarispeed hands it the span of loop samples a block
+ * needs, straight from block memory when the span sits in one run.
+ */
+class VarispeedReader
+{
+public:
+    static constexpr int TAPS = VARISPEED_TAPS;
+    static constexpr int TAPS_BEFORE = TAPS / 2 - 1; // source samples before floor (position) that contribute
+
+    VarispeedReader() {}
+
+    void prepareToPlay (const int maxBlockSize)
+    {
+        PERFETTO_FUNCTION();
+        getFilterBank(); // built on first use; do it here rather than on the audio thread
+        window.resize ((size_t) getSpanCapacity (maxBlockSize));
+    }
+
+    void releaseResources() { window.clear(); }
+
+    // Source samples numSamples outputs at up to MAX_PLAYBACK_SPEED can touch
+    static int getSpanCapacity (const int numSamples) { return (int) std::ceil ((float) numSamples * MAX_PLAYBACK_SPEED) + TAPS + 1; }
+
+    // Working space for spans that cannot be read in place, getSpanCapacity (maxBlockSize) samples
+    float* getWindow() { return window.data(); }
+    int getWindowSize() const { return (int) window.size(); }
+
+    // Adds numSamples interpolated samples to destination, the first at source[position], then every step samples.
+    // source must hold TAPS_BEFORE samples before the lowest position and TAPS / 2 after the highest.
+    void render (const float* source, double position, const double step, float* destination, const int numSamples) const
+    {
+        PERFETTO_FUNCTION();
+        const auto& table = getFilterBank()[(size_t) getCutoffBand (step)];
+
+        for (int i = 0; i < numSamples; ++i, position += step)
+        {
+            const int whole = (int) position; // positions are never below TAPS_BEFORE, so truncation is floor
+            const float phase = (float) (position - whole) * (float) VARISPEED_PHASES;
+            const int row = std::min ((int) phase, VARISPEED_PHASES - 1);
+
+            destination[i] += dot (table[(size_t) row].data(), phase - (float) row, source + whole - TAPS_BEFORE);
+        }
+    }
+
+    static int getCutoffBand (const double step)
+    {
+        const double excess = (std::abs (step) - 1.0) / (MAX_PLAYBACK_SPEED - 1.0);
+        return juce::jlimit (0, VARISPEED_CUTOFF_BANDS - 1, (int) std::ceil (excess * (VARISPEED_CUTOFF_BANDS - 1) - 1.0e-6));
+    }
+
+private:
+    // Per phase: TAPS coefficients, then TAPS differences to the next phase
+    using PhaseRow = std::array<float, 2 * TAPS>;
+    using FilterTable = std::array<PhaseRow, VARISPEED_PHASES>;
+    using FilterBank = std::array<FilterTable, VARISPEED_CUTOFF_BANDS>;
+
+    std::vector<float> window;
+
+    static float dot (const float* row, const float fraction, const float* source)
+    {
+        using namespace BufferKernels::detail;
+#if LOOPER_USE_SSE2 || LOOPER_USE_NEON
+        const Vector fractionVector = splat (fraction);
+        Vector accumulator = splat (0.0f);
+        for (int j = 0; j < TAPS; j += 4)
+        {
+            const Vector coefficients = add (load (row + j), mul (fractionVector, load (row + TAPS + j)));
+            accumulator = add (accumulator, mul (coefficients, load (source + j)));
+        }
+        return sum (accumulator);
+#else
+        float accumulator = 0.0f;
+        for (int j = 0; j < TAPS; ++j)
+            accumulator += (row[j] + fraction * row[TAPS + j]) * source[j];
+        return accumulator;
+#endif
+    }
+
+    static const FilterBank& getFilterBank()
+    {
+        static const std::unique_ptr<FilterBank> bank = buildFilterBank();
+        return *bank;
+    }
+
+    static std::unique_ptr<FilterBank> buildFilterBank()
+    {
+        auto bank = std::make_unique<FilterBank>();
+        std::array<float, TAPS> current {}, next {};
+
+        for (int band = 0; band < VARISPEED_CUTOFF_BANDS; ++band)
+        {
+            const double bandSpeed = 1.0 + (MAX_PLAYBACK_SPEED - 1.0) * band / std::max (1, VARISPEED_CUTOFF_BANDS - 1);
+            const double cutoff = 1.0 / bandSpeed;
+
+            computeCoefficients (current, 0.0, cutoff);
+            for (int phase = 0; phase < VARISPEED_PHASES; ++phase)
+            {
+                computeCoefficients (next, (double) (phase + 1) / VARISPEED_PHASES, cutoff);
+
+                auto& row = (*bank)[(size_t) band][(size_t) phase];
+                for (int j = 0; j < TAPS; ++j)
+                {
+                    row[(size_t) j] = current[(size_t) j];
+                    row[(size_t) (TAPS + j)] = next[(size_t) j] - current[(size_t) j];
+                }
+                current = next;
+            }
+        }
+        return bank;
+    }
+
+    // Kaiser-windowed sinc for a position fraction samples past tap TAPS_BEFORE, normalised to unity gain at DC
+    static void computeCoefficients (std::array<float, TAPS>& coefficients, const double fraction, const double cutoff)
+    {
+        constexpr double beta = VARISPEED_KAISER_BETA;
+        const double halfWidth = TAPS / 2.0;
+        double total = 0.0;
+        std::array<double, TAPS> values {};
+
+        for (int j = 0; j < TAPS; ++j)
+        {
+            const double distance = (double) (j - TAPS_BEFORE) - fraction;
+            const double x = cutoff * distance * juce::MathConstants<double>::pi;
+            const double sinc = std::abs (x) < 1.0e-9 ? 1.0 : std::sin (x) / x;
+            const double ratio = juce::jlimit (-1.0, 1.0, distance / halfWidth);
+            values[(size_t) j] = sinc * besselI0 (beta * std::sqrt (1.0 - ratio * ratio)) / besselI0 (beta);
+            total += values[(size_t) j];
+        }
+
+        for (int j = 0; j < TAPS; ++j)
+            coefficients[(size_t) j] = (float) (values[(size_t) j] / total);
+    }
+
+    static double besselI0 (const double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 32; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VarispeedReader)
+};
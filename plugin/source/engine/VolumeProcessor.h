@@ -1,4 +1,6 @@
 #pragma once
+#include "engine/BufferKernels.h"
+#include "engine/ChunkedLoopBuffer.h"
 #include "engine/Constants.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
@@ -11,14 +13,13 @@ public:
     void prepareToPlay (const double currentSampleRate, const int /*blockSize*/)
     {
         sampleRate = currentSampleRate;
-        setCrossFadeLength ((int) (CROSSFADE_DEFAULT_LENGTH_SECONDS * sampleRate));
     }
 
     void releaseResources() { clear(); }
 
     void clear()
     {
-        trackVolume = previousTrackVolume = 1.0f;
+        trackVolume = previousTrackVolume = previousSourceGain = 1.0f;
         soloed = muted = false;
     }
 
@@ -46,6 +47,10 @@ public:
         }
     }
 
+    // The next applyVolume would scale the block by zero throughout: muted, soloed out or turned all the way down,
+    // with any fade to silence already done
+    bool isInaudible() const { return trackVolume == 0.0f && std::abs (trackVolume - previousTrackVolume) <= 0.001f; }
+
     void applyVolume (juce::AudioBuffer<float>& output, const int numSamples)
     {
         PERFETTO_FUNCTION();
@@ -60,6 +65,30 @@ public:
         }
     }
 
+    // Adds source into destination at the track volume times sourceGain (the loop's playback gain), ramping from the
+    // last block's gain when either moved. Only destination's own content is left unscaled; a silent source costs
+    // nothing but keeps the ramp in step.
+    void addWithVolume (juce::AudioBuffer<float>& destination,
+                        const juce::AudioBuffer<float>& source,
+                        const int numSamples,
+                        const bool sourceIsSilent = false,
+                        const float sourceGain = 1.0f)
+    {
+        PERFETTO_FUNCTION();
+        const float endGain = trackVolume * sourceGain;
+        float startGain = endGain;
+        if (std::abs (trackVolume - previousTrackVolume) > 0.001f || std::abs (sourceGain - previousSourceGain) > 0.001f)
+        {
+            startGain = previousTrackVolume * previousSourceGain;
+            previousTrackVolume = trackVolume;
+            previousSourceGain = sourceGain;
+        }
+        if (sourceIsSilent || (startGain == 0.0f && endGain == 0.0f)) return;
+
+        for (int ch = 0; ch < std::min (destination.getNumChannels(), source.getNumChannels()); ++ch)
+            BufferKernels::addWithGainRamp (destination.getWritePointer (ch), source.getReadPointer (ch), numSamples, startGain, endGain);
+    }
+
     void setOverdubNewGain (const float newGain) { overdubNewGain = std::clamp (newGain, MIN_OVERDUB_GAIN, MAX_OVERDUB_GAIN); }
 
     void setOverdubOldGain (const float newGain) { overdubOldGain = std::clamp (newGain, MIN_BASE_GAIN, MAX_BASE_GAIN); }
@@ -69,7 +98,8 @@ public:
     double getOverdubNewGain() const { return overdubNewGain; }
     double getOverdubOldGain() const { return overdubOldGain; }
 
-    void normalizeOutput (juce::AudioBuffer<float>& audioBuffer, const int length)
+    template <typename BufferType>
+    static void normalizeOutput (BufferType& audioBuffer, const int length)
     {
         PERFETTO_FUNCTION();
         // if (shouldNormalizeOutput)
@@ -83,24 +113,35 @@ public:
         // }
     }
 
-    void applyCrossfade (juce::AudioBuffer<float>& audioBuffer, const int length)
+    // A loop layer takes its peak from the peak table and only moves its playback gain, so normalising costs a
+    // float per region and loses nothing however often undo and redo repeat it. 16-bit storage has a fixed
+    // ceiling, so there the samples are rescaled to the level they are heard at and overdubs keep their headroom.
+    static void normalizeOutput (ChunkedLoopBuffer& layer, const int length)
     {
         PERFETTO_FUNCTION();
-        const int fadeSamples = std::min (crossFadeLength, length / 4);
-        if (fadeSamples > 0)
+        const float peak = layer.getPeak (0, length);
+        if (peak <= 0.001f) return; // silent
+
+        const float gain = layer.getPlaybackGain() * NORMALIZE_TARGET_LEVEL / peak;
+        if (layer.getSampleFormat() == LoopSampleFormat::Float32)
         {
-            audioBuffer.applyGainRamp (0, fadeSamples, 0.0f, 1.0f);                    // fade in
-            audioBuffer.applyGainRamp (length - fadeSamples, fadeSamples, 1.0f, 0.0f); // fade out
+            layer.setPlaybackGain (gain);
+            return;
         }
+        layer.setPlaybackGain (1.0f);
+        layer.applyGain (0, length, gain);
     }
 
-    void setCrossFadeLength (const int newLength) { crossFadeLength = newLength; }
-
     void saveBalancedLayers (float* dest, const float* source, int numSamples, bool shouldOverdub)
     {
         PERFETTO_FUNCTION();
-        juce::FloatVectorOperations::multiply (dest, shouldOverdub ? (float) overdubOldGain : 0, (int) numSamples);
-        juce::FloatVectorOperations::addWithMultiply (dest, source, (float) overdubNewGain, (int) numSamples);
+        getBalancedOverdubKernel() (dest, source, numSamples, shouldOverdub);
+    }
+
+    // New input is divided by the loop's playback gain, so it is heard at the overdub gain whatever the loop is heard at
+    BufferKernels::BalancedOverdub getBalancedOverdubKernel (const float loopPlaybackGain = 1.0f) const
+    {
+        return { (float) overdubOldGain, (float) overdubNewGain / loopPlaybackGain };
     }
 
     // bool isNormalizingOutput() const { return shouldNormalizeOutput; }
@@ -113,11 +154,10 @@ private:
     // bool shouldNormalizeOutput = true;
 
     float previousTrackVolume = 1.0f;
+    float previousSourceGain = 1.0f;
     bool soloed = DEFAULT_SOLO_STATE;
     bool muted = DEFAULT_MUTE_STATE;
 
-    int crossFadeLength = 0;
-
     double sampleRate = 0.0;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VolumeProcessor)
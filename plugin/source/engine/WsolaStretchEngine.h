@@ -0,0 +1,323 @@
+#pragma once
+
+#include "engine/BufferKernels.h"
+#include "engine/Constants.h"
+#include "engine/TimeStretchEngine.h"
+#include "profiler/PerfettoProfiler.h"
+#include <JuceHeader.h>
+#include <cmath>
+#include <vector>
+
+/**
+ * In-house WSOLA time-stretcher, lighter than SoundTouch for the common practice case of slowing a
+ * loop down with its pitch kept.
+ *
+ * Output is built from sequences of source cut at nominal steps of tempo * (sequence - overlap).
+ * Each new sequence starts wherever, within a seek window around its nominal position, it best
+ * matches the tail of the previous one, and the two are crossfaded over the overlap. The match is
+ * searched once on the sum of all channels and applied to every channel, so stereo stays linked.
+ * The search is a normalised cross-correlation, taken every searchStep positions and refined around
+ * the best, with the products summed four at a time. Pitch shifts resample the stretched output with
+ * a cubic interpolator, which is plenty for the ±2 semitone range tracks allow.
+ *
+ * Quality tiers trade sequence, seek and overlap lengths, and the coarseness of the search, against
+ * CPU. A new tier takes effect at the next reset(). Buffers are sized for the largest tier in
+ * prepareToPlay.
+ */
+class WsolaStretchEngine : public TimeStretchEngine
+{
+public:
+    WsolaStretchEngine() {}
+
+    void setQuality (const StretchQuality newQuality) { quality = newQuality; }
+    StretchQuality getQuality() const { return quality; }
+
+    void prepareToPlay (const double newSampleRate, const int numChannels, const int newMaxBlockSize) override
+    {
+        PERFETTO_FUNCTION();
+        sampleRate = newSampleRate;
+        channels = juce::jlimit (1, MAX_NUM_CHANNELS, numChannels);
+        maxBlockSize = newMaxBlockSize;
+
+        const auto largest = getTier (StretchQuality::High);
+        const int maxSequence = toSamples (largest.sequenceMs);
+        const int maxSeek = toSamples (largest.seekMs);
+        const int maxOverlap = toSamples (largest.overlapMs);
+
+        inputCapacity = 2 * (maxSeek + maxSequence + maxOverlap) + 6 * maxBlockSize;
+        outputCapacity = 2 * maxSequence + 6 * maxBlockSize;
+        input.setSize (channels, inputCapacity);
+        output.setSize (channels, outputCapacity);
+        tail.setSize (channels, maxOverlap);
+        searchMid.resize ((size_t) (maxSeek + maxOverlap + 1));
+        tailMid.resize ((size_t) maxOverlap);
+        energy.resize ((size_t) (maxSeek + maxOverlap + 2));
+
+        reset();
+    }
+
+    void releaseResources() override
+    {
+        input.setSize (0, 0);
+        output.setSize (0, 0);
+        tail.setSize (0, 0);
+        searchMid.clear();
+        tailMid.clear();
+        energy.clear();
+    }
+
+    void reset() override
+    {
+        const auto tier = getTier (quality);
+        sequence = toSamples (tier.sequenceMs);
+        overlap = std::max (1, toSamples (tier.overlapMs));
+        halfSeek = toSamples (tier.seekMs) / 2;
+        searchStep = tier.searchStep;
+
+        inputStart = inputEnd = 0;
+        outputStart = outputEnd = 0;
+        haveTail = false;
+        skipDebt = 0.0;
+        resamplePosition = 0.0;
+    }
+
+    void setParameters (const double tempo, const double rate, const double pitchSemitones) override
+    {
+        speed = tempo * rate;
+        pitchRatio = rate * std::pow (2.0, pitchSemitones / 12.0);
+        stretchTempo = speed / pitchRatio;
+    }
+
+    // The first sequence, a seek window and an overlap of margin, and a block's worth of source
+    int getPrimingSamples() const override
+    {
+        return sequence + halfSeek + overlap + (int) std::ceil ((double) maxBlockSize * speed) + 2;
+    }
+
+    void putSamples (const juce::AudioBuffer<float>& source, int numFrames) override
+    {
+        PERFETTO_FUNCTION();
+        if (inputEnd + numFrames > inputCapacity) compactInput();
+        if (inputEnd + numFrames > inputCapacity)
+        {
+            jassertfalse; // fed far more than it was asked for
+            numFrames = inputCapacity - inputEnd;
+        }
+
+        for (int ch = 0; ch < channels; ++ch)
+            input.copyFrom (ch, inputEnd, source, std::min (ch, source.getNumChannels() - 1), 0, numFrames);
+        inputEnd += numFrames;
+
+        process();
+    }
+
+    int addReceived (juce::AudioBuffer<float>& destination, const int numFrames) override
+    {
+        PERFETTO_FUNCTION();
+
+        // Cubic interpolation needs one sample behind the position and two ahead
+        int frames = 0;
+        double position = resamplePosition;
+        while (frames < numFrames && outputStart + (int) position + 2 < outputEnd)
+        {
+            ++frames;
+            position += pitchRatio;
+        }
+
+        for (int ch = 0; ch < std::min (channels, destination.getNumChannels()); ++ch)
+        {
+            const float* stretched = output.getReadPointer (ch);
+            float* dest = destination.getWritePointer (ch);
+            double readPosition = resamplePosition;
+            for (int i = 0; i < frames; ++i, readPosition += pitchRatio)
+            {
+                const int index = outputStart + (int) readPosition;
+                const float fraction = (float) (readPosition - (int) readPosition);
+                const float previous = stretched[std::max (0, index - 1)];
+                dest[i] += hermite (previous, stretched[index], stretched[index + 1], stretched[index + 2], fraction);
+            }
+        }
+
+        const int consumed = (int) position;
+        outputStart += consumed;
+        resamplePosition = position - consumed;
+        return frames;
+    }
+
+private:
+    struct Tier
+    {
+        double sequenceMs;
+        double seekMs;
+        double overlapMs;
+        int searchStep;
+    };
+
+    static Tier getTier (const StretchQuality tierQuality)
+    {
+        switch (tierQuality)
+        {
+            case StretchQuality::Fast:
+                return { 40.0, 10.0, 6.0, 4 };
+            case StretchQuality::Balanced:
+                return { 60.0, 15.0, 8.0, 2 };
+            case StretchQuality::High:
+                break;
+        }
+        return { 82.0, 28.0, 12.0, 1 };
+    }
+
+    StretchQuality quality = DEFAULT_STRETCH_QUALITY;
+    double sampleRate = 44100.0;
+    int channels = 1;
+    int maxBlockSize = 0;
+
+    double speed = 1.0;
+    double pitchRatio = 1.0;
+    double stretchTempo = 1.0;
+
+    int sequence = 0;
+    int overlap = 1;
+    int halfSeek = 0;
+    int searchStep = 1;
+
+    juce::AudioBuffer<float> input;  // source; [inputStart - halfSeek, inputEnd) is kept for the search
+    juce::AudioBuffer<float> output; // stretched, before the pitch resampler
+    juce::AudioBuffer<float> tail;   // end of the last sequence, crossfaded into the next
+    std::vector<float> searchMid, tailMid;
+    std::vector<double> energy;
+    int inputCapacity = 0, outputCapacity = 0;
+    int inputStart = 0, inputEnd = 0;
+    int outputStart = 0, outputEnd = 0;
+    bool haveTail = false;
+    double skipDebt = 0.0;
+    double resamplePosition = 0.0;
+
+    int toSamples (const double ms) const { return (int) (sampleRate * ms / 1000.0); }
+
+    void process()
+    {
+        const int produced = sequence - overlap;
+        while (inputEnd - inputStart >= (haveTail ? halfSeek : 0) + sequence)
+        {
+            if (outputEnd + produced > outputCapacity) compactOutput();
+            if (outputEnd + produced > outputCapacity) break; // caught up; the rest waits in the input
+
+            const int start = haveTail ? findBestSequenceStart() : inputStart;
+            for (int ch = 0; ch < channels; ++ch)
+            {
+                const float* source = input.getReadPointer (ch, start);
+                float* dest = output.getWritePointer (ch, outputEnd);
+                float* tailData = tail.getWritePointer (ch);
+
+                if (haveTail)
+                {
+                    const float step = 1.0f / (float) overlap;
+                    for (int i = 0; i < overlap; ++i)
+                        dest[i] = tailData[i] + ((float) i * step) * (source[i] - tailData[i]);
+                }
+                else
+                {
+                    juce::FloatVectorOperations::copy (dest, source, overlap);
+                }
+
+                juce::FloatVectorOperations::copy (dest + overlap, source + overlap, produced - overlap);
+                juce::FloatVectorOperations::copy (tailData, source + produced, overlap);
+            }
+
+            outputEnd += produced;
+            haveTail = true;
+
+            skipDebt += stretchTempo * produced;
+            const int skip = (int) skipDebt;
+            skipDebt -= skip;
+            inputStart += skip;
+        }
+    }
+
+    // Where, within the seek window around inputStart, the source best continues the last tail
+    int findBestSequenceStart()
+    {
+        PERFETTO_FUNCTION();
+        const int searchStart = std::max (0, inputStart - halfSeek);
+        const int positions = inputStart + halfSeek - searchStart;
+        const int span = positions + overlap;
+
+        juce::FloatVectorOperations::copy (searchMid.data(), input.getReadPointer (0, searchStart), span);
+        juce::FloatVectorOperations::copy (tailMid.data(), tail.getReadPointer (0), overlap);
+        for (int ch = 1; ch < channels; ++ch)
+        {
+            juce::FloatVectorOperations::add (searchMid.data(), input.getReadPointer (ch, searchStart), span);
+            juce::FloatVectorOperations::add (tailMid.data(), tail.getReadPointer (ch), overlap);
+        }
+
+        energy[0] = 0.0;
+        for (int i = 0; i < span; ++i)
+            energy[(size_t) i + 1] = energy[(size_t) i] + (double) searchMid[(size_t) i] * searchMid[(size_t) i];
+
+        // Silence and ties keep the nominal position
+        int best = inputStart - searchStart;
+        double bestScore = score (best);
+        for (int p = 0; p < positions; p += searchStep)
+            considerPosition (p, best, bestScore);
+
+        const int coarseBest = best;
+        for (int p = std::max (0, coarseBest - searchStep + 1); p < std::min (positions, coarseBest + searchStep); ++p)
+            considerPosition (p, best, bestScore);
+
+        return searchStart + best;
+    }
+
+    void considerPosition (const int position, int& best, double& bestScore) const
+    {
+        const double candidate = score (position);
+        if (candidate > bestScore)
+        {
+            bestScore = candidate;
+            best = position;
+        }
+    }
+
+    double score (const int position) const
+    {
+        const double correlation = BufferKernels::detail::dot (tailMid.data(), searchMid.data() + position, overlap);
+        const double norm = energy[(size_t) (position + overlap)] - energy[(size_t) position];
+        return correlation / std::sqrt (std::max (norm, 1.0e-9));
+    }
+
+    void compactInput()
+    {
+        const int keep = std::max (0, inputStart - halfSeek);
+        if (keep == 0) return;
+        for (int ch = 0; ch < channels; ++ch)
+        {
+            float* data = input.getWritePointer (ch);
+            std::memmove (data, data + keep, (size_t) (inputEnd - keep) * sizeof (float));
+        }
+        inputStart -= keep;
+        inputEnd -= keep;
+    }
+
+    void compactOutput()
+    {
+        const int keep = std::max (0, outputStart - 1); // one sample of history for the interpolator
+        if (keep == 0) return;
+        for (int ch = 0; ch < channels; ++ch)
+        {
+            float* data = output.getWritePointer (ch);
+            std::memmove (data, data + keep, (size_t) (outputEnd - keep) * sizeof (float));
+        }
+        outputStart -= keep;
+        outputEnd -= keep;
+    }
+
+    static float hermite (const float previous, const float current, const float next, const float afterNext, const float fraction)
+    {
+        const float c1 = 0.5f * (next - previous);
+        const float c2 = previous - 2.5f * current + 2.0f * next - 0.5f * afterNext;
+        const float c3 = 0.5f * (afterNext - previous) + 1.5f * (current - next);
+        return ((c3 * fraction + c2) * fraction + c1) * fraction + current;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (WsolaStretchEngine)
+};
@@ -16,7 +16,7 @@ public:
         contentComponent = std::make_unique<ContentComponent> (monitor);
         setContentOwned (contentComponent.get(), true);
 
-        centreWithSize (400, 300);
+        centreWithSize (400, 420);
         setVisible (true);
     }
 
@@ -123,6 +123,36 @@ private:
             double xrunRate = totalBlocks > 0 ? (double) xruns / totalBlocks * 100.0 : 0.0;
             g.drawText ("Overrun Rate:", leftMargin, y, 150, 20, juce::Justification::left);
             g.drawText (juce::String (xrunRate, 3) + "%", leftMargin + 150, y, 100, 20, juce::Justification::left);
+            y += lineHeight;
+
+            y += 10; // Spacing
+
+            // Loop memory shared by all tracks
+            g.setColour (LooperTheme::Colors::text);
+            g.drawText ("Loop Memory:", leftMargin, y, 150, 20, juce::Justification::left);
+            g.drawText (juce::String (monitor->getLoopArenaResidentMB(), 0) + " / " + juce::String (monitor->getLoopArenaBudgetMB(), 0) + " MB",
+                        leftMargin + 150,
+                        y,
+                        200,
+                        20,
+                        juce::Justification::left);
+            y += lineHeight;
+
+            y += 10; // Spacing
+
+            // Undo history compression
+            g.setColour (LooperTheme::Colors::text);
+            g.drawText ("Undo Compression:", leftMargin, y, 150, 20, juce::Justification::left);
+            g.drawText (juce::String (monitor->getUndoCompressionRatio(), 2) + "x", leftMargin + 150, y, 100, 20, juce::Justification::left);
+            y += lineHeight;
+
+            g.setColour (LooperTheme::Colors::textDim);
+            g.drawText ("Undo Memory Saved:", leftMargin, y, 150, 20, juce::Justification::left);
+            g.drawText (juce::String (monitor->getUndoMemorySavedMB(), 1) + " MB", leftMargin + 150, y, 100, 20, juce::Justification::left);
+            y += lineHeight;
+
+            g.drawText ("Undo On Disk:", leftMargin, y, 150, 20, juce::Justification::left);
+            g.drawText (juce::String (monitor->getUndoOnDiskMB(), 1) + " MB", leftMargin + 150, y, 100, 20, juce::Justification::left);
         }
 
         void resized() override { resetButton.setBounds (getWidth() - 120, getHeight() - 40, 100, 30); }
@@ -146,7 +146,7 @@ void WaveformComponent::handleAsyncUpdate()
         backgroundProcessor.addJob (
             [this, capturedSnapshot = std::move (snapshot), targetWidth]() mutable
             {
-                cache.updateFromBuffer (capturedSnapshot.buffer, capturedSnapshot.length, targetWidth);
+                cache.updateFromBuffer (capturedSnapshot.buffer, capturedSnapshot.length, targetWidth, &capturedSnapshot.silence);
                 juce::MessageManager::callAsync ([this]() { repaint(); });
             });
     }
@@ -24,10 +24,10 @@ public:
         {
             auto channel = std::make_unique<TrackComponent> (engine->getMessageBus(),
                                                              i,
-                                                             engine->getTrackByIndex (i)->getUIBridge(),
+                                                             engine->getTrackUIBridge (i),
                                                              engine->getAutomationEngine());
-            channels[(size_t) i] = std::move (channel);
-            addAndMakeVisible (*channels[(size_t) i]);
+            addAndMakeVisible (*channel);
+            channels.push_back (std::move (channel));
         }
 
         addAndMakeVisible (*globalBar);
@@ -53,10 +53,8 @@ public:
 
         mainFlex.items.add (juce::FlexItem (*globalBar).withFlex (0.3f));
 
-        for (int i = 0; i < NUM_TRACKS; ++i)
+        for (auto& channel : channels)
         {
-            auto* channel = channels[(size_t) i].get();
-
             mainFlex.items.add (juce::FlexItem().withFlex (0.05f)); // spacer between tracks
             mainFlex.items.add (juce::FlexItem (*channel).withFlex (0.8f));
         }
@@ -76,7 +74,7 @@ public:
 
 private:
     std::unique_ptr<GlobalControlBar> globalBar;
-    std::array<std::unique_ptr<TrackComponent>, NUM_TRACKS> channels;
+    std::vector<std::unique_ptr<TrackComponent>> channels;
     std::unique_ptr<FooterComponent> footerComponent;
     std::unique_ptr<MidiMappingComponent> midiMappingComponent;
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "engine/LoopSilenceMap.h"
 #include "profiler/PerfettoProfiler.h"
 #include <JuceHeader.h>
 
@@ -17,7 +18,11 @@ public:
         numChannels.store (0, std::memory_order_relaxed);
     }
 
-    void updateFromBuffer (const juce::AudioBuffer<float>& source, int sourceLength, int targetWidth)
+    // Pixels lying wholly in regions the silence map marks silent are drawn flat without scanning their samples
+    void updateFromBuffer (const juce::AudioBuffer<float>& source,
+                           int sourceLength,
+                           int targetWidth,
+                           const LoopSilenceMap* silence = nullptr)
     {
         PERFETTO_FUNCTION();
         if (targetWidth <= 0 || sourceLength <= 0) return;
@@ -39,10 +44,13 @@ public:
                 int end = std::min (start + samplesPerPixel, sourceLength);
 
                 float min = 0.0f, max = 0.0f;
-                for (int i = start; i < end; ++i)
+                if (silence == nullptr || ! silence->isSilent (start, end - start))
                 {
-                    min = std::min (min, data[i]);
-                    max = std::max (max, data[i]);
+                    for (int i = start; i < end; ++i)
+                    {
+                        min = std::min (min, data[i]);
+                        max = std::max (max, data[i]);
+                    }
                 }
                 scratchBuffer[(size_t) ch][(size_t) pixel] = { min, max };
             }
@@ -1,17 +1,32 @@
 #include "audio/EngineCommandBus.h"
+#include "engine/AudioFileLoader.h"
+#include "engine/BackingTrackStream.h"
 #include "engine/BufferManager.h"
+#include "engine/ChunkedLoopBuffer.h"
 #include "engine/Constants.h"
+#include "engine/LayerFinalizer.h"
 #include "engine/LevelMeter.h"
+#include "engine/LoopBlockPool.h"
 #include "engine/LoopFifo.h"
+#include "engine/LoopPeakTable.h"
 #include "engine/LoopLifo.h"
+#include "engine/LoopSilenceMap.h"
 #include "engine/Metronome.h"
 #include "engine/PlaybackEngine.h"
+#include "engine/ScratchBufferPool.h"
+#include "engine/StretchPipeline.h"
+#include "engine/TrackRenderPool.h"
+#include "engine/UndoLayerCodec.h"
 #include "engine/UndoManager.h"
+#include "engine/VarispeedReader.h"
+#include "engine/UndoSpillFile.h"
 #include "engine/VolumeProcessor.h"
+#include "engine/WsolaStretchEngine.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 using ::testing::Eq;
+using ::testing::UnorderedElementsAre;
 using ::testing::FloatNear;
 
 // ============================================================================
@@ -361,6 +376,20 @@ TEST_F (LoopLifoTest, ClearResetsState)
     EXPECT_EQ (lifo.getSlotToPush(), 0);
 }
 
+TEST_F (LoopLifoTest, TracksResidencyPerSlot)
+{
+    lifo.finishedWrite (1, false);
+    lifo.finishedWrite (1, false);
+    lifo.setResidency (0, LoopLifo::Residency::OnDisk);
+
+    EXPECT_FALSE (lifo.isResident (lifo.getLayerIndexAtDepth (2)));
+    EXPECT_TRUE (lifo.isResident (lifo.getLayerIndexAtDepth (1)));
+    EXPECT_EQ (lifo.getNumLayersWithResidency (LoopLifo::Residency::OnDisk), 1);
+
+    lifo.clear();
+    EXPECT_TRUE (lifo.isResident (0));
+}
+
 // ============================================================================
 // LevelMeter Tests
 // ============================================================================
@@ -691,25 +720,6 @@ TEST_F (VolumeProcessorTest, SaveBalancedLayersRecordMode)
     EXPECT_NEAR (dest[0], 0.4f, 0.01f);
 }
 
-TEST_F (VolumeProcessorTest, ApplyCrossfadeFadesInAndOut)
-{
-    processor.setCrossFadeLength (100);
-
-    for (int i = 0; i < 512; ++i)
-    {
-        buffer.setSample (0, i, 1.0f);
-    }
-
-    processor.applyCrossfade (buffer, 512);
-
-    // First sample should be near zero (fade in)
-    EXPECT_LT (buffer.getSample (0, 0), 0.1f);
-    // Last sample should be near zero (fade out)
-    EXPECT_LT (buffer.getSample (0, 511), 0.1f);
-    // Middle should be full volume
-    EXPECT_NEAR (buffer.getSample (0, 256), 1.0f, 0.1f);
-}
-
 TEST_F (VolumeProcessorTest, ClearResetsState)
 {
     processor.setTrackVolume (0.5f);
@@ -723,16 +733,123 @@ TEST_F (VolumeProcessorTest, ClearResetsState)
     EXPECT_FALSE (processor.isSoloed());
 }
 
+TEST_F (VolumeProcessorTest, AddWithVolumeScalesOnlyTheSource)
+{
+    juce::AudioBuffer<float> mix (2, 64), stem (2, 64);
+    for (int ch = 0; ch < 2; ++ch)
+    {
+        juce::FloatVectorOperations::fill (mix.getWritePointer (ch), 1.0f, 64);
+        juce::FloatVectorOperations::fill (stem.getWritePointer (ch), 0.5f, 64);
+    }
+
+    processor.setTrackVolume (0.5f);
+    processor.addWithVolume (mix, stem, 64); // ramps from the previous volume
+    processor.addWithVolume (mix, stem, 64);
+    EXPECT_NEAR (mix.getSample (1, 63), 1.0f + 0.5f * (1.0f - 0.5f * 63.0f / 64.0f) + 0.25f, 1.0e-6f);
+
+    // A silent stem adds nothing, but the ramp still moves on
+    processor.setTrackVolume (1.0f);
+    processor.addWithVolume (mix, stem, 64, true);
+    juce::AudioBuffer<float> fresh (2, 64);
+    fresh.clear();
+    processor.addWithVolume (fresh, stem, 64);
+    EXPECT_FLOAT_EQ (fresh.getSample (0, 0), 0.5f);
+}
+
+TEST_F (VolumeProcessorTest, NormalizingALoopOnlyMovesItsPlaybackGain)
+{
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 256, 8, 8);
+    ChunkedLoopBuffer layer;
+    layer.prepareToPlay (pool, 1024);
+    for (int ch = 0; ch < 2; ++ch)
+        layer.forEachWritableRun (ch, 0, 1000, [] (float* dest, int, int n) { std::fill_n (dest, n, 0.2f); });
+
+    VolumeProcessor::normalizeOutput (layer, 1000);
+    EXPECT_FLOAT_EQ (layer.getPlaybackGain(), NORMALIZE_TARGET_LEVEL / 0.2f);
+    EXPECT_FLOAT_EQ (layer.getSample (0, 500), NORMALIZE_TARGET_LEVEL);
+
+    // Stored samples are untouched, so normalising again changes nothing
+    VolumeProcessor::normalizeOutput (layer, 1000);
+    EXPECT_FLOAT_EQ (layer.getPlaybackGain(), NORMALIZE_TARGET_LEVEL / 0.2f);
+    layer.forEachReadableRun (1, 0, 1000, [] (const float* source, int, int n) { EXPECT_EQ (source[n - 1], 0.2f); });
+
+    // Overdubs are divided by the playback gain, so they are heard at their own gain
+    const auto kernel = processor.getBalancedOverdubKernel (layer.getPlaybackGain());
+    float stored = 0.2f;
+    const float input = 0.1f;
+    kernel (&stored, &input, 1, true);
+    EXPECT_FLOAT_EQ (stored * layer.getPlaybackGain(), NORMALIZE_TARGET_LEVEL + 0.1f);
+    layer.releaseResources();
+
+    // 16-bit storage is rescaled instead and keeps unity gain
+    LoopBlockPool int16Pool;
+    int16Pool.prepareToPlay (2, 256, 8, 8, false, LoopSampleFormat::Int16);
+    ChunkedLoopBuffer int16Layer;
+    int16Layer.prepareToPlay (int16Pool, 1024);
+    for (int ch = 0; ch < 2; ++ch)
+        int16Layer.forEachWritableRun (ch, 0, 1000, [] (float* dest, int, int n) { std::fill_n (dest, n, 0.2f); });
+    VolumeProcessor::normalizeOutput (int16Layer, 1000);
+    EXPECT_FLOAT_EQ (int16Layer.getPlaybackGain(), 1.0f);
+    EXPECT_NEAR (int16Layer.getSample (0, 500), NORMALIZE_TARGET_LEVEL, 1e-3f);
+    int16Layer.releaseResources();
+}
+
+TEST_F (VolumeProcessorTest, InaudibleOnceMuteHasFadedOut)
+{
+    juce::AudioBuffer<float> block (2, 64);
+    block.clear();
+    processor.setTrackVolume (0.8f);
+    processor.applyVolume (block, 64);
+    EXPECT_FALSE (processor.isInaudible());
+
+    // The block after muting still ramps down, so it must be rendered
+    processor.setMuted (true);
+    EXPECT_FALSE (processor.isInaudible());
+    processor.applyVolume (block, 64);
+    EXPECT_TRUE (processor.isInaudible());
+
+    processor.setMuted (false);
+    EXPECT_FALSE (processor.isInaudible());
+}
+
 // ============================================================================
 // PlaybackEngine Tests
 // ============================================================================
 
+namespace
+{
+constexpr double VARISPEED_TEST_PERIOD = 48.0; // Source sine period in samples; a whole number of periods fits every test loop
+
+float varispeedTestSine (const double position)
+{
+    return (float) std::sin (juce::MathConstants<double>::twoPi * position / VARISPEED_TEST_PERIOD);
+}
+
+void fillWithVarispeedTestSine (BufferManager& manager, const int loopLength)
+{
+    juce::AudioBuffer<float> loop (2, loopLength);
+    for (int ch = 0; ch < 2; ++ch)
+        for (int i = 0; i < loopLength; ++i)
+            loop.setSample (ch, i, varispeedTestSine (i));
+
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, loop, loopLength, false, false);
+    manager.finalizeLayer (false, loopLength);
+}
+} // namespace
+
 class PlaybackEngineTest : public ::testing::Test
 {
 protected:
+    LoopBlockPool cachePool; // outlives the blocks the engine's cache draws from it
     PlaybackEngine engine;
+    ScratchBufferPool scratch;
 
-    void SetUp() override { engine.prepareToPlay (44100.0, 4096, 2, 512); }
+    void SetUp() override
+    {
+        scratch.prepareToPlay (2, 512, 2);
+        engine.prepareToPlay (44100.0, 2, 512, scratch);
+    }
 };
 
 TEST_F (PlaybackEngineTest, InitializesWithDefaultSpeed) { EXPECT_FLOAT_EQ (engine.getPlaybackSpeed(), 1.0f); }
@@ -812,6 +929,491 @@ TEST_F (PlaybackEngineTest, SetKeepPitchWhenChangingSpeedUpdates)
     EXPECT_FALSE (engine.shouldKeepPitchWhenChangingSpeed());
 }
 
+TEST_F (PlaybackEngineTest, VarispeedWithoutPitchLockHasNoLatency)
+{
+    EXPECT_TRUE (engine.isNativeVarispeedEnabled());
+
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+
+    engine.setKeepPitchWhenChangingSpeed (false);
+    engine.setPlaybackSpeed (1.5f);
+
+    // The loop comes out from the first sample, at the new speed and pitch
+    juce::AudioBuffer<float> output (2, 512);
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+
+    for (int ch = 0; ch < 2; ++ch)
+        for (int i = 0; i < 512; ++i)
+            ASSERT_NEAR (output.getSample (ch, i), varispeedTestSine (1.5 * i), 2.0e-3f) << "ch " << ch << " i " << i;
+    EXPECT_EQ (manager.getReadPosition(), 768);
+}
+
+TEST_F (PlaybackEngineTest, PitchLockedStretchCutsEveryChannelAtTheSameSplice)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    juce::AudioBuffer<float> loop (2, 4800);
+    for (int i = 0; i < 4800; ++i)
+    {
+        loop.setSample (0, i, varispeedTestSine (i));
+        loop.setSample (1, i, -0.5f * varispeedTestSine (i));
+    }
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, loop, 4800, false, false);
+    manager.finalizeLayer (false, 4800);
+    manager.setReadPosition (0);
+
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+
+    juce::AudioBuffer<float> output (2, 512);
+    float peak = 0.0f;
+    for (int block = 0; block < 20; ++block)
+    {
+        output.clear();
+        engine.processPlayback (output, manager, 512, false);
+
+        // Right is a scaled copy of left, so with one splice for both it stays one after stretching
+        for (int i = 0; i < 512; ++i)
+            ASSERT_NEAR (output.getSample (1, i), -0.5f * output.getSample (0, i), 1.0e-5f) << "block " << block << " i " << i;
+        peak = std::max (peak, output.getMagnitude (0, 0, 512));
+    }
+    EXPECT_GT (peak, 0.5f);
+}
+
+TEST_F (PlaybackEngineTest, StretcherIdlesOnTheFastPathAndFeedsExactlyWhatPlays)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+    juce::AudioBuffer<float> output (2, 512);
+
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+    EXPECT_FALSE (engine.isStretchRunning());
+
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+    for (int block = 0; block < 50; ++block)
+    {
+        output.clear();
+        engine.processPlayback (output, manager, 512, false);
+    }
+    ASSERT_TRUE (engine.isStretchRunning());
+
+    // Fifty blocks at 0.7x advance the playhead by 17920 samples, and that is all the stretcher was fed beyond its
+    // priming, give or take the fraction of a sample still owed
+    EXPECT_NEAR ((double) engine.getStretchSourceSamplesFed(), 17920.0, 1.0);
+    EXPECT_NEAR (manager.getExactReadPosition(), std::fmod (512.0 + 17920.0, 4800.0), 0.01);
+
+    engine.setPlaybackSpeed (1.0f);
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+    EXPECT_FALSE (engine.isStretchRunning());
+}
+
+TEST_F (PlaybackEngineTest, PathChangesCrossfadeFromTheOutgoingPath)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+    juce::AudioBuffer<float> output (2, 512);
+
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+
+    // The switch to varispeed starts from the unity read and ends on the new path
+    engine.setKeepPitchWhenChangingSpeed (false);
+    engine.setPlaybackSpeed (1.5f);
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+
+    for (int ch = 0; ch < 2; ++ch)
+    {
+        EXPECT_NEAR (output.getSample (ch, 0), varispeedTestSine (512.0), 1.0e-3f);
+        EXPECT_NEAR (output.getSample (ch, 511), varispeedTestSine (512.0 + 1.5 * 511.0), 1.0e-2f);
+    }
+}
+
+TEST_F (PlaybackEngineTest, WsolaBackendStretchesAndSwitchesBackendWithoutStopping)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+    juce::AudioBuffer<float> output (2, 512);
+
+    engine.setTimeStretchBackend (TimeStretchBackend::Wsola);
+    engine.setStretchQuality (StretchQuality::Fast);
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+    for (int block = 0; block < 50; ++block)
+    {
+        output.clear();
+        engine.processPlayback (output, manager, 512, false);
+    }
+    ASSERT_TRUE (engine.isStretchRunning());
+    EXPECT_GT (output.getMagnitude (0, 0, 512), 0.5f);
+    EXPECT_NEAR ((double) engine.getStretchSourceSamplesFed(), 17920.0, 1.0);
+
+    // A new backend takes over from the playhead, crossfading from the old one
+    engine.setTimeStretchBackend (TimeStretchBackend::SoundTouch);
+    output.clear();
+    engine.processPlayback (output, manager, 512, false);
+    EXPECT_TRUE (engine.isStretchRunning());
+    EXPECT_NEAR ((double) engine.getStretchSourceSamplesFed(), 0.7 * 512.0, 1.0);
+}
+
+TEST_F (PlaybackEngineTest, OffloadedStretchMatchesInlineStretch)
+{
+    if (! StretchOffloadWorker::isSupported()) GTEST_SKIP() << "stretch offload needs a second core";
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    BufferManager offloadedManager;
+    offloadedManager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (offloadedManager, 4800);
+
+    StretchOffloadWorker worker;
+    worker.start (44100.0, 512);
+    ScratchBufferPool offloadedScratch;
+    offloadedScratch.prepareToPlay (2, 512, 2);
+    PlaybackEngine offloaded;
+    offloaded.prepareToPlay (44100.0, 2, 512, offloadedScratch);
+    offloaded.setStretchOffloadWorker (&worker);
+    offloaded.setStretchOffloadEnabled (true);
+
+    for (auto* e : { &engine, &offloaded })
+    {
+        e->setTimeStretchBackend (TimeStretchBackend::Wsola);
+        e->setStretchQuality (StretchQuality::Fast);
+        e->setKeepPitchWhenChangingSpeed (true);
+        e->setPlaybackSpeed (0.7f);
+    }
+
+    // Small host blocks, with a speed change halfway through that has to travel with the queued jobs
+    juce::AudioBuffer<float> expected (2, 64);
+    juce::AudioBuffer<float> output (2, 64);
+    for (int block = 0; block < 400; ++block)
+    {
+        if (block == 200)
+            for (auto* e : { &engine, &offloaded })
+                e->setPlaybackSpeed (1.3f);
+
+        expected.clear();
+        output.clear();
+        engine.processPlayback (expected, manager, 64, false);
+        offloaded.processPlayback (output, offloadedManager, 64, false);
+        ASSERT_TRUE (offloaded.isStretchOffloaded());
+
+        // A block that found the worker mid-job plays short rather than waiting, so the outputs only match up to it
+        if (offloaded.getStretchOffloadUnderruns() > 0) continue;
+        for (int ch = 0; ch < 2; ++ch)
+            for (int i = 0; i < 64; ++i)
+                ASSERT_NEAR (output.getSample (ch, i), expected.getSample (ch, i), 1.0e-5f) << "block " << block << ", sample " << i;
+    }
+    EXPECT_EQ (offloadedManager.getReadPosition(), manager.getReadPosition());
+    EXPECT_EQ (offloaded.getStretchSourceSamplesFed(), engine.getStretchSourceSamplesFed());
+
+    offloaded.releaseResources();
+    offloaded.setStretchOffloadWorker (nullptr);
+    worker.stop();
+}
+
+TEST_F (PlaybackEngineTest, RecordingKeepsStretchInline)
+{
+    if (! StretchOffloadWorker::isSupported()) GTEST_SKIP() << "stretch offload needs a second core";
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    juce::AudioBuffer<float> output (2, 64);
+
+    // Never started: the audio thread runs every job itself when it collects the output
+    StretchOffloadWorker worker;
+    engine.setStretchOffloadWorker (&worker);
+    engine.setStretchOffloadEnabled (true);
+    engine.setTimeStretchBackend (TimeStretchBackend::Wsola);
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+
+    engine.processPlayback (output, manager, 64, false);
+    EXPECT_TRUE (engine.isStretchOffloaded());
+
+    engine.setLoopRecordedThisBlock (true);
+    engine.processPlayback (output, manager, 64, false);
+    EXPECT_FALSE (engine.isStretchOffloaded());
+    EXPECT_TRUE (engine.isStretchRunning());
+
+    engine.setLoopRecordedThisBlock (false);
+    output.clear();
+    engine.processPlayback (output, manager, 64, false);
+    EXPECT_TRUE (engine.isStretchOffloaded());
+    EXPECT_GT (output.getMagnitude (0, 0, 64), 0.0f);
+
+    engine.setStretchOffloadWorker (nullptr);
+}
+
+namespace
+{
+// Adds a constant for every frame asked of it, whatever it is fed
+class ConstantStretcher : public TimeStretchEngine
+{
+public:
+    void prepareToPlay (double, int, int) override {}
+    void releaseResources() override {}
+    void reset() override {}
+    void setParameters (double, double, double) override {}
+    int getPrimingSamples() const override { return 0; }
+    void putSamples (const juce::AudioBuffer<float>&, int) override {}
+    int addReceived (juce::AudioBuffer<float>& destination, const int numFrames) override
+    {
+        for (int ch = 0; ch < destination.getNumChannels(); ++ch)
+            juce::FloatVectorOperations::add (destination.getWritePointer (ch), 1.0f, numFrames);
+        return numFrames;
+    }
+};
+} // namespace
+
+TEST (StretchPipelineTest, ShortBlockFadesOutAndResumedOutputFadesIn)
+{
+    ConstantStretcher stretcher;
+    StretchPipeline pipeline;
+    pipeline.prepareToPlay (1, 64);
+    pipeline.renderAhead (stretcher, 64);
+    pipeline.activate (stretcher, 1.0, 1.0, 0.0);
+
+    // Only the rendered-ahead block is there for a block twice its size
+    juce::AudioBuffer<float> output (1, 128);
+    output.clear();
+    EXPECT_EQ (pipeline.popOutput (output, 128), 64);
+    EXPECT_EQ (pipeline.getUnderruns(), 1);
+    EXPECT_FLOAT_EQ (output.getSample (0, 0), 1.0f);
+    EXPECT_LT (output.getSample (0, 63), 0.05f);
+    for (int i = 1; i < 64; ++i)
+        ASSERT_LE (output.getSample (0, i), output.getSample (0, i - 1)) << "sample " << i;
+    EXPECT_EQ (output.getSample (0, 64), 0.0f);
+
+    // The owed block is skipped, and what follows ramps up from silence over the fade, without a step
+    float previous = 0.0f;
+    for (int block = 0; block < 3; ++block)
+    {
+        for (int job = 0; job < (block == 0 ? 2 : 1); ++job)
+        {
+            ASSERT_TRUE (pipeline.canQueue (64, 64));
+            pipeline.commitJob (64, 64, 1.0, 1.0, 0.0);
+        }
+
+        output.clear();
+        ASSERT_EQ (pipeline.popOutput (output, 64), 64);
+        for (int i = 0; i < 64; ++i)
+        {
+            const float sample = output.getSample (0, i);
+            ASSERT_GE (sample, previous) << "block " << block << ", sample " << i;
+            ASSERT_LE (sample - previous, 2.0f / (float) STRETCH_OFFLOAD_UNDERRUN_FADE_SAMPLES) << "block " << block << ", sample " << i;
+            previous = sample;
+        }
+    }
+    EXPECT_FLOAT_EQ (previous, 1.0f);
+    EXPECT_EQ (pipeline.getUnderruns(), 1);
+    pipeline.deactivate();
+}
+
+TEST_F (PlaybackEngineTest, StretchedTrackReplaysCachedPassOnceSettingsHoldForALoop)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+    cachePool.prepareToPlay (2, LOOP_BLOCK_SIZE_SAMPLES, 4, 1);
+    engine.prepareRenderedLoopCache (cachePool, 4800);
+
+    engine.setTimeStretchBackend (TimeStretchBackend::Wsola);
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+
+    // The first pass is stretched; the pass is 4800 / 0.7 samples long, so 14 blocks cover it
+    constexpr int passLength = 6857;
+    juce::AudioBuffer<float> output (2, 512);
+    std::vector<float> expectedPass ((size_t) passLength);
+    for (int block = 0; block < 14; ++block)
+    {
+        output.clear();
+        const double playhead = manager.getExactReadPosition();
+        engine.processPlayback (output, manager, 512, false);
+        EXPECT_FALSE (engine.isPlayingRenderedLoop());
+        for (int i = 0; i < 512 && block * 512 + i < passLength; ++i)
+            expectedPass[(size_t) ((std::llround (playhead / 0.7) + i) % passLength)] = output.getSample (0, i);
+    }
+
+    // After a crossfading block, later passes are read back from where the playhead maps into the first one. The
+    // start of the pass is where the capture's overlap was crossfaded in, so it is not the first pass as played.
+    for (int block = 14; block < 40; ++block)
+    {
+        output.clear();
+        const double playhead = manager.getExactReadPosition();
+        engine.processPlayback (output, manager, 512, false);
+        ASSERT_TRUE (engine.isPlayingRenderedLoop());
+        EXPECT_FALSE (engine.isStretchRunning());
+        if (block == 14) continue;
+
+        for (int i = 0; i < 512; ++i)
+        {
+            const auto index = (size_t) ((std::llround (playhead / 0.7) + i) % passLength);
+            if (index < (size_t) RENDERED_LOOP_SEAM_SAMPLES + 2 || index >= (size_t) passLength - 2) continue;
+            ASSERT_EQ (output.getSample (0, i), expectedPass[index]) << "block " << block << ", sample " << i;
+        }
+    }
+    EXPECT_NEAR (manager.getExactReadPosition(), std::fmod (40 * 512 * 0.7, 4800.0), 1.0e-3);
+}
+
+TEST_F (PlaybackEngineTest, CachedPassWrapsWithoutAJumpWhereTheCaptureStarted)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    manager.setReadPosition (0);
+    cachePool.prepareToPlay (2, LOOP_BLOCK_SIZE_SAMPLES, 4, 1);
+    engine.prepareRenderedLoopCache (cachePool, 4800);
+
+    for (const auto backend : { TimeStretchBackend::Wsola, TimeStretchBackend::SoundTouch })
+    {
+        engine.setTimeStretchBackend (backend);
+        engine.setKeepPitchWhenChangingSpeed (true);
+        engine.setPlaybackSpeed (0.7f);
+        manager.setReadPosition (0);
+
+        // Capture, then read a whole cached pass back in pass order
+        constexpr int passLength = 6857;
+        juce::AudioBuffer<float> output (2, 512);
+        std::vector<float> replayed ((size_t) passLength);
+        for (int block = 0; block < 45; ++block)
+        {
+            output.clear();
+            const double playhead = manager.getExactReadPosition();
+            const bool cached = engine.isPlayingRenderedLoop();
+            engine.processPlayback (output, manager, 512, false);
+            if (! cached || ! engine.isPlayingRenderedLoop()) continue;
+            for (int i = 0; i < 512; ++i)
+                replayed[(size_t) ((std::llround (playhead / 0.7) + i) % passLength)] = output.getSample (0, i);
+        }
+        ASSERT_TRUE (engine.isPlayingRenderedLoop());
+
+        // The capture started at index 0; stepping across it and its overlap is no rougher than anywhere else
+        auto step = [&] (const int index) { return std::abs (replayed[(size_t) index] - replayed[(size_t) ((index + passLength - 1) % passLength)]); };
+        float largestStep = 0.0f, largestSeamStep = 0.0f;
+        for (int index = RENDERED_LOOP_SEAM_SAMPLES + 8; index < passLength - 8; ++index)
+            largestStep = std::max (largestStep, step (index));
+        for (int index = -8; index < RENDERED_LOOP_SEAM_SAMPLES + 8; ++index)
+            largestSeamStep = std::max (largestSeamStep, step ((index + passLength) % passLength));
+        EXPECT_GT (largestStep, 0.0f);
+        EXPECT_LE (largestSeamStep, 1.5f * largestStep) << "wsola " << (backend == TimeStretchBackend::Wsola);
+
+        // A backend change starts a new pass
+        engine.setPlaybackSpeed (1.0f);
+        output.clear();
+        engine.processPlayback (output, manager, 512, false);
+    }
+}
+
+TEST_F (PlaybackEngineTest, RenderedLoopCacheIsDroppedOnRecordingAndSettingsChanges)
+{
+    BufferManager manager;
+    manager.prepareToPlay (2, 4800);
+    fillWithVarispeedTestSine (manager, 4800);
+    cachePool.prepareToPlay (2, LOOP_BLOCK_SIZE_SAMPLES, 4, 1);
+    engine.prepareRenderedLoopCache (cachePool, 4800);
+    engine.setTimeStretchBackend (TimeStretchBackend::Wsola);
+    engine.setKeepPitchWhenChangingSpeed (true);
+    engine.setPlaybackSpeed (0.7f);
+    juce::AudioBuffer<float> output (2, 512);
+
+    auto playBlocks = [&] (const int blocks)
+    {
+        for (int block = 0; block < blocks; ++block)
+        {
+            output.clear();
+            engine.processPlayback (output, manager, 512, false);
+        }
+    };
+
+    playBlocks (15);
+    ASSERT_TRUE (engine.isPlayingRenderedLoop());
+
+    // Recording into the loop takes playback back to the stretcher, which then needs a whole pass again
+    engine.setLoopRecordedThisBlock (true);
+    playBlocks (1);
+    engine.setLoopRecordedThisBlock (false);
+    EXPECT_FALSE (engine.isPlayingRenderedLoop());
+    EXPECT_TRUE (engine.isStretchRunning());
+    playBlocks (10);
+    EXPECT_FALSE (engine.isPlayingRenderedLoop());
+    playBlocks (5);
+    EXPECT_TRUE (engine.isPlayingRenderedLoop());
+
+    // So does any change to what the stretcher would play
+    engine.setPlaybackPitchSemitones (2.0f);
+    playBlocks (1);
+    EXPECT_FALSE (engine.isPlayingRenderedLoop());
+    EXPECT_GT (output.getMagnitude (0, 0, 512), 0.1f);
+
+    engine.setRenderedLoopCacheEnabled (false);
+    playBlocks (40);
+    EXPECT_FALSE (engine.isPlayingRenderedLoop());
+}
+
+TEST_F (PlaybackEngineTest, InaudibleBlocksMoveThePlayheadLikePlayedOnes)
+{
+    BufferManager played, skipped;
+    for (auto* manager : { &played, &skipped })
+    {
+        manager->prepareToPlay (2, 4800);
+        fillWithVarispeedTestSine (*manager, 4800);
+        manager->setReadPosition (0);
+    }
+
+    ScratchBufferPool quietScratch;
+    quietScratch.prepareToPlay (2, 512, 3);
+    PlaybackEngine quiet;
+    quiet.prepareToPlay (44100.0, 2, 512, quietScratch);
+    for (auto* e : { &engine, &quiet })
+    {
+        e->setKeepPitchWhenChangingSpeed (true);
+        e->setPlaybackSpeed (0.7f);
+        e->setPlaybackDirectionBackward();
+    }
+
+    juce::AudioBuffer<float> output (2, 512);
+    int wraps = 0;
+    for (int block = 0; block < 30; ++block)
+    {
+        output.clear();
+        const bool playedWrapped = engine.processPlayback (output, played, 512, false);
+        const bool skippedWrapped = quiet.advanceInaudibly (skipped, 512, false);
+        ASSERT_EQ (playedWrapped, skippedWrapped) << "block " << block;
+        ASSERT_EQ (played.getExactReadPosition(), skipped.getExactReadPosition()) << "block " << block;
+        wraps += playedWrapped ? 1 : 0;
+    }
+    EXPECT_GT (wraps, 0);
+    EXPECT_TRUE (engine.isStretchRunning());
+    EXPECT_FALSE (quiet.isStretchRunning());
+    EXPECT_TRUE (quiet.wasLastBlockSilent());
+
+    // Heard again, the stretcher starts from the playhead the skipped blocks left
+    output.clear();
+    engine.processPlayback (output, played, 512, false);
+    output.clear();
+    quiet.processPlayback (output, skipped, 512, false);
+    EXPECT_TRUE (quiet.isStretchRunning());
+    EXPECT_EQ (played.getExactReadPosition(), skipped.getExactReadPosition());
+    EXPECT_GT (output.getMagnitude (0, 512), 0.1f);
+    quiet.releaseResources();
+}
+
 TEST_F (PlaybackEngineTest, ClearResetsToDefaults)
 {
     engine.setPlaybackSpeed (1.5f);
@@ -829,7 +1431,7 @@ TEST_F (PlaybackEngineTest, ReleaseResourcesClearsState)
     engine.releaseResources();
 
     // After release, should be safe to prepare again
-    engine.prepareToPlay (44100.0, 4096, 2, 512);
+    engine.prepareToPlay (44100.0, 2, 512, scratch);
     EXPECT_FLOAT_EQ (engine.getPlaybackSpeed(), 1.0f);
 }
 
@@ -840,27 +1442,32 @@ TEST_F (PlaybackEngineTest, ReleaseResourcesClearsState)
 class UndoStackManagerTest : public ::testing::Test
 {
 protected:
+    LoopBlockPool pool;
     UndoStackManager undoManager;
-    std::unique_ptr<juce::AudioBuffer<float>> testBuffer;
+    std::unique_ptr<ChunkedLoopBuffer> testBuffer;
 
     void SetUp() override
     {
-        undoManager.prepareToPlay (5, 2, 1000);
-        testBuffer = std::make_unique<juce::AudioBuffer<float>> (2, 1000);
+        // 5 undo + 5 redo + staging + live, 4 blocks of 256 samples each, all distinct in the worst case
+        pool.prepareToPlay (2, 256, 48, 48);
+        undoManager.prepareToPlay (pool, 5, 1000);
+        testBuffer = std::make_unique<ChunkedLoopBuffer>();
+        testBuffer->prepareToPlay (pool, 1000);
     }
 
-    void fillBufferWithValue (juce::AudioBuffer<float>& buffer, float value)
+    void TearDown() override
+    {
+        testBuffer.reset();
+        undoManager.releaseResources();
+    }
+
+    void fillBufferWithValue (ChunkedLoopBuffer& buffer, float value)
     {
         for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
-        {
-            for (int i = 0; i < buffer.getNumSamples(); ++i)
-            {
-                buffer.setSample (ch, i, value);
-            }
-        }
+            buffer.forEachWritableRun (ch, 0, buffer.getNumSamples(), [value] (float* dest, int, int n) { std::fill_n (dest, n, value); });
     }
 
-    float getBufferValue (const juce::AudioBuffer<float>& buffer) { return buffer.getSample (0, 0); }
+    float getBufferValue (const ChunkedLoopBuffer& buffer) { return buffer.getSample (0, 0); }
 };
 
 TEST_F (UndoStackManagerTest, InitializesCorrectly)
@@ -1013,62 +1620,1114 @@ TEST_F (UndoStackManagerTest, ClearResetsAllState)
     EXPECT_FALSE (undoManager.redo (testBuffer));
 }
 
-TEST_F (UndoStackManagerTest, ReleaseResourcesClearsBuffers)
+TEST_F (UndoStackManagerTest, OverdubDuplicatesOnlyTouchedBlocks)
 {
     fillBufferWithValue (*testBuffer, 0.5f);
     undoManager.stageCurrentBuffer (*testBuffer, 1000);
     undoManager.finalizeCopyAndPush (1000);
 
-    undoManager.releaseResources();
+    // The pushed layer shares all four blocks with the live buffer
+    EXPECT_EQ (pool.getNumBlocksInUse(), 4);
 
-    // After release, should be safe to prepare again
-    undoManager.prepareToPlay (3, 2, 500);
-    EXPECT_EQ (undoManager.getNumLayers(), 3);
-}
+    testBuffer->forEachWritableRun (0, 300, 10, [] (float* dest, int, int n) { std::fill_n (dest, n, 0.9f); });
+    EXPECT_EQ (pool.getNumBlocksInUse(), 5);
 
-// ============================================================================
-// BufferManager Tests
-// ============================================================================
+    EXPECT_TRUE (undoManager.undo (testBuffer));
+    EXPECT_FLOAT_EQ (testBuffer->getSample (0, 305), 0.5f);
+}
 
-class BufferManagerTest : public ::testing::Test
+TEST_F (UndoStackManagerTest, OlderLayersAreCompressedAndRestoredForUndo)
 {
-protected:
-    BufferManager manager;
-    juce::AudioBuffer<float> inputBuffer;
-    juce::AudioBuffer<float> outputBuffer;
+    for (int i = 0; i < 4; ++i)
+    {
+        fillBufferWithValue (*testBuffer, 0.1f * (float) (i + 1));
+        undoManager.stageCurrentBuffer (*testBuffer, 1000);
+        undoManager.finalizeCopyAndPush (1000);
+    }
 
-    void SetUp() override
+    // Only the most recent layer stays within UNDO_RESIDENT_LAYERS
+    for (int attempt = 0; attempt < 500 && undoManager.getCompressedBytes() == 0; ++attempt)
     {
-        manager.prepareToPlay (2, 1000);
-        inputBuffer.setSize (2, 100);
-        outputBuffer.setSize (2, 100);
+        undoManager.processBackgroundCompression();
+        std::this_thread::sleep_for (std::chrono::milliseconds (2));
     }
+    ASSERT_GT (undoManager.getCompressedBytes(), 0u);
+    EXPECT_GT (undoManager.getCompressionRatio(), 4.0f);
 
-    void fillBufferWithValue (juce::AudioBuffer<float>& buffer, float value)
+    fillBufferWithValue (*testBuffer, 0.9f);
+    for (int i = 4; i > 0; --i)
     {
-        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        bool undone = false;
+        for (int attempt = 0; attempt < 500 && ! undone; ++attempt)
         {
-            for (int i = 0; i < buffer.getNumSamples(); ++i)
-            {
-                buffer.setSample (ch, i, value);
-            }
+            undoManager.processBackgroundCompression();
+            undone = undoManager.undo (testBuffer);
+            if (! undone) std::this_thread::sleep_for (std::chrono::milliseconds (2));
         }
+        ASSERT_TRUE (undone);
+        EXPECT_FLOAT_EQ (testBuffer->getSample (1, 999), 0.1f * (float) i);
     }
-};
-
-TEST_F (BufferManagerTest, InitializesCorrectly)
-{
-    EXPECT_EQ (manager.getNumChannels(), 2);
-    EXPECT_EQ (manager.getNumSamples(), 1000);
-    EXPECT_EQ (manager.getLength(), 0);
 }
 
-TEST_F (BufferManagerTest, ClearResetsState)
+TEST_F (UndoStackManagerTest, ColdUndoIsDeferredUntilPagedIn)
 {
-    manager.setLength (500);
-    manager.clear();
+    for (int i = 0; i < 3; ++i)
+    {
+        fillBufferWithValue (*testBuffer, 0.1f * (float) (i + 1));
+        undoManager.stageCurrentBuffer (*testBuffer, 1000);
+        undoManager.finalizeCopyAndPush (1000);
+    }
 
-    EXPECT_EQ (manager.getLength(), 0);
+    // Slots 0 and 1 hold the two layers below the hot one
+    for (int attempt = 0; attempt < 500 && (undoManager.isLayerResident (0) || undoManager.isLayerResident (1)); ++attempt)
+    {
+        undoManager.processBackgroundCompression();
+        std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+    ASSERT_EQ (undoManager.getLayerResidency (0), LoopLifo::Residency::OnDisk);
+    ASSERT_EQ (undoManager.getLayerResidency (1), LoopLifo::Residency::OnDisk);
+    EXPECT_GT (undoManager.getSpilledBytes(), 0u);
+
+    ASSERT_TRUE (undoManager.undo (testBuffer));
+    ASSERT_FALSE (undoManager.isUndoReady());
+    EXPECT_FALSE (undoManager.undo (testBuffer));
+
+    ASSERT_TRUE (undoManager.deferUndo());
+    ASSERT_TRUE (undoManager.deferUndo());
+    EXPECT_FALSE (undoManager.deferUndo()); // only two layers left to undo
+
+    for (int i = 2; i > 0; --i)
+    {
+        for (int attempt = 0; attempt < 500 && ! undoManager.isUndoReady(); ++attempt)
+        {
+            undoManager.processBackgroundCompression();
+            std::this_thread::sleep_for (std::chrono::milliseconds (2));
+        }
+        ASSERT_TRUE (undoManager.undo (testBuffer));
+        EXPECT_FLOAT_EQ (testBuffer->getSample (0, 500), 0.1f * (float) i);
+    }
+    EXPECT_EQ (undoManager.getPendingUndos(), 0);
+}
+
+TEST_F (UndoStackManagerTest, ReleaseResourcesClearsBuffers)
+{
+    fillBufferWithValue (*testBuffer, 0.5f);
+    undoManager.stageCurrentBuffer (*testBuffer, 1000);
+    undoManager.finalizeCopyAndPush (1000);
+
+    undoManager.releaseResources();
+
+    // After release, should be safe to prepare again
+    undoManager.prepareToPlay (pool, 3, 500);
+    EXPECT_EQ (undoManager.getNumLayers(), 3);
+}
+
+TEST (LoopBlockPoolTest, LockedPoolStillServesBlocks)
+{
+    LoopBlockPool lockedPool;
+    lockedPool.prepareToPlay (2, 256, 4, 4, true);
+    EXPECT_TRUE (lockedPool.isLockingPages());
+
+    // Locking may be refused by RLIMIT_MEMLOCK; the blocks are usable either way
+    const int id = lockedPool.acquireBlock();
+    ASSERT_NE (id, LoopBlockPool::INVALID_BLOCK);
+    lockedPool.getBlockData (id, 1)[255] = 1.0f;
+    EXPECT_EQ (lockedPool.getBudgetBytes(), 4 * 2 * 256 * sizeof (float));
+    lockedPool.releaseBlock (id);
+}
+
+TEST (LoopBlockPoolTest, RealtimeThreadMissesRatherThanClearingOrAllocating)
+{
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 256, 2, 2);
+    const int first = pool.acquireBlock();
+    const int second = pool.acquireBlock();
+    ASSERT_NE (second, LoopBlockPool::INVALID_BLOCK);
+    pool.getBlockData (first, 0)[0] = 1.0f;
+    pool.releaseBlock (first);
+
+    // The released block is still dirty, and only a maintenance pass or an ordinary thread may clear it
+    {
+        const LoopBlockPool::ScopedRealtimeThread realtime;
+        EXPECT_EQ (pool.acquireBlock(), LoopBlockPool::INVALID_BLOCK);
+    }
+    EXPECT_EQ (pool.getNumReserveMisses(), 1);
+    EXPECT_FALSE (LoopBlockPool::isRealtimeThread());
+
+    const int reused = pool.acquireBlock();
+    ASSERT_EQ (reused, first);
+    EXPECT_EQ (pool.getBlockData (reused, 0)[0], 0.0f);
+    pool.releaseBlock (reused);
+    pool.cleanReleasedBlocks();
+    {
+        const LoopBlockPool::ScopedRealtimeThread realtime;
+        EXPECT_EQ (pool.acquireBlock(), first);
+    }
+}
+
+TEST (LoopBlockPoolTest, RealtimeThreadClaimsEveryClearedBlockWithoutScanning)
+{
+    LoopBlockPool pool;
+    pool.prepareToPlay (1, 64, 8, 8);
+    std::vector<int> ids;
+    for (int i = 0; i < 8; ++i)
+        ids.push_back (pool.acquireBlock());
+
+    // Hand back every other block; once cleared, the realtime thread gets exactly those, then misses
+    for (int i = 0; i < 8; i += 2)
+        pool.releaseBlock (ids[(size_t) i]);
+    pool.cleanReleasedBlocks();
+
+    std::vector<int> claimed;
+    {
+        const LoopBlockPool::ScopedRealtimeThread realtime;
+        for (int id = pool.acquireBlock(); id != LoopBlockPool::INVALID_BLOCK; id = pool.acquireBlock())
+            claimed.push_back (id);
+    }
+    EXPECT_THAT (claimed, UnorderedElementsAre (ids[0], ids[2], ids[4], ids[6]));
+    EXPECT_EQ (pool.getNumReserveMisses(), 1);
+
+    for (const int id : ids)
+        pool.releaseBlock (id);
+}
+
+// ============================================================================
+// ScratchBufferPool Tests
+// ============================================================================
+
+TEST (ScratchBufferPoolTest, BuffersAreReturnedWhenScopeEnds)
+{
+    ScratchBufferPool pool;
+    pool.prepareToPlay (2, 512, 2);
+
+    // Room for a block of source at top speed
+    EXPECT_GE (pool.getNumSamples(), (int) (512 * MAX_PLAYBACK_SPEED));
+    {
+        auto first = pool.borrow();
+        auto second = pool.borrow();
+        ASSERT_TRUE (first);
+        ASSERT_TRUE (second);
+        EXPECT_NE (&*first, &*second);
+        EXPECT_EQ (first->getNumChannels(), 2);
+
+        EXPECT_FALSE (pool.borrow());
+        EXPECT_EQ (pool.getNumFailedBorrows(), 1);
+    }
+
+    auto again = pool.borrow();
+    EXPECT_TRUE (again);
+}
+
+// ============================================================================
+// UndoSpillFile Tests
+// ============================================================================
+
+TEST (UndoSpillFileTest, StoresAndReusesRanges)
+{
+    UndoSpillFile spill;
+    ASSERT_TRUE (spill.open());
+
+    std::vector<uint32_t> words (1000);
+    for (size_t i = 0; i < words.size(); ++i)
+        words[i] = (uint32_t) (i * 2654435761u);
+
+    const int64_t first = spill.write (words.data(), words.size());
+    const int64_t second = spill.write (words.data(), 10);
+    ASSERT_NE (first, UndoSpillFile::INVALID_OFFSET);
+    EXPECT_EQ (std::memcmp (spill.read (first), words.data(), words.size() * sizeof (uint32_t)), 0);
+    EXPECT_EQ (spill.getUsedBytes(), 1010 * sizeof (uint32_t));
+
+    spill.release (first, words.size());
+    EXPECT_EQ (spill.write (words.data(), 500), first);
+    EXPECT_EQ (spill.read (second)[9], words[9]);
+}
+
+TEST (UndoSpillFileTest, GrowsAndKeepsEarlierData)
+{
+    UndoSpillFile spill;
+    ASSERT_TRUE (spill.open());
+
+    const uint32_t marker[] = { 0xdeadbeefu, 0x01234567u };
+    const int64_t offset = spill.write (marker, 2);
+
+    std::vector<uint32_t> large (UNDO_SPILL_GROW_BYTES / sizeof (uint32_t), 7u);
+    ASSERT_NE (spill.write (large.data(), large.size()), UndoSpillFile::INVALID_OFFSET);
+
+    EXPECT_GT (spill.getFileBytes(), UNDO_SPILL_GROW_BYTES);
+    EXPECT_EQ (spill.read (offset)[0], marker[0]);
+    EXPECT_EQ (spill.read (offset)[1], marker[1]);
+}
+
+// ============================================================================
+// UndoLayerCodec Tests
+// ============================================================================
+
+TEST (UndoLayerCodecTest, RoundTripIsBitExact)
+{
+    std::vector<float> samples (3000);
+    juce::Random random (42);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = 0.5f * std::sin ((float) i * 0.05f) + 0.01f * (random.nextFloat() - 0.5f);
+
+    samples[10] = -0.0f;
+    samples[11] = std::numeric_limits<float>::denorm_min();
+    samples[12] = -1.0e30f;
+    samples[13] = std::numeric_limits<float>::infinity();
+
+    std::vector<uint32_t> words;
+    UndoLayerCodec::encode (samples.data(), (int) samples.size(), words);
+
+    std::vector<float> decoded (samples.size());
+    ASSERT_TRUE (UndoLayerCodec::decode (words.data(), words.size(), decoded.data(), (int) decoded.size()));
+    EXPECT_EQ (std::memcmp (samples.data(), decoded.data(), samples.size() * sizeof (float)), 0);
+}
+
+TEST (UndoLayerCodecTest, SilencePacksToAboutOneBitPerSample)
+{
+    std::vector<float> silence (4096, 0.0f);
+    std::vector<uint32_t> words;
+    UndoLayerCodec::encode (silence.data(), (int) silence.size(), words);
+
+    EXPECT_LE (words.size(), silence.size() / 30);
+}
+
+TEST (UndoLayerCodecTest, TruncatedStreamIsRejected)
+{
+    std::vector<float> samples (512, 0.25f);
+    samples[300] = -0.75f;
+    std::vector<uint32_t> words;
+    UndoLayerCodec::encode (samples.data(), (int) samples.size(), words);
+
+    std::vector<float> decoded (samples.size());
+    EXPECT_FALSE (UndoLayerCodec::decode (words.data(), words.size() / 2, decoded.data(), (int) decoded.size()));
+}
+
+TEST (UndoLayerCodecTest, SixteenBitStorageRoundTripsExactly)
+{
+    for (auto format : { LoopSampleFormat::Int16, LoopSampleFormat::Float16 })
+    {
+        std::vector<float> samples (3000);
+        for (size_t i = 0; i < samples.size(); ++i)
+            samples[i] = 0.7f * std::sin ((float) i * 0.03f);
+        samples[5] = -LOOP_INT16_HEADROOM;
+
+        std::vector<uint16_t> stored (samples.size());
+        LoopSampleConversion::fromFloat (format, samples.data(), reinterpret_cast<uint8_t*> (stored.data()), (int) samples.size());
+
+        std::vector<uint32_t> words;
+        UndoLayerCodec::encode (format, reinterpret_cast<const uint8_t*> (stored.data()), (int) stored.size(), words);
+        EXPECT_LT (words.size() * sizeof (uint32_t), stored.size() * sizeof (uint16_t));
+
+        std::vector<uint16_t> decoded (stored.size());
+        ASSERT_TRUE (UndoLayerCodec::decode (words.data(), words.size(), format, reinterpret_cast<uint8_t*> (decoded.data()), (int) decoded.size()));
+        EXPECT_EQ (decoded, stored);
+    }
+}
+
+// ============================================================================
+// LoopSampleConversion Tests
+// ============================================================================
+
+TEST (LoopSampleConversionTest, HalfFloatMatchesIeeeEncoding)
+{
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (1.0f), 0x3c00);
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (-2.0f), 0xc000);
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (65504.0f), 0x7bff);
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (70000.0f), 0x7c00);
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (5.9604645e-8f), 0x0001); // smallest subnormal
+    EXPECT_EQ (LoopSampleConversion::floatToHalf (1.0f + 1.0f / 2048.0f), 0x3c00); // tie rounds to even
+
+    for (uint16_t half : { 0x0000, 0x8000, 0x0001, 0x03ff, 0x0400, 0x3c00, 0xbc01, 0x7bff, 0x7c00, 0xfc00 })
+        EXPECT_EQ (LoopSampleConversion::floatToHalf (LoopSampleConversion::halfToFloat (half)), half);
+
+    // The block kernels agree with the scalar conversion, whichever path they take
+    std::vector<float> samples (37);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = ((float) i - 18.0f) * 0.137f;
+    std::vector<uint16_t> halves (samples.size());
+    LoopSampleConversion::floatToHalf (samples.data(), halves.data(), (int) samples.size());
+    std::vector<float> decoded (samples.size());
+    LoopSampleConversion::halfToFloat (halves.data(), decoded.data(), (int) halves.size());
+
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        EXPECT_EQ (halves[i], LoopSampleConversion::floatToHalf (samples[i]));
+        EXPECT_NEAR (decoded[i], samples[i], std::abs (samples[i]) / 1024.0f);
+    }
+}
+
+TEST (LoopSampleConversionTest, Int16KeepsHeadroomAndRequantisesExactly)
+{
+    const float step = LOOP_INT16_HEADROOM / 32767.0f;
+    std::vector<float> samples (1000);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = 1.6f * std::sin ((float) i * 0.01f);
+    samples[0] = 3.0f;
+
+    std::vector<int16_t> stored (samples.size());
+    LoopSampleConversion::floatToInt16 (samples.data(), stored.data(), (int) samples.size());
+    std::vector<float> decoded (samples.size());
+    LoopSampleConversion::int16ToFloat (stored.data(), decoded.data(), (int) stored.size());
+
+    // Overdubs above unity survive; only beyond the headroom is the signal clipped. Below it, rounding is off by at most half a step.
+    EXPECT_NEAR (decoded[0], LOOP_INT16_HEADROOM, step);
+    for (size_t i = 1; i < samples.size(); ++i)
+        EXPECT_NEAR (decoded[i], samples[i], step * 0.5f + 1.0e-6f);
+
+    // Writing back what was read leaves the stored values unchanged
+    std::vector<int16_t> rewritten (stored.size());
+    LoopSampleConversion::floatToInt16 (decoded.data(), rewritten.data(), (int) decoded.size());
+    EXPECT_EQ (rewritten, stored);
+}
+
+// ============================================================================
+// ChunkedLoopBuffer Tests
+// ============================================================================
+
+class ChunkedLoopBufferTest : public ::testing::Test
+{
+protected:
+    LoopBlockPool pool;
+    ChunkedLoopBuffer buffer;
+
+    void SetUp() override
+    {
+        pool.prepareToPlay (2, 256, 8, 8);
+        buffer.prepareToPlay (pool, 2048);
+    }
+
+    void TearDown() override { buffer.releaseResources(); }
+
+    void writeValue (int start, int num, float value)
+    {
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+            buffer.forEachWritableRun (ch, start, num, [value] (float* dest, int, int n) { std::fill_n (dest, n, value); });
+    }
+};
+
+TEST_F (ChunkedLoopBufferTest, StartsWithoutBlocks)
+{
+    EXPECT_EQ (buffer.getNumSamples(), 2048);
+    EXPECT_EQ (buffer.getNumAllocatedBlocks(), 0);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 1000), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, AllocatesOnlyWrittenBlocks)
+{
+    writeValue (600, 10, 0.5f);
+
+    EXPECT_EQ (buffer.getNumAllocatedBlocks(), 1);
+    EXPECT_FLOAT_EQ (buffer.getSample (1, 605), 0.5f);
+    EXPECT_FLOAT_EQ (buffer.getSample (1, 0), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, RunsSplitAtBlockBoundaries)
+{
+    std::vector<int> runs;
+    buffer.forEachWritableRun (0, 250, 20, [&] (float*, int, int n) { runs.push_back (n); });
+
+    ASSERT_EQ (runs.size(), 2u);
+    EXPECT_EQ (runs[0], 6);
+    EXPECT_EQ (runs[1], 14);
+}
+
+TEST_F (ChunkedLoopBufferTest, UnwrittenRangesReadAsSilence)
+{
+    writeValue (0, 256, 1.0f);
+
+    juce::AudioBuffer<float> out (2, 512);
+    out.clear();
+    buffer.copyTo (out, 0, 512);
+
+    EXPECT_FLOAT_EQ (out.getSample (0, 255), 1.0f);
+    EXPECT_FLOAT_EQ (out.getSample (0, 256), 0.0f);
+    EXPECT_FLOAT_EQ (buffer.getMagnitude (0, 256, 256), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, ReleaseBlocksFromKeepsLoopHead)
+{
+    writeValue (0, 2048, 0.25f);
+    EXPECT_EQ (buffer.getNumAllocatedBlocks(), 8);
+
+    buffer.releaseBlocksFrom (300);
+
+    EXPECT_EQ (buffer.getNumAllocatedBlocks(), 2);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 299), 0.25f);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 600), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, ReleasedBlocksAreClearedBeforeReuse)
+{
+    writeValue (0, 256, 0.9f);
+    buffer.clear();
+    writeValue (300, 1, 0.1f);
+
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 256), 0.0f);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 300), 0.1f);
+}
+
+TEST_F (ChunkedLoopBufferTest, ExhaustedPoolDropsWrites)
+{
+    ChunkedLoopBuffer other;
+    other.prepareToPlay (pool, 2048);
+
+    writeValue (0, 2048, 0.5f);
+    other.forEachWritableRun (0, 0, 16, [] (float* dest, int, int n) { std::fill_n (dest, n, 1.0f); });
+
+    EXPECT_EQ (other.getNumAllocatedBlocks(), 0);
+    EXPECT_FLOAT_EQ (other.getSample (0, 0), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, ShareFromTakesNoNewBlocks)
+{
+    ChunkedLoopBuffer copy;
+    copy.prepareToPlay (pool, 2048);
+
+    writeValue (0, 512, 0.4f);
+    copy.shareFrom (buffer, 512);
+
+    EXPECT_EQ (pool.getNumBlocksInUse(), 2);
+    EXPECT_FLOAT_EQ (copy.getSample (1, 511), 0.4f);
+}
+
+TEST_F (ChunkedLoopBufferTest, WriteAfterShareDuplicatesOnlyTouchedBlock)
+{
+    ChunkedLoopBuffer copy;
+    copy.prepareToPlay (pool, 2048);
+
+    writeValue (0, 512, 0.4f);
+    copy.shareFrom (buffer, 512);
+    writeValue (10, 5, 0.8f);
+
+    EXPECT_EQ (pool.getNumBlocksInUse(), 3);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 12), 0.8f);
+    EXPECT_FLOAT_EQ (copy.getSample (0, 12), 0.4f);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 9), 0.4f);
+}
+
+TEST_F (ChunkedLoopBufferTest, GainOnSharedBlocksLeavesOtherOwnerIntact)
+{
+    ChunkedLoopBuffer copy;
+    copy.prepareToPlay (pool, 2048);
+
+    writeValue (0, 256, 1.0f);
+    copy.shareFrom (buffer, 256);
+    buffer.applyGain (0, 256, 0.5f);
+
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 100), 0.5f);
+    EXPECT_FLOAT_EQ (copy.getSample (0, 100), 1.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, Int16StorageConvertsOnEveryPath)
+{
+    LoopBlockPool int16Pool;
+    int16Pool.prepareToPlay (2, 256, 8, 8, false, LoopSampleFormat::Int16);
+    EXPECT_EQ (int16Pool.getBlockBytes(), pool.getBlockBytes() / 2);
+
+    ChunkedLoopBuffer int16Buffer;
+    int16Buffer.prepareToPlay (int16Pool, 2048);
+
+    // Record, overdub on top, then read back across a block boundary
+    for (int pass = 0; pass < 2; ++pass)
+        for (int ch = 0; ch < 2; ++ch)
+            int16Buffer.forEachWritableRun (ch,
+                                            0,
+                                            600,
+                                            [] (float* dest, const int offset, const int n)
+                                            {
+                                                for (int i = 0; i < n; ++i)
+                                                    dest[i] += 0.6f * std::sin ((float) (offset + i) * 0.02f);
+                                            });
+
+    const float step = LOOP_INT16_HEADROOM / 32767.0f;
+    std::vector<float> readBack (600);
+    int16Buffer.forEachReadableRun (1,
+                                    0,
+                                    600,
+                                    [&] (const float* src, const int offset, const int n) { std::copy_n (src, n, readBack.data() + offset); });
+    for (int i = 0; i < 600; ++i)
+    {
+        EXPECT_NEAR (readBack[(size_t) i], 1.2f * std::sin ((float) i * 0.02f), 2.0f * step);
+        EXPECT_FLOAT_EQ (int16Buffer.getSample (1, i), readBack[(size_t) i]);
+    }
+
+    int16Buffer.applyGain (0, 600, 0.5f);
+    EXPECT_NEAR (int16Buffer.getMagnitude (0, 0, 600), 0.6f, 2.0f * step);
+    int16Buffer.releaseResources();
+}
+
+TEST_F (ChunkedLoopBufferTest, GainRampSpansBlocks)
+{
+    writeValue (0, 512, 1.0f);
+    buffer.applyGainRamp (0, 512, 0.0f, 1.0f);
+
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 0), 0.0f);
+    EXPECT_NEAR (buffer.getSample (0, 256), 0.5f, 1.0e-4f);
+}
+
+TEST_F (ChunkedLoopBufferTest, SilenceMapFollowsWritesSharingAndReleases)
+{
+    writeValue (300, 10, 0.5f);
+    EXPECT_TRUE (buffer.getSilenceMap().isRegionSilent (0));
+    EXPECT_FALSE (buffer.getSilenceMap().isRegionSilent (1));
+
+    // Silent regions are copied as zeros, whatever the destination held
+    juce::AudioBuffer<float> copy (2, 1024);
+    for (int ch = 0; ch < 2; ++ch)
+        juce::FloatVectorOperations::fill (copy.getWritePointer (ch), 9.0f, 1024);
+    buffer.copyTo (copy, 0, 1024);
+    EXPECT_EQ (copy.getSample (1, 0), 0.0f);
+    EXPECT_EQ (copy.getSample (1, 305), 0.5f);
+    EXPECT_EQ (copy.getSample (1, 700), 0.0f);
+
+    ChunkedLoopBuffer shared;
+    shared.prepareToPlay (pool, 2048);
+    shared.shareFrom (buffer, 512);
+    EXPECT_FALSE (shared.getSilenceMap().isRegionSilent (1));
+    shared.releaseResources();
+
+    buffer.releaseBlocksFrom (256);
+    EXPECT_TRUE (buffer.getSilenceMap().isSilent (0, 2048));
+    EXPECT_EQ (buffer.getMagnitude (0, 0, 2048), 0.0f);
+}
+
+TEST_F (ChunkedLoopBufferTest, PeakTableFollowsWritesGainAndSharing)
+{
+    const auto& peaks = buffer.getPeakTable();
+    writeValue (300, 10, 0.5f);
+    writeValue (1100, 10, -0.25f);
+
+    // Plain writes leave their regions stale, and a peak over them is measured instead
+    EXPECT_TRUE (peaks.isRegionStale (1));
+    EXPECT_FLOAT_EQ (buffer.getPeak (0, 2048), 0.5f);
+    EXPECT_FLOAT_EQ (buffer.getPeak (1024, 1024), 0.25f);
+
+    buffer.refreshPeaks (0, 2048);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (1), 0.5f);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (4), 0.25f);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (0), 0.0f);
+
+    // Gain scales the regions it covers whole; the playback gain changes what is heard, not what is stored
+    buffer.applyGain (0, 1024, 0.5f);
+    EXPECT_FALSE (peaks.isRegionStale (1));
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (1), 0.25f);
+    buffer.setPlaybackGain (2.0f);
+    EXPECT_FLOAT_EQ (buffer.getPeak (0, 2048), 0.5f);
+    EXPECT_FLOAT_EQ (buffer.getSample (0, 305), 0.5f);
+    EXPECT_FLOAT_EQ (buffer.getMagnitude (1, 1024, 1024), 0.5f);
+
+    ChunkedLoopBuffer shared;
+    shared.prepareToPlay (pool, 2048);
+    shared.shareFrom (buffer, 2048);
+    EXPECT_FLOAT_EQ (shared.getPlaybackGain(), 2.0f);
+    EXPECT_FLOAT_EQ (shared.getPeakTable().getRegionPeak (4), 0.25f);
+    shared.releaseResources();
+
+    buffer.clear();
+    EXPECT_FLOAT_EQ (buffer.getPlaybackGain(), 1.0f);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (4), 0.0f);
+}
+
+TEST (LoopSilenceMapTest, RunsSplitWhereSilenceStartsOrStops)
+{
+    constexpr int region = LoopSilenceMap::REGION_SAMPLES;
+    LoopSilenceMap map;
+    map.prepareToPlay (region * 100);
+    EXPECT_TRUE (map.isSilent (0, region * 100));
+
+    map.markSounding (region * 2 + 10, region); // touches regions 2 and 3
+    map.markSounding (region * 70, 1);
+    EXPECT_TRUE (map.isRegionSilent (1));
+    EXPECT_FALSE (map.isRegionSilent (2));
+    EXPECT_FALSE (map.isRegionSilent (3));
+    EXPECT_TRUE (map.isRegionSilent (4));
+    EXPECT_FALSE (map.isRegionSilent (70));
+
+    std::vector<std::tuple<int, int, bool>> runs;
+    map.forEachRun (100, region * 5, [&] (int start, int num, bool isSilent) { runs.emplace_back (start, num, isSilent); });
+    const std::vector<std::tuple<int, int, bool>> expected = { { 100, region * 2 - 100, true },
+                                                               { region * 2, region * 2, false },
+                                                               { region * 4, region + 100, true } };
+    EXPECT_EQ (runs, expected);
+
+    // Only regions lying wholly inside the range are silenced
+    map.markSilent (region * 2 + 1, region * 2);
+    EXPECT_FALSE (map.isRegionSilent (2));
+    EXPECT_TRUE (map.isRegionSilent (3));
+}
+
+TEST (LayerFinalizerTest, FinishedLayerSwapsInWhileTheRawOneKeepsPlaying)
+{
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 256, 8, 8);
+    auto layer = std::make_unique<ChunkedLoopBuffer>();
+    layer->prepareToPlay (pool, 2048);
+    for (int ch = 0; ch < 2; ++ch)
+        layer->forEachWritableRun (ch, 0, 1024, [] (float* dest, int, int n) { std::fill_n (dest, n, 0.25f); });
+
+    LayerFinalizer finalizer;
+    finalizer.prepareToPlay (pool, 2048);
+    finalizer.post (*layer, 1024);
+    auto* rawLayer = layer.get();
+
+    bool installed = false;
+    for (int attempt = 0; attempt < 500 && ! installed; ++attempt)
+    {
+        // Until the swap, the live layer is the raw one and reads as recorded
+        EXPECT_FLOAT_EQ (layer->getSample (0, 500), 0.25f);
+        installed = finalizer.collect (layer);
+        if (! installed) std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+    ASSERT_TRUE (installed);
+    EXPECT_NE (layer.get(), rawLayer);
+    EXPECT_TRUE (finalizer.isIdle());
+
+    // Normalised end to end; the seam is left for playback to crossfade
+    EXPECT_NEAR (layer->getSample (1, 500), NORMALIZE_TARGET_LEVEL, 1e-6f);
+    EXPECT_NEAR (layer->getSample (0, 0), NORMALIZE_TARGET_LEVEL, 1e-6f);
+    EXPECT_NEAR (layer->getSample (0, 1023), NORMALIZE_TARGET_LEVEL, 1e-6f);
+
+    // The raw layer's blocks went back to the pool with the swap
+    EXPECT_EQ (layer->getNumAllocatedBlocks(), 4);
+    EXPECT_EQ (pool.getNumBlocksInUse(), 4);
+
+    finalizer.releaseResources();
+    layer->releaseResources();
+}
+
+TEST (LayerFinalizerTest, DiscardedResultIsReleasedRatherThanInstalled)
+{
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 256, 8, 8);
+    auto layer = std::make_unique<ChunkedLoopBuffer>();
+    layer->prepareToPlay (pool, 2048);
+    for (int ch = 0; ch < 2; ++ch)
+        layer->forEachWritableRun (ch, 0, 512, [] (float* dest, int, int n) { std::fill_n (dest, n, 0.25f); });
+
+    LayerFinalizer finalizer;
+    finalizer.prepareToPlay (pool, 2048);
+    finalizer.post (*layer, 512);
+    finalizer.discard();
+    auto* rawLayer = layer.get();
+
+    for (int attempt = 0; attempt < 500 && finalizer.isBusy(); ++attempt)
+    {
+        EXPECT_FALSE (finalizer.collect (layer));
+        if (finalizer.isBusy()) std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+    ASSERT_TRUE (finalizer.isIdle());
+    EXPECT_EQ (layer.get(), rawLayer);
+    EXPECT_FLOAT_EQ (layer->getSample (1, 100), 0.25f);
+    EXPECT_EQ (pool.getNumBlocksInUse(), 2);
+
+    finalizer.releaseResources();
+    layer->releaseResources();
+}
+
+// ============================================================================
+// AudioFileLoader Tests
+// ============================================================================
+
+// Writes numSamples of a constant value as a 24-bit WAV file
+static void writeConstantWav (const juce::File& file, const double sampleRate, const int numChannels, const int numSamples, const float value)
+{
+    file.deleteFile();
+    juce::WavAudioFormat wavFormat;
+    std::unique_ptr<juce::AudioFormatWriter> writer (
+        wavFormat.createWriterFor (new juce::FileOutputStream (file), sampleRate, (unsigned int) numChannels, 24, {}, 0));
+    ASSERT_NE (writer, nullptr);
+
+    juce::AudioBuffer<float> content (numChannels, numSamples);
+    for (int ch = 0; ch < numChannels; ++ch)
+        juce::FloatVectorOperations::fill (content.getWritePointer (ch), value, numSamples);
+    writer->writeFromAudioSampleBuffer (content, 0, numSamples);
+}
+
+TEST (AudioFileLoaderTest, DecodesAMonoFileIntoEveryChannelAtTheLoopRate)
+{
+    juce::TemporaryFile temp (".wav");
+    writeConstantWav (temp.getFile(), 22050.0, 1, 22050, 0.25f);
+
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 1 << 14, 8, 8);
+    ChunkedLoopBuffer layer;
+    layer.prepareToPlay (pool, 1 << 16);
+
+    juce::AudioFormatManager formats;
+    formats.registerBasicFormats();
+    std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor (temp.getFile()));
+    ASSERT_NE (reader, nullptr);
+
+    // Half a second at 22.05 kHz is half a second at 44.1 kHz
+    const int length = AudioFileLoader::decodeInto (*reader, layer, 44100.0, 0);
+    EXPECT_NEAR (length, 22050 * 2, 2);
+    EXPECT_NEAR (layer.getSample (0, 20000), 0.25f, 1e-3f);
+    EXPECT_NEAR (layer.getSample (1, 40000), 0.25f, 1e-3f);
+
+    // Peaks are known without rescanning the loop
+    EXPECT_FALSE (layer.getPeakTable().isRegionStale (LoopPeakTable::regionOf (20000)));
+    EXPECT_NEAR (layer.getPeak (0, length), 0.25f, 1e-3f);
+
+    layer.releaseResources();
+}
+
+TEST (AudioFileLoaderTest, TargetLengthCutsOrPadsTheFile)
+{
+    juce::TemporaryFile temp (".wav");
+    writeConstantWav (temp.getFile(), 44100.0, 2, 1000, 0.5f);
+
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 1 << 14, 8, 8);
+    ChunkedLoopBuffer layer;
+    layer.prepareToPlay (pool, 1 << 16);
+
+    juce::AudioFormatManager formats;
+    formats.registerBasicFormats();
+
+    std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor (temp.getFile()));
+    ASSERT_NE (reader, nullptr);
+    EXPECT_EQ (AudioFileLoader::decodeInto (*reader, layer, 44100.0, 3000), 3000);
+    EXPECT_NEAR (layer.getSample (0, 999), 0.5f, 1e-4f);
+    EXPECT_FLOAT_EQ (layer.getSample (1, 2500), 0.0f);
+
+    layer.clear();
+    EXPECT_EQ (AudioFileLoader::decodeInto (*reader, layer, 44100.0, 400), 400);
+    EXPECT_FLOAT_EQ (layer.getSample (0, 500), 0.0f);
+
+    // Never past the layer's capacity
+    EXPECT_EQ (AudioFileLoader::decodeInto (*reader, layer, 44100.0, 1 << 20), 1 << 16);
+
+    layer.releaseResources();
+}
+
+TEST (AudioFileLoaderTest, FilesPostedToSeveralSlotsLoadInParallelAndSwapIn)
+{
+    juce::TemporaryFile first (".wav"), second (".wav");
+    writeConstantWav (first.getFile(), 44100.0, 2, 5000, 0.25f);
+    writeConstantWav (second.getFile(), 44100.0, 2, 7000, 0.5f);
+
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 1 << 14, 16, 8);
+    std::array<std::unique_ptr<ChunkedLoopBuffer>, 2> live;
+    for (auto& layer : live)
+    {
+        layer = std::make_unique<ChunkedLoopBuffer>();
+        layer->prepareToPlay (pool, 1 << 16);
+    }
+
+    AudioFileLoader loader;
+    loader.prepareToPlay (pool, 1 << 16, 44100.0, 2, 2);
+    EXPECT_EQ (loader.getNumLoaderThreads(), 2);
+    loader.post (0, first.getFile(), 0);
+    loader.post (1, second.getFile(), 0);
+
+    std::array<int, 2> lengths = { 0, 0 };
+    for (int attempt = 0; attempt < 500 && (lengths[0] == 0 || lengths[1] == 0); ++attempt)
+    {
+        for (int slot = 0; slot < 2; ++slot)
+            loader.collect (slot,
+                            [&] (std::unique_ptr<ChunkedLoopBuffer>& layer, const int length, BackingTrackStream*)
+                            {
+                                std::swap (live[(size_t) slot], layer);
+                                lengths[(size_t) slot] = length;
+                            });
+        std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+
+    EXPECT_EQ (lengths[0], 5000);
+    EXPECT_EQ (lengths[1], 7000);
+    EXPECT_NEAR (live[0]->getSample (1, 4000), 0.25f, 1e-4f);
+    EXPECT_NEAR (live[1]->getSample (0, 6000), 0.5f, 1e-4f);
+    EXPECT_TRUE (loader.isIdle (0));
+    EXPECT_TRUE (loader.isIdle (1));
+
+    loader.releaseResources();
+    for (auto& layer : live)
+        layer->releaseResources();
+}
+
+TEST (AudioFileLoaderTest, DiscardedAndUnreadableFilesAreNotInstalled)
+{
+    juce::TemporaryFile temp (".wav");
+    writeConstantWav (temp.getFile(), 44100.0, 2, 5000, 0.25f);
+
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 1 << 14, 8, 8);
+
+    AudioFileLoader loader;
+    loader.prepareToPlay (pool, 1 << 16, 44100.0, 1, 1);
+    bool installed = false;
+    auto install = [&installed] (std::unique_ptr<ChunkedLoopBuffer>&, int, BackingTrackStream*) { installed = true; };
+
+    loader.post (0, temp.getFile(), 0);
+    loader.discard (0);
+    loader.post (0, juce::File::getSpecialLocation (juce::File::tempDirectory).getChildFile ("no_such_file.wav"), 0);
+    for (int attempt = 0; attempt < 500 && loader.isBusy (0); ++attempt)
+    {
+        loader.collect (0, install);
+        std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+
+    EXPECT_TRUE (loader.isIdle (0));
+    EXPECT_FALSE (installed);
+    EXPECT_EQ (pool.getNumBlocksInUse(), 0);
+
+    loader.releaseResources();
+}
+
+TEST (AudioFileLoaderTest, FilesLongerThanTheCapacityAreStreamedUnlessCut)
+{
+    juce::TemporaryFile temp (".wav");
+    writeConstantWav (temp.getFile(), 44100.0, 2, 1 << 17, 0.25f);
+
+    LoopBlockPool pool;
+    pool.prepareToPlay (2, 1 << 14, 32, 8);
+
+    AudioFileLoader loader;
+    loader.prepareToPlay (pool, 1 << 15, 44100.0, 1, 1);
+    BackingTrackStream* stream = nullptr;
+    int loadedLength = 0;
+    auto install = [&] (std::unique_ptr<ChunkedLoopBuffer>&, const int length, BackingTrackStream* loadedStream)
+    {
+        stream = loadedStream;
+        loadedLength = length;
+    };
+    auto loadAndCollect = [&] (const int targetLength)
+    {
+        loadedLength = 0;
+        loader.post (0, temp.getFile(), targetLength);
+        for (int attempt = 0; attempt < 500 && loadedLength == 0; ++attempt)
+        {
+            loader.collect (0, install);
+            std::this_thread::sleep_for (std::chrono::milliseconds (2));
+        }
+    };
+
+    // Whole, from disk, with the start already read
+    loadAndCollect (0);
+    ASSERT_NE (stream, nullptr);
+    EXPECT_EQ (loadedLength, 1 << 17);
+    EXPECT_EQ (stream->getState(), BackingTrackStream::Ready);
+    EXPECT_NEAR (stream->getBuffer()->getSample (0, 100), 0.25f, 1e-4f);
+
+    // Fitted to a loop, it decodes into memory as before
+    loadAndCollect (1000);
+    EXPECT_EQ (stream, nullptr);
+    EXPECT_EQ (loadedLength, 1000);
+
+    loader.releaseResources();
+    EXPECT_EQ (pool.getNumBlocksInUse(), 0);
+}
+
+// ============================================================================
+// BackingTrackStream Tests
+// ============================================================================
+
+// numSamples of a ramp from 0 towards 1, so every sample says where in the file it came from
+static void writeRampWav (const juce::File& file, const double sampleRate, const int numSamples)
+{
+    file.deleteFile();
+    juce::WavAudioFormat wavFormat;
+    std::unique_ptr<juce::AudioFormatWriter> writer (wavFormat.createWriterFor (new juce::FileOutputStream (file), sampleRate, 1, 24, {}, 0));
+    ASSERT_NE (writer, nullptr);
+
+    juce::AudioBuffer<float> content (1, numSamples);
+    for (int i = 0; i < numSamples; ++i)
+        content.setSample (0, i, (float) i / (float) numSamples);
+    writer->writeFromAudioSampleBuffer (content, 0, numSamples);
+}
+
+class BackingTrackStreamTest : public ::testing::Test
+{
+protected:
+    static constexpr int BLOCK = 1 << 14;
+    static constexpr int FILE_LENGTH = BLOCK * 40;
+
+    juce::TemporaryFile temp { ".wav" };
+    LoopBlockPool pool;
+    BackingTrackStream stream;
+    BufferManager manager;
+
+    void SetUp() override
+    {
+        pool.prepareToPlay (2, BLOCK, 64, 8);
+        manager.prepareToPlay (pool, BLOCK);
+    }
+
+    void TearDown() override
+    {
+        if (stream.getState() == BackingTrackStream::Attached)
+        {
+            manager.swapAudioBuffer (stream.getBuffer());
+            stream.detach();
+        }
+        stream.releaseResources();
+        manager.releaseResources();
+    }
+
+    int open (const double fileSampleRate)
+    {
+        writeRampWav (temp.getFile(), fileSampleRate, FILE_LENGTH);
+        juce::AudioFormatManager formats;
+        formats.registerBasicFormats();
+        std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor (temp.getFile()));
+        const auto length = AudioFileLoader::getLengthAtRate (*reader, 44100.0);
+        EXPECT_TRUE (stream.claim());
+        return stream.open (std::move (reader), pool, 44100.0, (int) length);
+    }
+
+    void attach()
+    {
+        manager.swapAudioBuffer (stream.getBuffer());
+        stream.attach();
+        manager.finalizeLayer (false, stream.getLength());
+    }
+
+    // The reader's work, done here so each step is deterministic
+    void readEverythingMissing()
+    {
+        while (stream.service())
+        {
+        }
+    }
+
+    BackingTrackStream::Window windowAt (const double playhead, const int wrapStart = 0, const int wrapEnd = FILE_LENGTH)
+    {
+        BackingTrackStream::Window window;
+        window.playhead = playhead;
+        window.wrapStart = wrapStart;
+        window.wrapEnd = wrapEnd;
+        window.guardEnd = wrapEnd;
+        return window;
+    }
+
+    float sampleAt (const int position) { return manager.getAudioBuffer()->getSample (1, position); }
+};
+
+TEST_F (BackingTrackStreamTest, OnlyTheWindowAroundThePlayheadIsResident)
+{
+    ASSERT_EQ (open (44100.0), FILE_LENGTH);
+    attach();
+    EXPECT_EQ (manager.getLength(), FILE_LENGTH);
+    EXPECT_GT (manager.getLength(), BLOCK);
+
+    // The start is ready before the first block plays, the mono file on both channels
+    EXPECT_EQ (stream.getNumResidentBlocks(), STREAM_READ_AHEAD_BLOCKS + 2);
+    EXPECT_NEAR (sampleAt (5000), 5000.0f / FILE_LENGTH, 1e-5f);
+    EXPECT_FLOAT_EQ (sampleAt (20 * BLOCK), 0.0f);
+
+    // Far from anything read, the first update finds nothing and plays silence until the reader catches up
+    const int position = 20 * BLOCK + 100;
+    EXPECT_FALSE (stream.update (windowAt (position), 512.0));
+    EXPECT_EQ (stream.getNumUnderruns(), 1);
+    readEverythingMissing();
+    EXPECT_TRUE (stream.update (windowAt (position), 512.0));
+    EXPECT_NEAR (sampleAt (position), (float) position / FILE_LENGTH, 1e-5f);
+    EXPECT_NEAR (sampleAt (position + 3 * BLOCK), (float) (position + 3 * BLOCK) / FILE_LENGTH, 1e-5f);
+
+    // What playback left went back to the pool; what it needs next, and the wrap point, stayed
+    EXPECT_FLOAT_EQ (sampleAt (3 * BLOCK), 0.0f);
+    EXPECT_TRUE (stream.isResident (0));
+    EXPECT_TRUE (stream.isResident (FILE_LENGTH - 1));
+    EXPECT_LE (stream.getNumResidentBlocks(), STREAM_MAX_RESIDENT_BLOCKS);
+    EXPECT_EQ (pool.getNumBlocksInUse(), stream.getNumResidentBlocks());
+}
+
+TEST_F (BackingTrackStreamTest, RegionEndsAndPendingSeeksAreReadAhead)
+{
+    ASSERT_EQ (open (44100.0), FILE_LENGTH);
+    attach();
+
+    // A region far from the playhead: both its ends are fetched before playback reaches them
+    auto window = windowAt (1000.0, 30 * BLOCK + 10, 33 * BLOCK + 10);
+    window.seekTarget = 30 * BLOCK + 10;
+    stream.update (window, 512.0);
+    readEverythingMissing();
+    stream.update (window, 512.0);
+    EXPECT_TRUE (stream.isResident (30 * BLOCK + 10));
+    EXPECT_TRUE (stream.isResident (33 * BLOCK + 9));
+
+    // Reverse playback reads ahead towards the start
+    window = windowAt (10 * BLOCK + 5);
+    window.direction = -1;
+    stream.update (window, 512.0);
+    readEverythingMissing();
+    EXPECT_TRUE (stream.update (window, 512.0));
+    EXPECT_TRUE (stream.isResident (5 * BLOCK));
+    EXPECT_FALSE (stream.isResident (12 * BLOCK));
+}
+
+TEST_F (BackingTrackStreamTest, ResamplesEachBlockOnItsOwn)
+{
+    // Half the engine rate: twice as long, every block interpolated from its own read of the file
+    ASSERT_EQ (open (22050.0), FILE_LENGTH * 2);
+    attach();
+
+    for (const int position : { 5, BLOCK - 1, BLOCK, 3 * BLOCK + 777 })
+        EXPECT_NEAR (sampleAt (position), (float) position / (2.0f * FILE_LENGTH), 1e-5f) << position;
+}
+
+TEST_F (BackingTrackStreamTest, DetachingHandsEveryBlockBack)
+{
+    ASSERT_EQ (open (44100.0), FILE_LENGTH);
+    attach();
+    stream.update (windowAt (15 * BLOCK), 512.0);
+    readEverythingMissing();
+    EXPECT_GT (pool.getNumBlocksInUse(), 0);
+
+    // The track gets its own buffer back and the stream can be opened again
+    manager.swapAudioBuffer (stream.getBuffer());
+    stream.detach();
+    EXPECT_EQ (manager.getNumSamples(), BLOCK);
+    EXPECT_EQ (manager.getLength(), 0);
+    EXPECT_FALSE (stream.service());
+    EXPECT_EQ (pool.getNumBlocksInUse(), 0);
+    EXPECT_EQ (open (44100.0), FILE_LENGTH);
+}
+
+// ============================================================================
+// BufferManager Tests
+// ============================================================================
+
+class BufferManagerTest : public ::testing::Test
+{
+protected:
+    BufferManager manager;
+    juce::AudioBuffer<float> inputBuffer;
+    juce::AudioBuffer<float> outputBuffer;
+
+    void SetUp() override
+    {
+        manager.prepareToPlay (2, 1000);
+        inputBuffer.setSize (2, 100);
+        outputBuffer.setSize (2, 100);
+    }
+
+    void fillBufferWithValue (juce::AudioBuffer<float>& buffer, float value)
+    {
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        {
+            for (int i = 0; i < buffer.getNumSamples(); ++i)
+            {
+                buffer.setSample (ch, i, value);
+            }
+        }
+    }
+};
+
+TEST_F (BufferManagerTest, InitializesCorrectly)
+{
+    EXPECT_EQ (manager.getNumChannels(), 2);
+    EXPECT_EQ (manager.getNumSamples(), 1000);
+    EXPECT_EQ (manager.getLength(), 0);
+}
+
+TEST_F (BufferManagerTest, ClearResetsState)
+{
+    manager.setLength (500);
+    manager.clear();
+
+    EXPECT_EQ (manager.getLength(), 0);
     EXPECT_EQ (manager.getWritePosition(), 0);
     EXPECT_EQ (manager.getReadPosition(), 0);
 }
@@ -1097,7 +2756,7 @@ TEST_F (BufferManagerTest, WriteToAudioBufferBasicCopy)
     manager.writeToAudioBuffer (copyFunc, inputBuffer, 100, false, false);
 
     // Check data was written
-    EXPECT_FLOAT_EQ (manager.getReadPointer (0)[0], 0.5f);
+    EXPECT_FLOAT_EQ (manager.getSample (0, 0), 0.5f);
 }
 
 TEST_F (BufferManagerTest, WriteToAudioBufferWrapsAround)
@@ -1190,6 +2849,526 @@ TEST_F (BufferManagerTest, ReleaseResourcesClearsBuffer)
     EXPECT_EQ (manager.getLength(), 0);
 }
 
+TEST_F (BufferManagerTest, ReverseReadAndWriteMatchPerSampleReference)
+{
+    juce::AudioBuffer<float> ramp (2, 1000);
+    for (int ch = 0; ch < 2; ++ch)
+        for (int i = 0; i < 1000; ++i)
+            ramp.setSample (ch, i, (float) (i + ch * 1000));
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, ramp, 1000, false, false);
+    manager.setLength (1000);
+
+    // Crosses the loop start, so the block is two reversed segments; the lambda takes the stack-buffer fallback
+    juce::AudioBuffer<float> kernelOut (2, 512), lambdaOut (2, 512);
+    manager.setReadPosition (100);
+    manager.readFromAudioBuffer (BufferKernels::Copy {}, kernelOut, 512, -1.0f, false);
+    EXPECT_EQ (manager.getReadPosition(), 588);
+    manager.setReadPosition (100);
+    manager.readFromAudioBuffer ([] (float* dest, const float* src, int samples) { juce::FloatVectorOperations::copy (dest, src, samples); },
+                                 lambdaOut,
+                                 512,
+                                 -1.0f,
+                                 false);
+
+    for (int ch = 0; ch < 2; ++ch)
+    {
+        for (int i = 0; i < 512; ++i)
+        {
+            const float expected = ramp.getSample (ch, ((100 - i) % 1000 + 1000) % 1000);
+            ASSERT_EQ (kernelOut.getSample (ch, i), expected) << "ch " << ch << " i " << i;
+            ASSERT_EQ (lambdaOut.getSample (ch, i), expected) << "ch " << ch << " i " << i;
+        }
+    }
+
+    // While reversed, a recorded block lands back to front
+    manager.setWritePosition (0);
+    fillBufferWithValue (inputBuffer, 0.0f);
+    for (int i = 0; i < 100; ++i)
+        inputBuffer.setSample (0, i, (float) i);
+    manager.writeToAudioBuffer (BufferKernels::BalancedOverdub { 0.0f, 1.0f }, inputBuffer, 100, false, false);
+    for (int i = 0; i < 100; ++i)
+        ASSERT_EQ (manager.getSample (0, i), (float) (99 - i));
+}
+
+TEST_F (BufferManagerTest, SilenceMapFollowsRecordingAndOverdubs)
+{
+    const auto& silence = manager.getAudioBuffer()->getSilenceMap();
+
+    // A first pass of silence with one stab: only the stab's region sounds
+    juce::AudioBuffer<float> pass (2, 1000);
+    pass.clear();
+    pass.setSample (1, 600, 0.5f);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, pass, 1000, false, false);
+    manager.finalizeLayer (false, 0);
+    for (int region = 0; region < 4; ++region)
+        EXPECT_EQ (silence.isRegionSilent (region), region != 2) << "region " << region;
+
+    // Overdubbing silence keeps what is there; replacing a whole region with silence clears it
+    fillBufferWithValue (inputBuffer, 0.0f);
+    manager.setWritePosition (550);
+    manager.writeToAudioBuffer (BufferKernels::BalancedOverdub { 1.0f, 1.0f }, inputBuffer, 100, true, false);
+    EXPECT_FALSE (silence.isRegionSilent (2));
+
+    juce::AudioBuffer<float> zeros (2, 256);
+    zeros.clear();
+    manager.setWritePosition (512);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, zeros, 200, false, false);
+    EXPECT_FALSE (silence.isRegionSilent (2));
+    manager.setWritePosition (512);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, zeros, 256, false, false);
+    EXPECT_TRUE (silence.isRegionSilent (2));
+
+    // While reversed, the first input sample lands at the end of the range: region 1 here, not region 0
+    juce::AudioBuffer<float> scratch (2, 10);
+    manager.setReadPosition (100);
+    manager.readFromAudioBuffer (BufferKernels::Add {}, scratch, 10, -1.0f, false);
+    inputBuffer.setSample (0, 0, 0.25f);
+    manager.setWritePosition (200);
+    manager.writeToAudioBuffer (BufferKernels::BalancedOverdub { 1.0f, 1.0f }, inputBuffer, 100, true, false);
+    EXPECT_EQ (manager.getSample (0, 299), 0.25f);
+    EXPECT_TRUE (silence.isRegionSilent (0));
+    EXPECT_FALSE (silence.isRegionSilent (1));
+
+    // Kernels that say nothing about silence are taken to make sound
+    fillBufferWithValue (inputBuffer, 0.0f);
+    manager.setWritePosition (800);
+    auto plainCopy = [] (float* dest, const float* src, int samples, bool) { juce::FloatVectorOperations::copy (dest, src, samples); };
+    manager.writeToAudioBuffer (plainCopy, inputBuffer, 100, true, false);
+    EXPECT_FALSE (silence.isRegionSilent (3));
+}
+
+TEST_F (BufferManagerTest, PeakTableFollowsRecordingAndOverdubs)
+{
+    auto& layer = *manager.getAudioBuffer();
+    const auto& peaks = layer.getPeakTable();
+
+    juce::AudioBuffer<float> pass (2, 1000);
+    pass.clear();
+    pass.setSample (1, 600, 0.5f);
+    pass.setSample (0, 100, -0.75f);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, pass, 1000, false, false);
+    manager.finalizeLayer (false, 0);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (0), 0.75f);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (1), 0.0f);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (2), 0.5f);
+
+    // An overdub that turns the old audio down lowers the peak of the regions it crosses, exactly
+    fillBufferWithValue (inputBuffer, 0.1f);
+    manager.setWritePosition (0);
+    manager.writeToAudioBuffer (BufferKernels::BalancedOverdub { 0.5f, 1.0f }, inputBuffer, 100, true, false);
+    manager.setWritePosition (100);
+    manager.writeToAudioBuffer (BufferKernels::BalancedOverdub { 0.5f, 1.0f }, inputBuffer, 100, true, false);
+    EXPECT_FLOAT_EQ (peaks.getRegionPeak (0), 0.275f);
+
+    for (int region = 0; region < 4; ++region)
+    {
+        EXPECT_FALSE (peaks.isRegionStale (region));
+        const int start = region * LoopPeakTable::REGION_SAMPLES;
+        const int num = std::min (LoopPeakTable::REGION_SAMPLES, 1000 - start);
+        EXPECT_FLOAT_EQ (peaks.getRegionPeak (region), std::max (layer.getMagnitude (0, start, num), layer.getMagnitude (1, start, num)));
+    }
+}
+
+TEST_F (BufferManagerTest, SkippingSilentRegionsLeavesPlaybackUnchanged)
+{
+    juce::AudioBuffer<float> pass (2, 1000);
+    pass.clear();
+    for (int i = 0; i < 40; ++i)
+        for (int ch = 0; ch < 2; ++ch)
+            pass.setSample (ch, 300 + i, std::sin ((float) i * 0.3f) * (float) (ch + 1));
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, pass, 1000, false, false);
+    manager.finalizeLayer (false, 0);
+
+    // Add skips silent regions; the lambda has no silence trait, so it reads every sample
+    auto plainAdd = [] (float* dest, const float* src, int samples) { juce::FloatVectorOperations::add (dest, src, samples); };
+    juce::AudioBuffer<float> skipped (2, 100), reference (2, 100);
+    for (const float speed : { 1.0f, -1.0f })
+    {
+        for (int start = 0; start < 1000; start += 70)
+        {
+            skipped.clear();
+            reference.clear();
+            manager.setReadPosition (start);
+            manager.readFromAudioBuffer (BufferKernels::Add {}, skipped, 100, speed, false);
+            const bool skippedAll = manager.wasLastReadSilent();
+            manager.setReadPosition (start);
+            manager.readFromAudioBuffer (plainAdd, reference, 100, speed, false);
+
+            bool referenceIsSilent = true;
+            for (int ch = 0; ch < 2; ++ch)
+            {
+                for (int i = 0; i < 100; ++i)
+                {
+                    ASSERT_EQ (skipped.getSample (ch, i), reference.getSample (ch, i)) << "speed " << speed << " start " << start;
+                    referenceIsSilent = referenceIsSilent && reference.getSample (ch, i) == 0.0f;
+                }
+            }
+            if (skippedAll) EXPECT_TRUE (referenceIsSilent) << "speed " << speed << " start " << start;
+        }
+    }
+
+    // Well away from the stab, a block reads nothing at all
+    manager.setReadPosition (800);
+    manager.readFromAudioBuffer (BufferKernels::Add {}, skipped, 100, 1.0f, false);
+    EXPECT_TRUE (manager.wasLastReadSilent());
+    manager.setReadPosition (280);
+    manager.readFromAudioBuffer (BufferKernels::Add {}, skipped, 100, 1.0f, false);
+    EXPECT_FALSE (manager.wasLastReadSilent());
+}
+
+TEST_F (BufferManagerTest, SeamBlendsTheGuardIntoTheHeadOfALoopRegion)
+{
+    juce::AudioBuffer<float> ramp (2, 1000);
+    for (int ch = 0; ch < 2; ++ch)
+        for (int i = 0; i < 1000; ++i)
+            ramp.setSample (ch, i, (float) i / 1000.0f);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, ramp, 1000, false, false);
+    manager.finalizeLayer (false, 0);
+    manager.setLoopRegion (200, 600);
+    manager.setSeamFadeLength (40);
+
+    // From 40 samples before the region end, across the wrap
+    juce::AudioBuffer<float> heard (2, 100);
+    heard.clear();
+    manager.readAt (BufferKernels::Copy {}, heard, 560, 100, 1);
+
+    for (int i = 0; i < 40; ++i)
+        EXPECT_FLOAT_EQ (heard.getSample (1, i), (float) (560 + i) / 1000.0f);
+
+    // The head picks up the guard, the audio that followed the region end, and fades it into its own
+    for (int i = 0; i < 40; ++i)
+    {
+        const float in = (float) i / 40.0f;
+        EXPECT_NEAR (heard.getSample (0, 40 + i), (200 + i) / 1000.0f * in + (600 + i) / 1000.0f * (1.0f - in), 1e-6f);
+    }
+    EXPECT_FLOAT_EQ (heard.getSample (0, 39), 0.599f);
+    EXPECT_FLOAT_EQ (heard.getSample (0, 40), 0.6f);
+    EXPECT_FLOAT_EQ (heard.getSample (0, 80), 0.24f);
+
+    // Reading back to front crosses the same seam
+    juce::AudioBuffer<float> reversed (2, 100);
+    reversed.clear();
+    manager.readAt (BufferKernels::Copy {}, reversed, 259, 100, -1);
+    for (int i = 0; i < 100; ++i)
+        EXPECT_FLOAT_EQ (reversed.getSample (0, i), heard.getSample (0, 99 - i));
+
+    // None of it was written into the loop
+    for (int i = 0; i < 1000; i += 7)
+        EXPECT_FLOAT_EQ (manager.getSample (1, i), (float) i / 1000.0f);
+}
+
+TEST_F (BufferManagerTest, SeamFadesTheLoopEndsWhenThereIsNoGuard)
+{
+    juce::AudioBuffer<float> pass (2, 1000);
+    pass.clear();
+    for (int ch = 0; ch < 2; ++ch)
+        for (int i = 900; i < 1000; ++i)
+            pass.setSample (ch, i, 0.5f);
+    manager.writeToAudioBuffer (BufferKernels::Copy {}, pass, 1000, false, false);
+    manager.finalizeLayer (false, 0);
+    manager.setSeamFadeLength (40);
+
+    // Nothing follows the loop end, so the tail fades out and the head, silent here, stays silent
+    outputBuffer.clear();
+    manager.setReadPosition (940);
+    manager.readFromAudioBuffer (BufferKernels::Add {}, outputBuffer, 100, 1.0f, false);
+    for (int i = 0; i < 20; ++i)
+        EXPECT_FLOAT_EQ (outputBuffer.getSample (0, i), 0.5f);
+    for (int i = 0; i < 40; ++i)
+        EXPECT_NEAR (outputBuffer.getSample (0, 20 + i), 0.5f * (1.0f - (float) i / 40.0f), 1e-6f);
+    for (int i = 60; i < 100; ++i)
+        EXPECT_EQ (outputBuffer.getSample (0, i), 0.0f);
+
+    EXPECT_FLOAT_EQ (manager.getSample (0, 999), 0.5f);
+
+    // The seam stays inside a quarter of the wrap range
+    manager.setSeamFadeLength (1000);
+    outputBuffer.clear();
+    manager.setReadPosition (900);
+    manager.readFromAudioBuffer (BufferKernels::Add {}, outputBuffer, 1, 1.0f, false);
+    EXPECT_NEAR (outputBuffer.getSample (0, 0), 0.5f * (1.0f - 150.0f / 250.0f), 1e-6f);
+}
+
+TEST (BufferKernelsTest, ReversedKernelsMatchScalarReference)
+{
+    std::vector<float> source (37), destination (37), reference (37);
+    for (size_t i = 0; i < source.size(); ++i)
+        source[i] = (float) i * 0.25f - 3.0f;
+
+    std::fill (destination.begin(), destination.end(), 1.0f);
+    BufferKernels::Add {}.reversed (destination.data(), source.data(), 37);
+    for (int i = 0; i < 37; ++i)
+        EXPECT_FLOAT_EQ (destination[(size_t) i], 1.0f + source[(size_t) (36 - i)]);
+
+    std::fill (destination.begin(), destination.end(), 2.0f);
+    BufferKernels::BalancedOverdub { 0.5f, 0.25f }.reversed (destination.data(), source.data(), 37, true);
+    for (int i = 0; i < 37; ++i)
+        EXPECT_FLOAT_EQ (destination[(size_t) i], 1.0f + 0.25f * source[(size_t) (36 - i)]);
+
+    BufferKernels::reverseCopy (reference.data(), source.data(), 37);
+    EXPECT_TRUE (std::equal (reference.rbegin(), reference.rend(), source.begin()));
+}
+
+TEST (BufferKernelsTest, AddWithGainRampMatchesScalarReference)
+{
+    std::vector<float> source (37), destination (37);
+    for (size_t i = 0; i < source.size(); ++i)
+        source[i] = (float) i * 0.25f - 3.0f;
+
+    std::fill (destination.begin(), destination.end(), 1.0f);
+    BufferKernels::addWithGainRamp (destination.data(), source.data(), 37, 0.5f, 0.5f);
+    for (int i = 0; i < 37; ++i)
+        EXPECT_FLOAT_EQ (destination[(size_t) i], 1.0f + 0.5f * source[(size_t) i]);
+
+    std::fill (destination.begin(), destination.end(), 1.0f);
+    BufferKernels::addWithGainRamp (destination.data(), source.data(), 37, 0.0f, 1.0f);
+    for (int i = 0; i < 37; ++i)
+        EXPECT_NEAR (destination[(size_t) i], 1.0f + source[(size_t) i] * (float) i / 37.0f, 1.0e-5f) << "i " << i;
+}
+
+// ============================================================================
+// TrackRenderPool Tests
+// ============================================================================
+
+namespace
+{
+struct RenderPoolTestBatch
+{
+    std::array<std::atomic<int>, 16> runs {};
+    std::atomic<int> offCallingThread { 0 };
+    std::thread::id callingThread = std::this_thread::get_id();
+};
+
+void countRenderPoolTask (void* context, const int index)
+{
+    auto& batch = *static_cast<RenderPoolTestBatch*> (context);
+    batch.runs[(size_t) index].fetch_add (1);
+    if (std::this_thread::get_id() != batch.callingThread) batch.offCallingThread.fetch_add (1);
+}
+} // namespace
+
+TEST (TrackRenderPoolTest, RunsEveryTaskOnceBeforeReturning)
+{
+    TrackRenderPool pool;
+    pool.prepareToPlay (3, 44100.0, 512);
+    ASSERT_EQ (pool.getNumWorkers(), 3);
+
+    RenderPoolTestBatch batch;
+    for (int round = 1; round <= 2000; ++round)
+    {
+        const int numTasks = 2 + round % 15;
+        pool.run (countRenderPoolTask, &batch, numTasks);
+        for (int i = 0; i < numTasks; ++i)
+            ASSERT_EQ (batch.runs[(size_t) i].exchange (0), 1) << "round " << round << " task " << i;
+        for (int i = numTasks; i < 16; ++i)
+            ASSERT_EQ (batch.runs[(size_t) i].load(), 0) << "round " << round << " task " << i;
+
+        // Let the workers fall asleep now and then, so waking them is exercised too
+        if (round % 500 == 0) std::this_thread::sleep_for (std::chrono::milliseconds (20));
+    }
+    pool.releaseResources();
+    EXPECT_EQ (pool.getNumWorkers(), 0);
+}
+
+TEST (TrackRenderPoolTest, RunsOnTheCallingThreadWithoutWorkers)
+{
+    TrackRenderPool pool;
+    pool.prepareToPlay (0, 44100.0, 512);
+
+    RenderPoolTestBatch batch;
+    pool.run (countRenderPoolTask, &batch, 8);
+    for (int i = 0; i < 8; ++i)
+        EXPECT_EQ (batch.runs[(size_t) i].load(), 1);
+    EXPECT_EQ (batch.offCallingThread.load(), 0);
+}
+
+// ============================================================================
+// VarispeedReader Tests
+// ============================================================================
+
+TEST (VarispeedReaderTest, UnitSpeedReproducesTheSource)
+{
+    std::vector<float> source (300), output (256, 0.0f);
+    juce::Random random (7);
+    for (auto& sample : source)
+        sample = random.nextFloat() * 2.0f - 1.0f;
+
+    VarispeedReader reader;
+    reader.prepareToPlay (256);
+    reader.render (source.data(), 20.0, 1.0, output.data(), 256);
+
+    for (int i = 0; i < 256; ++i)
+        ASSERT_NEAR (output[(size_t) i], source[(size_t) (20 + i)], 1.0e-6f) << "i " << i;
+}
+
+TEST (VarispeedReaderTest, ResampledSineFollowsTheSpeed)
+{
+    std::vector<float> source (2000);
+    for (size_t i = 0; i < source.size(); ++i)
+        source[i] = varispeedTestSine ((double) i);
+
+    VarispeedReader reader;
+    reader.prepareToPlay (512);
+
+    for (const double speed : { 0.5, 0.77, 1.5, 2.0, -1.5 })
+    {
+        std::vector<float> output (512, 0.0f);
+        const double start = speed > 0.0 ? 10.25 : 1990.25;
+        reader.render (source.data(), start, speed, output.data(), 512);
+
+        for (int i = 0; i < 512; ++i)
+            ASSERT_NEAR (output[(size_t) i], varispeedTestSine (start + speed * i), 2.0e-3f) << "speed " << speed << " i " << i;
+    }
+}
+
+TEST (VarispeedReaderTest, HigherSpeedsUseSteeperCutoffs)
+{
+    EXPECT_EQ (VarispeedReader::getCutoffBand (1.0), 0);
+    EXPECT_EQ (VarispeedReader::getCutoffBand (0.5), 0);
+    EXPECT_EQ (VarispeedReader::getCutoffBand (-1.0), 0);
+    EXPECT_GT (VarispeedReader::getCutoffBand (1.01), 0);
+    EXPECT_EQ (VarispeedReader::getCutoffBand (MAX_PLAYBACK_SPEED), VARISPEED_CUTOFF_BANDS - 1);
+    EXPECT_LE (VarispeedReader::getCutoffBand (1.3), VarispeedReader::getCutoffBand (1.6));
+}
+
+TEST (VarispeedReaderTest, BufferManagerReadsAcrossBlocksAndTheLoopEnd)
+{
+    // Longer than one storage block, so spans cross a block boundary as well as the loop end
+    const int loopLength = (int) VARISPEED_TEST_PERIOD * 1000;
+    ASSERT_GT (loopLength, LOOP_BLOCK_SIZE_SAMPLES);
+
+    BufferManager manager;
+    manager.prepareToPlay (2, loopLength);
+    fillWithVarispeedTestSine (manager, loopLength);
+
+    VarispeedReader reader;
+    reader.prepareToPlay (512);
+    juce::AudioBuffer<float> output (2, 512);
+
+    for (const float speed : { 1.5f, -1.5f, 0.7f })
+    {
+        manager.setReadPosition (loopLength - 300);
+        double position = loopLength - 300;
+        bool wrapped = false;
+
+        for (int block = 0; block < 100; ++block)
+        {
+            output.clear();
+            wrapped = manager.readVarispeed (reader, output, 512, speed, false) || wrapped;
+
+            for (int ch = 0; ch < 2; ++ch)
+                for (int i = 0; i < 512; ++i)
+                    ASSERT_NEAR (output.getSample (ch, i), varispeedTestSine (position + speed * i), 2.0e-3f)
+                        << "speed " << speed << " block " << block << " i " << i;
+
+            position += speed * 512.0;
+        }
+        EXPECT_TRUE (wrapped);
+    }
+}
+
+// ============================================================================
+// WsolaStretchEngine Tests
+// ============================================================================
+
+namespace
+{
+// Streams the test sine through the stretcher as PlaybackEngine would and returns numBlocks blocks of output
+juce::AudioBuffer<float> stretchTestSine (WsolaStretchEngine& stretcher, const double speed, const int numBlocks)
+{
+    constexpr int blockSize = 512;
+    juce::AudioBuffer<float> source (2, 16384), block (2, blockSize), output (2, blockSize * numBlocks);
+    int sourcePosition = 0;
+    double debt = 0.0;
+
+    const auto feed = [&] (const int numFrames)
+    {
+        for (int ch = 0; ch < 2; ++ch)
+            for (int i = 0; i < numFrames; ++i)
+                source.setSample (ch, i, varispeedTestSine (sourcePosition + i));
+        stretcher.putSamples (source, numFrames);
+        sourcePosition += numFrames;
+    };
+
+    feed (stretcher.getPrimingSamples());
+    for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+    {
+        debt += speed * blockSize;
+        feed ((int) debt);
+        debt -= (int) debt;
+
+        block.clear();
+        EXPECT_EQ (stretcher.addReceived (block, blockSize), blockSize) << "ran dry at block " << blockIndex;
+        for (int ch = 0; ch < 2; ++ch)
+            output.copyFrom (ch, blockIndex * blockSize, block, ch, 0, blockSize);
+    }
+    return output;
+}
+
+// Average distance between rising zero crossings of a channel from start on
+double measurePeriod (const juce::AudioBuffer<float>& buffer, const int start)
+{
+    const float* data = buffer.getReadPointer (0);
+    int first = -1, last = -1, crossings = 0;
+    for (int i = start + 1; i < buffer.getNumSamples(); ++i)
+    {
+        if (data[i - 1] < 0.0f && data[i] >= 0.0f)
+        {
+            if (first < 0) first = i;
+            last = i;
+            ++crossings;
+        }
+    }
+    return crossings > 1 ? (double) (last - first) / (crossings - 1) : 0.0;
+}
+} // namespace
+
+TEST (WsolaStretchEngineTest, SlowsDownWithoutChangingPitchOrLevel)
+{
+    WsolaStretchEngine stretcher;
+    stretcher.prepareToPlay (44100.0, 2, 512);
+
+    for (const auto quality : { StretchQuality::Fast, StretchQuality::Balanced, StretchQuality::High })
+    {
+        stretcher.setQuality (quality);
+        stretcher.reset();
+        stretcher.setParameters (0.7, 1.0, 0.0);
+
+        const auto output = stretchTestSine (stretcher, 0.7, 40);
+        EXPECT_NEAR (measurePeriod (output, 2048), VARISPEED_TEST_PERIOD, 0.5);
+        EXPECT_NEAR (output.getRMSLevel (0, 2048, output.getNumSamples() - 2048), std::sqrt (0.5f), 0.03f);
+
+        for (int i = 0; i < output.getNumSamples(); ++i)
+            ASSERT_EQ (output.getSample (0, i), output.getSample (1, i)) << "i " << i;
+    }
+}
+
+TEST (WsolaStretchEngineTest, NeverRunsDryAcrossTheSpeedRange)
+{
+    WsolaStretchEngine stretcher;
+    stretcher.prepareToPlay (48000.0, 2, 512);
+    stretcher.setQuality (StretchQuality::High);
+
+    for (const double speed : { 0.25, 0.5, 1.3, (double) MAX_PLAYBACK_SPEED })
+    {
+        stretcher.reset();
+        stretcher.setParameters (speed, 1.0, 0.0);
+        const auto output = stretchTestSine (stretcher, speed, 30);
+        EXPECT_NEAR (measurePeriod (output, 2048), VARISPEED_TEST_PERIOD, 0.5) << "speed " << speed;
+    }
+}
+
+TEST (WsolaStretchEngineTest, PitchShiftScalesTheFrequency)
+{
+    WsolaStretchEngine stretcher;
+    stretcher.prepareToPlay (44100.0, 2, 512);
+    stretcher.reset();
+    stretcher.setParameters (1.0, 1.0, 2.0);
+
+    const auto output = stretchTestSine (stretcher, 1.0, 40);
+    EXPECT_NEAR (measurePeriod (output, 2048), VARISPEED_TEST_PERIOD / std::pow (2.0, 2.0 / 12.0), 0.5);
+}
+
 // ============================================================================
 // EngineMessageBus Tests
 // ============================================================================